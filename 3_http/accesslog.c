@@ -0,0 +1,355 @@
+/**
+ * @file accesslog.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Asynchronous access log written by a background thread
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "accesslog.h"
+#include "common.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// room for one formatted entry with every path byte escaped
+#define LINE_MAX_SIZE (ACCESSLOG_PATH_SIZE * 6 + 256)
+
+struct entry {
+    unsigned long long time_ns;
+    unsigned long long latency_ns;
+    unsigned long long bytes;
+    unsigned int status;
+    // 0 if the request was malformed
+    unsigned char method_len;
+    unsigned char path_len;
+    char method[ACCESSLOG_METHOD_SIZE];
+    char path[ACCESSLOG_PATH_SIZE];
+};
+
+/**
+ * @brief Single producer single consumer ring. The worker only writes
+ * head, the flusher only writes tail, each on its own cache line.
+ */
+struct accesslog_ring {
+    // next entry written by the worker
+    unsigned long long head __attribute__((aligned(STATS_CACHE_LINE)));
+    // last tail seen by the worker, saves loading the flusher's line
+    unsigned long long tail_seen;
+    // next entry read by the flusher
+    unsigned long long tail __attribute__((aligned(STATS_CACHE_LINE)));
+    struct accesslog_ring* next;
+    struct entry entries[ACCESSLOG_RING_SIZE];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct accesslog_ring* rings = NULL;
+static int log_fd = -1;
+static enum accesslog_format log_format;
+static pthread_t flusher;
+static int stopping = 0;
+
+/**
+ * @brief Output buffer of the flusher
+ */
+struct out {
+    char buf[ACCESSLOG_BUF_SIZE];
+    size_t len;
+    // second of the cached time stamp
+    time_t sec;
+    char date[32];
+};
+
+/**
+ * @brief Writes the whole buffer to the log. Errors are reported once
+ * and the buffer is discarded so that the workers never stall.
+ *
+ * @param out output buffer
+ */
+static void out_flush(struct out* out)
+{
+    static int failed = 0;
+    size_t pos = 0;
+    while (pos < out->len) {
+        ssize_t n = write(log_fd, out->buf + pos, out->len - pos);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (!failed) {
+                log_error("Writing the access log failed: %s", strerror(errno));
+                failed = 1;
+            }
+            break;
+        }
+        pos += n;
+    }
+    out->len = 0;
+}
+
+/**
+ * @brief Appends a string as the body of a JSON string.
+ *
+ * @param p output position
+ * @param s string
+ * @param len length of the string
+ * @return char* position behind the escaped string
+ */
+static char* json_escape(char* p, const char* s, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20 || c == 0x7f) {
+            *p++ = '\\';
+            *p++ = 'u';
+            *p++ = '0';
+            *p++ = '0';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 0xf];
+        } else {
+            *p++ = c;
+        }
+    }
+    return p;
+}
+
+/**
+ * @brief Formats an entry into the output buffer.
+ *
+ * @param out output buffer with at least LINE_MAX_SIZE bytes free
+ * @param e entry
+ */
+static void format_entry(struct out* out, const struct entry* e)
+{
+    char* p = out->buf + out->len;
+    if (log_format == ACCESSLOG_BINARY) {
+        struct accesslog_record record;
+        memset(&record, 0, sizeof(record));
+        record.time_ns = e->time_ns;
+        record.latency_ns = e->latency_ns;
+        record.bytes = e->bytes;
+        record.status = e->status;
+        record.method_len = e->method_len;
+        record.path_len = e->path_len;
+        memcpy(p, &record, sizeof(record));
+        p += sizeof(record);
+        memcpy(p, e->method, e->method_len);
+        p += e->method_len;
+        memcpy(p, e->path, e->path_len);
+        out->len = p + e->path_len - out->buf;
+        return;
+    }
+
+    // the date only changes once per second
+    time_t sec = e->time_ns / 1000000000ULL;
+    if (sec != out->sec) {
+        struct tm tm;
+        gmtime_r(&sec, &tm);
+        strftime(out->date, sizeof(out->date), "%Y-%m-%dT%H:%M:%S", &tm);
+        out->sec = sec;
+    }
+    unsigned int ms = e->time_ns / 1000000ULL % 1000;
+    double latency_us = e->latency_ns / 1e3;
+
+    if (log_format == ACCESSLOG_JSON) {
+        p += sprintf(p, "{\"time\":\"%s.%03uZ\",", out->date, ms);
+        if (e->method_len > 0) {
+            p += sprintf(p, "\"method\":\"");
+            p = json_escape(p, e->method, e->method_len);
+            p += sprintf(p, "\",\"path\":\"");
+            p = json_escape(p, e->path, e->path_len);
+            p += sprintf(p, "\",");
+        } else {
+            p += sprintf(p, "\"method\":null,\"path\":null,");
+        }
+        p += sprintf(p, "\"status\":%u,\"bytes\":%llu,\"latency_us\":%.3f}\n", e->status, e->bytes, latency_us);
+    } else if (e->method_len > 0) {
+        p += sprintf(p, "%s.%03uZ %.*s %.*s %u %llu %.3f\n", out->date, ms, (int)e->method_len, e->method,
+            (int)e->path_len, e->path, e->status, e->bytes, latency_us);
+    } else {
+        p += sprintf(p, "%s.%03uZ - - %u %llu %.3f\n", out->date, ms, e->status, e->bytes, latency_us);
+    }
+    out->len = p - out->buf;
+}
+
+/**
+ * @brief Moves all queued entries of a ring into the output buffer.
+ *
+ * @param out output buffer
+ * @param ring ring
+ * @return size_t number of entries taken
+ */
+static size_t drain(struct out* out, struct accesslog_ring* ring)
+{
+    unsigned long long tail = ring->tail;
+    unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t taken = head - tail;
+    while (tail != head) {
+        if (out->len > sizeof(out->buf) - LINE_MAX_SIZE) {
+            out_flush(out);
+        }
+        format_entry(out, &ring->entries[tail & (ACCESSLOG_RING_SIZE - 1)]);
+        tail++;
+    }
+    // the worker may reuse the slots only after they were formatted
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return taken;
+}
+
+/**
+ * @brief Main function of the flusher thread. Polls the rings, so the
+ * workers never make a system call to log.
+ *
+ * @param arg unused
+ * @return void* NULL
+ */
+static void* flush_main(void* arg)
+{
+    (void)arg;
+    struct out* out = malloc(sizeof(struct out));
+    if (out == NULL) {
+        log_error("malloc failed");
+        return NULL;
+    }
+    out->len = 0;
+    out->sec = -1;
+
+    struct timespec interval = { 0, ACCESSLOG_INTERVAL * 1000000L };
+    while (1) {
+        // read before draining, so that the last pass sees every entry
+        int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        pthread_mutex_lock(&lock);
+        struct accesslog_ring* list = rings;
+        pthread_mutex_unlock(&lock);
+
+        size_t taken = 0;
+        for (struct accesslog_ring* ring = list; ring != NULL; ring = ring->next) {
+            taken += drain(out, ring);
+        }
+        if (out->len > 0) {
+            out_flush(out);
+        }
+        if (taken == 0) {
+            if (stop) {
+                break;
+            }
+            nanosleep(&interval, NULL);
+        }
+    }
+    free(out);
+    return NULL;
+}
+
+int accesslog_open(const char* path, enum accesslog_format format)
+{
+    if (strcmp(path, "-") == 0) {
+        log_fd = dup(STDOUT_FILENO);
+    } else {
+        log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    if (log_fd < 0) {
+        log_error("Opening the access log %s failed: %s", path, strerror(errno));
+        return -1;
+    }
+    log_format = format;
+
+    // signals are handled by the main thread only
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    int res = pthread_create(&flusher, NULL, flush_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (res != 0) {
+        log_error("Starting the access log thread failed");
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+struct accesslog_ring* accesslog_register(void)
+{
+    if (log_fd < 0) {
+        return NULL;
+    }
+    struct accesslog_ring* ring;
+    if (posix_memalign((void**)&ring, STATS_CACHE_LINE, sizeof(struct accesslog_ring)) != 0) {
+        return NULL;
+    }
+    ring->head = 0;
+    ring->tail_seen = 0;
+    ring->tail = 0;
+
+    pthread_mutex_lock(&lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&lock);
+    return ring;
+}
+
+int accesslog_write(struct accesslog_ring* ring, const char* method, const char* path, unsigned int status,
+    unsigned long long bytes, unsigned long long latency_ns)
+{
+    unsigned long long head = ring->head;
+    if (head - ring->tail_seen >= ACCESSLOG_RING_SIZE) {
+        ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - ring->tail_seen >= ACCESSLOG_RING_SIZE) {
+            return -1;
+        }
+    }
+
+    struct entry* e = &ring->entries[head & (ACCESSLOG_RING_SIZE - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    e->time_ns = (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    e->latency_ns = latency_ns;
+    e->bytes = bytes;
+    e->status = status;
+    e->method_len = 0;
+    e->path_len = 0;
+    if (method != NULL && path != NULL) {
+        e->method_len = strnlen(method, ACCESSLOG_METHOD_SIZE);
+        e->path_len = strnlen(path, ACCESSLOG_PATH_SIZE);
+        memcpy(e->method, method, e->method_len);
+        memcpy(e->path, path, e->path_len);
+    }
+    // publish the entry to the flusher
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void accesslog_close(void)
+{
+    if (log_fd < 0) {
+        return;
+    }
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+    close(log_fd);
+    log_fd = -1;
+
+    pthread_mutex_lock(&lock);
+    while (rings != NULL) {
+        struct accesslog_ring* next = rings->next;
+        free(rings);
+        rings = next;
+    }
+    pthread_mutex_unlock(&lock);
+}
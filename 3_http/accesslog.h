@@ -0,0 +1,93 @@
+/**
+ * @file accesslog.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Asynchronous access log written by a background thread
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef ACCESSLOG
+#define ACCESSLOG
+
+#include <stddef.h>
+#include <stdint.h>
+
+// entries of the ring of each worker, a power of two
+#define ACCESSLOG_RING_SIZE (4096)
+// longer paths are truncated
+#define ACCESSLOG_PATH_SIZE (240)
+#define ACCESSLOG_METHOD_SIZE (8)
+// the flusher writes at the latest when this much is buffered
+#define ACCESSLOG_BUF_SIZE (256 * 1024)
+// milliseconds the flusher sleeps if all rings are empty
+#define ACCESSLOG_INTERVAL (20)
+
+enum accesslog_format {
+    ACCESSLOG_TEXT,
+    ACCESSLOG_JSON,
+    ACCESSLOG_BINARY
+};
+
+/**
+ * @brief Record of the binary format, all fields in host byte order. The
+ * record is followed by method_len bytes of the method and path_len bytes
+ * of the path.
+ */
+struct accesslog_record {
+    // wall clock time the response was sent in nanoseconds since the epoch
+    uint64_t time_ns;
+    uint64_t latency_ns;
+    uint64_t bytes;
+    uint16_t status;
+    uint8_t method_len;
+    uint8_t path_len;
+    uint32_t reserved;
+};
+
+/**
+ * @brief Ring of one worker. Only used internally.
+ */
+struct accesslog_ring;
+
+/**
+ * @brief Opens the log and starts the flusher thread. Must be called
+ * before the workers are started.
+ *
+ * @param path file to append to, "-" for stdout
+ * @param format format of the entries
+ * @return int 0 on success -1 on failure
+ */
+int accesslog_open(const char* path, enum accesslog_format format);
+
+/**
+ * @brief Creates the ring of a worker. Thread safe.
+ *
+ * @return struct accesslog_ring* ring or NULL if the log is not open
+ */
+struct accesslog_ring* accesslog_register(void);
+
+/**
+ * @brief Queues an entry without blocking. Must only be called by the
+ * worker owning the ring. The entry is dropped if the ring is full.
+ *
+ * @param ring ring of the worker
+ * @param method request method or NULL if the request was malformed
+ * @param path request path or NULL if the request was malformed
+ * @param status response status
+ * @param bytes bytes sent, head included
+ * @param latency_ns time from the complete request head to the last byte
+ * @return int 0 if queued, -1 if dropped
+ */
+int accesslog_write(struct accesslog_ring* ring, const char* method, const char* path, unsigned int status,
+    unsigned long long bytes, unsigned long long latency_ns);
+
+/**
+ * @brief Stops the flusher thread after it wrote all queued entries and
+ * closes the log. The workers must have stopped.
+ */
+void accesslog_close(void);
+
+#endif
@@ -0,0 +1,456 @@
+/**
+ * @file aio.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Asynchronous file opening for the event loops
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "aio.h"
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define OPEN_FLAGS (O_RDONLY | O_NONBLOCK | O_CLOEXEC)
+
+/**
+ * @brief Job with the state needed by io_uring. The public part comes
+ * first so that jobs can be passed around as struct aio_job.
+ */
+struct ujob {
+    struct aio_job job;
+    struct aio* aio;
+    int open_res;
+    struct ujob* next;
+};
+
+/**
+ * @brief Memory mapped rings of an io_uring instance
+ */
+struct uring {
+    int fd;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_entries;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    // sqes written but not submitted yet
+    unsigned queued;
+};
+
+struct aio {
+    int efd;
+    // NULL if the thread pool is used
+    struct uring* ring;
+    // jobs completed by the thread pool
+    pthread_mutex_t lock;
+    struct ujob* done;
+};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct ujob* pool_head = NULL;
+static struct ujob* pool_tail = NULL;
+static int pool_threads = 0;
+
+/**
+ * @brief Opens and stats the file of a job with blocking system calls.
+ *
+ * @param job job
+ */
+static void open_blocking(struct ujob* job)
+{
+    job->job.fd = open(job->job.path, OPEN_FLAGS);
+    job->job.err = 0;
+    if (job->job.fd < 0) {
+        job->job.err = errno;
+    } else if (fstat(job->job.fd, &job->job.st) < 0) {
+        job->job.err = errno;
+        close(job->job.fd);
+        job->job.fd = -1;
+    }
+}
+
+/**
+ * @brief Hands a completed job back to the event loop that queued it.
+ *
+ * @param job completed job
+ */
+static void job_done(struct ujob* job)
+{
+    struct aio* aio = job->aio;
+    pthread_mutex_lock(&aio->lock);
+    job->next = aio->done;
+    aio->done = job;
+    pthread_mutex_unlock(&aio->lock);
+
+    uint64_t one = 1;
+    ssize_t ignored = write(aio->efd, &one, sizeof one);
+    (void)ignored;
+}
+
+/**
+ * @brief Entry point of a pool thread. Runs queued jobs forever.
+ *
+ * @param arg unused
+ * @return void* NULL
+ */
+static void* pool_main(void* arg)
+{
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_head == NULL) {
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        }
+        struct ujob* job = pool_head;
+        pool_head = job->next;
+        if (pool_head == NULL) {
+            pool_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        open_blocking(job);
+        job_done(job);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the pool threads once. Signals stay with the main thread.
+ */
+static void pool_start(void)
+{
+    sigset_t set, old;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    for (int i = 0; i < AIO_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_main, NULL) == 0) {
+            pthread_detach(thread);
+            pool_threads++;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+ * @brief Queues a job for the thread pool.
+ *
+ * @param job job
+ * @return int 0 on success -1 if no pool thread is running
+ */
+static int pool_queue(struct ujob* job)
+{
+    pthread_once(&pool_once, pool_start);
+    if (pool_threads == 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&pool_lock);
+    job->next = NULL;
+    if (pool_tail != NULL) {
+        pool_tail->next = job;
+    } else {
+        pool_head = job;
+    }
+    pool_tail = job;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+/**
+ * @brief Unmaps the rings and closes the io_uring.
+ *
+ * @param ring ring
+ */
+static void uring_free(struct uring* ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+/**
+ * @brief Sets up an io_uring whose completions are signaled on
+ * @code{efd}. Uses the raw system calls, no liburing is needed.
+ *
+ * @param efd eventfd
+ * @return struct uring* ring or NULL if io_uring is not available
+ */
+static struct uring* uring_create(int efd)
+{
+    struct uring* ring = calloc(1, sizeof(struct uring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    params.flags = IORING_SETUP_CLAMP;
+    ring->fd = syscall(__NR_io_uring_setup, AIO_URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        uring_free(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQES);
+    if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED
+        || syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+        uring_free(ring);
+        return NULL;
+    }
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = (unsigned*)(sq + params.sq_off.ring_entries);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return ring;
+}
+
+/**
+ * @brief Gets the next free submission queue entry.
+ *
+ * @param ring ring
+ * @return struct io_uring_sqe* cleared entry or NULL if the queue is full
+ */
+static struct io_uring_sqe* uring_sqe(struct uring* ring)
+{
+    unsigned tail = *ring->sq_tail + ring->queued;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= *ring->sq_entries) {
+        return NULL;
+    }
+    unsigned index = tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->queued++;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/**
+ * @brief Queues an openat of the job path.
+ *
+ * @param ring ring
+ * @param job job
+ * @return int 0 on success -1 if the queue is full
+ */
+static int uring_queue(struct uring* ring, struct ujob* job)
+{
+    if (*ring->sq_entries - (*ring->sq_tail + ring->queued - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) == 0) {
+        aio_submit(job->aio);
+    }
+    struct io_uring_sqe* open_sqe = uring_sqe(ring);
+    if (open_sqe == NULL) {
+        return -1;
+    }
+
+    open_sqe->opcode = IORING_OP_OPENAT;
+    open_sqe->fd = AT_FDCWD;
+    open_sqe->addr = (uintptr_t)job->job.path;
+    open_sqe->open_flags = OPEN_FLAGS;
+    open_sqe->user_data = (uintptr_t)job;
+    return 0;
+}
+
+/**
+ * @brief Fills in the result of a job from its io_uring completion. The
+ * open file is stated rather than the path, which may have been replaced
+ * by a rename meanwhile. fstat only reads the inode which the open
+ * already loaded, so it does not block on the disk.
+ *
+ * @param job job
+ */
+static void uring_finish(struct ujob* job)
+{
+    job->job.fd = job->open_res >= 0 ? job->open_res : -1;
+    job->job.err = job->open_res < 0 ? -job->open_res : 0;
+    if (job->job.fd >= 0 && fstat(job->job.fd, &job->job.st) < 0) {
+        job->job.err = errno;
+        close(job->job.fd);
+        job->job.fd = -1;
+    }
+}
+
+struct aio* aio_create(enum aio_mode mode)
+{
+    struct aio* aio = malloc(sizeof(struct aio));
+    if (aio == NULL) {
+        return NULL;
+    }
+    aio->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (aio->efd < 0) {
+        free(aio);
+        return NULL;
+    }
+    pthread_mutex_init(&aio->lock, NULL);
+    aio->done = NULL;
+    aio->ring = mode == AIO_URING ? uring_create(aio->efd) : NULL;
+    if (mode == AIO_URING && aio->ring == NULL) {
+        log_error("io_uring not available, opening files in a thread pool");
+    }
+    return aio;
+}
+
+int aio_fd(struct aio* aio)
+{
+    return aio->efd;
+}
+
+struct aio_job* aio_open(struct aio* aio, const char* path, void* ctx)
+{
+    struct ujob* job = malloc(sizeof(struct ujob));
+    if (job == NULL || (job->job.path = strdup(path)) == NULL) {
+        free(job);
+        return NULL;
+    }
+    job->job.fd = -1;
+    job->job.err = 0;
+    job->job.ctx = ctx;
+    job->job.next = NULL;
+    job->aio = aio;
+
+    // a full ring falls back to the pool
+    if ((aio->ring == NULL || uring_queue(aio->ring, job) < 0) && pool_queue(job) < 0) {
+        free(job->job.path);
+        free(job);
+        return NULL;
+    }
+    return &job->job;
+}
+
+void aio_submit(struct aio* aio)
+{
+    struct uring* ring = aio->ring;
+    if (ring == NULL || ring->queued == 0) {
+        return;
+    }
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+    unsigned queued = ring->queued;
+    ring->queued = 0;
+    while (queued > 0) {
+        int n = syscall(__NR_io_uring_enter, ring->fd, queued, 0, 0, NULL, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // the kernel consumes the remaining entries on the next enter
+            log_error("io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        queued -= n;
+    }
+}
+
+struct aio_job* aio_complete(struct aio* aio)
+{
+    uint64_t count;
+    ssize_t ignored = read(aio->efd, &count, sizeof count);
+    (void)ignored;
+
+    struct aio_job* done = NULL;
+    struct uring* ring = aio->ring;
+    if (ring != NULL) {
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            struct ujob* job = (struct ujob*)(uintptr_t)cqe->user_data;
+            job->open_res = cqe->res;
+            uring_finish(job);
+            job->job.next = done;
+            done = &job->job;
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_lock(&aio->lock);
+    struct ujob* job = aio->done;
+    aio->done = NULL;
+    pthread_mutex_unlock(&aio->lock);
+    for (; job != NULL; job = job->next) {
+        job->job.next = done;
+        done = &job->job;
+    }
+    return done;
+}
+
+void aio_job_free(struct aio_job* job)
+{
+    if (job->fd >= 0) {
+        close(job->fd);
+    }
+    free(job->path);
+    free(job);
+}
+
+void aio_free(struct aio* aio)
+{
+    if (aio->ring != NULL) {
+        uring_free(aio->ring);
+    }
+    pthread_mutex_destroy(&aio->lock);
+    close(aio->efd);
+    free(aio);
+}
@@ -0,0 +1,106 @@
+/**
+ * @file aio.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Asynchronous file opening for the event loops
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef AIO
+#define AIO
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// submission queue entries of the io_uring of each worker
+#define AIO_URING_ENTRIES (256)
+// threads shared by all workers which do not use io_uring
+#define AIO_THREADS (4)
+
+enum aio_mode {
+    AIO_OFF,
+    AIO_THREADS_ONLY,
+    AIO_URING
+};
+
+/**
+ * @brief Request to open a file. The result is filled in before the job
+ * is returned by aio_complete.
+ */
+struct aio_job {
+    char* path;
+    // opened file or -1
+    int fd;
+    // errno if the file could not be opened
+    int err;
+    struct stat st;
+    void* ctx;
+    struct aio_job* next;
+};
+
+/**
+ * @brief Asynchronous opener of one event loop. Only used internally.
+ */
+struct aio;
+
+/**
+ * @brief Creates the opener of an event loop. AIO_URING falls back to the
+ * thread pool if the kernel does not provide io_uring.
+ *
+ * @param mode AIO_URING or AIO_THREADS_ONLY
+ * @return struct aio* opener or NULL on failure
+ */
+struct aio* aio_create(enum aio_mode mode);
+
+/**
+ * @brief Gets the fd which becomes readable once jobs are completed.
+ *
+ * @param aio opener
+ * @return int eventfd
+ */
+int aio_fd(struct aio* aio);
+
+/**
+ * @brief Queues opening @code{path} read only and non blocking together
+ * with a stat of it. io_uring jobs are batched until aio_submit.
+ *
+ * @param aio opener
+ * @param path path of the file, copied
+ * @param ctx context of the caller
+ * @return struct aio_job* job or NULL on failure
+ */
+struct aio_job* aio_open(struct aio* aio, const char* path, void* ctx);
+
+/**
+ * @brief Submits all queued jobs with a single system call.
+ *
+ * @param aio opener
+ */
+void aio_submit(struct aio* aio);
+
+/**
+ * @brief Gets all completed jobs. Called once aio_fd is readable.
+ *
+ * @param aio opener
+ * @return struct aio_job* list of completed jobs linked by next
+ */
+struct aio_job* aio_complete(struct aio* aio);
+
+/**
+ * @brief Frees a completed job. An fd which is still set is closed.
+ *
+ * @param job job
+ */
+void aio_job_free(struct aio_job* job);
+
+/**
+ * @brief Frees an opener. All of its jobs must be completed.
+ *
+ * @param aio opener
+ */
+void aio_free(struct aio* aio);
+
+#endif
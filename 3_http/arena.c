@@ -0,0 +1,122 @@
+/**
+ * @file arena.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Bounded bump allocator for the memory of one request
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+// alignment of every allocation, enough for any scalar type
+#define ALIGN (16)
+
+struct arena_block {
+    struct arena_block* next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__((aligned(ALIGN)));
+};
+
+/**
+ * @brief Allocates a block with room for @code{size} bytes.
+ *
+ * @param size usable size
+ * @return struct arena_block* block or NULL on failure
+ */
+static struct arena_block* block_create(size_t size)
+{
+    struct arena_block* block = malloc(sizeof(struct arena_block) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void arena_init(struct arena* arena)
+{
+    arena->blocks = NULL;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->exhausted = 0;
+}
+
+void* arena_alloc(struct arena* arena, size_t size)
+{
+    size = (size + ALIGN - 1) & ~(ALIGN - 1);
+    if (size == 0 || size > ARENA_MAX - arena->used) {
+        arena->exhausted += size != 0;
+        return NULL;
+    }
+
+    // the newest block is first, older blocks are full enough
+    struct arena_block* block = arena->blocks;
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        struct arena_block* fresh = block_create(block_size);
+        if (fresh == NULL) {
+            return NULL;
+        }
+        fresh->next = block;
+        arena->blocks = block = fresh;
+    }
+
+    void* mem = block->data + block->used;
+    block->used += size;
+    arena->used += size;
+    if (arena->used > arena->peak) {
+        arena->peak = arena->used;
+    }
+    return mem;
+}
+
+char* arena_strdup(struct arena* arena, const char* str)
+{
+    size_t len = strlen(str) + 1;
+    char* copy = arena_alloc(arena, len);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+void arena_reset(struct arena* arena)
+{
+    struct arena_block* block = arena->blocks;
+    if (block == NULL) {
+        return;
+    }
+    // keep the oldest block if it has the default size
+    while (block->next != NULL) {
+        struct arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+    if (block->size != ARENA_BLOCK_SIZE) {
+        free(block);
+        block = NULL;
+    } else {
+        block->used = 0;
+    }
+    arena->blocks = block;
+    arena->used = 0;
+}
+
+void arena_free(struct arena* arena)
+{
+    struct arena_block* block = arena->blocks;
+    while (block != NULL) {
+        struct arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena_init(arena);
+}
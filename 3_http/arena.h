@@ -0,0 +1,79 @@
+/**
+ * @file arena.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Bounded bump allocator for the memory of one request
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef ARENA
+#define ARENA
+
+#include <stddef.h>
+
+// size of the first block, kept between requests
+#define ARENA_BLOCK_SIZE (4096)
+// most memory one arena may hand out between two resets
+#define ARENA_MAX (64 * 1024)
+
+struct arena_block;
+
+/**
+ * @brief Arena whose allocations are freed all at once by arena_reset.
+ * The first block is allocated on first use and reused afterwards, larger
+ * requests get overflow blocks which are freed on reset.
+ */
+struct arena {
+    struct arena_block* blocks;
+    // bytes handed out since the last reset
+    size_t used;
+    // most bytes handed out between two resets
+    size_t peak;
+    // allocations refused because of ARENA_MAX
+    unsigned long long exhausted;
+};
+
+/**
+ * @brief Initializes an empty arena without allocating memory.
+ *
+ * @param arena arena
+ */
+void arena_init(struct arena* arena);
+
+/**
+ * @brief Allocates memory aligned for any type. The memory stays valid
+ * until the next arena_reset.
+ *
+ * @param arena arena
+ * @param size number of bytes
+ * @return void* memory or NULL if ARENA_MAX would be exceeded
+ */
+void* arena_alloc(struct arena* arena, size_t size);
+
+/**
+ * @brief Copies a string into the arena.
+ *
+ * @param arena arena
+ * @param str 0 terminated string
+ * @return char* copy or NULL on failure
+ */
+char* arena_strdup(struct arena* arena, const char* str);
+
+/**
+ * @brief Frees all allocations at once. The first block is kept.
+ *
+ * @param arena arena
+ */
+void arena_reset(struct arena* arena);
+
+/**
+ * @brief Frees all memory of the arena.
+ *
+ * @param arena arena
+ */
+void arena_free(struct arena* arena);
+
+#endif
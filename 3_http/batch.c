@@ -0,0 +1,532 @@
+/**
+ * @file batch.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Concurrent batch downloads over reused connections
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "batch.h"
+#include "common.h"
+#include "parser.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define PROTOCOL "HTTP/1.1"
+#define MAX_EVENTS (64)
+#define REQ_SIZE (4096)
+
+enum bconn_state {
+    BCONN_CONNECTING,
+    BCONN_SENDING,
+    BCONN_HEAD,
+    BCONN_BODY,
+    BCONN_IDLE
+};
+
+struct bconn {
+    int fd;
+    enum bconn_state state;
+    struct host* host;
+    size_t job;
+    int reused;
+    char req[REQ_SIZE];
+    size_t req_len;
+    size_t req_sent;
+    char buf[BATCH_BUF_SIZE];
+    size_t len;
+    struct parser parser;
+    struct body body;
+    int outfd;
+    int ok;
+    int keep_alive;
+    struct bconn* next;
+};
+
+/**
+ * @brief Cached address and idle connections of a host.
+ */
+struct host {
+    char name[BATCH_MAX_HOST];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    struct bconn* idle;
+    struct host* next;
+};
+
+struct batch {
+    int epfd;
+    char** urls;
+    char** outs;
+    size_t nurls;
+    size_t next;
+    const char* port;
+    struct host* hosts;
+    int active;
+    int failed;
+};
+
+static void job_start(struct batch* batch, size_t job, int reuse);
+
+/**
+ * @brief Gets the cached host of @code{url}. Unknown hosts are resolved
+ * and added to the cache.
+ *
+ * @param batch batch
+ * @param url url
+ * @return struct host* host or NULL if the host can not be resolved
+ */
+static struct host* host_get(struct batch* batch, const char* url)
+{
+    char name[strlen(url) + 1];
+    host_from_url(url, name);
+    if (strlen(name) >= BATCH_MAX_HOST) {
+        return NULL;
+    }
+
+    for (struct host* host = batch->hosts; host != NULL; host = host->next) {
+        if (strcmp(host->name, name) == 0) {
+            return host;
+        }
+    }
+
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(name, batch->port, &hints, &ai) != 0) {
+        return NULL;
+    }
+
+    struct host* host = malloc(sizeof(struct host));
+    if (host == NULL) {
+        freeaddrinfo(ai);
+        return NULL;
+    }
+    strcpy(host->name, name);
+    memcpy(&host->addr, ai->ai_addr, ai->ai_addrlen);
+    host->addrlen = ai->ai_addrlen;
+    host->idle = NULL;
+    host->next = batch->hosts;
+    batch->hosts = host;
+    freeaddrinfo(ai);
+    return host;
+}
+
+/**
+ * @brief Sets the epoll events the connection waits for.
+ *
+ * @param batch batch
+ * @param conn connection
+ * @param events EPOLLIN or EPOLLOUT
+ */
+static void conn_watch(struct batch* batch, struct bconn* conn, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(batch->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/**
+ * @brief Opens a new non blocking connection to @code{host}
+ *
+ * @param batch batch
+ * @param host host
+ * @return struct bconn* connection or NULL on failure
+ */
+static struct bconn* conn_open(struct batch* batch, struct host* host)
+{
+    struct bconn* conn = malloc(sizeof(struct bconn));
+    if (conn == NULL) {
+        return NULL;
+    }
+    conn->fd = socket(host->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        free(conn);
+        return NULL;
+    }
+    if (connect(conn->fd, (struct sockaddr*)&host->addr, host->addrlen) < 0 && errno != EINPROGRESS) {
+        close(conn->fd);
+        free(conn);
+        return NULL;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(batch->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+        close(conn->fd);
+        free(conn);
+        return NULL;
+    }
+    conn->state = BCONN_CONNECTING;
+    conn->host = host;
+    conn->reused = 0;
+    conn->outfd = -1;
+    return conn;
+}
+
+/**
+ * @brief Closes the connection.
+ *
+ * @param batch batch
+ * @param conn connection
+ */
+static void conn_free(struct batch* batch, struct bconn* conn)
+{
+    epoll_ctl(batch->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn);
+}
+
+/**
+ * @brief Removes an idle connection from the pool of its host.
+ *
+ * @param conn idle connection
+ */
+static void idle_remove(struct bconn* conn)
+{
+    struct bconn** p = &conn->host->idle;
+    while (*p != conn) {
+        p = &(*p)->next;
+    }
+    *p = conn->next;
+}
+
+/**
+ * @brief Finishes the job of the connection. Successful keep alive
+ * connections are returned to the pool of their host.
+ *
+ * @param batch batch
+ * @param conn connection
+ * @param ok 1 if the job succeeded
+ */
+static void job_finish(struct batch* batch, struct bconn* conn, int ok)
+{
+    if (conn->outfd >= 0) {
+        close(conn->outfd);
+        conn->outfd = -1;
+    }
+    if (!ok || !conn->ok) {
+        batch->failed++;
+    }
+    batch->active--;
+
+    if (ok && conn->keep_alive && conn->len == 0) {
+        conn->state = BCONN_IDLE;
+        conn->next = conn->host->idle;
+        conn->host->idle = conn;
+        // an idle connection becomes readable when the server closes it
+        conn_watch(batch, conn, EPOLLIN);
+    } else {
+        conn_free(batch, conn);
+    }
+}
+
+/**
+ * @brief Handles a failed connection. A request on a reused connection
+ * which the server closed before responding is retried once on a new
+ * connection.
+ *
+ * @param batch batch
+ * @param conn connection
+ */
+static void job_fail(struct batch* batch, struct bconn* conn)
+{
+    if (conn->reused && conn->state == BCONN_HEAD && conn->len == 0) {
+        size_t job = conn->job;
+        conn_free(batch, conn);
+        batch->active--;
+        job_start(batch, job, 0);
+        return;
+    }
+    log_error("%s: download failed", batch->urls[conn->job]);
+    job_finish(batch, conn, 0);
+}
+
+static void job_start(struct batch* batch, size_t job, int reuse)
+{
+    const char* url = batch->urls[job];
+    batch->active++;
+
+    struct host* host = host_get(batch, url);
+    if (host == NULL) {
+        log_error("%s: could not resolve host", url);
+        batch->failed++;
+        batch->active--;
+        return;
+    }
+
+    struct bconn* conn = reuse ? host->idle : NULL;
+    if (conn != NULL) {
+        host->idle = conn->next;
+        conn->reused = 1;
+        conn->state = BCONN_SENDING;
+        conn_watch(batch, conn, EPOLLOUT);
+    } else if ((conn = conn_open(batch, host)) == NULL) {
+        log_error("%s: connect failed", url);
+        batch->failed++;
+        batch->active--;
+        return;
+    }
+
+    conn->job = job;
+    conn->len = 0;
+    conn->req_sent = 0;
+    conn->ok = 1;
+    int len = snprintf(conn->req, sizeof(conn->req), "GET %s %s\r\nHost: %s\r\n\r\n",
+        file_path_from_url(url), PROTOCOL, host->name);
+    if (len < 0 || (size_t)len >= sizeof(conn->req)) {
+        log_error("%s: url too long", url);
+        job_finish(batch, conn, 0);
+        return;
+    }
+    conn->req_len = len;
+}
+
+/**
+ * @brief Writes all bytes to the output file
+ *
+ * @param fd output file
+ * @param data data
+ * @param len length of data
+ * @return int 0 on success -1 on failure
+ */
+static int write_all(int fd, const char* data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Handles a completely received response head.
+ *
+ * @param batch batch
+ * @param conn connection
+ * @return int 0 on success -1 on failure
+ */
+static int on_head(struct batch* batch, struct bconn* conn)
+{
+    struct parser* parser = &conn->parser;
+    if (body_init(&conn->body, parser) < 0) {
+        return -1;
+    }
+
+    const struct slice* connection = parser_header(parser, "Connection");
+    conn->keep_alive = slice_eq(parser->version, PROTOCOL) && conn->body.mode != BODY_UNTIL_CLOSE
+        && (connection == NULL || !slice_eq(*connection, "close"));
+
+    if (parser->status == 200) {
+        const char* out = batch->outs[conn->job];
+        conn->outfd = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (conn->outfd < 0) {
+            log_error("Error creating output file %s", out);
+            conn->ok = 0;
+        }
+    } else {
+        // the body is skipped so the connection can be reused
+        log_error("%s: %d %.*s", batch->urls[conn->job], parser->status, (int)parser->reason.len, parser->reason.ptr);
+        conn->ok = 0;
+    }
+
+    size_t head_len = parser->pos;
+    memmove(conn->buf, conn->buf + head_len, conn->len - head_len);
+    conn->len -= head_len;
+    conn->state = BCONN_BODY;
+    return 0;
+}
+
+/**
+ * @brief Writes the buffered body data to the output file.
+ *
+ * @param conn connection
+ * @return int PARSE_DONE if the body is complete, PARSE_AGAIN or PARSE_ERROR
+ */
+static int on_body(struct bconn* conn)
+{
+    size_t off = 0;
+    int res = PARSE_AGAIN;
+    while (res == PARSE_AGAIN) {
+        size_t consumed;
+        struct slice data;
+        res = body_next(&conn->body, conn->buf + off, conn->len - off, &consumed, &data);
+        if (res == PARSE_ERROR) {
+            return res;
+        }
+        if (data.len > 0 && conn->outfd >= 0 && write_all(conn->outfd, data.ptr, data.len) < 0) {
+            return PARSE_ERROR;
+        }
+        off += consumed;
+        if (consumed == 0) {
+            break;
+        }
+    }
+    memmove(conn->buf, conn->buf + off, conn->len - off);
+    conn->len -= off;
+    return res;
+}
+
+/**
+ * @brief Reads and processes the response.
+ *
+ * @param batch batch
+ * @param conn connection
+ */
+static void conn_read(struct batch* batch, struct bconn* conn)
+{
+    while (1) {
+        ssize_t n = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            if (n == 0 && conn->state == BCONN_BODY && conn->body.mode == BODY_UNTIL_CLOSE) {
+                conn->keep_alive = 0;
+                job_finish(batch, conn, 1);
+            } else {
+                job_fail(batch, conn);
+            }
+            return;
+        }
+        conn->len += n;
+
+        if (conn->state == BCONN_HEAD) {
+            int res = parser_parse(&conn->parser, conn->buf, conn->len);
+            if (res == PARSE_AGAIN && conn->len < sizeof(conn->buf)) {
+                continue;
+            }
+            if (res != PARSE_DONE || on_head(batch, conn) < 0) {
+                job_fail(batch, conn);
+                return;
+            }
+        }
+
+        int res = on_body(conn);
+        if (res == PARSE_ERROR) {
+            job_fail(batch, conn);
+            return;
+        }
+        if (res == PARSE_DONE) {
+            job_finish(batch, conn, 1);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Sends the request of the connection.
+ *
+ * @param batch batch
+ * @param conn connection
+ */
+static void conn_send(struct batch* batch, struct bconn* conn)
+{
+    if (conn->state == BCONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof err;
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            job_fail(batch, conn);
+            return;
+        }
+        conn->state = BCONN_SENDING;
+    }
+
+    while (conn->req_sent < conn->req_len) {
+        ssize_t n = send(conn->fd, conn->req + conn->req_sent, conn->req_len - conn->req_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n < 0) {
+            job_fail(batch, conn);
+            return;
+        }
+        conn->req_sent += n;
+    }
+
+    conn->state = BCONN_HEAD;
+    parser_init_res(&conn->parser);
+    conn_watch(batch, conn, EPOLLIN);
+}
+
+int httpc_batch(char** urls, char** outs, size_t nurls, const char* port, int concurrency)
+{
+    struct batch batch = { .urls = urls, .outs = outs, .nurls = nurls, .next = 0, .port = port, .hosts = NULL, .active = 0, .failed = 0 };
+    batch.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (batch.epfd < 0) {
+        log_error("epoll_create failed");
+        return nurls;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (batch.next < batch.nurls || batch.active > 0) {
+        while (batch.active < concurrency && batch.next < batch.nurls) {
+            job_start(&batch, batch.next++, 1);
+        }
+        if (batch.active == 0) {
+            continue;
+        }
+
+        int n = epoll_wait(batch.epfd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            log_error("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct bconn* conn = events[i].data.ptr;
+            if (conn->state == BCONN_IDLE) {
+                // closed by the server or unexpected data
+                idle_remove(conn);
+                conn_free(&batch, conn);
+            } else if (conn->state == BCONN_CONNECTING || conn->state == BCONN_SENDING) {
+                conn_send(&batch, conn);
+            } else {
+                conn_read(&batch, conn);
+            }
+        }
+    }
+
+    while (batch.hosts != NULL) {
+        struct host* host = batch.hosts;
+        while (host->idle != NULL) {
+            struct bconn* conn = host->idle;
+            host->idle = conn->next;
+            conn_free(&batch, conn);
+        }
+        batch.hosts = host->next;
+        free(host);
+    }
+    close(batch.epfd);
+    return batch.failed + (batch.nurls - batch.next);
+}
@@ -0,0 +1,36 @@
+/**
+ * @file batch.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Concurrent batch downloads over reused connections
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef BATCH
+#define BATCH
+
+#include <stddef.h>
+
+#define BATCH_BUF_SIZE (65536)
+#define BATCH_MAX_HOST (256)
+
+/**
+ * @brief Downloads every url of @code{urls} into the file of the same index
+ * in @code{outs}. Up to @code{concurrency} requests run at the same time on
+ * non blocking sockets. Connections are kept alive and reused for further
+ * requests to the same host and the address of every host is resolved
+ * only once.
+ * 
+ * @param urls valid urls
+ * @param outs output files
+ * @param nurls number of urls
+ * @param port port of the servers
+ * @param concurrency maximum number of parallel requests
+ * @return int number of failed downloads
+ */
+int httpc_batch(char** urls, char** outs, size_t nurls, const char* port, int concurrency);
+
+#endif
@@ -0,0 +1,268 @@
+/**
+ * @file bench.c
+ * @author Lorenz Hörburger 12024737
+ * @brief HTTP load generator CLI
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "common.h"
+#include "loadgen.h"
+#include "parser.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STD_CONNECTIONS (16)
+#define STD_REQUESTS (1000)
+
+struct options {
+    char* port;
+    char* url;
+    int connections;
+    int requests;
+    int keep_alive;
+    int slow;
+    // bytes of the body of every PUT request, 0 to send GET requests
+    long long upload;
+    // heads to parse in the parser microbenchmark, 0 to load a server
+    int parses;
+};
+
+/**
+ * @brief Prints the usage of the program.
+ *
+ */
+void usage(void)
+{
+    (void)fprintf(stderr, "Usage: %s [-p PORT] [-c CONNECTIONS] [-n REQUESTS] [-k] [-s SLOW] [-u UPLOAD_KB] URL\n"
+                          "       %s -x PARSES\n",
+        prg_name, prg_name);
+}
+
+/**
+ * @brief Parses a positive number option.
+ *
+ * @param arg option argument
+ * @param name name of the option for the error message
+ * @return int parsed number
+ */
+static int parse_count(const char* arg, const char* name)
+{
+    char* endptr;
+    long value = strtol(arg, &endptr, 10);
+    if (*endptr != '\0' || value < 1 || value > 1000000000) {
+        log_error("Invalid number of %s. Must be at least 1", name);
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+/**
+ * @brief Initializes the options of the program.
+ *
+ * @param argc argument counter
+ * @param argv argument vector
+ * @return struct options initialized options struct
+ */
+static struct options init_options(int argc, char** argv)
+{
+    struct options opts;
+    char opt;
+    int opt_p = 0;
+    int opt_c = 0;
+    int opt_n = 0;
+    int opt_k = 0;
+    int opt_s = 0;
+    int opt_u = 0;
+    int opt_x = 0;
+    opts.port = "80";
+    opts.connections = STD_CONNECTIONS;
+    opts.requests = STD_REQUESTS;
+    opts.keep_alive = 0;
+    opts.slow = 0;
+    opts.upload = 0;
+    opts.parses = 0;
+    while ((opt = getopt(argc, argv, "p:c:n:ks:u:x:")) != -1) {
+        switch (opt) {
+        case 'p':
+            opt_p += 1;
+            opts.port = optarg;
+            break;
+        case 'c':
+            opt_c += 1;
+            opts.connections = parse_count(optarg, "connections");
+            break;
+        case 'n':
+            opt_n += 1;
+            opts.requests = parse_count(optarg, "requests");
+            break;
+        case 'k':
+            opt_k += 1;
+            opts.keep_alive = 1;
+            break;
+        case 's':
+            opt_s += 1;
+            opts.slow = parse_count(optarg, "slow connections");
+            break;
+        case 'u':
+            opt_u += 1;
+            opts.upload = parse_count(optarg, "upload kilobytes") * 1024LL;
+            break;
+        case 'x':
+            opt_x += 1;
+            opts.parses = parse_count(optarg, "parses");
+            break;
+        default:
+            usage();
+            exit(EXIT_FAILURE);
+            break;
+        }
+    }
+
+    // too many options
+    if (opt_p > 1 || opt_c > 1 || opt_n > 1 || opt_k > 1 || opt_s > 1 || opt_u > 1 || opt_x > 1) {
+        log_error("Too many options");
+        exit(EXIT_FAILURE);
+    }
+
+    // the parser microbenchmark needs no server
+    if (opt_x) {
+        if (opt_p || opt_c || opt_n || opt_k || opt_s || opt_u || argc != optind) {
+            usage();
+            exit(EXIT_FAILURE);
+        }
+        opts.url = NULL;
+        return opts;
+    }
+
+    if (opt_p && !is_port_valid(opts.port)) {
+        log_error("Invalid port. Port must be in ranche of 0 - 65535");
+        exit(EXIT_FAILURE);
+    }
+
+    if (argc - 1 != optind) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    opts.url = argv[optind];
+    if (!is_url_valid(opts.url)) {
+        log_error("Invalid URL");
+        exit(EXIT_FAILURE);
+    }
+    return opts;
+}
+
+/**
+ * @brief Prints the result as a single line JSON object. Latencies are
+ * given in microseconds, the upload fields count the bodies of completed
+ * PUT requests.
+ *
+ * @param opts options
+ * @param result result
+ */
+static void print_result(struct options* opts, struct loadgen_result* result)
+{
+    const struct hist* lat = &result->latency;
+    double mean = lat->total > 0 ? (double)(lat->sum / lat->total) : 0;
+    printf("{\"url\":\"%s\",\"connections\":%d,\"requests_per_connection\":%d,\"keep_alive\":%s,"
+           "\"slow_connections\":%d,\"slow_closed\":%llu,"
+           "\"requests\":%llu,\"errors\":%llu,\"non_2xx\":%llu,\"connects\":%llu,\"bytes\":%llu,"
+           "\"seconds\":%.6f,\"requests_per_second\":%.1f,\"bytes_per_second\":%.1f,"
+           "\"upload_bytes\":%llu,\"upload_bytes_per_second\":%.1f,"
+           "\"latency_us\":{\"min\":%.3f,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}}\n",
+        opts->url, opts->connections, opts->requests, opts->keep_alive ? "true" : "false", opts->slow,
+        result->slow_closed,
+        result->requests, result->errors, result->non_2xx, result->connects, result->bytes,
+        result->seconds, result->requests / result->seconds, result->bytes / result->seconds,
+        result->uploaded, result->uploaded / result->seconds,
+        lat->min / 1e3, mean / 1e3, hist_percentile(lat, 50) / 1e3, hist_percentile(lat, 90) / 1e3,
+        hist_percentile(lat, 99) / 1e3, hist_percentile(lat, 99.9) / 1e3, lat->max / 1e3);
+}
+
+/**
+ * @brief Gets a monotonic timestamp
+ *
+ * @return double seconds
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Parses the head curl sends @code{parses} times, once in one piece and
+ * once split in the middle of a line like a head arriving in two reads.
+ * Prints the heads parsed per second as a single line JSON object.
+ *
+ * @param parses number of heads to parse per variant
+ * @return int 0 on success -1 if the head did not parse
+ */
+static int parse_bench(int parses)
+{
+    static const char head[] = "GET /static/css/site.css HTTP/1.1\r\nHost: localhost:8080\r\n"
+                               "User-Agent: curl/7.88.1\r\nAccept: */*\r\nAccept-Encoding: gzip\r\n"
+                               "Connection: keep-alive\r\n\r\n";
+    size_t len = sizeof(head) - 1;
+    struct parser parser;
+    double start = now();
+    for (int i = 0; i < parses; i++) {
+        parser_init(&parser);
+        if (parser_parse(&parser, head, len) != PARSE_DONE) {
+            return -1;
+        }
+    }
+    double whole = now() - start;
+
+    start = now();
+    for (int i = 0; i < parses; i++) {
+        parser_init(&parser);
+        if (parser_parse(&parser, head, len / 2) != PARSE_AGAIN || parser_parse(&parser, head, len) != PARSE_DONE) {
+            return -1;
+        }
+    }
+    double split = now() - start;
+
+    printf("{\"parses\":%d,\"head_bytes\":%zu,\"headers\":%zu,\"parses_per_second\":%.1f,"
+           "\"split_parses_per_second\":%.1f}\n",
+        parses, len, parser.nheaders, parses / whole, parses / split);
+    return 0;
+}
+
+/**
+ * @brief Main method of the load generator CLI. Exits with 1 if any
+ * request failed.
+ *
+ * @param argc argument counter
+ * @param argv argument vector
+ * @return int exit status
+ */
+int main(int argc, char** argv)
+{
+    prg_name = argv[0];
+    struct options opts = init_options(argc, argv);
+
+    if (opts.parses > 0) {
+        if (parse_bench(opts.parses) < 0) {
+            log_error("Parsing the benchmark head failed");
+            exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    struct loadgen_result result;
+    if (loadgen_run(opts.url, opts.port, opts.connections, opts.requests, opts.keep_alive, opts.slow, opts.upload, &result) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    print_result(&opts, &result);
+    exit(result.errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    return 0;
+}
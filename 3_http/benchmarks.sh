@@ -0,0 +1,257 @@
+#!/bin/sh
+# @file benchmarks.sh
+# @author Lorenz Hörburger (12024737)
+# @date 15.01.2023
+#
+# @brief Benchmarks of the server, each prints one line per measurement,
+# and its regression check
+#
+# Usage: ./benchmarks.sh workers|hotset|parser|slowloris|sizes|regress
+#
+# workers   requests per second of a 1 KiB file with 1, 2, 4, ... workers
+#           up to the number of cores (WORKERS overrides the list)
+# hotset    requests per second and file cache hits and misses of a hot
+#           set of 1, 16 and 256 small files requested in parallel
+#           (HOTSET overrides the list)
+# parser    request heads parsed per second, whole and split in two reads
+# slowloris p99 latency of keep alive clients alone and next to SLOW slow
+#           connections, sized to outlast the header timeout. Fails if the
+#           p99 exceeds P99_MAX_US or P99_RATIO times the baseline, or if
+#           the server closed no slow connection
+# sizes     requests per second of 1 KiB, 64 KiB and 1 MiB files sent with
+#           sendfile (-s 0), the default mapping threshold, mapped (-s 1 MiB)
+#           and mapped with MLOCK_MB locked (-L), fewer requests for larger
+#           files
+# regress   HTTP/1.1 regression check with curl, prints one line per check
+#           and fails if any check failed
+#
+# PORT, CONNECTIONS and REQUESTS override the defaults below.
+
+PORT=${PORT:-8099}
+CONNECTIONS=${CONNECTIONS:-64}
+REQUESTS=${REQUESTS:-2000}
+ROOT=$(mktemp -d)
+trap 'rm -rf "$ROOT"' EXIT
+
+# prints a number field of the JSON line of bench
+field()
+{
+    sed -n "s/.*\"$1\":\([0-9.]*\).*/\1/p"
+}
+
+# starts the server with the given options, its pid is in SERVER
+start_server()
+{
+    ./server -p "$PORT" "$@" &
+    SERVER=$!
+    sleep 0.5
+}
+
+stop_server()
+{
+    kill "$SERVER"
+    wait "$SERVER"
+}
+
+workers()
+{
+    head -c 1024 /dev/urandom > "$ROOT/k1.bin"
+    if [ -z "$WORKERS" ]; then
+        WORKERS=1
+        w=2
+        while [ "$w" -le "$(nproc)" ]; do
+            WORKERS="$WORKERS $w"
+            w=$((w * 2))
+        done
+    fi
+    for w in $WORKERS; do
+        start_server -w "$w" "$ROOT"
+        result=$(./bench -p "$PORT" -c "$CONNECTIONS" -n "$REQUESTS" -k "http://localhost/k1.bin")
+        echo "workers=$w requests_per_second=$(echo "$result" | field requests_per_second)" \
+            "errors=$(echo "$result" | field errors)"
+        stop_server
+    done
+}
+
+# prints the value of a file cache counter of the server
+cache_lookups()
+{
+    ./client -p "$PORT" "http://localhost/__stats" | sed -n "s/^http_file_cache_lookups_total{result=\"$1\"} //p"
+}
+
+hotset()
+{
+    for files in ${HOTSET:-1 16 256}; do
+        rm -f "$ROOT"/*
+        i=0
+        while [ "$i" -lt "$files" ]; do
+            head -c 512 /dev/urandom > "$ROOT/f$i.bin"
+            i=$((i + 1))
+        done
+        start_server "$ROOT"
+        # one bench per file, together they keep CONNECTIONS connections busy
+        conns=$(((CONNECTIONS + files - 1) / files))
+        pids=
+        i=0
+        while [ "$i" -lt "$files" ]; do
+            ./bench -p "$PORT" -c "$conns" -n "$REQUESTS" -k "http://localhost/f$i.bin" > "$ROOT/result$i" &
+            pids="$pids $!"
+            i=$((i + 1))
+        done
+        wait $pids
+        rps=$(cat "$ROOT"/result* | field requests_per_second | awk '{ s += $1 } END { printf "%.1f", s }')
+        errors=$(cat "$ROOT"/result* | field errors | awk '{ s += $1 } END { print s }')
+        echo "files=$files requests_per_second=$rps errors=$errors" \
+            "cache_hits=$(cache_lookups hit) cache_misses=$(cache_lookups miss)"
+        stop_server
+    done
+}
+
+parser()
+{
+    result=$(./bench -x "${PARSES:-1000000}")
+    echo "parses_per_second=$(echo "$result" | field parses_per_second)" \
+        "split_parses_per_second=$(echo "$result" | field split_parses_per_second)"
+}
+
+slowloris()
+{
+    slow=${SLOW:-256}
+    max_us=${P99_MAX_US:-100000}
+    ratio=${P99_RATIO:-20}
+    head -c 1024 /dev/urandom > "$ROOT/k1.bin"
+    start_server "$ROOT"
+    base=$(./bench -p "$PORT" -c "$CONNECTIONS" -n "$REQUESTS" -k "http://localhost/k1.bin")
+    base_p99=$(echo "$base" | field p99)
+    # long enough for the 10 s header timeout to close slow connections
+    rps=$(echo "$base" | field requests_per_second)
+    requests=$(awk -v rps="$rps" -v c="$CONNECTIONS" 'BEGIN { printf "%d", rps * 15 / c + 1 }')
+    result=$(./bench -p "$PORT" -c "$CONNECTIONS" -n "$requests" -k -s "$slow" "http://localhost/k1.bin")
+    stop_server
+    p99=$(echo "$result" | field p99)
+    closed=$(echo "$result" | field slow_closed)
+    echo "slow=0 p99_us=$base_p99 errors=$(echo "$base" | field errors)"
+    echo "slow=$slow p99_us=$p99 errors=$(echo "$result" | field errors) slow_closed=$closed"
+    if ! awk -v p="$p99" -v b="$base_p99" -v max="$max_us" -v r="$ratio" 'BEGIN { exit !(p <= max && p <= b * r) }'; then
+        echo "p99 of $p99 us exceeds $max_us us or $ratio times the baseline" >&2
+        exit 1
+    fi
+    if [ "$closed" -eq 0 ]; then
+        echo "no slow connection was closed by the server" >&2
+        exit 1
+    fi
+}
+
+sizes()
+{
+    head -c 1024 /dev/urandom > "$ROOT/k1.bin"
+    head -c 65536 /dev/urandom > "$ROOT/k64.bin"
+    head -c 1048576 /dev/urandom > "$ROOT/m1.bin"
+    for mode in sendfile default mmap mlock; do
+        case "$mode" in
+        sendfile) start_server -s 0 "$ROOT" ;;
+        default) start_server "$ROOT" ;;
+        mmap) start_server -s 1048576 "$ROOT" ;;
+        mlock) start_server -s 1048576 -L "${MLOCK_MB:-64}" "$ROOT" ;;
+        esac
+        for file in k1 k64 m1; do
+            case "$file" in
+            k1) requests=$REQUESTS ;;
+            k64) requests=$((REQUESTS / 16 + 1)) ;;
+            m1) requests=$((REQUESTS / 256 + 1)) ;;
+            esac
+            result=$(./bench -p "$PORT" -c "$CONNECTIONS" -n "$requests" -k "http://localhost/$file.bin")
+            echo "file=$file.bin mode=$mode requests_per_second=$(echo "$result" | field requests_per_second)" \
+                "errors=$(echo "$result" | field errors)"
+        done
+        stop_server
+    done
+}
+
+# compares a result with the expected one and counts failures
+check()
+{
+    if [ "$3" = "$2" ]; then
+        echo "ok $1"
+    else
+        echo "FAIL $1: expected $2, got $3"
+        failures=$((failures + 1))
+    fi
+}
+
+# prints the status code of a request
+status()
+{
+    curl -s -o /dev/null -w "%{http_code}" "$@"
+}
+
+regress()
+{
+    failures=0
+    mkdir "$ROOT/www" "$ROOT/www/sub" "$ROOT/www/empty"
+    echo "<h1>index</h1>" > "$ROOT/www/index.html"
+    head -c 5000 /dev/urandom > "$ROOT/www/bin.dat"
+    : > "$ROOT/www/zero.bin"
+    echo "sub file" > "$ROOT/www/sub/f.txt"
+    echo "space" > "$ROOT/www/with space.txt"
+    i=0
+    while [ "$i" -lt 200 ]; do
+        echo "body { margin: ${i}px; }" >> "$ROOT/www/style.css"
+        i=$((i + 1))
+    done
+    url="http://localhost:$PORT"
+    start_server -l -u 1 "$ROOT/www"
+
+    check index "200 15" "$(curl -s -o /dev/null -w "%{http_code} %{size_download}" "$url/")"
+    check file "200 5000" "$(curl -s -o /dev/null -w "%{http_code} %{size_download}" "$url/bin.dat")"
+    check missing 404 "$(status "$url/nope")"
+    check listing 200 "$(status "$url/empty/")"
+    check directory-redirect "301 $url/sub/" "$(curl -s -o /dev/null -w "%{http_code} %{redirect_url}" "$url/sub")"
+    check percent-decoding 200 "$(status "$url/with%20space.txt")"
+    check traversal 403 "$(status --path-as-is "$url/../etc/passwd")"
+    check bad-target 400 "$(status --request-target abc "$url/")"
+    curl -s --compressed -o "$ROOT/style.css" "$url/style.css"
+    check gzip same "$(cmp -s "$ROOT/style.css" "$ROOT/www/style.css" && echo same)"
+    check range "206 10" "$(curl -s -o /dev/null -w "%{http_code} %{size_download}" -H "Range: bytes=0-9" "$url/bin.dat")"
+    check empty-suffix-range 416 "$(status -H "Range: bytes=-5" "$url/zero.bin")"
+    check put-create 201 "$(status -T "$ROOT/www/bin.dat" "$url/up.dat")"
+    check put-replace 204 "$(status -T "$ROOT/www/index.html" "$url/up.dat")"
+    check put-content same "$(cmp -s "$ROOT/www/up.dat" "$ROOT/www/index.html" && echo same)"
+    check stats 200 "$(status "$url/__stats")"
+    check conflicting-length 400 "$(status -H "Content-Length: 0" -H "Content-Length: 5" "$url/")"
+    check large-head 431 "$(status -H "X-Large: $(head -c 20000 /dev/zero | tr '\0' a)" "$url/")"
+    result=$(./bench -p "$PORT" -c 8 -n 500 -k "http://localhost/index.html")
+    check keep-alive-errors 0 "$(echo "$result" | field errors)"
+    check keep-alive-non-2xx 0 "$(echo "$result" | field non_2xx)"
+
+    stop_server
+    if [ "$failures" -gt 0 ]; then
+        echo "$failures checks failed" >&2
+        exit 1
+    fi
+}
+
+case "$1" in
+workers)
+    workers
+    ;;
+hotset)
+    hotset
+    ;;
+parser)
+    parser
+    ;;
+slowloris)
+    slowloris
+    ;;
+sizes)
+    sizes
+    ;;
+regress)
+    regress
+    ;;
+*)
+    echo "Usage: $0 workers|hotset|parser|slowloris|sizes|regress" >&2
+    exit 1
+    ;;
+esac
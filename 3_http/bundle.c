@@ -0,0 +1,166 @@
+/**
+ * @file bundle.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Static bundle of a packed docRoot served from one memory mapping
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "bundle.h"
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Checks that a range lies within the bundle.
+ *
+ * @param bundle bundle
+ * @param offset start of the range
+ * @param len length of the range
+ * @return int 1 if it does
+ */
+static int in_bundle(const struct bundle* bundle, uint64_t offset, uint64_t len)
+{
+    return offset <= bundle->size && len <= bundle->size - offset;
+}
+
+/**
+ * @brief Checks the offsets of a representation.
+ *
+ * @param bundle bundle
+ * @param variant representation
+ * @return int 1 if valid
+ */
+static int variant_valid(const struct bundle* bundle, const struct bundle_variant* variant)
+{
+    return in_bundle(bundle, variant->head, variant->head_len) && in_bundle(bundle, variant->body, variant->body_len)
+        && memchr(variant->etag, '\0', BUNDLE_ETAG_SIZE) != NULL;
+}
+
+/**
+ * @brief Validates the header and all entries of a mapped bundle.
+ *
+ * @param bundle bundle
+ * @return int 0 if valid -1 otherwise
+ */
+static int validate(struct bundle* bundle)
+{
+    const struct bundle_header* header = (const struct bundle_header*)bundle->map;
+    if (bundle->size < sizeof(*header) || memcmp(header->magic, BUNDLE_MAGIC, BUNDLE_MAGIC_SIZE) != 0
+        || header->size != bundle->size) {
+        return -1;
+    }
+    // the arrays are accessed in place, so they must be aligned
+    if (header->seeds % sizeof(uint64_t) != 0 || header->entries % sizeof(uint64_t) != 0
+        || (header->count > 0 && header->nbuckets == 0)
+        || !in_bundle(bundle, header->seeds, (uint64_t)header->nbuckets * sizeof(uint32_t))
+        || !in_bundle(bundle, header->entries, (uint64_t)header->count * sizeof(struct bundle_entry))) {
+        return -1;
+    }
+    bundle->count = header->count;
+    bundle->nbuckets = header->nbuckets;
+    bundle->seeds = (const uint32_t*)(bundle->map + header->seeds);
+    bundle->entries = (const struct bundle_entry*)(bundle->map + header->entries);
+
+    for (uint32_t i = 0; i < bundle->count; i++) {
+        const struct bundle_entry* entry = &bundle->entries[i];
+        if (!in_bundle(bundle, entry->path, entry->path_len) || !variant_valid(bundle, &entry->plain)
+            || ((entry->flags & BUNDLE_GZIP) && !variant_valid(bundle, &entry->gz))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+uint64_t bundle_hash(const char* path, size_t len)
+{
+    // 64 bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint32_t bundle_bucket(uint64_t hash, uint32_t nbuckets)
+{
+    return (hash >> 32) % nbuckets;
+}
+
+uint32_t bundle_slot(uint64_t hash, uint32_t seed, uint32_t count)
+{
+    // finalizer of splitmix64, every seed gives an independent slot
+    uint64_t x = hash ^ (seed * 0x9e3779b97f4a7c15ULL);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x % count;
+}
+
+struct bundle* bundle_open(const char* path)
+{
+    struct bundle* bundle = malloc(sizeof(struct bundle));
+    if (bundle == NULL) {
+        log_error("malloc failed");
+        return NULL;
+    }
+    bundle->fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (bundle->fd < 0 || fstat(bundle->fd, &st) < 0) {
+        log_error("Opening the bundle %s failed: %s", path, strerror(errno));
+        if (bundle->fd >= 0) {
+            close(bundle->fd);
+        }
+        free(bundle);
+        return NULL;
+    }
+
+    bundle->size = st.st_size;
+    bundle->map = bundle->size > 0 ? mmap(NULL, bundle->size, PROT_READ, MAP_SHARED, bundle->fd, 0) : MAP_FAILED;
+    if (bundle->map == MAP_FAILED) {
+        log_error("Mapping the bundle %s failed", path);
+        close(bundle->fd);
+        free(bundle);
+        return NULL;
+    }
+    if (validate(bundle) < 0) {
+        log_error("%s is no valid bundle", path);
+        bundle_close(bundle);
+        return NULL;
+    }
+    // every request reads from the mapping, fault it in once
+    madvise((void*)bundle->map, bundle->size, MADV_WILLNEED);
+    return bundle;
+}
+
+const struct bundle_entry* bundle_find(const struct bundle* bundle, const char* path)
+{
+    if (bundle->count == 0) {
+        return NULL;
+    }
+    size_t len = strlen(path);
+    uint64_t hash = bundle_hash(path, len);
+    uint32_t seed = bundle->seeds[bundle_bucket(hash, bundle->nbuckets)];
+    const struct bundle_entry* entry = &bundle->entries[bundle_slot(hash, seed, bundle->count)];
+    // paths which are not in the bundle land on an arbitrary slot
+    if (entry->path_len != len || memcmp(bundle->map + entry->path, path, len) != 0) {
+        return NULL;
+    }
+    return entry;
+}
+
+void bundle_close(struct bundle* bundle)
+{
+    munmap((void*)bundle->map, bundle->size);
+    close(bundle->fd);
+    free(bundle);
+}
@@ -0,0 +1,140 @@
+/**
+ * @file bundle.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Static bundle of a packed docRoot served from one memory mapping
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef BUNDLE
+#define BUNDLE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUNDLE_MAGIC "HTBUNDL1"
+#define BUNDLE_MAGIC_SIZE (8)
+#define BUNDLE_ETAG_SIZE (48)
+// the entry has a gzip variant
+#define BUNDLE_GZIP (0x1)
+
+/**
+ * @brief Start of a bundle file. All numbers are in host byte order, all
+ * offsets count from the start of the file.
+ */
+struct bundle_header {
+    char magic[BUNDLE_MAGIC_SIZE];
+    // number of entries, also the number of slots of the perfect hash
+    uint32_t count;
+    // number of displacement seeds of the perfect hash
+    uint32_t nbuckets;
+    // offset of uint32_t seeds[nbuckets]
+    uint64_t seeds;
+    // offset of struct bundle_entry entries[count] in slot order
+    uint64_t entries;
+    // size of the whole file
+    uint64_t size;
+};
+
+/**
+ * @brief One representation of an entry.
+ */
+struct bundle_variant {
+    // offset of the precomputed header lines each terminated by \r\n
+    uint64_t head;
+    uint64_t body;
+    uint64_t body_len;
+    uint32_t head_len;
+    uint32_t reserved;
+    // 0 terminated entity tag including the quotes
+    char etag[BUNDLE_ETAG_SIZE];
+};
+
+/**
+ * @brief Entry of a URL path. Aliases of the same file, e.g. a directory
+ * and its index file, share their representations.
+ */
+struct bundle_entry {
+    // offset of the URL path, not 0 terminated
+    uint64_t path;
+    uint32_t path_len;
+    uint32_t flags;
+    int64_t mtime;
+    struct bundle_variant plain;
+    // valid if BUNDLE_GZIP is set
+    struct bundle_variant gz;
+};
+
+/**
+ * @brief Opened bundle.
+ */
+struct bundle {
+    int fd;
+    // whole file mapped read only
+    const char* map;
+    size_t size;
+    uint32_t count;
+    uint32_t nbuckets;
+    const uint32_t* seeds;
+    const struct bundle_entry* entries;
+};
+
+/**
+ * @brief Hashes a URL path. The hash is computed once per lookup, the
+ * bucket and the slot are derived from it.
+ *
+ * @param path path
+ * @param len length of the path
+ * @return uint64_t hash
+ */
+uint64_t bundle_hash(const char* path, size_t len);
+
+/**
+ * @brief Gets the bucket of a hash, which selects the displacement seed.
+ *
+ * @param hash hash of the path
+ * @param nbuckets number of buckets
+ * @return uint32_t bucket
+ */
+uint32_t bundle_bucket(uint64_t hash, uint32_t nbuckets);
+
+/**
+ * @brief Gets the slot of a hash displaced by the seed of its bucket.
+ *
+ * @param hash hash of the path
+ * @param seed seed of the bucket
+ * @param count number of slots
+ * @return uint32_t slot
+ */
+uint32_t bundle_slot(uint64_t hash, uint32_t seed, uint32_t count);
+
+/**
+ * @brief Maps a bundle and validates all its offsets, so lookups need no
+ * further checks.
+ *
+ * @param path bundle file
+ * @return struct bundle* bundle or NULL on failure
+ */
+struct bundle* bundle_open(const char* path);
+
+/**
+ * @brief Looks up a URL path with one probe of the perfect hash.
+ *
+ * @param bundle bundle
+ * @param path 0 terminated URL path
+ * @return const struct bundle_entry* entry or NULL if the path is not
+ * in the bundle
+ */
+const struct bundle_entry* bundle_find(const struct bundle* bundle, const char* path);
+
+/**
+ * @brief Unmaps and closes the bundle.
+ *
+ * @param bundle bundle
+ */
+void bundle_close(struct bundle* bundle);
+
+#endif
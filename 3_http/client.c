@@ -9,8 +9,10 @@
  * @copyright Copyright (c) 2023
  *
  */
+#include "batch.h"
 #include "common.h"
 #include "httpc.h"
+#include "segdl.h"
 #include <getopt.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -18,11 +20,19 @@
 #include <string.h>
 
 #define STD_FILE "index.html"
+#define STD_CONCURRENCY (8)
 
 struct options {
     FILE* out;
     char* port;
     char* url;
+    // batch mode
+    char* urlFile;
+    char* dir;
+    int concurrency;
+    // segmented mode writes to outPath with jobs connections
+    char* outPath;
+    int jobs;
 };
 
 static struct options* g_opts;
@@ -36,8 +46,10 @@ static FILE* open_out_file(const char* file);
  */
 void usage(void)
 {
-    (void)fprintf(stderr, "Usage: %s [-p PORT] [ -o FILE | -d DIR ] URL\n",
-        prg_name);
+    (void)fprintf(stderr, "Usage: %s [-p PORT] [ -o FILE | -d DIR ] URL\n"
+                          "       %s [-p PORT] -j JOBS ( -o FILE | -d DIR ) URL\n"
+                          "       %s [-p PORT] [-c CONCURRENCY] -i URL_FILE -d DIR\n",
+        prg_name, prg_name, prg_name);
 }
 
 /**
@@ -56,8 +68,19 @@ static struct options init_options(int argc, char** argv)
     int opt_p = 0;
     int opt_o = 0;
     int opt_d = 0;
+    int opt_i = 0;
+    int opt_c = 0;
+    int opt_j = 0;
+    char* endptr;
     opts.port = "80";
-    while ((opt = getopt(argc, argv, "p:o:d:")) != -1) {
+    opts.out = NULL;
+    opts.url = NULL;
+    opts.urlFile = NULL;
+    opts.dir = NULL;
+    opts.concurrency = STD_CONCURRENCY;
+    opts.outPath = NULL;
+    opts.jobs = 0;
+    while ((opt = getopt(argc, argv, "p:o:d:i:c:j:")) != -1) {
         switch (opt) {
         case 'p':
             opt_p += 1;
@@ -71,6 +94,26 @@ static struct options init_options(int argc, char** argv)
             opt_d += 1;
             dir = optarg;
             break;
+        case 'i':
+            opt_i += 1;
+            opts.urlFile = optarg;
+            break;
+        case 'c':
+            opt_c += 1;
+            opts.concurrency = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || opts.concurrency < 1) {
+                log_error("Invalid concurrency. Must be at least 1");
+                clean_exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            opt_j += 1;
+            opts.jobs = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || opts.jobs < 1 || opts.jobs > SEGDL_MAX_JOBS) {
+                log_error("Invalid number of jobs. Must be in range of 1 - %d", SEGDL_MAX_JOBS);
+                clean_exit(EXIT_FAILURE);
+            }
+            break;
         default:
             usage();
             clean_exit(EXIT_FAILURE);
@@ -79,7 +122,7 @@ static struct options init_options(int argc, char** argv)
     }
 
     // too many options
-    if (opt_p > 1 || opt_o > 1 || opt_d > 1) {
+    if (opt_p > 1 || opt_o > 1 || opt_d > 1 || opt_i > 1 || opt_c > 1 || opt_j > 1) {
         log_error("Too many options");
         clean_exit(EXIT_FAILURE);
     }
@@ -98,6 +141,16 @@ static struct options init_options(int argc, char** argv)
         }
     }
 
+    // batch mode reads the urls from a file
+    if (opt_i || opt_c) {
+        if (!opt_i || !opt_d || opt_j || argc != optind) {
+            usage();
+            clean_exit(EXIT_FAILURE);
+        }
+        opts.dir = dir;
+        return opts;
+    }
+
     // check URL argument
     if (argc - 1 == optind) {
         opts.url = argv[optind];
@@ -112,18 +165,34 @@ static struct options init_options(int argc, char** argv)
         clean_exit(EXIT_FAILURE);
     }
 
+    // segments are written in place, so stdout is not possible
+    if (opt_j && !opt_o && !opt_d) {
+        usage();
+        clean_exit(EXIT_FAILURE);
+    }
+
     if (opt_o) {
-        opts.out = open_out_file(outFile);
+        opts.outPath = strdup(outFile);
     } else if (opt_d) {
         char* file = file_from_url(opts.url);
         if (file == NULL) {
             file = STD_FILE;
         }
-        char strDir[strlen(file) + strlen(dir) + 2];
-        sprintf(strDir, "%s/%s", dir, file);
-        opts.out = open_out_file(strDir);
-    } else {
+        opts.outPath = malloc(strlen(file) + strlen(dir) + 2);
+        if (opts.outPath != NULL) {
+            sprintf(opts.outPath, "%s/%s", dir, file);
+        }
+    }
+    if ((opt_o || opt_d) && opts.outPath == NULL) {
+        log_error("malloc failed");
+        clean_exit(EXIT_FAILURE);
+    }
+
+    if (opts.outPath == NULL) {
         opts.out = stdout;
+    } else if (!opt_j) {
+        // the segmented mode must not truncate a partial download
+        opts.out = open_out_file(opts.outPath);
     }
 
     return opts;
@@ -146,6 +215,69 @@ static FILE* open_out_file(const char* file)
     return out;
 }
 
+/**
+ * @brief Downloads all urls listed in the url file, one per line, into
+ * the output directory. Empty lines are ignored.
+ * 
+ * @param opts options in batch mode
+ * @return int number of failed downloads
+ */
+static int run_batch(struct options* opts)
+{
+    FILE* in = fopen(opts->urlFile, "r");
+    if (in == NULL) {
+        log_error("Error opening url file %s", opts->urlFile);
+        clean_exit(EXIT_FAILURE);
+    }
+
+    char** urls = NULL;
+    size_t nurls = 0;
+    size_t cap = 0;
+    char* line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, in) != -1) {
+        line[strcspn(line, " \t\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        if (!is_url_valid(line)) {
+            log_error("Invalid url: %s.", line);
+            clean_exit(EXIT_FAILURE);
+        }
+        if (nurls == cap) {
+            cap = cap == 0 ? 64 : cap * 2;
+            urls = realloc(urls, cap * sizeof(char*));
+            if (urls == NULL) {
+                log_error("realloc failed");
+                clean_exit(EXIT_FAILURE);
+            }
+        }
+        urls[nurls++] = strdup(line);
+    }
+    free(line);
+    fclose(in);
+
+    char** outs = malloc((nurls + 1) * sizeof(char*));
+    for (size_t i = 0; i < nurls; i++) {
+        char* file = file_from_url(urls[i]);
+        if (file == NULL) {
+            file = STD_FILE;
+        }
+        outs[i] = malloc(strlen(file) + strlen(opts->dir) + 2);
+        sprintf(outs[i], "%s/%s", opts->dir, file);
+    }
+
+    int failed = httpc_batch(urls, outs, nurls, opts->port, opts->concurrency);
+
+    for (size_t i = 0; i < nurls; i++) {
+        free(urls[i]);
+        free(outs[i]);
+    }
+    free(urls);
+    free(outs);
+    return failed;
+}
+
 /**
  * @brief Exits the program with the given exit code and
  * cleans up all claimed ressoureces.
@@ -158,6 +290,7 @@ static void clean_exit(int exit_status)
         if (g_opts->out != NULL) {
             fclose(g_opts->out);
         }
+        free(g_opts->outPath);
     }
     exit(exit_status);
 }
@@ -174,15 +307,33 @@ int main(int argc, char** argv)
     prg_name = argv[0];
     struct options opts = init_options(argc, argv);
     g_opts = &opts;
+
+    if (opts.urlFile != NULL) {
+        if (run_batch(&opts) > 0) {
+            log_error("Some downloads failed");
+            clean_exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    if (opts.jobs > 0) {
+        int res = httpc_segmented(opts.url, opts.port, opts.outPath, opts.jobs);
+        if (res < 0) {
+            log_error("HTTPC failed");
+            clean_exit(EXIT_FAILURE);
+        }
+        if (res > 0) {
+            clean_exit(EXIT_SUCCESS);
+        }
+        // no range support, download over a single connection
+        opts.out = open_out_file(opts.outPath);
+    }
+
     if (httpc("GET", opts.url, opts.port, opts.out) < 0) {
         log_error("HTTPC failed");
         clean_exit(EXIT_FAILURE);
     }
 
-    if(opts.out != NULL) {
-        fclose(opts.out);
-    }
-
-    exit(EXIT_SUCCESS);
+    clean_exit(EXIT_SUCCESS);
     return 0;
 }
@@ -14,44 +14,126 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include <time.h>
 
-void get_rfc822_date(char* date)
+const char* prg_name;
+
+void format_http_date(time_t t, char* date, size_t size)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(date, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+time_t parse_http_date(const char* date)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof tm);
+    char* end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+int resolve_path_buf(char* buf, size_t size, const char* docRoot, const char* rel_url, const char* index)
+{
+    const char* file = file_from_url(rel_url);
+    int len = snprintf(buf, size, "%s%s%s", docRoot, rel_url, file == NULL ? index : "");
+    if (len < 0 || (size_t)len >= size) {
+        return -1;
+    }
+    return len;
+}
+
+/**
+ * @brief Gets the value of a hex digit
+ *
+ * @param c character
+ * @return int value or -1 if @code{c} is no hex digit
+ */
+static int hex_value(char c)
 {
-    char outstr[200];
-    time_t t;
-    struct tm* tmp;
-    t = time(NULL);
-    tmp = localtime(&t);
-    if (tmp == NULL) {
-        log_error("localtime");
+    if (c >= '0' && c <= '9') {
+        return c - '0';
     }
-    if (strftime(outstr, sizeof(outstr), "%a, %d %b %y %T %z", tmp) == 0) {
-        log_error("strftime returned 0");
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
     }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
 
-    strcpy(date, outstr);
+int url_decode_path(char* buf, size_t size, const char* url)
+{
+    size_t len = 0;
+    for (const char* p = url; *p != '\0' && *p != '?'; p++) {
+        char c = *p;
+        if (c == '%') {
+            int high = hex_value(p[1]);
+            int low = high >= 0 ? hex_value(p[2]) : -1;
+            if (low < 0 || (high == 0 && low == 0)) {
+                return -1;
+            }
+            c = (char)(high << 4 | low);
+            p += 2;
+        }
+        if (len + 1 >= size) {
+            return -1;
+        }
+        buf[len++] = c;
+    }
+    buf[len] = '\0';
+    return len;
 }
 
-char* resolve_path(char* docRoot, char* rel_url, char* index)
+int path_safe(const char* path)
 {
-    char* resolved = malloc(strlen(docRoot) + strlen(rel_url) + strlen(index) + 1);
-    strcpy(resolved, docRoot);
-    strcat(resolved, rel_url);
-    char* file = file_from_url(rel_url);
-    if (file == NULL) {
-        strcat(resolved, index);
-    }
-    return resolved;
+    if (path[0] != '/') {
+        return 0;
+    }
+    const char* seg = path + 1;
+    while (1) {
+        const char* end = strchr(seg, '/');
+        size_t len = end != NULL ? (size_t)(end - seg) : strlen(seg);
+        if ((len == 1 && seg[0] == '.') || (len == 2 && seg[0] == '.' && seg[1] == '.')) {
+            return 0;
+        }
+        if (end == NULL) {
+            return 1;
+        }
+        seg = end + 1;
+    }
 }
 
-int file_size(FILE* file)
+int is_compressible(const char* path)
 {
-    int size;
-    fseek(file, 0L, SEEK_END);
-    size = ftell(file);
-    fseek(file, 0L, SEEK_SET);
-    return size;
+    static const char* const extensions[] = {
+        ".html", ".htm", ".css", ".js", ".json", ".txt", ".svg", ".xml", ".csv", ".md"
+    };
+    const char* ext = strrchr(path, '.');
+    if (ext == NULL || strchr(ext, '/') != NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        if (strcasecmp(ext, extensions[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+off_t file_size(FILE* file)
+{
+    struct stat st;
+    if (fstat(fileno(file), &st) < 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    return st.st_size;
 }
 
 int is_port_valid(const char* port)
@@ -73,8 +155,8 @@ int is_port_valid(const char* port)
 char* file_from_url(const char* url)
 {
     char* lastSlash = strrchr(url, '/');
-    char* file = lastSlash + 1;
-    if ((lastSlash + 1)[0] == '\0') {
+    char* file = lastSlash != NULL ? lastSlash + 1 : (char*)url;
+    if (file[0] == '\0') {
         return NULL;
     }
     return file;
@@ -109,14 +191,42 @@ int is_url_valid(const char* url)
 char* status_str(int status)
 {
     switch (status) {
+    case 100:
+        return "Continue";
     case 200:
         return "OK";
+    case 201:
+        return "Created";
+    case 204:
+        return "No Content";
+    case 206:
+        return "Partial Content";
+    case 301:
+        return "Moved Permanently";
+    case 304:
+        return "Not Modified";
     case 400:
         return "Bad Request";
+    case 403:
+        return "Forbidden";
     case 404:
         return "Not Found";
+    case 409:
+        return "Conflict";
+    case 413:
+        return "Content Too Large";
+    case 416:
+        return "Range Not Satisfiable";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 500:
+        return "Internal Server Error";
     case 501:
         return "Not implemented";
+    case 502:
+        return "Bad Gateway";
+    case 503:
+        return "Service Unavailable";
     default:
         return NULL;
     }
@@ -131,10 +241,11 @@ char* status_str(int status)
  */
 void log_error(const char* format, ...)
 {
+    // one write per message, so that messages of threads do not interleave
+    char message[LOG_MESSAGE_SIZE];
     va_list args;
-    fprintf(stderr, "%s ERROR: ", prg_name);
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vsnprintf(message, sizeof(message), format, args);
     va_end(args);
-    fprintf(stderr, "\n");
+    fprintf(stderr, "%s ERROR: %s\n", prg_name, message);
 }
@@ -12,8 +12,13 @@
 #ifndef COMMON
 #define COMMON
 #include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
 
-const char* prg_name;
+// longer error messages are truncated
+#define LOG_MESSAGE_SIZE (1024)
+
+extern const char* prg_name;
 
 /**
  * @brief Validates if the given port is valid.
@@ -30,6 +35,7 @@ int is_port_valid(const char* port);
  * Examples: 
  * http://localhost/test/abc.html would return abc.html
  * http://localhost/ would return null because no file is specified
+ * abc.html without any slash would return abc.html
  * 
  * @param url valid url eg http://localhost/this/index.html
  * @return char* file if present else null
@@ -73,33 +79,76 @@ void host_from_url(const char* url, char* host);
 char* status_str(int status);
 
 /**
- * @brief Get the rfc822 date and saves it into date
+ * @brief Formats @code{t} as HTTP date (IMF-fixdate), e.g.
+ * Sun, 06 Nov 1994 08:49:37 GMT
  * 
+ * @param t time
  * @param date buffer to save date into
+ * @param size size of buffer
+ */
+void format_http_date(time_t t, char* date, size_t size);
+
+/**
+ * @brief Parses a HTTP date (IMF-fixdate)
+ * 
+ * @param date 0 terminated date
+ * @return time_t parsed time or -1 if invalid
  */
-void get_rfc822_date(char* date);
+time_t parse_http_date(const char* date);
 
 /**
- * @brief Gets the size in bytes of a file.
+ * @brief Gets the size in bytes of a file. Does not move the file position.
  * 
  * @param file opened file
- * @return int size in byte
+ * @return off_t size in byte or -1 if @code{file} is no regular file
  */
-int file_size(FILE* file);
+off_t file_size(FILE* file);
 
 /**
- * @brief Resolves the path for the given parameters.
+ * @brief Resolves the path for the given parameters into @code{buf}.
  * if rel_url accesses a specific file the the resolved path
  * is docRoot + rel_url. If no file is specified the index 
  * will be appended.
- * This function allocates memory. Memorey must be freed.
  * 
+ * @param buf output buffer
+ * @param size size of buffer
  * @param docRoot document root
  * @param rel_url relative url
  * @param index default file
- * @return char* resolved path
+ * @return int length of the path or -1 if it does not fit into @code{buf}
+ */
+int resolve_path_buf(char* buf, size_t size, const char* docRoot, const char* rel_url, const char* index);
+
+/**
+ * @brief Decodes the percent escapes of the path of @code{url} into
+ * @code{buf}. The query behind ? is not part of the path and is dropped.
+ * 
+ * @param buf output buffer
+ * @param size size of buffer
+ * @param url origin form url, e.g. /with%20space.txt?x=1
+ * @return int length of the path or -1 if an escape is malformed, decodes
+ * to a 0 byte or the path does not fit into @code{buf}
+ */
+int url_decode_path(char* buf, size_t size, const char* url);
+
+/**
+ * @brief Checks that a URL path names a file below the docRoot, i.e. it
+ * starts with / and has no . or .. segments. Must be checked after
+ * url_decode_path and before the path is resolved with resolve_path_buf.
+ * 
+ * @param path URL path
+ * @return int 1 if safe, 0 otherwise
+ */
+int path_safe(const char* path);
+
+/**
+ * @brief Checks if the file extension denotes a text format that is worth
+ * compressing.
+ * 
+ * @param path file path
+ * @return int 1 if compressible, 0 otherwise
  */
-char* resolve_path(char* docRoot, char* rel_url, char* index);
+int is_compressible(const char* path);
 
 /**
  * @brief Logs and error to stdrr. Supports all the 
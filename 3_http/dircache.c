@@ -0,0 +1,445 @@
+/**
+ * @file dircache.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Bounded cache of rendered directory listings
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "dircache.h"
+#include "common.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define DIRCACHE_BUCKETS (256)
+#define LISTING_SIZE (4096)
+
+/**
+ * @brief Record returned by getdents64, not exported by every libc
+ */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/**
+ * @brief Growing html buffer
+ */
+struct html {
+    char* buf;
+    size_t len;
+    size_t size;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dirlisting* buckets[DIRCACHE_BUCKETS];
+// least recently used listings are at the tail
+static struct dirlisting* lru_head = NULL;
+static struct dirlisting* lru_tail = NULL;
+static size_t bytes = 0;
+
+/**
+ * @brief FNV-1a hash of a path
+ *
+ * @param path 0 terminated path
+ * @return uint32_t hash
+ */
+static uint32_t hash_path(const char* path)
+{
+    uint32_t hash = 2166136261u;
+    for (; *path != '\0'; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Frees the listing and its html
+ *
+ * @param listing listing
+ */
+static void listing_free(struct dirlisting* listing)
+{
+    free(listing->html);
+    free(listing->path);
+    free(listing);
+}
+
+/**
+ * @brief Unlinks the listing from the LRU list. Caller must hold the lock.
+ *
+ * @param listing cached listing
+ */
+static void lru_unlink(struct dirlisting* listing)
+{
+    if (listing->prev != NULL) {
+        listing->prev->next = listing->next;
+    } else {
+        lru_head = listing->next;
+    }
+    if (listing->next != NULL) {
+        listing->next->prev = listing->prev;
+    } else {
+        lru_tail = listing->prev;
+    }
+}
+
+/**
+ * @brief Inserts the listing as most recently used. Caller must hold the
+ * lock.
+ *
+ * @param listing cached listing
+ */
+static void lru_push(struct dirlisting* listing)
+{
+    listing->prev = NULL;
+    listing->next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->prev = listing;
+    } else {
+        lru_tail = listing;
+    }
+    lru_head = listing;
+}
+
+/**
+ * @brief Removes the listing from the cache. It is freed once no response
+ * references it anymore. Caller must hold the lock.
+ *
+ * @param listing cached listing
+ */
+static void listing_remove(struct dirlisting* listing)
+{
+    struct dirlisting** p = &buckets[hash_path(listing->path) % DIRCACHE_BUCKETS];
+    while (*p != listing) {
+        p = &(*p)->hnext;
+    }
+    *p = listing->hnext;
+    lru_unlink(listing);
+    listing->cached = 0;
+    bytes -= listing->len;
+    if (listing->refs == 0) {
+        listing_free(listing);
+    }
+}
+
+/**
+ * @brief Makes room for @code{n} more bytes.
+ *
+ * @param html html buffer
+ * @param n number of bytes
+ * @return int 0 on success -1 on failure
+ */
+static int reserve(struct html* html, size_t n)
+{
+    if (html->len + n <= html->size) {
+        return 0;
+    }
+    size_t size = html->size;
+    while (html->len + n > size) {
+        size *= 2;
+    }
+    char* buf = realloc(html->buf, size);
+    if (buf == NULL) {
+        return -1;
+    }
+    html->buf = buf;
+    html->size = size;
+    return 0;
+}
+
+/**
+ * @brief Appends a string.
+ *
+ * @param html html buffer
+ * @param str 0 terminated string
+ * @return int 0 on success -1 on failure
+ */
+static int append(struct html* html, const char* str)
+{
+    size_t len = strlen(str);
+    if (reserve(html, len) < 0) {
+        return -1;
+    }
+    memcpy(html->buf + html->len, str, len);
+    html->len += len;
+    return 0;
+}
+
+/**
+ * @brief Appends a name percent encoded for use in an href. Room must be
+ * reserved by the caller, at most three bytes per character are written.
+ *
+ * @param html html buffer
+ * @param name name
+ */
+static void append_href(struct html* html, const char* name)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char* out = html->buf + html->len;
+    for (const unsigned char* c = (const unsigned char*)name; *c != '\0'; c++) {
+        if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || strchr("-._~", *c) != NULL) {
+            *out++ = *c;
+        } else {
+            *out++ = '%';
+            *out++ = hex[*c >> 4];
+            *out++ = hex[*c & 15];
+        }
+    }
+    html->len = out - html->buf;
+}
+
+/**
+ * @brief Appends a name escaped as html text. Room must be reserved by
+ * the caller, at most six bytes per character are written.
+ *
+ * @param html html buffer
+ * @param name name
+ */
+static void append_text(struct html* html, const char* name)
+{
+    char* out = html->buf + html->len;
+    for (const char* c = name; *c != '\0'; c++) {
+        const char* entity = NULL;
+        switch (*c) {
+        case '<':
+            entity = "&lt;";
+            break;
+        case '>':
+            entity = "&gt;";
+            break;
+        case '&':
+            entity = "&amp;";
+            break;
+        case '"':
+            entity = "&quot;";
+            break;
+        default:
+            *out++ = *c;
+            continue;
+        }
+        size_t len = strlen(entity);
+        memcpy(out, entity, len);
+        out += len;
+    }
+    html->len = out - html->buf;
+}
+
+/**
+ * @brief Checks if an entry of the directory is a directory itself.
+ * Only needs a system call if the file system does not report the type.
+ *
+ * @param dirfd directory
+ * @param dent entry
+ * @return int 1 if it is a directory
+ */
+static int is_dir(int dirfd, const struct linux_dirent64* dent)
+{
+    if (dent->d_type != DT_UNKNOWN && dent->d_type != DT_LNK) {
+        return dent->d_type == DT_DIR;
+    }
+    struct stat st;
+    return fstatat(dirfd, dent->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * @brief Renders the listing of an open directory. The entries are read
+ * with getdents64 in batches of DIRCACHE_DENTS_SIZE bytes and appended
+ * to one buffer, in the order of the directory.
+ *
+ * @param html html buffer
+ * @param dirfd directory
+ * @param url url path of the directory
+ * @return int 0 on success -1 on failure
+ */
+static int render(struct html* html, int dirfd, const char* url)
+{
+    int res = 0;
+    res |= append(html, "<!DOCTYPE html>\n<html>\n<head><meta charset=\"utf-8\"><title>Index of ");
+    res |= reserve(html, 6 * strlen(url));
+    if (res == 0) {
+        append_text(html, url);
+    }
+    res |= append(html, "</title></head>\n<body>\n<h1>Index of ");
+    res |= reserve(html, 6 * strlen(url));
+    if (res == 0) {
+        append_text(html, url);
+    }
+    res |= append(html, "</h1>\n<hr>\n<pre>\n<a href=\"../\">../</a>\n");
+    if (res != 0) {
+        return -1;
+    }
+
+    char* dents = malloc(DIRCACHE_DENTS_SIZE);
+    if (dents == NULL) {
+        return -1;
+    }
+    while (1) {
+        long n = syscall(SYS_getdents64, dirfd, dents, DIRCACHE_DENTS_SIZE);
+        if (n <= 0) {
+            res = n < 0 ? -1 : 0;
+            break;
+        }
+        for (long pos = 0; pos < n;) {
+            struct linux_dirent64* dent = (struct linux_dirent64*)(dents + pos);
+            pos += dent->d_reclen;
+            const char* name = dent->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            size_t len = strlen(name);
+            int dir = is_dir(dirfd, dent);
+            // <a href="...">...</a> with a slash after both names of directories
+            if (reserve(html, 3 * len + 6 * len + 24) < 0) {
+                res = -1;
+                break;
+            }
+            memcpy(html->buf + html->len, "<a href=\"", 9);
+            html->len += 9;
+            append_href(html, name);
+            if (dir) {
+                html->buf[html->len++] = '/';
+            }
+            memcpy(html->buf + html->len, "\">", 2);
+            html->len += 2;
+            append_text(html, name);
+            if (dir) {
+                html->buf[html->len++] = '/';
+            }
+            memcpy(html->buf + html->len, "</a>\n", 5);
+            html->len += 5;
+        }
+        if (res != 0) {
+            break;
+        }
+    }
+    free(dents);
+    return res | append(html, "</pre>\n<hr>\n</body>\n</html>\n");
+}
+
+/**
+ * @brief Reads and renders the directory and creates an uncached listing
+ * with one reference.
+ *
+ * @param path path of the directory
+ * @param url url path of the directory
+ * @return struct dirlisting* listing or NULL
+ */
+static struct dirlisting* listing_create(const char* path, const char* url)
+{
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    struct dirlisting* listing = calloc(1, sizeof(struct dirlisting));
+    struct html html = { malloc(LISTING_SIZE), 0, LISTING_SIZE };
+    if (fstat(dirfd, &st) < 0 || listing == NULL || html.buf == NULL || (listing->path = strdup(path)) == NULL
+        || render(&html, dirfd, url) < 0) {
+        close(dirfd);
+        free(html.buf);
+        if (listing != NULL) {
+            free(listing->path);
+        }
+        free(listing);
+        return NULL;
+    }
+    close(dirfd);
+
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->html = html.buf;
+    listing->len = html.len;
+    listing->part.buf = html.buf;
+    listing->part.offset = 0;
+    listing->part.len = html.len;
+    snprintf(listing->etag, sizeof(listing->etag), "\"d%llx-%llx.%lx\"", (unsigned long long)st.st_ino,
+        (unsigned long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+    char date[64];
+    format_http_date(st.st_mtime, date, sizeof(date));
+    listing->head_len = snprintf(listing->head, sizeof(listing->head),
+        "Content-Type: text/html; charset=utf-8\r\nLast-Modified: %s\r\nETag: %s\r\n", date, listing->etag);
+    listing->refs = 1;
+    return listing;
+}
+
+struct dirlisting* dircache_get(const char* path, const char* url)
+{
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    uint32_t bucket = hash_path(path) % DIRCACHE_BUCKETS;
+    pthread_mutex_lock(&lock);
+    struct dirlisting* listing = buckets[bucket];
+    while (listing != NULL && strcmp(listing->path, path) != 0) {
+        listing = listing->hnext;
+    }
+    if (listing != NULL && (listing->ino != st.st_ino || listing->mtime.tv_sec != st.st_mtim.tv_sec
+            || listing->mtime.tv_nsec != st.st_mtim.tv_nsec)) {
+        listing_remove(listing);
+        listing = NULL;
+    }
+    if (listing != NULL) {
+        lru_unlink(listing);
+        lru_push(listing);
+        listing->refs++;
+        pthread_mutex_unlock(&lock);
+        return listing;
+    }
+    pthread_mutex_unlock(&lock);
+
+    // render outside of the lock
+    listing = listing_create(path, url);
+    if (listing == NULL || listing->len > DIRCACHE_MAX_BYTES) {
+        // too large to cache, freed on release
+        return listing;
+    }
+
+    pthread_mutex_lock(&lock);
+    // another worker may have rendered the directory meanwhile
+    struct dirlisting* old = buckets[bucket];
+    while (old != NULL && strcmp(old->path, path) != 0) {
+        old = old->hnext;
+    }
+    if (old != NULL) {
+        listing_remove(old);
+    }
+    while (lru_tail != NULL && bytes + listing->len > DIRCACHE_MAX_BYTES) {
+        listing_remove(lru_tail);
+    }
+    listing->cached = 1;
+    bytes += listing->len;
+    listing->hnext = buckets[bucket];
+    buckets[bucket] = listing;
+    lru_push(listing);
+    pthread_mutex_unlock(&lock);
+    return listing;
+}
+
+void dircache_release(struct dirlisting* listing)
+{
+    pthread_mutex_lock(&lock);
+    listing->refs--;
+    int unused = listing->refs == 0 && !listing->cached;
+    pthread_mutex_unlock(&lock);
+    if (unused) {
+        listing_free(listing);
+    }
+}
@@ -0,0 +1,66 @@
+/**
+ * @file dircache.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Bounded cache of rendered directory listings
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef DIRCACHE
+#define DIRCACHE
+
+#include "fcache.h"
+#include "https.h"
+#include <time.h>
+
+// total size of all cached listings
+#define DIRCACHE_MAX_BYTES (32 << 20)
+// buffer for the entries read by one getdents64 call
+#define DIRCACHE_DENTS_SIZE (64 * 1024)
+
+struct dirlisting {
+    char* path;
+    ino_t ino;
+    // modification time of the directory with nanoseconds
+    struct timespec mtime;
+    char* html;
+    size_t len;
+    // body part of the html
+    struct res_part part;
+    char etag[FCACHE_ETAG_SIZE + 16];
+    // Content-Type, Last-Modified and ETag header lines
+    char head[FCACHE_HEAD_SIZE + 48];
+    size_t head_len;
+    unsigned int refs;
+    int cached;
+    struct dirlisting* hnext;
+    struct dirlisting* prev;
+    struct dirlisting* next;
+};
+
+/**
+ * @brief Gets the HTML listing of the directory @code{path}. A cached
+ * listing is used as long as the mtime of the directory is unchanged,
+ * otherwise the directory is read again and the listing rendered. The
+ * least recently used listings are evicted once DIRCACHE_MAX_BYTES is
+ * exceeded. The returned listing must be released with
+ * dircache_release. Thread safe.
+ * 
+ * @param path path of the directory
+ * @param url url path of the directory, used as title
+ * @return struct dirlisting* listing or NULL if @code{path} is no
+ * readable directory
+ */
+struct dirlisting* dircache_get(const char* path, const char* url);
+
+/**
+ * @brief Releases a listing returned by dircache_get.
+ * 
+ * @param listing listing
+ */
+void dircache_release(struct dirlisting* listing);
+
+#endif
@@ -0,0 +1,395 @@
+/**
+ * @file fcache.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Bounded cache of open files for the static file server
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "fcache.h"
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FCACHE_BUCKETS (2048)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fentry* buckets[FCACHE_BUCKETS];
+// least recently used entries are at the tail
+static struct fentry* lru_head = NULL;
+static struct fentry* lru_tail = NULL;
+static unsigned int count = 0;
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+// set by fcache_configure before the cache is used
+static size_t mmap_max = 0;
+static size_t mlock_max = 0;
+static size_t locked_bytes = 0;
+
+/**
+ * @brief FNV-1a hash of a path
+ *
+ * @param path 0 terminated path
+ * @return uint32_t hash
+ */
+static uint32_t hash_path(const char* path)
+{
+    uint32_t hash = 2166136261u;
+    for (; *path != '\0'; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Frees an entry and closes its fd.
+ *
+ * @param entry entry
+ */
+static void entry_free(struct fentry* entry)
+{
+    if (entry->map != NULL) {
+        munmap(entry->map, entry->size);
+    }
+    if (entry->fd >= 0) {
+        close(entry->fd);
+    }
+    free(entry->path);
+    free(entry);
+}
+
+static void lru_unlink(struct fentry* entry)
+{
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        lru_head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        lru_tail = entry->prev;
+    }
+}
+
+static void lru_push(struct fentry* entry)
+{
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+}
+
+/**
+ * @brief Removes the entry from the cache. It is freed once
+ * no request references it anymore. Caller must hold the lock.
+ *
+ * @param entry cached entry
+ */
+static void entry_remove(struct fentry* entry)
+{
+    struct fentry** p = &buckets[hash_path(entry->path) % FCACHE_BUCKETS];
+    while (*p != entry) {
+        p = &(*p)->hnext;
+    }
+    *p = entry->hnext;
+    lru_unlink(entry);
+    entry->cached = 0;
+    count--;
+    if (entry->locked) {
+        munlock(entry->map, entry->size);
+        entry->locked = 0;
+        locked_bytes -= entry->size;
+    }
+    if (entry->refs == 0) {
+        entry_free(entry);
+    }
+}
+
+/**
+ * @brief Creates a new uncached entry with one reference. A missing file
+ * results in a negative entry with fd -1.
+ *
+ * @param path path of the file
+ * @param fd opened file or -1, owned by the entry
+ * @param st status of the file
+ * @param now current time
+ * @return struct fentry* entry or NULL
+ */
+static struct fentry* entry_create(const char* path, int fd, const struct stat* st, time_t now)
+{
+    struct fentry* entry = malloc(sizeof(struct fentry));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+        free(entry);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    entry->fd = fd;
+    entry->size = fd >= 0 ? st->st_size : 0;
+    entry->mtime = fd >= 0 ? st->st_mtime : 0;
+    entry->ino = fd >= 0 ? st->st_ino : 0;
+    entry->checked = now;
+    snprintf(entry->etag, sizeof(entry->etag), "\"%llx-%llx\"", (long long)entry->mtime, (long long)entry->size);
+    char date[64];
+    format_http_date(entry->mtime, date, sizeof(date));
+    entry->head_len = snprintf(entry->head, sizeof(entry->head), "Last-Modified: %s\r\nETag: %s\r\nAccept-Ranges: bytes\r\n", date, entry->etag);
+    entry->refs = 1;
+    entry->cached = 0;
+    entry->uses = 0;
+    entry->locked = 0;
+    // small files are sent from memory together with the head
+    entry->map = NULL;
+    if (fd >= 0 && entry->size > 0 && (size_t)entry->size <= mmap_max) {
+        entry->map = mmap(NULL, entry->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (entry->map == MAP_FAILED) {
+            entry->map = NULL;
+        }
+    }
+    return entry;
+}
+
+/**
+ * @brief Opens the file and creates a new uncached entry with one reference.
+ *
+ * @param path path of the file
+ * @param now current time
+ * @return struct fentry* entry or NULL
+ */
+static struct fentry* entry_open(const char* path, time_t now)
+{
+    struct stat st;
+    // a fifo must not block the server
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0 && errno != ENOENT && errno != ENOTDIR) {
+        return NULL;
+    }
+    if (fd >= 0 && (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))) {
+        close(fd);
+        return NULL;
+    }
+    return entry_create(path, fd, &st, now);
+}
+
+/**
+ * @brief Finds the entry of @code{path}. Caller must hold the lock.
+ *
+ * @param path path of the file
+ * @param bucket hash bucket of the path
+ * @return struct fentry* entry or NULL
+ */
+static struct fentry* lookup(const char* path, uint32_t bucket)
+{
+    struct fentry* entry = buckets[bucket];
+    while (entry != NULL && strcmp(entry->path, path) != 0) {
+        entry = entry->hnext;
+    }
+    return entry;
+}
+
+/**
+ * @brief Marks a cached entry as used and takes a reference to it. Caller
+ * must hold the lock.
+ *
+ * @param entry cached entry
+ * @return struct fentry* entry or NULL for a negative entry
+ */
+static struct fentry* entry_use(struct fentry* entry)
+{
+    hits++;
+    lru_unlink(entry);
+    lru_push(entry);
+    if (entry->fd < 0) {
+        return NULL;
+    }
+    // pin often used mappings while the budget lasts
+    if (++entry->uses == FCACHE_HOT_USES && entry->map != NULL && locked_bytes + entry->size <= mlock_max
+        && mlock(entry->map, entry->size) == 0) {
+        entry->locked = 1;
+        locked_bytes += entry->size;
+    }
+    entry->refs++;
+    return entry;
+}
+
+/**
+ * @brief Adds a new entry to the cache and replaces an older entry of the
+ * same path. Caller must hold the lock.
+ *
+ * @param entry new entry with one reference
+ * @param bucket hash bucket of the path
+ * @return struct fentry* entry or NULL for a negative entry
+ */
+static struct fentry* insert(struct fentry* entry, uint32_t bucket)
+{
+    struct fentry* other = lookup(entry->path, bucket);
+    if (other != NULL) {
+        entry_remove(other);
+    }
+    if (count == FCACHE_MAX_ENTRIES) {
+        entry_remove(lru_tail);
+    }
+    entry->cached = 1;
+    entry->hnext = buckets[bucket];
+    buckets[bucket] = entry;
+    lru_push(entry);
+    count++;
+    if (entry->fd < 0) {
+        // the negative entry stays in the cache without references
+        entry->refs--;
+        return NULL;
+    }
+    return entry;
+}
+
+/**
+ * @brief Checks whether an entry still describes the file on disk.
+ *
+ * @param entry cached entry
+ * @param exists whether the file exists
+ * @param st status of the file, only read if it exists
+ * @return int 1 if the entry is still valid, 0 otherwise
+ */
+static int entry_matches(const struct fentry* entry, int exists, const struct stat* st)
+{
+    if (entry->fd < 0) {
+        return !exists;
+    }
+    return exists && st->st_ino == entry->ino && st->st_mtime == entry->mtime && st->st_size == entry->size;
+}
+
+struct fentry* fcache_get(const char* path)
+{
+    time_t now = time(NULL);
+    uint32_t bucket = hash_path(path) % FCACHE_BUCKETS;
+
+    pthread_mutex_lock(&lock);
+    struct fentry* entry = lookup(path, bucket);
+    if (entry != NULL && now - entry->checked >= FCACHE_REVALIDATE) {
+        // stat outside of the lock, a slow disk must not block other lookups
+        pthread_mutex_unlock(&lock);
+        struct stat st;
+        int exists = stat(path, &st) == 0;
+        pthread_mutex_lock(&lock);
+        // the entry may have been replaced or evicted meanwhile
+        entry = lookup(path, bucket);
+        if (entry != NULL && !entry_matches(entry, exists, &st)) {
+            entry_remove(entry);
+            entry = NULL;
+        } else if (entry != NULL) {
+            entry->checked = now;
+        }
+    }
+
+    if (entry != NULL) {
+        entry = entry_use(entry);
+        pthread_mutex_unlock(&lock);
+        return entry;
+    }
+    misses++;
+    pthread_mutex_unlock(&lock);
+
+    // open outside of the lock, a slow disk must not block other lookups
+    entry = entry_open(path, now);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    entry = insert(entry, bucket);
+    pthread_mutex_unlock(&lock);
+    return entry;
+}
+
+struct fentry* fcache_peek(const char* path, int* cached)
+{
+    time_t now = time(NULL);
+    uint32_t bucket = hash_path(path) % FCACHE_BUCKETS;
+
+    pthread_mutex_lock(&lock);
+    struct fentry* entry = lookup(path, bucket);
+    // revalidating needs a stat, which is left to the caller
+    *cached = entry != NULL && now - entry->checked < FCACHE_REVALIDATE;
+    entry = *cached ? entry_use(entry) : NULL;
+    pthread_mutex_unlock(&lock);
+    return entry;
+}
+
+struct fentry* fcache_add(const char* path, int fd, int err, const struct stat* st)
+{
+    if (fd < 0 && err != ENOENT && err != ENOTDIR) {
+        return NULL;
+    }
+    if (fd >= 0 && !S_ISREG(st->st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    time_t now = time(NULL);
+    uint32_t bucket = hash_path(path) % FCACHE_BUCKETS;
+    pthread_mutex_lock(&lock);
+    struct fentry* entry = lookup(path, bucket);
+    if (entry != NULL && entry_matches(entry, fd >= 0, st)) {
+        // the cached entry is still valid, keep its fd
+        entry->checked = now;
+        entry = entry_use(entry);
+        pthread_mutex_unlock(&lock);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return entry;
+    }
+    misses++;
+    pthread_mutex_unlock(&lock);
+
+    entry = entry_create(path, fd, st, now);
+    if (entry == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&lock);
+    entry = insert(entry, bucket);
+    pthread_mutex_unlock(&lock);
+    return entry;
+}
+
+void fcache_release(struct fentry* entry)
+{
+    pthread_mutex_lock(&lock);
+    entry->refs--;
+    int unused = entry->refs == 0 && !entry->cached;
+    pthread_mutex_unlock(&lock);
+    if (unused) {
+        entry_free(entry);
+    }
+}
+
+void fcache_configure(size_t map_max, size_t lock_max)
+{
+    mmap_max = map_max;
+    mlock_max = lock_max;
+}
+
+void fcache_stats(unsigned long* h, unsigned long* m)
+{
+    pthread_mutex_lock(&lock);
+    *h = hits;
+    *m = misses;
+    pthread_mutex_unlock(&lock);
+}
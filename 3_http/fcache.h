@@ -0,0 +1,117 @@
+/**
+ * @file fcache.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Bounded cache of open files for the static file server
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef FCACHE
+#define FCACHE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define FCACHE_MAX_ENTRIES (1024)
+#define FCACHE_HEAD_SIZE (160)
+#define FCACHE_ETAG_SIZE (40)
+// seconds until a cached entry is compared against the file system again
+#define FCACHE_REVALIDATE (1)
+// default size up to which files are memory mapped
+#define FCACHE_MMAP_MAX (16 * 1024)
+// uses after which a mapping is locked into memory if the budget allows
+#define FCACHE_HOT_USES (16)
+
+struct fentry {
+    char* path;
+    int fd;
+    off_t size;
+    time_t mtime;
+    ino_t ino;
+    time_t checked;
+    char etag[FCACHE_ETAG_SIZE];
+    // Last-Modified, ETag and Accept-Ranges header lines
+    char head[FCACHE_HEAD_SIZE];
+    size_t head_len;
+    // whole file mapped read only if it is small, else NULL. Only passed
+    // to system calls, so a truncated file fails the send with EFAULT
+    // instead of raising SIGBUS
+    void* map;
+    // set if the mapping is locked into memory
+    int locked;
+    unsigned int uses;
+    unsigned int refs;
+    int cached;
+    struct fentry* hnext;
+    struct fentry* prev;
+    struct fentry* next;
+};
+
+/**
+ * @brief Looks up the regular file at @code{path}. On a miss the file is
+ * opened and added to the cache. Missing files are cached as well, so
+ * repeated lookups of them do not hit the file system. Entries are
+ * revalidated by mtime, inode and size at most every FCACHE_REVALIDATE
+ * seconds.
+ * The returned entry must be released with fcache_release. Thread safe.
+ * 
+ * @param path path of the file
+ * @return struct fentry* entry or NULL if the file is no readable regular file
+ */
+struct fentry* fcache_get(const char* path);
+
+/**
+ * @brief Looks up @code{path} like fcache_get but never touches the file
+ * system. Entries which are due for revalidation count as not cached.
+ * Thread safe.
+ * 
+ * @param path path of the file
+ * @param cached set to 1 if the cache knows the file, a missing file is
+ * known as well
+ * @return struct fentry* entry or NULL
+ */
+struct fentry* fcache_peek(const char* path, int* cached);
+
+/**
+ * @brief Adds a file which was opened by the caller, e.g. off the event
+ * loop. The cached entry is kept if the file did not change. Thread safe.
+ * 
+ * @param path path of the file
+ * @param fd file opened read only, owned by the cache afterwards, or -1
+ * @param err errno of the failed open if @code{fd} is -1
+ * @param st status of the file
+ * @return struct fentry* entry or NULL if the file is no readable regular file
+ */
+struct fentry* fcache_add(const char* path, int fd, int err, const struct stat* st);
+
+/**
+ * @brief Releases an entry returned by fcache_get, fcache_peek or
+ * fcache_add. The fd stays
+ * valid until the last reference is released.
+ * 
+ * @param entry entry
+ */
+void fcache_release(struct fentry* entry);
+
+/**
+ * @brief Configures the memory mapping of small files. Must be called
+ * before the cache is used.
+ * 
+ * @param map_max files up to this size are mapped, 0 disables mapping
+ * @param lock_max bytes of mappings which may be locked into memory
+ */
+void fcache_configure(size_t map_max, size_t lock_max);
+
+/**
+ * @brief Gets the hit and miss counters of the cache.
+ * 
+ * @param hits number of hits
+ * @param misses number of misses
+ */
+void fcache_stats(unsigned long* hits, unsigned long* misses);
+
+#endif
@@ -0,0 +1,296 @@
+/**
+ * @file gzcache.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Bounded cache of gzip compressed file contents
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "gzcache.h"
+#include "common.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define GZCACHE_BUCKETS (1024)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gzentry* buckets[GZCACHE_BUCKETS];
+// least recently used entries are at the tail
+static struct gzentry* lru_head = NULL;
+static struct gzentry* lru_tail = NULL;
+static size_t bytes = 0;
+
+/**
+ * @brief FNV-1a hash of a path
+ *
+ * @param path 0 terminated path
+ * @return uint32_t hash
+ */
+static uint32_t hash_path(const char* path)
+{
+    uint32_t hash = 2166136261u;
+    for (; *path != '\0'; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Frees the entry and the compressed data
+ *
+ * @param entry entry
+ */
+static void entry_free(struct gzentry* entry)
+{
+    free(entry->data);
+    free(entry->path);
+    free(entry);
+}
+
+/**
+ * @brief Unlinks the entry from the LRU list. Caller must hold the lock.
+ *
+ * @param entry cached entry
+ */
+static void lru_unlink(struct gzentry* entry)
+{
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        lru_head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        lru_tail = entry->prev;
+    }
+}
+
+/**
+ * @brief Inserts the entry as most recently used. Caller must hold the lock.
+ *
+ * @param entry cached entry
+ */
+static void lru_push(struct gzentry* entry)
+{
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+}
+
+/**
+ * @brief Removes the entry from the cache. It is freed once no response
+ * references it anymore. Caller must hold the lock.
+ *
+ * @param entry cached entry
+ */
+static void entry_remove(struct gzentry* entry)
+{
+    struct gzentry** p = &buckets[hash_path(entry->path) % GZCACHE_BUCKETS];
+    while (*p != entry) {
+        p = &(*p)->hnext;
+    }
+    *p = entry->hnext;
+    lru_unlink(entry);
+    entry->cached = 0;
+    bytes -= entry->len;
+    if (entry->refs == 0) {
+        entry_free(entry);
+    }
+}
+
+char* gzcache_compress(const char* in, size_t len, size_t* out_len)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof zs);
+    // 16 + MAX_WBITS selects the gzip header
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    size_t size = deflateBound(&zs, len);
+    char* out = malloc(size);
+    if (out == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef*)in;
+    zs.avail_in = len;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = size;
+    int res = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+
+    if (res != Z_STREAM_END || *out_len >= len) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/**
+ * @brief Reads and compresses the file and creates an uncached entry
+ * with one reference.
+ *
+ * @param file file
+ * @return struct gzentry* entry or NULL
+ */
+static struct gzentry* entry_create(struct fentry* file)
+{
+    struct gzentry* entry = calloc(1, sizeof(struct gzentry));
+    char* in = malloc(file->size);
+    if (entry == NULL || in == NULL || (entry->path = strdup(file->path)) == NULL) {
+        free(in);
+        free(entry);
+        return NULL;
+    }
+
+    ssize_t n = pread(file->fd, in, file->size, 0);
+    if (n == file->size) {
+        entry->data = gzcache_compress(in, n, &entry->len);
+    }
+    free(in);
+
+    entry->ino = file->ino;
+    entry->mtime = file->mtime;
+    entry->size = file->size;
+    entry->part.buf = entry->data;
+    entry->part.offset = 0;
+    entry->part.len = entry->len;
+    // the compressed representation needs its own entity tag
+    snprintf(entry->etag, sizeof(entry->etag), "%.*s-gz\"", (int)strlen(file->etag) - 1, file->etag);
+    char date[64];
+    format_http_date(file->mtime, date, sizeof(date));
+    entry->head_len = snprintf(entry->head, sizeof(entry->head),
+        "Last-Modified: %s\r\nETag: %s\r\nContent-Encoding: gzip\r\nVary: Accept-Encoding\r\n", date, entry->etag);
+    entry->refs = 1;
+    return entry;
+}
+
+/**
+ * @brief Finds the entry of a path. Caller must hold the lock.
+ *
+ * @param path path of the file
+ * @param bucket bucket of the path
+ * @return struct gzentry* entry or NULL
+ */
+static struct gzentry* lookup(const char* path, uint32_t bucket)
+{
+    struct gzentry* entry = buckets[bucket];
+    while (entry != NULL && strcmp(entry->path, path) != 0) {
+        entry = entry->hnext;
+    }
+    return entry;
+}
+
+/**
+ * @brief Checks whether an entry was compressed from the current content
+ * of a file.
+ *
+ * @param entry cached entry
+ * @param file file
+ * @return int 1 if the entry is still valid, 0 otherwise
+ */
+static int entry_matches(const struct gzentry* entry, const struct fentry* file)
+{
+    return entry->ino == file->ino && entry->mtime == file->mtime && entry->size == file->size;
+}
+
+/**
+ * @brief Marks a cached entry as most recently used and takes a reference.
+ * Caller must hold the lock.
+ *
+ * @param entry cached entry
+ * @return struct gzentry* entry or NULL if compression does not pay off
+ */
+static struct gzentry* entry_use(struct gzentry* entry)
+{
+    lru_unlink(entry);
+    lru_push(entry);
+    if (entry->data == NULL) {
+        return NULL;
+    }
+    entry->refs++;
+    return entry;
+}
+
+struct gzentry* gzcache_get(struct fentry* file)
+{
+    if (file->size < GZCACHE_MIN_FILE || file->size > GZCACHE_MAX_FILE) {
+        return NULL;
+    }
+
+    uint32_t bucket = hash_path(file->path) % GZCACHE_BUCKETS;
+    pthread_mutex_lock(&lock);
+    struct gzentry* entry = lookup(file->path, bucket);
+    if (entry != NULL && !entry_matches(entry, file)) {
+        entry_remove(entry);
+        entry = NULL;
+    }
+    if (entry != NULL) {
+        entry = entry_use(entry);
+        pthread_mutex_unlock(&lock);
+        return entry;
+    }
+    pthread_mutex_unlock(&lock);
+
+    // compress outside of the lock
+    entry = entry_create(file);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    // another worker may have compressed the file meanwhile
+    struct gzentry* old = lookup(file->path, bucket);
+    if (old != NULL && entry_matches(old, file)) {
+        old = entry_use(old);
+        pthread_mutex_unlock(&lock);
+        entry_free(entry);
+        return old;
+    }
+    if (old != NULL) {
+        entry_remove(old);
+    }
+    while (lru_tail != NULL && bytes + entry->len > GZCACHE_MAX_BYTES) {
+        entry_remove(lru_tail);
+    }
+    entry->cached = 1;
+    bytes += entry->len;
+    entry->hnext = buckets[bucket];
+    buckets[bucket] = entry;
+    lru_push(entry);
+    if (entry->data == NULL) {
+        // remember that compression does not pay off
+        entry->refs--;
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+    return entry;
+}
+
+void gzcache_release(struct gzentry* entry)
+{
+    pthread_mutex_lock(&lock);
+    entry->refs--;
+    int unused = entry->refs == 0 && !entry->cached;
+    pthread_mutex_unlock(&lock);
+    if (unused) {
+        entry_free(entry);
+    }
+}
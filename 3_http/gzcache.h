@@ -0,0 +1,77 @@
+/**
+ * @file gzcache.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Bounded cache of gzip compressed file contents
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef GZCACHE
+#define GZCACHE
+
+#include "fcache.h"
+#include "https.h"
+
+// total size of all compressed bodies
+#define GZCACHE_MAX_BYTES (64 << 20)
+// files outside of these limits are not compressed on the fly, larger
+// ones would stall the event loop for milliseconds
+#define GZCACHE_MIN_FILE (256)
+#define GZCACHE_MAX_FILE (64 << 10)
+// pack compresses ahead of time and takes larger files
+#define GZCACHE_MAX_PACK_FILE (4 << 20)
+
+struct gzentry {
+    char* path;
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+    // NULL if compression does not pay off
+    char* data;
+    size_t len;
+    // body part of the compressed data
+    struct res_part part;
+    char etag[FCACHE_ETAG_SIZE + 4];
+    // Last-Modified, ETag, Content-Encoding and Vary header lines
+    char head[FCACHE_HEAD_SIZE + 64];
+    size_t head_len;
+    unsigned int refs;
+    int cached;
+    struct gzentry* hnext;
+    struct gzentry* prev;
+    struct gzentry* next;
+};
+
+/**
+ * @brief Gets the gzip compressed content of a cached file. On a miss the
+ * file is compressed by the calling thread and added to the cache, the least recently used
+ * entries are evicted once GZCACHE_MAX_BYTES is exceeded.
+ * The returned entry must be released with gzcache_release. Thread safe.
+ * 
+ * @param file file to compress
+ * @return struct gzentry* entry or NULL if the file is not compressed
+ */
+struct gzentry* gzcache_get(struct fentry* file);
+
+/**
+ * @brief Compresses @code{len} bytes of @code{in} with gzip framing.
+ * 
+ * @param in data
+ * @param len length of data
+ * @param out_len length of the compressed data
+ * @return char* compressed data to free or NULL if it is not smaller than
+ * the input
+ */
+char* gzcache_compress(const char* in, size_t len, size_t* out_len);
+
+/**
+ * @brief Releases an entry returned by gzcache_get.
+ * 
+ * @param entry entry
+ */
+void gzcache_release(struct gzentry* entry);
+
+#endif
@@ -0,0 +1,1437 @@
+/**
+ * @file h2.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Cleartext HTTP/2 (h2c) connections of the server
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "h2.h"
+#include "accesslog.h"
+#include "arena.h"
+#include "hpack.h"
+#include "stats.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FRAME_DATA (0x0)
+#define FRAME_HEADERS (0x1)
+#define FRAME_PRIORITY (0x2)
+#define FRAME_RST_STREAM (0x3)
+#define FRAME_SETTINGS (0x4)
+#define FRAME_PUSH_PROMISE (0x5)
+#define FRAME_PING (0x6)
+#define FRAME_GOAWAY (0x7)
+#define FRAME_WINDOW_UPDATE (0x8)
+#define FRAME_CONTINUATION (0x9)
+
+#define FLAG_END_STREAM (0x1)
+#define FLAG_ACK (0x1)
+#define FLAG_END_HEADERS (0x4)
+#define FLAG_PADDED (0x8)
+#define FLAG_PRIORITY (0x20)
+
+#define ERR_NO_ERROR (0x0)
+#define ERR_PROTOCOL (0x1)
+#define ERR_INTERNAL (0x2)
+#define ERR_FLOW_CONTROL (0x3)
+#define ERR_STREAM_CLOSED (0x5)
+#define ERR_FRAME_SIZE (0x6)
+#define ERR_REFUSED_STREAM (0x7)
+#define ERR_COMPRESSION (0x9)
+#define ERR_ENHANCE_YOUR_CALM (0xb)
+
+#define SETTINGS_ENABLE_PUSH (0x2)
+#define SETTINGS_MAX_CONCURRENT_STREAMS (0x3)
+#define SETTINGS_INITIAL_WINDOW_SIZE (0x4)
+#define SETTINGS_MAX_FRAME_SIZE (0x5)
+
+#define DEFAULT_WINDOW (65535)
+#define MAX_WINDOW (0x7fffffffLL)
+#define MAX_FRAME_SIZE_LIMIT (16777215)
+// output space needed to read another frame, enough for its answers
+#define CONTROL_RESERVE (256)
+// DATA frames smaller than this wait for more output space
+#define DATA_MIN (4096)
+#define STREAM_BUCKETS (64)
+// encoded response head, sent in a single HEADERS frame
+#define RES_BLOCK_SIZE (4096)
+// longest HTTP2-Settings header of an upgrade request
+#define UPGRADE_SETTINGS_MAX (256)
+#define UPGRADE_RESPONSE "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+
+enum stream_state {
+    // receiving the request
+    STREAM_OPEN,
+    // request complete, the response head is not framed yet
+    STREAM_READY,
+    // sending the body
+    STREAM_BODY
+};
+
+struct stream {
+    uint32_t id;
+    enum stream_state state;
+    // answered with 400, the request was malformed
+    int bad;
+    struct req req;
+    struct res res;
+    // memory of the request and its response
+    struct arena arena;
+    struct header headers[PARSER_MAX_HEADERS];
+    struct res_part single;
+    struct res_part* parts;
+    size_t nparts;
+    size_t part;
+    int part_started;
+    // position in the memory or fd of the current part
+    off_t part_off;
+    // bytes left of the current part, -1 if it ends with the body fd
+    off_t part_left;
+    int body_fd;
+    off_t body_len;
+    // send window, may become negative when the peer shrinks it
+    long long window;
+    // bytes framed for the access log
+    unsigned long long sent;
+    // monotonic time the request was complete
+    unsigned long long start;
+    // all streams in the order they take turns sending
+    struct stream* prev;
+    struct stream* next;
+    struct stream* hnext;
+};
+
+struct h2conn {
+    const struct h2_env* env;
+    struct hpack_decoder dec;
+    unsigned char in[H2_FRAME_HEAD + H2_MAX_FRAME];
+    size_t in_len;
+    // set once the client preface was received
+    int preface;
+    // set while frames wait for output space
+    int paused;
+    unsigned char out[H2_OUT_SIZE];
+    size_t out_pos;
+    size_t out_len;
+    // header block of block_stream collected from CONTINUATION frames
+    unsigned char block[H2_HEADER_BLOCK_MAX];
+    size_t block_len;
+    uint32_t block_stream;
+    int block_end_stream;
+    long long send_window;
+    // initial send window of new streams, set by the peer
+    long long initial_window;
+    // highest stream opened by the peer
+    uint32_t last_stream;
+    int nstreams;
+    struct stream* first;
+    struct stream* last;
+    struct stream* buckets[STREAM_BUCKETS];
+    // no new streams, closed once the open ones are answered
+    int goaway;
+    int goaway_sent;
+    // connection error, closed once GOAWAY is sent
+    int failed;
+};
+
+/**
+ * @brief Context of decoding a request header block
+ */
+struct decode_ctx {
+    // stream the fields belong to or NULL if they are ignored
+    struct stream* s;
+    // set after the first regular field
+    int regular;
+};
+
+/**
+ * @brief Gets the current monotonic time in nanoseconds.
+ *
+ * @return unsigned long long time
+ */
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Reads a 32 bit big endian integer.
+ *
+ * @param p input
+ * @return uint32_t value
+ */
+static uint32_t get32(const unsigned char* p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * @brief Writes a 32 bit big endian integer.
+ *
+ * @param p output
+ * @param v value
+ */
+static void put32(unsigned char* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/**
+ * @brief Writes a frame head.
+ *
+ * @param p output of H2_FRAME_HEAD bytes
+ * @param len payload length
+ * @param type frame type
+ * @param flags frame flags
+ * @param id stream id
+ */
+static void put_head(unsigned char* p, size_t len, int type, int flags, uint32_t id)
+{
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, id);
+}
+
+/**
+ * @brief Makes room at the end of the output buffer. The unsent bytes
+ * are only moved to the front if the room would not suffice otherwise.
+ *
+ * @param h2 connection
+ * @param need bytes needed
+ * @return int 1 if the room is available, 0 otherwise
+ */
+static int out_room(struct h2conn* h2, size_t need)
+{
+    if (sizeof(h2->out) - h2->out_len >= need) {
+        return 1;
+    }
+    if (h2->out_pos > 0) {
+        memmove(h2->out, h2->out + h2->out_pos, h2->out_len - h2->out_pos);
+        h2->out_len -= h2->out_pos;
+        h2->out_pos = 0;
+    }
+    return sizeof(h2->out) - h2->out_len >= need;
+}
+
+/**
+ * @brief Queues a frame. Control frames always find room as frames are
+ * only read while CONTROL_RESERVE bytes are free.
+ *
+ * @param h2 connection
+ * @param type frame type
+ * @param flags frame flags
+ * @param id stream id
+ * @param payload payload
+ * @param len payload length
+ */
+static void queue_frame(struct h2conn* h2, int type, int flags, uint32_t id, const void* payload, size_t len)
+{
+    if (!out_room(h2, H2_FRAME_HEAD + len)) {
+        return;
+    }
+    put_head(h2->out + h2->out_len, len, type, flags, id);
+    memcpy(h2->out + h2->out_len + H2_FRAME_HEAD, payload, len);
+    h2->out_len += H2_FRAME_HEAD + len;
+}
+
+/**
+ * @brief Queues a WINDOW_UPDATE frame.
+ *
+ * @param h2 connection
+ * @param id stream id, 0 for the connection
+ * @param increment window increment
+ */
+static void queue_window_update(struct h2conn* h2, uint32_t id, uint32_t increment)
+{
+    unsigned char payload[4];
+    put32(payload, increment);
+    queue_frame(h2, FRAME_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+/**
+ * @brief Queues GOAWAY with the last stream that is answered.
+ *
+ * @param h2 connection
+ * @param code error code
+ */
+static void queue_goaway(struct h2conn* h2, uint32_t code)
+{
+    unsigned char payload[8];
+    put32(payload, h2->last_stream);
+    put32(payload + 4, code);
+    queue_frame(h2, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    h2->goaway = 1;
+    h2->goaway_sent = 1;
+}
+
+/**
+ * @brief Fails the connection. No more frames are read and it is closed
+ * once the GOAWAY frame is sent.
+ *
+ * @param h2 connection
+ * @param code error code
+ */
+static void conn_error(struct h2conn* h2, uint32_t code)
+{
+    if (!h2->failed) {
+        queue_goaway(h2, code);
+        h2->failed = 1;
+    }
+}
+
+/**
+ * @brief Finds an open stream.
+ *
+ * @param h2 connection
+ * @param id stream id
+ * @return struct stream* stream or NULL if it is not open
+ */
+static struct stream* stream_find(struct h2conn* h2, uint32_t id)
+{
+    struct stream* s = h2->buckets[(id >> 1) % STREAM_BUCKETS];
+    while (s != NULL && s->id != id) {
+        s = s->hnext;
+    }
+    return s;
+}
+
+/**
+ * @brief Appends a stream to the end of the sending order.
+ *
+ * @param h2 connection
+ * @param s stream
+ */
+static void stream_append(struct h2conn* h2, struct stream* s)
+{
+    s->next = NULL;
+    s->prev = h2->last;
+    if (h2->last != NULL) {
+        h2->last->next = s;
+    } else {
+        h2->first = s;
+    }
+    h2->last = s;
+}
+
+/**
+ * @brief Removes a stream from the sending order.
+ *
+ * @param h2 connection
+ * @param s stream
+ */
+static void stream_unlink(struct h2conn* h2, struct stream* s)
+{
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        h2->first = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    } else {
+        h2->last = s->prev;
+    }
+}
+
+/**
+ * @brief Opens a stream.
+ *
+ * @param h2 connection
+ * @param id stream id
+ * @return struct stream* stream or NULL on failure
+ */
+static struct stream* stream_create(struct h2conn* h2, uint32_t id)
+{
+    struct stream* s = malloc(sizeof(struct stream));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->id = id;
+    s->state = STREAM_OPEN;
+    s->bad = 0;
+    arena_init(&s->arena);
+    memset(&s->req, 0, sizeof(s->req));
+    s->req.headers = s->headers;
+    s->req.keep_alive = 1;
+    memset(&s->res, 0, sizeof(s->res));
+    s->res.status = 400;
+    s->res.fd = -1;
+    s->res.arena = &s->arena;
+    s->nparts = 0;
+    s->part = 0;
+    s->part_started = 0;
+    s->body_fd = -1;
+    s->body_len = 0;
+    s->window = h2->initial_window;
+    s->sent = 0;
+    s->start = 0;
+
+    stream_append(h2, s);
+    struct stream** bucket = &h2->buckets[(id >> 1) % STREAM_BUCKETS];
+    s->hnext = *bucket;
+    *bucket = s;
+    h2->nstreams++;
+    return s;
+}
+
+/**
+ * @brief Closes a stream and releases its response.
+ *
+ * @param h2 connection
+ * @param s stream
+ */
+static void stream_free(struct h2conn* h2, struct stream* s)
+{
+    if (s->res.body != NULL) {
+        fclose(s->res.body);
+    }
+    if (s->res.done != NULL) {
+        s->res.done(&s->res);
+    }
+    stats_arena(h2->env->stats, s->arena.peak, s->arena.exhausted);
+    arena_free(&s->arena);
+
+    stream_unlink(h2, s);
+    struct stream** p = &h2->buckets[(s->id >> 1) % STREAM_BUCKETS];
+    while (*p != s) {
+        p = &(*p)->hnext;
+    }
+    *p = s->hnext;
+    h2->nstreams--;
+    free(s);
+}
+
+/**
+ * @brief Counts and logs a stream whose response is framed completely,
+ * then closes it.
+ *
+ * @param h2 connection
+ * @param s stream
+ */
+static void stream_finish(struct h2conn* h2, struct stream* s)
+{
+    const struct h2_env* env = h2->env;
+    unsigned long long ns = now_ns() - s->start;
+    stats_request(env->stats, s->res.status, ns);
+    if (env->log != NULL && accesslog_write(env->log, s->req.method, s->req.path, s->res.status, s->sent, ns) < 0) {
+        stats_add(&env->stats->log_dropped, 1);
+    }
+    stream_free(h2, s);
+}
+
+/**
+ * @brief Resets a stream.
+ *
+ * @param h2 connection
+ * @param id stream id
+ * @param code error code
+ */
+static void stream_error(struct h2conn* h2, uint32_t id, uint32_t code)
+{
+    unsigned char payload[4];
+    put32(payload, code);
+    queue_frame(h2, FRAME_RST_STREAM, 0, id, payload, sizeof(payload));
+    struct stream* s = stream_find(h2, id);
+    if (s != NULL) {
+        stream_free(h2, s);
+    }
+}
+
+/**
+ * @brief Answers a complete request. The handler runs right away, the
+ * response is framed once there is output space.
+ *
+ * @param h2 connection
+ * @param s stream
+ */
+static void respond(struct h2conn* h2, struct stream* s)
+{
+    s->start = now_ns();
+    s->state = STREAM_READY;
+    if (s->req.method == NULL || s->req.path == NULL) {
+        s->bad = 1;
+    }
+    if (s->bad) {
+        stats_add(&h2->env->stats->parse_failures, 1);
+        s->req.method = NULL;
+        s->req.path = NULL;
+        s->res.status = 400;
+    } else {
+        h2->env->handle(h2->env->ctx, &s->req, &s->res);
+        s->res.open_path = NULL;
+    }
+
+    s->body_len = res_body(&s->res, &s->single, &s->parts, &s->nparts, &s->body_fd);
+    if (s->res.status < 200 || s->res.status == 204 || s->res.status == 304) {
+        // neither a body nor a content-length
+        s->nparts = 0;
+        s->body_len = -1;
+    }
+}
+
+/**
+ * @brief Stores a decoded request field in the stream. Malformed fields
+ * mark the request as bad, it is answered with 400.
+ *
+ * @param ctx decode_ctx
+ * @param name name
+ * @param name_len length of the name
+ * @param value value
+ * @param value_len length of the value
+ * @return int always 0, the block is decoded to its end
+ */
+static int emit_field(void* ctx, const char* name, size_t name_len, const char* value, size_t value_len)
+{
+    struct decode_ctx* dctx = ctx;
+    struct stream* s = dctx->s;
+    if (s == NULL || s->bad) {
+        return 0;
+    }
+    char* copy = arena_alloc(&s->arena, name_len + value_len + 2);
+    if (copy == NULL) {
+        s->bad = 1;
+        return 0;
+    }
+    memcpy(copy, name, name_len);
+    copy[name_len] = '\0';
+    char* v = copy + name_len + 1;
+    memcpy(v, value, value_len);
+    v[value_len] = '\0';
+    for (size_t i = 0; i < name_len; i++) {
+        if (isupper((unsigned char)name[i])) {
+            s->bad = 1;
+            return 0;
+        }
+    }
+
+    struct slice field = { copy, name_len };
+    if (name_len > 0 && name[0] == ':') {
+        if (dctx->regular) {
+            s->bad = 1;
+        } else if (slice_eq(field, ":method") && s->req.method == NULL) {
+            s->req.method = v;
+        } else if (slice_eq(field, ":path") && s->req.path == NULL) {
+            // only the origin form, absolute targets go into :authority
+            s->req.path = v;
+            s->bad |= v[0] != '/';
+        } else if (slice_eq(field, ":authority")) {
+            // handlers know it as Host
+            field.ptr = "host";
+            field.len = 4;
+        } else if (!slice_eq(field, ":scheme")) {
+            s->bad = 1;
+        }
+        if (field.ptr == copy) {
+            return 0;
+        }
+    } else {
+        dctx->regular = 1;
+        if (slice_eq(field, "connection") || slice_eq(field, "keep-alive") || slice_eq(field, "transfer-encoding")
+            || slice_eq(field, "upgrade")) {
+            s->bad = 1;
+            return 0;
+        }
+    }
+
+    if (s->req.nheaders == PARSER_MAX_HEADERS) {
+        s->bad = 1;
+        return 0;
+    }
+    struct header* h = &s->headers[s->req.nheaders++];
+    h->name = field;
+    h->value.ptr = v;
+    h->value.len = value_len;
+    if (slice_eq(field, "content-length") && slice_to_ll(h->value, &s->req.content_length) < 0) {
+        s->bad = 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Handles a complete header block. It is decoded even if the
+ * stream is refused, so that the dynamic table stays in sync.
+ *
+ * @param h2 connection
+ */
+static void headers_done(struct h2conn* h2)
+{
+    uint32_t id = h2->block_stream;
+    int end = h2->block_end_stream;
+    h2->block_stream = 0;
+
+    struct decode_ctx ctx = { NULL, 0 };
+    struct stream* s = stream_find(h2, id);
+    int refused = 0;
+    if (s != NULL) {
+        // trailers, their fields are not used
+        if (s->state != STREAM_OPEN || !end) {
+            conn_error(h2, ERR_PROTOCOL);
+            return;
+        }
+    } else if (id > h2->last_stream) {
+        if (!h2->goaway) {
+            h2->last_stream = id;
+            s = h2->nstreams < H2_MAX_STREAMS ? stream_create(h2, id) : NULL;
+            refused = s == NULL;
+            ctx.s = s;
+        }
+    } else {
+        conn_error(h2, ERR_STREAM_CLOSED);
+        return;
+    }
+
+    int res = hpack_decode(&h2->dec, h2->block, h2->block_len, emit_field, &ctx);
+    h2->block_len = 0;
+    if (res != 0) {
+        conn_error(h2, ERR_COMPRESSION);
+        return;
+    }
+    if (refused) {
+        stream_error(h2, id, ERR_REFUSED_STREAM);
+    } else if (s != NULL && end) {
+        respond(h2, s);
+    }
+}
+
+/**
+ * @brief Removes the padding of a DATA or HEADERS payload.
+ *
+ * @param flags frame flags
+ * @param p payload, advanced behind the pad length
+ * @param len payload length, reduced by the padding
+ * @return int 0 on success -1 if the padding is invalid
+ */
+static int strip_padding(int flags, const unsigned char** p, size_t* len)
+{
+    if (!(flags & FLAG_PADDED)) {
+        return 0;
+    }
+    if (*len < 1 || (*p)[0] >= *len) {
+        return -1;
+    }
+    *len -= 1 + (*p)[0];
+    (*p)++;
+    return 0;
+}
+
+/**
+ * @brief Handles a DATA frame. Request bodies are not used, their bytes
+ * are returned to the flow control windows right away.
+ *
+ * @param h2 connection
+ * @param flags frame flags
+ * @param id stream id
+ * @param p payload
+ * @param len payload length
+ */
+static void on_data(struct h2conn* h2, int flags, uint32_t id, const unsigned char* p, size_t len)
+{
+    size_t flow = len;
+    if (id == 0 || strip_padding(flags, &p, &len) < 0) {
+        conn_error(h2, ERR_PROTOCOL);
+        return;
+    }
+    if (flow > 0) {
+        queue_window_update(h2, 0, flow);
+    }
+    struct stream* s = stream_find(h2, id);
+    if (s == NULL || s->state != STREAM_OPEN) {
+        if (id > h2->last_stream) {
+            conn_error(h2, ERR_PROTOCOL);
+        } else {
+            stream_error(h2, id, ERR_STREAM_CLOSED);
+        }
+        return;
+    }
+    if (flags & FLAG_END_STREAM) {
+        respond(h2, s);
+    } else if (flow > 0) {
+        queue_window_update(h2, id, flow);
+    }
+}
+
+/**
+ * @brief Handles a HEADERS frame, the block may continue in
+ * CONTINUATION frames.
+ *
+ * @param h2 connection
+ * @param flags frame flags
+ * @param id stream id
+ * @param p payload
+ * @param len payload length
+ */
+static void on_headers(struct h2conn* h2, int flags, uint32_t id, const unsigned char* p, size_t len)
+{
+    if (id == 0 || id % 2 == 0 || strip_padding(flags, &p, &len) < 0) {
+        conn_error(h2, ERR_PROTOCOL);
+        return;
+    }
+    if (flags & FLAG_PRIORITY) {
+        if (len < 5) {
+            conn_error(h2, ERR_PROTOCOL);
+            return;
+        }
+        p += 5;
+        len -= 5;
+    }
+    if (len > sizeof(h2->block)) {
+        conn_error(h2, ERR_ENHANCE_YOUR_CALM);
+        return;
+    }
+    memcpy(h2->block, p, len);
+    h2->block_len = len;
+    h2->block_stream = id;
+    h2->block_end_stream = flags & FLAG_END_STREAM;
+    if (flags & FLAG_END_HEADERS) {
+        headers_done(h2);
+    }
+}
+
+/**
+ * @brief Handles a CONTINUATION frame.
+ *
+ * @param h2 connection
+ * @param flags frame flags
+ * @param p payload
+ * @param len payload length
+ */
+static void on_continuation(struct h2conn* h2, int flags, const unsigned char* p, size_t len)
+{
+    if (h2->block_stream == 0) {
+        conn_error(h2, ERR_PROTOCOL);
+        return;
+    }
+    if (len > sizeof(h2->block) - h2->block_len) {
+        conn_error(h2, ERR_ENHANCE_YOUR_CALM);
+        return;
+    }
+    memcpy(h2->block + h2->block_len, p, len);
+    h2->block_len += len;
+    if (flags & FLAG_END_HEADERS) {
+        headers_done(h2);
+    }
+}
+
+/**
+ * @brief Applies the settings of the peer.
+ *
+ * @param h2 connection
+ * @param p settings, 6 bytes each
+ * @param len length of the settings
+ * @return int 0 on success, the error code otherwise
+ */
+static uint32_t apply_settings(struct h2conn* h2, const unsigned char* p, size_t len)
+{
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        unsigned int id = p[i] << 8 | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+        switch (id) {
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                return ERR_PROTOCOL;
+            }
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > MAX_WINDOW) {
+                return ERR_FLOW_CONTROL;
+            }
+            // open streams move by the difference
+            for (struct stream* s = h2->first; s != NULL; s = s->next) {
+                s->window += (long long)value - h2->initial_window;
+                if (s->window > MAX_WINDOW) {
+                    return ERR_FLOW_CONTROL;
+                }
+            }
+            h2->initial_window = value;
+            break;
+        case SETTINGS_MAX_FRAME_SIZE:
+            // frames are never larger than H2_MAX_FRAME anyway
+            if (value < H2_MAX_FRAME || value > MAX_FRAME_SIZE_LIMIT) {
+                return ERR_PROTOCOL;
+            }
+            break;
+        default:
+            // the encoder uses no dynamic table and nothing is pushed
+            break;
+        }
+    }
+    return ERR_NO_ERROR;
+}
+
+/**
+ * @brief Handles a SETTINGS frame.
+ *
+ * @param h2 connection
+ * @param flags frame flags
+ * @param id stream id
+ * @param p payload
+ * @param len payload length
+ */
+static void on_settings(struct h2conn* h2, int flags, uint32_t id, const unsigned char* p, size_t len)
+{
+    if (id != 0) {
+        conn_error(h2, ERR_PROTOCOL);
+        return;
+    }
+    if (flags & FLAG_ACK) {
+        if (len != 0) {
+            conn_error(h2, ERR_FRAME_SIZE);
+        }
+        return;
+    }
+    if (len % 6 != 0) {
+        conn_error(h2, ERR_FRAME_SIZE);
+        return;
+    }
+    uint32_t code = apply_settings(h2, p, len);
+    if (code != ERR_NO_ERROR) {
+        conn_error(h2, code);
+        return;
+    }
+    queue_frame(h2, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+/**
+ * @brief Handles a WINDOW_UPDATE frame.
+ *
+ * @param h2 connection
+ * @param id stream id
+ * @param p payload
+ * @param len payload length
+ */
+static void on_window_update(struct h2conn* h2, uint32_t id, const unsigned char* p, size_t len)
+{
+    if (len != 4) {
+        conn_error(h2, ERR_FRAME_SIZE);
+        return;
+    }
+    uint32_t increment = get32(p) & 0x7fffffff;
+    if (id == 0) {
+        h2->send_window += increment;
+        if (increment == 0 || h2->send_window > MAX_WINDOW) {
+            conn_error(h2, increment == 0 ? ERR_PROTOCOL : ERR_FLOW_CONTROL);
+        }
+        return;
+    }
+    struct stream* s = stream_find(h2, id);
+    if (s == NULL) {
+        // closed streams may still receive updates sent before
+        if (id > h2->last_stream) {
+            conn_error(h2, ERR_PROTOCOL);
+        }
+        return;
+    }
+    s->window += increment;
+    if (increment == 0 || s->window > MAX_WINDOW) {
+        stream_error(h2, id, increment == 0 ? ERR_PROTOCOL : ERR_FLOW_CONTROL);
+    }
+}
+
+/**
+ * @brief Handles a received frame.
+ *
+ * @param h2 connection
+ * @param type frame type
+ * @param flags frame flags
+ * @param id stream id
+ * @param p payload
+ * @param len payload length
+ */
+static void on_frame(struct h2conn* h2, int type, int flags, uint32_t id, const unsigned char* p, size_t len)
+{
+    // a header block must not be interrupted
+    if (h2->block_stream != 0 && (type != FRAME_CONTINUATION || id != h2->block_stream)) {
+        conn_error(h2, ERR_PROTOCOL);
+        return;
+    }
+    switch (type) {
+    case FRAME_DATA:
+        on_data(h2, flags, id, p, len);
+        break;
+    case FRAME_HEADERS:
+        on_headers(h2, flags, id, p, len);
+        break;
+    case FRAME_PRIORITY:
+        // streams are served round robin, priorities are ignored
+        if (id == 0) {
+            conn_error(h2, ERR_PROTOCOL);
+        } else if (len != 5) {
+            stream_error(h2, id, ERR_FRAME_SIZE);
+        }
+        break;
+    case FRAME_RST_STREAM:
+        if (id == 0 || id > h2->last_stream) {
+            conn_error(h2, ERR_PROTOCOL);
+        } else if (len != 4) {
+            conn_error(h2, ERR_FRAME_SIZE);
+        } else {
+            struct stream* s = stream_find(h2, id);
+            if (s != NULL) {
+                stream_free(h2, s);
+            }
+        }
+        break;
+    case FRAME_SETTINGS:
+        on_settings(h2, flags, id, p, len);
+        break;
+    case FRAME_PING:
+        if (id != 0) {
+            conn_error(h2, ERR_PROTOCOL);
+        } else if (len != 8) {
+            conn_error(h2, ERR_FRAME_SIZE);
+        } else if (!(flags & FLAG_ACK)) {
+            queue_frame(h2, FRAME_PING, FLAG_ACK, 0, p, len);
+        }
+        break;
+    case FRAME_GOAWAY:
+        // the peer opens no more streams, the open ones are answered
+        h2->goaway = 1;
+        break;
+    case FRAME_WINDOW_UPDATE:
+        on_window_update(h2, id, p, len);
+        break;
+    case FRAME_CONTINUATION:
+        on_continuation(h2, flags, p, len);
+        break;
+    case FRAME_PUSH_PROMISE:
+        // only servers push
+        conn_error(h2, ERR_PROTOCOL);
+        break;
+    default:
+        // unknown frame types must be ignored
+        break;
+    }
+}
+
+/**
+ * @brief Handles all complete frames of the input buffer. Stops early if
+ * the output buffer has no room for the answers.
+ *
+ * @param h2 connection
+ */
+static void process(struct h2conn* h2)
+{
+    size_t pos = 0;
+    if (!h2->preface) {
+        size_t n = h2->in_len < H2_PREFACE_LEN ? h2->in_len : H2_PREFACE_LEN;
+        if (memcmp(h2->in, H2_PREFACE, n) != 0) {
+            conn_error(h2, ERR_PROTOCOL);
+            return;
+        }
+        if (n < H2_PREFACE_LEN) {
+            return;
+        }
+        h2->preface = 1;
+        pos = H2_PREFACE_LEN;
+    }
+
+    h2->paused = 0;
+    while (!h2->failed && h2->in_len - pos >= H2_FRAME_HEAD) {
+        if (!out_room(h2, CONTROL_RESERVE)) {
+            h2->paused = 1;
+            break;
+        }
+        const unsigned char* f = h2->in + pos;
+        size_t len = (size_t)f[0] << 16 | f[1] << 8 | f[2];
+        if (len > H2_MAX_FRAME) {
+            conn_error(h2, ERR_FRAME_SIZE);
+            break;
+        }
+        if (h2->in_len - pos < H2_FRAME_HEAD + len) {
+            break;
+        }
+        on_frame(h2, f[3], f[4], get32(f + 5) & 0x7fffffff, f + H2_FRAME_HEAD, len);
+        pos += H2_FRAME_HEAD + len;
+    }
+    memmove(h2->in, h2->in + pos, h2->in_len - pos);
+    h2->in_len -= pos;
+}
+
+/**
+ * @brief Encodes the header lines of a response. Names are lower cased
+ * and connection specific headers are left out. Lines which do not fit
+ * are dropped.
+ *
+ * @param out output buffer
+ * @param size size of the buffer
+ * @param lines header lines each terminated by \r\n
+ * @param len length of the lines
+ * @return size_t encoded length
+ */
+static size_t encode_lines(unsigned char* out, size_t size, const char* lines, size_t len)
+{
+    size_t n = 0;
+    const char* end = lines + len;
+    while (lines < end) {
+        const char* eol = memchr(lines, '\r', end - lines);
+        const char* colon = memchr(lines, ':', end - lines);
+        if (eol == NULL) {
+            eol = end;
+        }
+        if (colon != NULL && colon < eol) {
+            char name[64];
+            size_t name_len = colon - lines;
+            const char* value = colon + 1;
+            while (value < eol && *value == ' ') {
+                value++;
+            }
+            if (name_len < sizeof(name)) {
+                for (size_t i = 0; i < name_len; i++) {
+                    name[i] = tolower((unsigned char)lines[i]);
+                }
+                struct slice field = { name, name_len };
+                if (!slice_eq(field, "connection") && !slice_eq(field, "keep-alive")
+                    && !slice_eq(field, "transfer-encoding")) {
+                    n += hpack_encode_field(out + n, size - n, name, name_len, value, eol - value);
+                }
+            }
+        }
+        lines = eol + 2 <= end ? eol + 2 : end;
+    }
+    return n;
+}
+
+/**
+ * @brief Encodes the response head of a stream.
+ *
+ * @param h2 connection
+ * @param s stream
+ * @param out output buffer
+ * @param size size of the buffer
+ * @return size_t encoded length
+ */
+static size_t encode_head(struct h2conn* h2, struct stream* s, unsigned char* out, size_t size)
+{
+    struct res* res = &s->res;
+    size_t n = hpack_encode_status(out, size, res->status);
+    if (res->status >= 200 && res->status < 300) {
+        // the worker formats "Date: ...\r\n"
+        const char* date = h2->env->date;
+        size_t len = strlen(date);
+        if (len > 8) {
+            n += hpack_encode_field(out + n, size - n, "date", 4, date + 6, len - 8);
+        }
+    }
+    if (s->body_len >= 0 && res->status != 304) {
+        char digits[24];
+        int len = snprintf(digits, sizeof(digits), "%lld", (long long)s->body_len);
+        n += hpack_encode_field(out + n, size - n, "content-length", 14, digits, len);
+    }
+    if (res->headers != NULL) {
+        n += encode_lines(out + n, size - n, res->headers, res->headers_len);
+    }
+    n += encode_lines(out + n, size - n, res->extra, res->extra_len);
+    return n;
+}
+
+/**
+ * @brief Frames the next piece of a stream's response.
+ *
+ * @param h2 connection
+ * @param s stream
+ * @return int 1 if a frame was queued or the stream ended, 0 if the
+ * stream cannot send, -1 if the output buffer is full
+ */
+static int stream_fill(struct h2conn* h2, struct stream* s)
+{
+    if (s->state == STREAM_OPEN) {
+        return 0;
+    }
+    if (s->state == STREAM_READY) {
+        unsigned char block[RES_BLOCK_SIZE];
+        size_t len = encode_head(h2, s, block, sizeof(block));
+        if (!out_room(h2, H2_FRAME_HEAD + len)) {
+            return -1;
+        }
+        int end = s->nparts == 0 || s->body_len == 0;
+        queue_frame(h2, FRAME_HEADERS, FLAG_END_HEADERS | (end ? FLAG_END_STREAM : 0), s->id, block, len);
+        s->sent += H2_FRAME_HEAD + len;
+        if (end) {
+            stream_finish(h2, s);
+        } else {
+            s->state = STREAM_BODY;
+        }
+        return 1;
+    }
+
+    long long window = s->window < h2->send_window ? s->window : h2->send_window;
+    if (window <= 0) {
+        return 0;
+    }
+    struct res_part* part = &s->parts[s->part];
+    if (!s->part_started) {
+        s->part_started = 1;
+        s->part_left = part->len;
+        s->part_off = part->buf != NULL ? 0 : part->offset;
+    }
+    size_t chunk = H2_MAX_FRAME;
+    if ((long long)chunk > window) {
+        chunk = window;
+    }
+    if (s->part_left >= 0 && (off_t)chunk > s->part_left) {
+        chunk = s->part_left;
+    }
+    if (!out_room(h2, H2_FRAME_HEAD + (chunk < DATA_MIN ? chunk : DATA_MIN))) {
+        return -1;
+    }
+    size_t room = sizeof(h2->out) - h2->out_len - H2_FRAME_HEAD;
+    if (chunk > room) {
+        chunk = room;
+    }
+
+    unsigned char* data = h2->out + h2->out_len + H2_FRAME_HEAD;
+    ssize_t n = chunk;
+    if (part->buf != NULL) {
+        memcpy(data, part->buf + s->part_off, chunk);
+    } else {
+        // the fd may be shared, do not move its file position
+        do {
+            n = pread(s->body_fd, data, chunk, s->part_off);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 || (n == 0 && s->part_left > 0)) {
+            // the file is gone or shrank
+            stream_error(h2, s->id, ERR_INTERNAL);
+            return 1;
+        }
+    }
+    s->part_off += n;
+    if (s->part_left > 0) {
+        s->part_left -= n;
+    } else if (n == 0) {
+        s->part_left = 0;
+    }
+
+    // the body ends with this frame if no bytes are left in any part
+    int end = 0;
+    if (s->part_left == 0) {
+        s->part_started = 0;
+        s->part++;
+        while (s->part < s->nparts && s->parts[s->part].len == 0) {
+            s->part++;
+        }
+        end = s->part == s->nparts;
+    }
+    if (n == 0 && !end) {
+        return 1;
+    }
+
+    put_head(h2->out + h2->out_len, n, FRAME_DATA, end ? FLAG_END_STREAM : 0, s->id);
+    h2->out_len += H2_FRAME_HEAD + n;
+    s->window -= n;
+    h2->send_window -= n;
+    s->sent += H2_FRAME_HEAD + n;
+    if (end) {
+        stream_finish(h2, s);
+    } else {
+        // the others take their turn before this stream sends again
+        stream_unlink(h2, s);
+        stream_append(h2, s);
+    }
+    return 1;
+}
+
+/**
+ * @brief Fills the output buffer with one frame of every stream that can
+ * send per round, until the buffer is full or no stream can send.
+ *
+ * @param h2 connection
+ */
+static void fill(struct h2conn* h2)
+{
+    // after an upgrade the 101 goes out alone, clients only expect frames
+    // once they sent their preface
+    if (!h2->preface) {
+        return;
+    }
+    int progress = 1;
+    while (progress && !h2->failed) {
+        progress = 0;
+        int n = h2->nstreams;
+        struct stream* s = h2->first;
+        for (int i = 0; i < n && s != NULL; i++) {
+            struct stream* next = s->next;
+            int res = stream_fill(h2, s);
+            if (res < 0) {
+                return;
+            }
+            progress |= res;
+            s = next;
+        }
+    }
+}
+
+/**
+ * @brief Checks if a comma separated header value contains a token.
+ *
+ * @param value header value
+ * @param token token, compared case insensitive
+ * @return int 1 if it is contained
+ */
+static int has_token(struct slice value, const char* token)
+{
+    size_t len = strlen(token);
+    size_t i = 0;
+    while (i < value.len) {
+        while (i < value.len && (value.ptr[i] == ' ' || value.ptr[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < value.len && value.ptr[i] != ',' && value.ptr[i] != ' ') {
+            i++;
+        }
+        if (i - start == len && strncasecmp(value.ptr + start, token, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Decodes base64url without padding as used by HTTP2-Settings.
+ *
+ * @param in encoded value
+ * @param out output of at least 3/4 of the input length
+ * @return long decoded length or -1 if the value is invalid
+ */
+static long base64url_decode(struct slice in, unsigned char* out)
+{
+    uint32_t bits = 0;
+    int nbits = 0;
+    long n = 0;
+    for (size_t i = 0; i < in.len; i++) {
+        char c = in.ptr[i];
+        int v;
+        if (c >= 'A' && c <= 'Z') {
+            v = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            v = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            v = c - '0' + 52;
+        } else if (c == '-') {
+            v = 62;
+        } else if (c == '_') {
+            v = 63;
+        } else if (c == '=') {
+            break;
+        } else {
+            return -1;
+        }
+        bits = bits << 6 | v;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            out[n++] = bits >> nbits;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Opens stream 1 for the request which asked for the upgrade.
+ *
+ * @param h2 connection
+ * @param req upgrade request
+ * @return int 0 on success -1 on failure
+ */
+static int upgrade_stream(struct h2conn* h2, const struct req* req)
+{
+    struct stream* s = stream_create(h2, 1);
+    if (s == NULL) {
+        return -1;
+    }
+    h2->last_stream = 1;
+    s->req.method = arena_strdup(&s->arena, req->method);
+    s->req.path = arena_strdup(&s->arena, req->path);
+    for (size_t i = 0; i < req->nheaders && i < PARSER_MAX_HEADERS; i++) {
+        const struct header* h = &req->headers[i];
+        char* copy = arena_alloc(&s->arena, h->name.len + h->value.len);
+        if (copy == NULL) {
+            s->bad = 1;
+            break;
+        }
+        memcpy(copy, h->name.ptr, h->name.len);
+        memcpy(copy + h->name.len, h->value.ptr, h->value.len);
+        s->headers[i].name.ptr = copy;
+        s->headers[i].name.len = h->name.len;
+        s->headers[i].value.ptr = copy + h->name.len;
+        s->headers[i].value.len = h->value.len;
+        s->req.nheaders++;
+    }
+    respond(h2, s);
+    return 0;
+}
+
+int h2_preface(const char* buf, size_t len)
+{
+    size_t n = len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN;
+    if (memcmp(buf, H2_PREFACE, n) != 0) {
+        return -1;
+    }
+    return n == H2_PREFACE_LEN;
+}
+
+const struct slice* h2_upgrade_settings(const struct req* req)
+{
+    const struct slice* upgrade = req_header(req, "Upgrade");
+    if (upgrade == NULL || !has_token(*upgrade, "h2c") || req->content_length > 0 || req->chunked) {
+        return NULL;
+    }
+    return req_header(req, "HTTP2-Settings");
+}
+
+struct h2conn* h2_create(const struct h2_env* env, const struct req* upgrade, const struct slice* settings)
+{
+    struct h2conn* h2 = malloc(sizeof(struct h2conn));
+    if (h2 == NULL) {
+        return NULL;
+    }
+    h2->env = env;
+    hpack_decoder_init(&h2->dec);
+    h2->in_len = 0;
+    h2->preface = 0;
+    h2->paused = 0;
+    h2->out_pos = 0;
+    h2->out_len = 0;
+    h2->block_len = 0;
+    h2->block_stream = 0;
+    h2->block_end_stream = 0;
+    h2->send_window = DEFAULT_WINDOW;
+    h2->initial_window = DEFAULT_WINDOW;
+    h2->last_stream = 0;
+    h2->nstreams = 0;
+    h2->first = NULL;
+    h2->last = NULL;
+    memset(h2->buckets, 0, sizeof(h2->buckets));
+    h2->goaway = 0;
+    h2->goaway_sent = 0;
+    h2->failed = 0;
+
+    if (upgrade != NULL) {
+        memcpy(h2->out, UPGRADE_RESPONSE, sizeof(UPGRADE_RESPONSE) - 1);
+        h2->out_len = sizeof(UPGRADE_RESPONSE) - 1;
+    }
+    unsigned char payload[6];
+    payload[0] = 0;
+    payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(payload + 2, H2_MAX_STREAMS);
+    queue_frame(h2, FRAME_SETTINGS, 0, 0, payload, sizeof(payload));
+
+    if (upgrade != NULL) {
+        // the settings count as the first SETTINGS frame of the client
+        unsigned char decoded[UPGRADE_SETTINGS_MAX];
+        long len = settings->len <= UPGRADE_SETTINGS_MAX ? base64url_decode(*settings, decoded) : -1;
+        if (len < 0 || len % 6 != 0 || apply_settings(h2, decoded, len) != ERR_NO_ERROR || upgrade_stream(h2, upgrade) < 0) {
+            h2_free(h2);
+            return NULL;
+        }
+    }
+    return h2;
+}
+
+int h2_input(struct h2conn* h2, const char* data, size_t len)
+{
+    if (len > sizeof(h2->in) - h2->in_len) {
+        return -1;
+    }
+    memcpy(h2->in + h2->in_len, data, len);
+    h2->in_len += len;
+    return 0;
+}
+
+ssize_t h2_read(struct h2conn* h2, int fd)
+{
+    process(h2);
+    ssize_t total = 0;
+    while (!h2->paused && !h2->failed) {
+        ssize_t n = read(fd, h2->in + h2->in_len, sizeof(h2->in) - h2->in_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        total += n;
+        h2->in_len += n;
+        process(h2);
+    }
+    return total;
+}
+
+int h2_write(struct h2conn* h2, int fd, unsigned long long* sent)
+{
+    while (1) {
+        fill(h2);
+        if (h2->out_pos == h2->out_len) {
+            h2->out_pos = 0;
+            h2->out_len = 0;
+            return 1;
+        }
+        ssize_t n = send(fd, h2->out + h2->out_pos, h2->out_len - h2->out_pos, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        h2->out_pos += n;
+        *sent += n;
+    }
+}
+
+int h2_paused(const struct h2conn* h2)
+{
+    return h2->paused || h2->failed;
+}
+
+int h2_idle(const struct h2conn* h2)
+{
+    return h2->nstreams == 0 && h2->out_pos == h2->out_len;
+}
+
+int h2_finished(const struct h2conn* h2)
+{
+    return (h2->failed || (h2->goaway && h2->nstreams == 0)) && h2->out_pos == h2->out_len;
+}
+
+void h2_shutdown(struct h2conn* h2)
+{
+    if (!h2->goaway_sent && out_room(h2, H2_FRAME_HEAD + 8)) {
+        queue_goaway(h2, ERR_NO_ERROR);
+    }
+    h2->goaway = 1;
+}
+
+void h2_free(struct h2conn* h2)
+{
+    while (h2->first != NULL) {
+        stream_free(h2, h2->first);
+    }
+    hpack_decoder_free(&h2->dec);
+    free(h2);
+}
@@ -0,0 +1,158 @@
+/**
+ * @file h2.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Cleartext HTTP/2 (h2c) connections of the server
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef H2
+#define H2
+
+#include "https.h"
+#include "parser.h"
+#include <stddef.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN (sizeof(H2_PREFACE) - 1)
+#define H2_FRAME_HEAD (9)
+// largest frame accepted and sent, the minimum every peer must accept
+#define H2_MAX_FRAME (16384)
+// streams of one connection answered at once
+#define H2_MAX_STREAMS (256)
+// responses are framed into this buffer before they are sent
+#define H2_OUT_SIZE (64 * 1024)
+// largest header block of a request, CONTINUATION frames included
+#define H2_HEADER_BLOCK_MAX (16384)
+
+struct stats;
+struct accesslog_ring;
+
+/**
+ * @brief What the connections of a worker need from the event loop.
+ */
+struct h2_env {
+    // answers the request of a stream, must not use res_open
+    void (*handle)(void* ctx, struct req* req, struct res* res);
+    void* ctx;
+    struct stats* stats;
+    // NULL if the access log is disabled
+    struct accesslog_ring* log;
+    // Date header line of the worker, kept up to date by the worker
+    const char* date;
+};
+
+/**
+ * @brief State of one HTTP/2 connection. Only used internally.
+ */
+struct h2conn;
+
+/**
+ * @brief Checks if a connection starts with the HTTP/2 client preface.
+ *
+ * @param buf first bytes received
+ * @param len number of bytes
+ * @return int 1 if the preface is complete, 0 if more bytes are needed,
+ * -1 if the connection speaks HTTP/1.1
+ */
+int h2_preface(const char* buf, size_t len);
+
+/**
+ * @brief Gets the settings of an HTTP/1.1 request which asks to upgrade
+ * to h2c. Requests with a body are not upgraded.
+ *
+ * @param req request
+ * @return const struct slice* value of HTTP2-Settings or NULL
+ */
+const struct slice* h2_upgrade_settings(const struct req* req);
+
+/**
+ * @brief Creates an HTTP/2 connection and queues the server preface.
+ *
+ * @param env environment of the worker
+ * @param upgrade request which asked for the upgrade, answered on stream
+ * 1 after a 101 response, or NULL if the client used prior knowledge
+ * @param settings HTTP2-Settings of the upgrade request
+ * @return struct h2conn* connection or NULL on failure
+ */
+struct h2conn* h2_create(const struct h2_env* env, const struct req* upgrade, const struct slice* settings);
+
+/**
+ * @brief Passes bytes which were already received, e.g. behind the
+ * upgrade request.
+ *
+ * @param h2 connection
+ * @param data received bytes
+ * @param len number of bytes
+ * @return int 0 on success -1 if they do not fit
+ */
+int h2_input(struct h2conn* h2, const char* data, size_t len);
+
+/**
+ * @brief Processes buffered frames and reads from the socket until it
+ * would block. Reading pauses while the output buffer is too full to
+ * answer, see h2_paused.
+ *
+ * @param h2 connection
+ * @param fd client socket
+ * @return ssize_t bytes read or -1 if the connection must be closed
+ */
+ssize_t h2_read(struct h2conn* h2, int fd);
+
+/**
+ * @brief Frames the ready responses and sends them without blocking.
+ * DATA frames of all streams are interleaved within their flow control
+ * windows.
+ *
+ * @param h2 connection
+ * @param fd client socket
+ * @param sent bytes sent are added
+ * @return int 1 if nothing is left to send, 0 if the socket would block,
+ * -1 on failure
+ */
+int h2_write(struct h2conn* h2, int fd, unsigned long long* sent);
+
+/**
+ * @brief Checks if reading is paused until the output is sent.
+ *
+ * @param h2 connection
+ * @return int 1 if paused
+ */
+int h2_paused(const struct h2conn* h2);
+
+/**
+ * @brief Checks if the connection has no open streams and nothing to send.
+ *
+ * @param h2 connection
+ * @return int 1 if idle
+ */
+int h2_idle(const struct h2conn* h2);
+
+/**
+ * @brief Checks if the connection can be closed, i.e. it was shut down
+ * by either side or failed and everything is sent.
+ *
+ * @param h2 connection
+ * @return int 1 if finished
+ */
+int h2_finished(const struct h2conn* h2);
+
+/**
+ * @brief Sends GOAWAY and refuses new streams. The open streams are
+ * still answered.
+ *
+ * @param h2 connection
+ */
+void h2_shutdown(struct h2conn* h2);
+
+/**
+ * @brief Releases the connection and all its streams.
+ *
+ * @param h2 connection
+ */
+void h2_free(struct h2conn* h2);
+
+#endif
@@ -0,0 +1,547 @@
+/**
+ * @file hpack.c
+ * @author Lorenz Hörburger 12024737
+ * @brief HPACK header compression of HTTP/2 (RFC 7541)
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "hpack.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// a code tree of 256 leaves has 511 nodes
+#define HUFFMAN_NODES (512)
+
+// static table of RFC 7541 appendix A, index 1 is the first entry
+static const struct hpack_field static_table[HPACK_STATIC_SIZE] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// Huffman code of RFC 7541 appendix B, EOS is left out
+static const uint32_t huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t huffman_lens[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+/**
+ * @brief Node of the Huffman decoding tree. 0 marks a missing child as
+ * the root is never a child.
+ */
+struct huffman_node {
+    int16_t next[2];
+    // decoded symbol of a leaf or -1
+    int16_t sym;
+};
+
+static struct huffman_node huffman_tree[HUFFMAN_NODES];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Builds the decoding tree from the code table once.
+ */
+static void huffman_init(void)
+{
+    int nodes = 1;
+    huffman_tree[0].sym = -1;
+    for (int sym = 0; sym < 256; sym++) {
+        int node = 0;
+        for (int bit = huffman_lens[sym] - 1; bit >= 0; bit--) {
+            int b = (huffman_codes[sym] >> bit) & 1;
+            if (huffman_tree[node].next[b] == 0) {
+                huffman_tree[nodes].sym = -1;
+                huffman_tree[node].next[b] = nodes++;
+            }
+            node = huffman_tree[node].next[b];
+        }
+        huffman_tree[node].sym = sym;
+    }
+}
+
+/**
+ * @brief Decodes a Huffman encoded string. The padding must be a prefix
+ * of EOS, i.e. at most 7 one bits.
+ *
+ * @param in encoded string
+ * @param len length of the encoded string
+ * @param out output buffer
+ * @param size size of the output buffer
+ * @param out_len decoded length
+ * @return int 0 on success -1 on failure
+ */
+static int huffman_decode(const unsigned char* in, size_t len, char* out, size_t size, size_t* out_len)
+{
+    int node = 0;
+    int pad_bits = 0;
+    int pad_ones = 1;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int b = (in[i] >> bit) & 1;
+            node = huffman_tree[node].next[b];
+            if (node == 0) {
+                // also reached by EOS, which must not be sent
+                return -1;
+            }
+            pad_bits++;
+            pad_ones &= b;
+            if (huffman_tree[node].sym >= 0) {
+                if (n == size) {
+                    return -1;
+                }
+                out[n++] = huffman_tree[node].sym;
+                node = 0;
+                pad_bits = 0;
+                pad_ones = 1;
+            }
+        }
+    }
+    if (pad_bits > 7 || !pad_ones) {
+        return -1;
+    }
+    *out_len = n;
+    return 0;
+}
+
+/**
+ * @brief Decodes an integer with a prefix of @code{prefix} bits.
+ *
+ * @param p position, advanced behind the integer
+ * @param end end of the block
+ * @param prefix bits of the first byte used by the integer
+ * @param value decoded value
+ * @return int 0 on success -1 on failure
+ */
+static int decode_int(const unsigned char** p, const unsigned char* end, int prefix, size_t* value)
+{
+    if (*p == end) {
+        return -1;
+    }
+    size_t max = (1u << prefix) - 1;
+    size_t v = **p & max;
+    (*p)++;
+    if (v < max) {
+        *value = v;
+        return 0;
+    }
+    for (int shift = 0; *p < end && shift <= 28; shift += 7) {
+        unsigned char b = *(*p)++;
+        v += (size_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Decodes a string literal into @code{dst}, which holds up to
+ * HPACK_STRING_MAX bytes.
+ *
+ * @param p position, advanced behind the string
+ * @param end end of the block
+ * @param dst output buffer
+ * @param len decoded length
+ * @return int 0 on success -1 on failure
+ */
+static int decode_string(const unsigned char** p, const unsigned char* end, char* dst, size_t* len)
+{
+    if (*p == end) {
+        return -1;
+    }
+    int huffman = **p & 0x80;
+    size_t n;
+    if (decode_int(p, end, 7, &n) < 0 || n > (size_t)(end - *p)) {
+        return -1;
+    }
+    if (huffman) {
+        if (huffman_decode(*p, n, dst, HPACK_STRING_MAX, len) < 0) {
+            return -1;
+        }
+    } else {
+        if (n > HPACK_STRING_MAX) {
+            return -1;
+        }
+        memcpy(dst, *p, n);
+        *len = n;
+    }
+    *p += n;
+    return 0;
+}
+
+/**
+ * @brief Removes the oldest entries until the table fits into @code{max}.
+ *
+ * @param dec decoder
+ * @param max size the table must fit into
+ */
+static void evict(struct hpack_decoder* dec, size_t max)
+{
+    while (dec->size > max) {
+        struct hpack_entry* e = &dec->entries[(dec->first + dec->count - 1) % HPACK_TABLE_ENTRIES];
+        dec->size -= e->name_len + e->value_len + 32;
+        free(e->name);
+        dec->count--;
+    }
+}
+
+/**
+ * @brief Adds a field to the dynamic table. A field larger than the
+ * table empties it and is not added.
+ *
+ * @param dec decoder
+ * @param name name
+ * @param name_len length of the name
+ * @param value value
+ * @param value_len length of the value
+ */
+static void insert(struct hpack_decoder* dec, const char* name, size_t name_len, const char* value, size_t value_len)
+{
+    size_t size = name_len + value_len + 32;
+    if (size > dec->max_size) {
+        evict(dec, 0);
+        return;
+    }
+    evict(dec, dec->max_size - size);
+    // one more byte, so that an empty field is a valid allocation
+    char* mem = malloc(name_len + value_len + 1);
+    if (mem == NULL) {
+        return;
+    }
+    memcpy(mem, name, name_len);
+    memcpy(mem + name_len, value, value_len);
+    dec->first = (dec->first + HPACK_TABLE_ENTRIES - 1) % HPACK_TABLE_ENTRIES;
+    struct hpack_entry* e = &dec->entries[dec->first];
+    e->name = mem;
+    e->name_len = name_len;
+    e->value = mem + name_len;
+    e->value_len = value_len;
+    dec->count++;
+    dec->size += size;
+}
+
+/**
+ * @brief Looks up an index of the static or dynamic table.
+ *
+ * @param dec decoder
+ * @param index index, 1 is the first static entry
+ * @param name name of the entry
+ * @param name_len length of the name
+ * @param value value of the entry
+ * @param value_len length of the value
+ * @return int 0 on success -1 if the index is not used
+ */
+static int lookup(struct hpack_decoder* dec, size_t index, const char** name, size_t* name_len, const char** value,
+    size_t* value_len)
+{
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= HPACK_STATIC_SIZE) {
+        const struct hpack_field* f = &static_table[index - 1];
+        *name = f->name;
+        *name_len = strlen(f->name);
+        *value = f->value;
+        *value_len = strlen(f->value);
+        return 0;
+    }
+    index -= HPACK_STATIC_SIZE + 1;
+    if (index >= dec->count) {
+        return -1;
+    }
+    struct hpack_entry* e = &dec->entries[(dec->first + index) % HPACK_TABLE_ENTRIES];
+    *name = e->name;
+    *name_len = e->name_len;
+    *value = e->value;
+    *value_len = e->value_len;
+    return 0;
+}
+
+void hpack_decoder_init(struct hpack_decoder* dec)
+{
+    pthread_once(&huffman_once, huffman_init);
+    dec->first = 0;
+    dec->count = 0;
+    dec->size = 0;
+    dec->max_size = HPACK_TABLE_SIZE;
+}
+
+int hpack_decode(struct hpack_decoder* dec, const unsigned char* buf, size_t len, hpack_emit emit, void* ctx)
+{
+    const unsigned char* p = buf;
+    const unsigned char* end = buf + len;
+    char* name_buf = dec->scratch;
+    char* value_buf = dec->scratch + HPACK_STRING_MAX;
+    int res = 0;
+    while (p < end) {
+        const char* name;
+        const char* value;
+        size_t name_len;
+        size_t value_len;
+        size_t index;
+        unsigned char b = *p;
+        if (b & 0x80) {
+            // indexed field
+            if (decode_int(&p, end, 7, &index) < 0 || lookup(dec, index, &name, &name_len, &value, &value_len) < 0) {
+                return HPACK_ERROR;
+            }
+        } else if ((b & 0xe0) == 0x20) {
+            // dynamic table size update, at most what the settings allow
+            if (decode_int(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE) {
+                return HPACK_ERROR;
+            }
+            dec->max_size = index;
+            evict(dec, dec->max_size);
+            continue;
+        } else {
+            // literal, with incremental indexing, without or never indexed
+            int indexing = b & 0x40;
+            if (decode_int(&p, end, indexing ? 6 : 4, &index) < 0) {
+                return HPACK_ERROR;
+            }
+            if (index == 0) {
+                if (decode_string(&p, end, name_buf, &name_len) < 0) {
+                    return HPACK_ERROR;
+                }
+            } else {
+                // copied, the entry may be evicted by the insert below
+                if (lookup(dec, index, &name, &name_len, &value, &value_len) < 0 || name_len > HPACK_STRING_MAX) {
+                    return HPACK_ERROR;
+                }
+                memcpy(name_buf, name, name_len);
+            }
+            if (decode_string(&p, end, value_buf, &value_len) < 0) {
+                return HPACK_ERROR;
+            }
+            name = name_buf;
+            value = value_buf;
+            if (indexing) {
+                insert(dec, name, name_len, value, value_len);
+            }
+        }
+        if (res == 0) {
+            res = emit(ctx, name, name_len, value, value_len);
+        }
+    }
+    return res;
+}
+
+void hpack_decoder_free(struct hpack_decoder* dec)
+{
+    evict(dec, 0);
+}
+
+/**
+ * @brief Encodes an integer with a prefix of @code{prefix} bits.
+ *
+ * @param out output buffer
+ * @param size size of the buffer
+ * @param value value
+ * @param prefix bits of the first byte used by the integer
+ * @param flags high bits of the first byte
+ * @return size_t encoded length or 0 if it does not fit
+ */
+static size_t encode_int(unsigned char* out, size_t size, size_t value, int prefix, unsigned char flags)
+{
+    size_t max = (1u << prefix) - 1;
+    if (size == 0) {
+        return 0;
+    }
+    if (value < max) {
+        out[0] = flags | value;
+        return 1;
+    }
+    out[0] = flags | max;
+    value -= max;
+    size_t n = 1;
+    while (value >= 0x80) {
+        if (n == size) {
+            return 0;
+        }
+        out[n++] = 0x80 | (value & 0x7f);
+        value >>= 7;
+    }
+    if (n == size) {
+        return 0;
+    }
+    out[n++] = value;
+    return n;
+}
+
+/**
+ * @brief Encodes a string literal without Huffman coding.
+ *
+ * @param out output buffer
+ * @param size size of the buffer
+ * @param str string
+ * @param len length of the string
+ * @return size_t encoded length or 0 if it does not fit
+ */
+static size_t encode_string(unsigned char* out, size_t size, const char* str, size_t len)
+{
+    size_t n = encode_int(out, size, len, 7, 0);
+    if (n == 0 || len > size - n) {
+        return 0;
+    }
+    memcpy(out + n, str, len);
+    return n + len;
+}
+
+size_t hpack_encode_status(unsigned char* out, size_t size, unsigned int status)
+{
+    // indexes of the static table, 8 is :status 200
+    static const unsigned int indexed[] = { 200, 204, 206, 304, 400, 404, 500 };
+    for (size_t i = 0; i < sizeof(indexed) / sizeof(indexed[0]); i++) {
+        if (indexed[i] == status) {
+            return encode_int(out, size, 8 + i, 7, 0x80);
+        }
+    }
+    char digits[4];
+    snprintf(digits, sizeof(digits), "%03u", status % 1000);
+    return hpack_encode_field(out, size, ":status", 7, digits, 3);
+}
+
+size_t hpack_encode_field(unsigned char* out, size_t size, const char* name, size_t name_len, const char* value,
+    size_t value_len)
+{
+    size_t index = 0;
+    for (size_t i = 0; i < HPACK_STATIC_SIZE; i++) {
+        if (strlen(static_table[i].name) == name_len && memcmp(static_table[i].name, name, name_len) == 0) {
+            index = i + 1;
+            break;
+        }
+    }
+
+    size_t n = encode_int(out, size, index, 4, 0);
+    if (n == 0) {
+        return 0;
+    }
+    if (index == 0) {
+        size_t m = encode_string(out + n, size - n, name, name_len);
+        if (m == 0) {
+            return 0;
+        }
+        n += m;
+    }
+    size_t m = encode_string(out + n, size - n, value, value_len);
+    if (m == 0) {
+        return 0;
+    }
+    return n + m;
+}
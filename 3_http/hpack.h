@@ -0,0 +1,118 @@
+/**
+ * @file hpack.h
+ * @author Lorenz Hörburger 12024737
+ * @brief HPACK header compression of HTTP/2 (RFC 7541)
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef HPACK
+#define HPACK
+
+#include <stddef.h>
+
+#define HPACK_STATIC_SIZE (61)
+// dynamic table size of the decoder, the default of HTTP/2
+#define HPACK_TABLE_SIZE (4096)
+// every entry accounts for at least 32 bytes
+#define HPACK_TABLE_ENTRIES (HPACK_TABLE_SIZE / 32)
+// longest decoded name or value
+#define HPACK_STRING_MAX (8192)
+
+#define HPACK_ERROR (-1)
+
+struct hpack_field {
+    const char* name;
+    const char* value;
+};
+
+struct hpack_entry {
+    // name and value in one allocation
+    char* name;
+    size_t name_len;
+    char* value;
+    size_t value_len;
+};
+
+/**
+ * @brief Decoding state of one connection. The dynamic table is a ring
+ * with the newest entry at first.
+ */
+struct hpack_decoder {
+    struct hpack_entry entries[HPACK_TABLE_ENTRIES];
+    size_t first;
+    size_t count;
+    // size of the entries as defined by RFC 7541
+    size_t size;
+    // current limit set by the peer, at most HPACK_TABLE_SIZE
+    size_t max_size;
+    // decoded name and value of the current field
+    char scratch[2 * HPACK_STRING_MAX];
+};
+
+/**
+ * @brief Receives a decoded header field. Name and value are only valid
+ * during the call.
+ *
+ * @return int 0 to continue, any other value aborts the decoding
+ */
+typedef int (*hpack_emit)(void* ctx, const char* name, size_t name_len, const char* value, size_t value_len);
+
+/**
+ * @brief Initializes a decoder with an empty dynamic table.
+ *
+ * @param dec decoder
+ */
+void hpack_decoder_init(struct hpack_decoder* dec);
+
+/**
+ * @brief Decodes a complete header block. The dynamic table is updated
+ * even if emit aborts, so that the connection stays usable.
+ *
+ * @param dec decoder of the connection
+ * @param buf header block
+ * @param len length of the block
+ * @param emit called for every field in order
+ * @param ctx passed to emit
+ * @return int 0 on success, HPACK_ERROR on a malformed block or the
+ * first non zero result of emit
+ */
+int hpack_decode(struct hpack_decoder* dec, const unsigned char* buf, size_t len, hpack_emit emit, void* ctx);
+
+/**
+ * @brief Frees the dynamic table.
+ *
+ * @param dec decoder
+ */
+void hpack_decoder_free(struct hpack_decoder* dec);
+
+/**
+ * @brief Encodes a :status field, indexed if the static table has it.
+ *
+ * @param out output buffer
+ * @param size size of the buffer
+ * @param status status code
+ * @return size_t encoded length or 0 if it does not fit
+ */
+size_t hpack_encode_status(unsigned char* out, size_t size, unsigned int status);
+
+/**
+ * @brief Encodes a field as a literal which is not indexed, so the
+ * encoder needs no dynamic table. A name of the static table is
+ * referenced by its index.
+ *
+ * @param out output buffer
+ * @param size size of the buffer
+ * @param name lower case name
+ * @param name_len length of the name
+ * @param value value
+ * @param value_len length of the value
+ * @return size_t encoded length or 0 if it does not fit
+ */
+size_t hpack_encode_field(unsigned char* out, size_t size, const char* name, size_t name_len, const char* value,
+    size_t value_len);
+
+#endif
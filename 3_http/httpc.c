@@ -11,24 +11,57 @@
  */
 #include "httpc.h"
 #include "common.h"
+#include "parser.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #define PROTOCOL "HTTP/1.1"
+#define SPLICE_CHUNK (1 << 20)
 
-void send_request(FILE* sockfile, const char* method, const char* url)
+/**
+ * @brief Writes all bytes to @code{fd}
+ *
+ * @param fd file descriptor
+ * @param data data
+ * @param len length of data
+ * @return int 0 on success -1 on failure
+ */
+static int write_all(int fd, const char* data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int send_request(int sockfd, const char* method, const char* url)
 {
     char host[strlen(url) + 1];
     host_from_url(url, host);
     char* ressource = file_path_from_url(url);
-    fprintf(sockfile, "%s %s %s\r\nHost: %s\r\nConnection: close\r\n\r\n", method, ressource, PROTOCOL, host);
+    size_t size = strlen(method) + strlen(ressource) + strlen(host) + 64;
+    char req[size];
+    int len = snprintf(req, size, "%s %s %s\r\nHost: %s\r\n\r\n", method, ressource, PROTOCOL, host);
+    return write_all(sockfd, req, len);
 }
 
-FILE* create_socket(const char* url, const char* port)
+int create_socket(const char* url, const char* port)
 {
     char host[strlen(url) + 1];
     host_from_url(url, host);
@@ -39,114 +72,197 @@ FILE* create_socket(const char* url, const char* port)
 
     int res = getaddrinfo(host, port, &hints, &ai);
     if (res != 0) {
-        free(ai);
         log_error("Httpc failed getaddrinfo failed");
-        return NULL;
+        return -1;
     }
 
-    int sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    int sockfd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
     if (sockfd < 0) {
-        free(ai);
+        freeaddrinfo(ai);
         log_error("Httpc socket failed");
-        return NULL;
+        return -1;
     }
 
     if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) == -1) {
-        free(ai);
+        freeaddrinfo(ai);
+        close(sockfd);
         log_error("Httpc connect failed");
-        return NULL;
-    }
-
-    FILE* sockfile = fdopen(sockfd, "r+");
-    if (sockfile == NULL) {
-        free(ai);
-        log_error("Httpc open sockfile failed");
-        return NULL;
+        return -1;
     }
 
-    free(ai);
-    return sockfile;
+    freeaddrinfo(ai);
+    return sockfd;
 }
 
-int parse_res_line(char* line)
+/**
+ * @brief Moves up to @code{length} body bytes from the socket to the output
+ * through a pipe without copying them to userspace.
+ *
+ * @param sockfd socket
+ * @param outfd output file or pipe
+ * @param length number of bytes or -1 to read until the server closes
+ * @param progress called with the number of bytes written or NULL
+ * @param ctx passed to progress
+ * @return int 1 on success -1 on failure
+ */
+static int splice_body(int sockfd, int outfd, long long length, void (*progress)(void*, size_t), void* ctx)
 {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        return -1;
+    }
 
-    char* token = strtok(line, " ");
-    int i = 0;
-    long int status = -1;
-    while (token != NULL) {
-        if (i == 0) {
-            // protorol
-            if (strcmp(token, PROTOCOL) != 0) {
-                return -1;
+    int res = 1;
+    while (length != 0) {
+        size_t want = length > 0 && length < SPLICE_CHUNK ? (size_t)length : SPLICE_CHUNK;
+        ssize_t n = splice(sockfd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            res = n == 0 && length < 0 ? 1 : -1;
+            break;
+        }
+        if (length > 0) {
+            length -= n;
+        }
+        while (n > 0) {
+            ssize_t out = splice(pipefd[0], NULL, outfd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) {
+                continue;
             }
-        } else if (i == 1) {
-            // Status
-            char* endptr;
-            status = strtol(token, &endptr, 10);
-            if (*endptr != '\0') {
-                return -1;
+            if (out <= 0) {
+                res = -1;
+                length = 0;
+                break;
+            }
+            n -= out;
+            if (progress != NULL) {
+                progress(ctx, out);
             }
         }
-        i++;
-        token = strtok(NULL, " ");
     }
 
-    if (i < 3) {
-        return -1;
-    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return res;
+}
 
-    return status;
+/**
+ * @brief Writes the body data in @code{buf} to the output.
+ *
+ * @param body body framing
+ * @param buf received bytes
+ * @param len number of received bytes, unconsumed bytes are moved to
+ * the start of @code{buf}
+ * @param outfd output
+ * @param progress called with the number of bytes written or NULL
+ * @param ctx passed to progress
+ * @return int PARSE_DONE, PARSE_AGAIN or PARSE_ERROR
+ */
+static int write_body(struct body* body, char* buf, size_t* len, int outfd, void (*progress)(void*, size_t), void* ctx)
+{
+    size_t off = 0;
+    int res = PARSE_AGAIN;
+    while (res == PARSE_AGAIN) {
+        size_t consumed;
+        struct slice data;
+        res = body_next(body, buf + off, *len - off, &consumed, &data);
+        if (res == PARSE_ERROR || (data.len > 0 && write_all(outfd, data.ptr, data.len) < 0)) {
+            return PARSE_ERROR;
+        }
+        if (data.len > 0 && progress != NULL) {
+            progress(ctx, data.len);
+        }
+        off += consumed;
+        if (consumed == 0) {
+            break;
+        }
+    }
+    memmove(buf, buf + off, *len - off);
+    *len -= off;
+    return res;
 }
 
-int httpc(const char* method, const char* url, const char* port, FILE* output)
+int httpc_body(int sockfd, struct body* body, char* buf, size_t len, size_t size, int outfd,
+    void (*progress)(void* ctx, size_t n), void* ctx)
 {
-    FILE* sockfile = create_socket(url, port);
-    if (sockfile == NULL) {
-        return -1;
+    int res = write_body(body, buf, &len, outfd, progress, ctx);
+
+    struct stat st;
+    int spliceable = fstat(outfd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode));
+    if (res == PARSE_AGAIN && spliceable && (body->mode == BODY_LENGTH || body->mode == BODY_UNTIL_CLOSE)) {
+        return splice_body(sockfd, outfd, body->mode == BODY_LENGTH ? body->remaining : -1, progress, ctx);
     }
 
-    send_request(sockfile, method, url);
-
-    char* line = NULL;
-    size_t size = 0;
-    ssize_t read;
-
-    int body = 0;
-    int firstline = 1;
-    while ((read = getline(&line, &size, sockfile)) != -1) {
-        if (firstline) {
-            char* dup = strdup(line);
-            int status = parse_res_line(dup);
-            if (status == -1) {
-                fprintf(stderr, "Protocol Error!\n");
-                free(dup);
-                free(line);
-                fclose(sockfile);
-                exit(2);
-            } else if (status != 200) {
-                char* status_msg = strchr(line, ' ') + 1;
-                fprintf(stderr, "%s", status_msg);
-                free(dup);
-                exit(3);
-                break;
-            }
-            firstline = 0;
-            free(dup);
+    while (res == PARSE_AGAIN) {
+        ssize_t n = read(sockfd, buf + len, size - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
-        if (strcmp(line, "\r\n") == 0) {
-            body = 1;
+        if (n <= 0) {
+            return n == 0 && body->mode == BODY_UNTIL_CLOSE ? 1 : -1;
+        }
+        len += n;
+        res = write_body(body, buf, &len, outfd, progress, ctx);
+    }
+    return res == PARSE_DONE ? 1 : -1;
+}
+
+int httpc_head(int sockfd, char* buf, size_t size, size_t* len, struct parser* parser)
+{
+    *len = 0;
+    parser_init_res(parser);
+
+    int res = PARSE_AGAIN;
+    while (res == PARSE_AGAIN && *len < size) {
+        ssize_t n = read(sockfd, buf + *len, size - *len);
+        if (n < 0 && errno == EINTR) {
             continue;
         }
-        if (body) {
-            fprintf(output, "%s", line);
+        if (n <= 0) {
+            break;
         }
+        *len += n;
+        res = parser_parse(parser, buf, *len);
     }
+    return res == PARSE_DONE && slice_eq(parser->version, PROTOCOL) ? 0 : -1;
+}
 
-    if(sockfile != NULL) {
-        fclose(sockfile);
+int httpc(const char* method, const char* url, const char* port, FILE* output)
+{
+    int sockfd = create_socket(url, port);
+    if (sockfd < 0) {
+        return -1;
     }
 
-    free(line);
-    return 1;
+    if (send_request(sockfd, method, url) < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    char buf[HTTPC_BUF_SIZE];
+    size_t len;
+    struct parser parser;
+    struct body body;
+    if (httpc_head(sockfd, buf, sizeof(buf), &len, &parser) < 0 || body_init(&body, &parser) < 0) {
+        fprintf(stderr, "Protocol Error!\n");
+        close(sockfd);
+        exit(2);
+    }
+
+    if (parser.status != 200) {
+        fprintf(stderr, "%d %.*s\n", parser.status, (int)parser.reason.len, parser.reason.ptr);
+        close(sockfd);
+        exit(3);
+    }
+
+    // the body is written to the fd directly
+    fflush(output);
+    len -= parser.pos;
+    memmove(buf, buf + parser.pos, len);
+    int res = httpc_body(sockfd, &body, buf, len, sizeof(buf), fileno(output), NULL, NULL);
+
+    close(sockfd);
+    return res;
 }
@@ -12,11 +12,16 @@
 #ifndef HTTPC
 #define HTTPC
 
+#include "parser.h"
 #include <stdio.h>
 
+#define HTTPC_BUF_SIZE (65536)
+
 /**
  * @brief Sends a HTTP request with the given method
- * and writes the response to @code{output}
+ * and writes the response body to @code{output}. The body is framed by
+ * Content-Length or chunked encoding and written to the fd of
+ * @code{output} directly, using splice if it is a file or a pipe.
  * 
  * @param method request method
  * @param url url of http server
@@ -27,29 +32,54 @@
 int httpc(const char* method, const char* url, const char* port, FILE* output);
 
 /**
- * @brief Sends a http request to the socket @code{sockfile}
+ * @brief Sends a http request to the socket @code{sockfd}
  * 
- * @param sockfile socket of http server
+ * @param sockfd socket of http server
  * @param method request method
  * @param url url to access
+ * @return int 0 on success -1 on failure
  */
+int send_request(int sockfd, const char* method, const char* url);
 
 /**
  * @brief Creates a socket that connects to the http server
  * 
  * @param url req url
  * @param port port
- * @return FILE* opened socketfile
+ * @return int connected socket or -1 on failure
+ */
+int create_socket(const char* url, const char* port);
+
+/**
+ * @brief Reads the response head from @code{sockfd}. The head stays in
+ * @code{buf}, the parsed fields point into it and the body bytes received
+ * with it follow behind @code{parser->pos}.
+ * 
+ * @param sockfd socket of http server
+ * @param buf receive buffer
+ * @param size size of @code{buf}
+ * @param len set to the number of bytes received
+ * @param parser parser of the response
+ * @return int 0 on success -1 if the head is malformed or incomplete
  */
-FILE* create_socket(const char* url, const char* port);
+int httpc_head(int sockfd, char* buf, size_t size, size_t* len, struct parser* parser);
 
 /**
- * @brief Parses the response line and returns the response status.
- * Example HTTP/1.1 200 OK
+ * @brief Copies the response body to @code{outfd}. Bodies framed by length
+ * or by closing the connection are spliced if the output is a file or a
+ * pipe, all others are copied in large blocks.
  * 
- * @param line response line
- * @return int status or -1 if res line is invalid
+ * @param sockfd socket of http server
+ * @param body body framing
+ * @param buf buffer holding the body bytes received with the head at its start
+ * @param len number of bytes in @code{buf}
+ * @param size size of @code{buf}
+ * @param outfd output
+ * @param progress called with the number of bytes after every write, may be NULL
+ * @param ctx passed to @code{progress}
+ * @return int 1 on success -1 on failure
  */
-int parse_res_line(char* line);
+int httpc_body(int sockfd, struct body* body, char* buf, size_t len, size_t size, int outfd,
+    void (*progress)(void* ctx, size_t n), void* ctx);
 
 #endif
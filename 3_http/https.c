@@ -10,27 +10,237 @@
  *
  */
 #include "https.h"
+#include "accesslog.h"
 #include "common.h"
+#include "h2.h"
+#include "stats.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #define PROTOCOL "HTTP/1.1"
+#define CONN_BUF_SIZE (8192)
+#define MAX_EVENTS (256)
+#define BODY_CHUNK (1 << 20)
+// status lines are precomputed for this range
+#define STATUS_MIN (100)
+#define STATUS_MAX (599)
+#define CLOSE_LINE "Connection: close\r\n\r\n"
+// seconds covered by the timer wheel, more than the longest timeout
+#define TIMER_SLOTS (64)
+#define BUSY_RESPONSE PROTOCOL " 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\n" CLOSE_LINE
+#define CONTINUE_RESPONSE PROTOCOL " 100 Continue\r\n\r\n"
+// bytes read at once while the chunk framing of a request body is parsed,
+// the data behind it is spliced
+#define BODY_LINE (64)
+// seconds a closing connection drains a request body that was not read,
+// so that the client receives the response instead of a reset
+#define LINGER_TIMEOUT (5)
+
+enum conn_state {
+    CONN_READ_REQ,
+    // receiving the request body, see res_receive
+    CONN_READ_BODY,
+    // waiting for a file opened with res_open, not watched by epoll
+    CONN_OPENING,
+    // waiting for another thread, see res_wait, not watched by epoll
+    CONN_WAITING,
+    CONN_WRITE_HEAD,
+    CONN_WRITE_BODY,
+    // response sent, the rest of the request is read and dropped until
+    // the client closes, see LINGER_TIMEOUT
+    CONN_LINGER,
+    // switched to HTTP/2, all frames are handled by h2
+    CONN_H2
+};
+
+// the timer of a connection, indexes the timeout counters of the stats
+enum conn_timer {
+    // waiting for the first byte of the next request
+    TIMER_IDLE,
+    // waiting for the rest of the request head
+    TIMER_HEAD,
+    // waiting for the client to accept more of the response
+    TIMER_WRITE,
+    // waiting for more of the request body
+    TIMER_BODY,
+    TIMER_NONE
+};
+
+enum send_mode {
+    SEND_SENDFILE,
+    SEND_SPLICE,
+    SEND_COPY
+};
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    uint32_t events;
+    int keep_alive;
+    unsigned int requests;
+    // time of the last progress on the connection
+    time_t last_active;
+    // time the first byte of the current request head was received
+    time_t head_start;
+    enum conn_timer timer;
+    time_t deadline;
+    // connections of the same timer wheel slot
+    struct conn* tprev;
+    struct conn* tnext;
+    struct parser parser;
+    struct req req;
+    struct res res;
+    char in[CONN_BUF_SIZE];
+    size_t in_len;
+    size_t req_len;
+    size_t head_len;
+    size_t discard;
+    // framing of the request body received with res_receive
+    struct body req_body;
+    // next unparsed byte of the request body in the input buffer
+    size_t req_body_pos;
+    // bytes of the request body written so far
+    off_t req_body_len;
+    // the request body was not read completely
+    int linger;
+    // number of res_open calls of the current request
+    int opens;
+    // allocations of the current request
+    struct arena arena;
+    char out[CONN_BUF_SIZE];
+    size_t out_len;
+    size_t out_pos;
+    enum send_mode send_mode;
+    int body_fd;
+    off_t body_len;
+    struct res_part single;
+    struct res_part* parts;
+    size_t nparts;
+    size_t part;
+    int part_started;
+    // position in the body fd or in the memory of the current part
+    off_t body_off;
+    // bytes left of the current part, -1 if it ends with the body fd
+    off_t part_left;
+    // bytes of the body fd which may be sent if it is still being written
+    off_t body_avail;
+    // TCP_CORK is set while the parts of a response are sent
+    int corked;
+    // waiting for more of the body fd, not watched by epoll
+    int stalled;
+    int pipe[2];
+    size_t piped;
+    // monotonic time the request head was complete
+    unsigned long long req_start;
+    // bytes sent since the last event, added to the worker stats
+    unsigned long long sent;
+    // bytes sent of the current response
+    unsigned long long res_sent;
+    // HTTP/2 state once the connection switched, NULL before
+    struct h2conn* h2;
+    // next connection waiting for the wake fd
+    struct conn* wnext;
+    struct conn* prev;
+    struct conn* next;
+};
+
+struct server {
+    int epfd;
+    struct conn* conns;
+    int nconns;
+    // connections by the second their timer expires
+    struct conn* wheel[TIMER_SLOTS];
+    // all slots up to this second have been expired
+    time_t wheel_time;
+    void (*handle)(struct req*, struct res*);
+    struct settings* settings;
+    struct stats* stats;
+    // access log of the worker, NULL if disabled
+    struct accesslog_ring* log;
+    // passed to the HTTP/2 connections of the worker
+    struct h2_env h2env;
+    // opens files for handlers, NULL if disabled
+    struct aio* aio;
+    // written by other threads once waiting connections may continue
+    int wake_fd;
+    struct conn* waiting;
+    // Date header line, formatted once per second
+    time_t date_sec;
+    char date[48];
+    size_t date_len;
+};
+
+struct status_line {
+    char text[64];
+    size_t len;
+};
+
+struct worker {
+    pthread_t thread;
+    // set if the thread was created and must be joined
+    int started;
+    int sockfd;
+    int queue;
+    void (*handle)(struct req*, struct res*);
+    struct settings* settings;
+};
+
+static struct status_line status_lines[STATUS_MAX - STATUS_MIN + 1];
+static char keep_alive_line[96];
+static size_t keep_alive_len;
+static pthread_once_t heads_once = PTHREAD_ONCE_INIT;
 
 volatile sig_atomic_t server_quit = 0;
-char *gdup = NULL;
+// eventfd which wakes up all event loops on shutdown
+static volatile int quit_fd = -1;
+static char quit_tag;
+static char aio_tag;
+static char wake_tag;
 
+static void conn_event(struct server* server, struct conn* conn);
 
 void server_shutdown(void)
 {
     server_quit = 1;
+    if (quit_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t ignored = write(quit_fd, &one, sizeof one);
+        (void)ignored;
+    }
+}
+
+/**
+ * @brief Creates the shutdown eventfd once. Not thread safe, must be
+ * called before any worker is started.
+ */
+static void init_quit_fd(void)
+{
+    if (quit_fd < 0) {
+        quit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (quit_fd < 0) {
+            log_error("eventfd failed");
+            exit(EXIT_FAILURE);
+        }
+    }
 }
 
-int create_server(char* port)
+int create_server(char* port, int reuseport)
 {
     struct addrinfo hints, *ai;
     memset(&hints, 0, sizeof hints);
@@ -54,9 +264,13 @@ int create_server(char* port)
 
     int optval = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+    if (reuseport) {
+        // allows one listener per worker on the same port
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof optval);
+    }
 
     if (bind(sockfd, ai->ai_addr, ai->ai_addrlen) < 0) {
-        log_error("bind failed");
+        log_error("bind failed: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
@@ -64,142 +278,1927 @@ int create_server(char* port)
     return sockfd;
 }
 
-void server_listen(int sockfd, int queue, void (*handle)(struct req*, struct res*), struct settings* settings)
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return unsigned long long time in nanoseconds
+ */
+static unsigned long long now_ns(void)
 {
-    if (listen(sockfd, queue) < 0) {
-        log_error("listen failed");
-        exit(EXIT_FAILURE);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Sets the O_NONBLOCK flag on @code{fd}
+ *
+ * @param fd file descriptor
+ * @return int 0 on success -1 on failure
+ */
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
     }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-    while (!server_quit) {
-        int clientfd = accept(sockfd, NULL, NULL);
-        if (clientfd < 0) {
-            break;
+/**
+ * @brief Sets the TCP options of a listener, accepted connections inherit
+ * them. Responses leave without waiting for the ACK of the previous
+ * segment, the head and the body are joined with MSG_MORE instead.
+ *
+ * @param sockfd listening socket
+ * @param defer_accept 1 to accept connections only once data arrived
+ */
+static void set_listener_options(int sockfd, int defer_accept)
+{
+    int optval = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    if (defer_accept) {
+        // connections without a request are accepted after the timeout
+        optval = HEADER_TIMEOUT;
+        if (setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &optval, sizeof(optval)) < 0) {
+            log_error("TCP_DEFER_ACCEPT failed: %s", strerror(errno));
+        }
+        optval = FASTOPEN_QUEUE;
+        if (setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &optval, sizeof(optval)) < 0) {
+            log_error("TCP_FASTOPEN failed: %s", strerror(errno));
         }
+    }
+}
+
+/**
+ * @brief Sets TCP_CORK on the connection, so that the parts of a response
+ * are sent in full segments.
+ *
+ * @param conn connection
+ * @param cork 1 to cork, 0 to send the rest right away
+ */
+static void conn_cork(struct conn* conn, int cork)
+{
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    conn->corked = cork;
+}
+
+/**
+ * @brief Releases the ressources of the current response and prepares the
+ * connection for the next response.
+ *
+ * @param conn connection
+ */
+static void conn_reset(struct conn* conn)
+{
+    if (conn->res.body != NULL) {
+        fclose(conn->res.body);
+    }
+    if (conn->res.done != NULL) {
+        conn->res.done(&conn->res);
+    }
+    conn->res.status = 400;
+    conn->res.body = NULL;
+    conn->res.fd = -1;
+    conn->res.offset = 0;
+    conn->res.size = 0;
+    conn->res.parts = NULL;
+    conn->res.nparts = 0;
+    conn->res.headers = NULL;
+    conn->res.headers_len = 0;
+    conn->res.extra_len = 0;
+    conn->res.done = NULL;
+    conn->res.open_path = NULL;
+    conn->res.wait = NULL;
+    conn->res.avail = NULL;
+    conn->res.received = NULL;
+    conn->res.receive_fd = -1;
+    conn->res.receive_max = 0;
+    conn->linger = 0;
+    arena_reset(&conn->arena);
+    conn->out_len = 0;
+    conn->out_pos = 0;
+    conn->send_mode = SEND_SENDFILE;
+    conn->body_fd = -1;
+    conn->body_len = 0;
+    conn->parts = NULL;
+    conn->nparts = 0;
+    conn->part = 0;
+    conn->part_started = 0;
+    conn->body_off = 0;
+    conn->part_left = 0;
+    conn->body_avail = 0;
+    conn->stalled = 0;
+    conn->piped = 0;
+    conn->res_sent = 0;
+}
+
+/**
+ * @brief Removes the connection from the timer wheel.
+ *
+ * @param server server
+ * @param conn connection
+ */
+static void timer_stop(struct server* server, struct conn* conn)
+{
+    if (conn->timer == TIMER_NONE) {
+        return;
+    }
+    if (conn->tprev != NULL) {
+        conn->tprev->tnext = conn->tnext;
+    } else {
+        server->wheel[conn->deadline % TIMER_SLOTS] = conn->tnext;
+    }
+    if (conn->tnext != NULL) {
+        conn->tnext->tprev = conn->tprev;
+    }
+    conn->timer = TIMER_NONE;
+}
+
+/**
+ * @brief Starts or moves the timer of the connection.
+ *
+ * @param server server
+ * @param conn connection
+ * @param timer kind of the timer
+ * @param deadline second the connection times out
+ */
+static void timer_start(struct server* server, struct conn* conn, enum conn_timer timer, time_t deadline)
+{
+    // slots up to wheel_time are only visited again after a full turn
+    if (deadline <= server->wheel_time) {
+        deadline = server->wheel_time + 1;
+    }
+    if (conn->timer == timer && conn->deadline == deadline) {
+        return;
+    }
+    timer_stop(server, conn);
+    struct conn** slot = &server->wheel[deadline % TIMER_SLOTS];
+    conn->timer = timer;
+    conn->deadline = deadline;
+    conn->tprev = NULL;
+    conn->tnext = *slot;
+    if (*slot != NULL) {
+        (*slot)->tprev = conn;
+    }
+    *slot = conn;
+}
 
-        FILE* clientfile = fdopen(clientfd, "r+");
-        if (clientfile == NULL) {
-            log_error("Httpc open sockfile failed");
+/**
+ * @brief Sets the timer for what the connection waits for. The head
+ * timeout counts from the first byte of the head, so trickling bytes
+ * does not extend it. The other timeouts restart on every progress.
+ *
+ * @param server server
+ * @param conn connection
+ */
+static void conn_arm(struct server* server, struct conn* conn)
+{
+    switch (conn->state) {
+    case CONN_READ_REQ:
+        if (conn->in_len == 0 && conn->discard == 0) {
+            timer_start(server, conn, TIMER_IDLE, conn->last_active + KEEPALIVE_TIMEOUT);
+        } else {
+            timer_start(server, conn, TIMER_HEAD, conn->head_start + HEADER_TIMEOUT);
+        }
+        break;
+    case CONN_READ_BODY:
+        timer_start(server, conn, TIMER_BODY, conn->last_active + BODY_TIMEOUT);
+        break;
+    case CONN_LINGER:
+        // dropped data is no progress, last_active is the start
+        timer_start(server, conn, TIMER_BODY, conn->last_active + LINGER_TIMEOUT);
+        break;
+    case CONN_OPENING:
+    case CONN_WAITING:
+        // the open always completes, the connection must wait for it
+        timer_stop(server, conn);
+        break;
+    case CONN_H2:
+        if (h2_idle(conn->h2)) {
+            timer_start(server, conn, TIMER_IDLE, conn->last_active + KEEPALIVE_TIMEOUT);
+        } else {
+            timer_start(server, conn, TIMER_WRITE, conn->last_active + WRITE_TIMEOUT);
         }
+        break;
+    default:
+        timer_start(server, conn, TIMER_WRITE, conn->last_active + WRITE_TIMEOUT);
+        break;
+    }
+}
+
+/**
+ * @brief Closes the client connection and releases all its ressources.
+ *
+ * @param server server
+ * @param conn connection to close
+ */
+static void conn_close(struct server* server, struct conn* conn)
+{
+    epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    timer_stop(server, conn);
+    conn_reset(conn);
+    if (conn->h2 != NULL) {
+        h2_free(conn->h2);
+    }
+    stats_arena(server->stats, conn->arena.peak, conn->arena.exhausted);
+    arena_free(&conn->arena);
+    if (conn->pipe[0] >= 0) {
+        close(conn->pipe[0]);
+        close(conn->pipe[1]);
+    }
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        server->conns = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    server->nconns--;
+    free(conn);
+}
+
+/**
+ * @brief Sets the epoll events the connection waits for.
+ *
+ * @param server server
+ * @param conn connection
+ * @param events EPOLLIN or EPOLLOUT
+ */
+static void conn_watch(struct server* server, struct conn* conn, uint32_t events)
+{
+    if (conn->events != events) {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = conn;
+        epoll_ctl(server->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = events;
+    }
+}
+
+/**
+ * @brief Removes the connection from epoll until another thread writes
+ * to the wake fd.
+ *
+ * @param server server
+ * @param conn connection in CONN_WAITING or with a stalled body
+ */
+static void conn_park(struct server* server, struct conn* conn)
+{
+    epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    timer_stop(server, conn);
+    conn->wnext = server->waiting;
+    server->waiting = conn;
+}
+
+/**
+ * @brief Watches a connection again which waited outside of epoll.
+ *
+ * @param server server
+ * @param conn connection
+ * @return int 0 on success -1 if the connection was closed
+ */
+static int conn_unpark(struct server* server, struct conn* conn)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+        conn_close(server, conn);
+        return -1;
+    }
+    conn->events = EPOLLOUT;
+    conn->last_active = time(NULL);
+    return 0;
+}
+
+/**
+ * @brief Answers a connection over the limit with 503 and closes it
+ * without reading the request.
+ *
+ * @param server server
+ * @param clientfd client socket
+ */
+static void reject_conn(struct server* server, int clientfd)
+{
+    ssize_t ignored = send(clientfd, BUSY_RESPONSE, sizeof(BUSY_RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void)ignored;
+    // unread request data would turn the close into a reset
+    shutdown(clientfd, SHUT_WR);
+    char buf[CONN_BUF_SIZE];
+    ignored = recv(clientfd, buf, sizeof(buf), MSG_DONTWAIT);
+    close(clientfd);
+    stats_add(&server->stats->rejected, 1);
+}
 
-        struct req* req = parse_req(clientfile);
-        struct res res = { .status = 400, .body = NULL };
+/**
+ * @brief Accepts up to settings->accept_batch pending connections of the
+ * listening socket. The listener stays readable if more are pending, so
+ * the connections already being served are not starved by a burst.
+ *
+ * @param server server
+ * @param sockfd listening socket
+ */
+static void accept_conns(struct server* server, int sockfd)
+{
+    for (int i = 0; i < server->settings->accept_batch; i++) {
+        int clientfd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientfd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_error("accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+        if (server->settings->max_conns > 0 && server->nconns >= server->settings->max_conns) {
+            reject_conn(server, clientfd);
+            continue;
+        }
 
-        if (req != NULL) {
-            // Server Log
-            req->settings = settings;
-            (*handle)(req, &res);
+        struct conn* conn = malloc(sizeof(struct conn));
+        if (conn == NULL) {
+            log_error("Setting up connection failed");
+            free(conn);
+            close(clientfd);
+            continue;
         }
+        conn->fd = clientfd;
+        conn->state = CONN_READ_REQ;
+        conn->events = EPOLLIN;
+        conn->in_len = 0;
+        parser_init(&conn->parser);
+        conn->req_len = 0;
+        conn->discard = 0;
+        conn->keep_alive = 0;
+        conn->requests = 0;
+        conn->last_active = time(NULL);
+        conn->head_start = conn->last_active;
+        conn->timer = TIMER_NONE;
+        conn->pipe[0] = -1;
+        conn->pipe[1] = -1;
+        conn->sent = 0;
+        conn->corked = 0;
+        conn->h2 = NULL;
+        conn->res.body = NULL;
+        conn->res.done = NULL;
+        conn->res.arena = &conn->arena;
+        arena_init(&conn->arena);
+        conn_reset(conn);
 
-        send_response(clientfile, &res);
+        struct epoll_event ev;
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, clientfd, &ev) < 0) {
+            log_error("epoll_ctl failed: %s", strerror(errno));
+            free(conn);
+            close(clientfd);
+            continue;
+        }
 
-        if (clientfile != NULL) {
-            fclose(clientfile);
+        conn->prev = NULL;
+        conn->next = server->conns;
+        if (server->conns != NULL) {
+            server->conns->prev = conn;
         }
-        if (res.body != NULL) {
-            fclose(res.body);
+        server->conns = conn;
+        server->nconns++;
+        stats_add(&server->stats->accepted, 1);
+        if (server->settings->defer_accept) {
+            // the request arrived before the connection was accepted
+            conn_event(server, conn);
+        } else {
+            conn_arm(server, conn);
         }
     }
-    free(gdup);
-    close(sockfd);
 }
 
-void send_response(FILE* clientfile, struct res* res)
+/**
+ * @brief Builds the status lines and the connection trailers once.
+ */
+static void init_heads(void)
+{
+    for (int status = STATUS_MIN; status <= STATUS_MAX; status++) {
+        struct status_line* line = &status_lines[status - STATUS_MIN];
+        const char* reason = status_str(status);
+        line->len = snprintf(line->text, sizeof(line->text), "%s %d %s\r\n", PROTOCOL, status, reason != NULL ? reason : "");
+    }
+    keep_alive_len = snprintf(keep_alive_line, sizeof(keep_alive_line), "Connection: keep-alive\r\n"
+                                                                         "Keep-Alive: timeout=%d, max=%d\r\n\r\n",
+        KEEPALIVE_TIMEOUT, KEEPALIVE_MAX);
+}
+
+/**
+ * @brief Formats the Date header line of the worker if the second changed.
+ *
+ * @param server server
+ * @param now current time
+ */
+static void update_date(struct server* server, time_t now)
+{
+    if (now != server->date_sec) {
+        char date[64];
+        format_http_date(now, date, sizeof(date));
+        server->date_len = snprintf(server->date, sizeof(server->date), "Date: %s\r\n", date);
+        server->date_sec = now;
+    }
+}
+
+/**
+ * @brief Appends @code{len} bytes to the head if they fit.
+ *
+ * @param buf head buffer
+ * @param pos length of the head so far
+ * @param size size of buffer
+ * @param data data to append
+ * @param len length of data
+ * @return size_t new length of the head
+ */
+static size_t head_append(char* buf, size_t pos, size_t size, const char* data, size_t len)
 {
-    char date[100];
-    get_rfc822_date(date);
+    if (len <= size - pos) {
+        memcpy(buf + pos, data, len);
+        pos += len;
+    }
+    return pos;
+}
 
+/**
+ * @brief Formats the response line and headers of @code{res} into
+ * @code{buf}. All parts are precomputed, only Content-Length is
+ * formatted per response.
+ *
+ * @param server server
+ * @param res response
+ * @param body_len length of the body or -1 if unknown
+ * @param keep_alive 1 if the connection stays open after the response
+ * @param buf output buffer
+ * @param size size of buffer
+ * @return size_t length of the head
+ */
+static size_t format_res_head(struct server* server, struct res* res, off_t body_len, int keep_alive, char* buf, size_t size)
+{
     //Response line
-    fprintf(clientfile, "%s %d %s\r\n", PROTOCOL, res->status, status_str(res->status));
+    size_t len;
+    if (res->status >= STATUS_MIN && res->status <= STATUS_MAX) {
+        struct status_line* line = &status_lines[res->status - STATUS_MIN];
+        len = head_append(buf, 0, size, line->text, line->len);
+    } else {
+        len = snprintf(buf, size, "%s %d \r\n", PROTOCOL, res->status);
+    }
 
     if (res->status >= 200 && res->status < 300) {
-        fprintf(clientfile, "Date: %s\r\n", date);
+        len = head_append(buf, len, size, server->date, server->date_len);
     }
 
-    if (res->body != NULL) {
-        int content_length = file_size(res->body);
-        fprintf(clientfile, "Content-Length: %d\r\n", content_length);
+    // a 304 response has no body but describes the unmodified one, a
+    // 204 response has none at all
+    if (body_len >= 0 && res->status != 304 && res->status != 204) {
+        char digits[24];
+        char* p = digits + sizeof(digits);
+        unsigned long long value = body_len;
+        do {
+            *--p = '0' + value % 10;
+            value /= 10;
+        } while (value > 0);
+        len = head_append(buf, len, size, "Content-Length: ", sizeof("Content-Length: ") - 1);
+        len = head_append(buf, len, size, p, digits + sizeof(digits) - p);
+        len = head_append(buf, len, size, "\r\n", 2);
     }
 
-    fprintf(clientfile, "Connection: close\r\n");
+    if (res->headers != NULL) {
+        len = head_append(buf, len, size, res->headers, res->headers_len);
+    }
+    len = head_append(buf, len, size, res->extra, res->extra_len);
 
-    if (res->body != NULL) {
-        // End header / Begin Body
-        fprintf(clientfile, "\r\n");
-        char* line = NULL;
-        size_t size = 0;
-        ssize_t read;
-        while ((read = getline(&line, &size, res->body)) != -1) {
-            fprintf(clientfile, "%s", line);
-        }
-    }
-    fflush(clientfile);
-}
-
-int parse_req_line(char* line, struct req* req)
-{
-    char* token = strtok(line, " ");
-    int i = 0;
-    while (token != NULL) {
-        if (i == 0) {
-            // Method
-            req->method = token;
-        } else if (i == 1) {
-            // Path
-            req->path = token;
-        } else if (i == 2) {
-            // Protocol
-            if (strcmp(token, "HTTP/1.1\r\n") != 0) {
-                return -1;
-            }
-        }
-        i++;
-        token = strtok(NULL, " ");
+    if (keep_alive) {
+        len = head_append(buf, len, size, keep_alive_line, keep_alive_len);
+    } else {
+        len = head_append(buf, len, size, CLOSE_LINE, sizeof(CLOSE_LINE) - 1);
     }
+    return len;
+}
 
-    if (i != 3) {
-        return -1;
+/**
+ * @brief Removes @code{n} bytes from the front of the input buffer.
+ *
+ * @param conn connection
+ * @param n number of bytes
+ */
+static void conn_consume(struct conn* conn, size_t n)
+{
+    memmove(conn->in, conn->in + n, conn->in_len - n);
+    conn->in_len -= n;
+    parser_init(&conn->parser);
+}
+
+/**
+ * @brief Sets up the parts of the response body which are sent after
+ * the head and computes the body length.
+ *
+ * @param conn connection with a handled request
+ */
+static void setup_body(struct conn* conn)
+{
+    conn->body_len = res_body(&conn->res, &conn->single, &conn->parts, &conn->nparts, &conn->body_fd);
+}
+
+/**
+ * @brief Releases the rendered stats of a response.
+ *
+ * @param res response
+ */
+static void release_stats(struct res* res)
+{
+    free(res->ctx);
+}
+
+/**
+ * @brief Answers with the counters of all workers.
+ *
+ * @param res response
+ */
+static void serve_stats(struct res* res)
+{
+    size_t len;
+    char* text = stats_render(&len);
+    struct res_part* part = text != NULL ? res_alloc(res, sizeof(struct res_part)) : NULL;
+    if (part == NULL) {
+        free(text);
+        res->status = 500;
+        return;
     }
+    part->buf = text;
+    part->offset = 0;
+    part->len = len;
+    res->status = 200;
+    res->parts = part;
+    res->nparts = 1;
+    res->done = release_stats;
+    res->ctx = text;
+    res_header(res, "Content-Type: text/plain; version=0.0.4\r\nCache-Control: no-store\r\n");
+}
 
-    return 1;
+/**
+ * @brief Answers the request of an HTTP/2 stream. Files are opened by
+ * the handler itself, the stream cannot wait in CONN_OPENING.
+ *
+ * @param ctx server
+ * @param req request of the stream
+ * @param res response of the stream
+ */
+static void h2_handle(void* ctx, struct req* req, struct res* res)
+{
+    struct server* server = ctx;
+    req->settings = server->settings;
+    req->nonblock = 0;
+    req->opened = NULL;
+    req->wake_fd = -1;
+    req->waited = NULL;
+    req->receivable = 0;
+    if (strcmp(req->path, STATS_PATH) == 0 && strcmp(req->method, "GET") == 0) {
+        serve_stats(res);
+    } else {
+        (*server->handle)(req, res);
+    }
 }
 
-struct req* parse_req(FILE* client)
+/**
+ * @brief Handles an epoll event of an HTTP/2 connection. Reads and
+ * writes until the socket would block. Reading pauses while the client
+ * does not accept the answers, so it cannot queue unbounded work.
+ *
+ * @param server server
+ * @param conn connection in CONN_H2
+ */
+static void conn_h2_event(struct server* server, struct conn* conn)
 {
-    struct req* req = malloc(sizeof(struct req));
-    req->path = NULL;
-    req->method = NULL;
-    char* line = NULL;
-    char* dup;
-    size_t size = 0;
-    ssize_t read;
-    int firstline = 1;
-    while (1) {
-        read = getline(&line, &size, client);
-        if (read == -1 && errno != EINTR) {
-            break;
+    int res;
+    do {
+        ssize_t n = h2_read(conn->h2, conn->fd);
+        if (n > 0) {
+            conn->last_active = time(NULL);
         }
-        if (read == -1 && errno == EINTR) {
-            errno = 0;
-            continue;
+        res = n < 0 ? -1 : h2_write(conn->h2, conn->fd, &conn->sent);
+        if (conn->sent > 0) {
+            stats_add(&server->stats->bytes_sent, conn->sent);
+            conn->sent = 0;
+            conn->last_active = time(NULL);
         }
+        if (res < 0 || h2_finished(conn->h2)) {
+            conn_close(server, conn);
+            return;
+        }
+    } while (res > 0 && h2_paused(conn->h2));
 
-        if (firstline) {
-            dup = strdup(line);
-            gdup = dup;
-            firstline = 0;
-            if (parse_req_line(dup, req) < 0) {
-                free(req);
-                req = NULL;
-                continue;
-            }
-        } else if (strcmp(line, "\r\n") != 0) {
-            // ToDo: parse header
-            continue;
-        } else {
-            break;
+    conn_watch(server, conn, (h2_paused(conn->h2) ? 0 : EPOLLIN) | (res == 0 ? EPOLLOUT : 0));
+    conn_arm(server, conn);
+}
+
+/**
+ * @brief Switches the connection to HTTP/2. The bytes behind the
+ * consumed ones are the first input of the HTTP/2 connection.
+ *
+ * @param server server
+ * @param conn connection
+ * @param upgrade request which asked for the upgrade or NULL if the
+ * connection started with the preface
+ * @param settings HTTP2-Settings of the upgrade request
+ * @param consumed bytes of the input buffer which belong to HTTP/1.1
+ * @return int 1 if switched, 0 if the connection stays HTTP/1.1
+ */
+static int conn_switch(struct server* server, struct conn* conn, const struct req* upgrade, const struct slice* settings,
+    size_t consumed)
+{
+    conn->h2 = h2_create(&server->h2env, upgrade, settings);
+    if (conn->h2 == NULL) {
+        return 0;
+    }
+    if (h2_input(conn->h2, conn->in + consumed, conn->in_len - consumed) < 0) {
+        h2_free(conn->h2);
+        conn->h2 = NULL;
+        return 0;
+    }
+    conn_reset(conn);
+    conn->in_len = 0;
+    conn->state = CONN_H2;
+    return 1;
+}
+
+/**
+ * @brief Calls the handler. If it asks for a file with res_open, the file
+ * is opened asynchronously and the connection waits in CONN_OPENING. If
+ * it waits for another thread with res_wait, the connection waits in
+ * CONN_WAITING.
+ *
+ * @param server server
+ * @param conn connection with a valid request
+ * @return int 1 if the response is ready, 0 if the connection waits
+ */
+static int conn_handle(struct server* server, struct conn* conn)
+{
+    conn->req.settings = server->settings;
+    conn->req.nonblock = server->aio != NULL && conn->opens < RES_OPEN_MAX;
+    conn->req.wake_fd = server->wake_fd;
+    conn->req.receivable = 1;
+    (*server->handle)(&conn->req, &conn->res);
+    conn->req.waited = NULL;
+
+    if (conn->req.opened != NULL) {
+        aio_job_free(conn->req.opened);
+        conn->req.opened = NULL;
+    }
+    if (conn->res.wait != NULL) {
+        void* ctx = conn->res.wait;
+        conn_reset(conn);
+        conn->req.waited = ctx;
+        conn->state = CONN_WAITING;
+        conn_park(server, conn);
+        return 0;
+    }
+    if (conn->res.open_path == NULL) {
+        return 1;
+    }
+    if (!conn->req.nonblock) {
+        // not allowed, the handler had to open the file itself
+        conn->res.open_path = NULL;
+        return 1;
+    }
+
+    struct aio_job* job = aio_open(server->aio, conn->res.open_path, conn);
+    conn_reset(conn);
+    if (job == NULL) {
+        // the handler has to open the file itself
+        conn->opens = RES_OPEN_MAX;
+        return conn_handle(server, conn);
+    }
+
+    conn->opens++;
+    conn->state = CONN_OPENING;
+    epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    return 0;
+}
+
+/**
+ * @brief Formats the response head and starts sending the response.
+ *
+ * @param server server
+ * @param conn connection with a complete response
+ * @param keep_alive 1 if the connection may stay open after the response
+ */
+static void conn_answer(struct server* server, struct conn* conn, int keep_alive)
+{
+    setup_body(conn);
+
+    conn->requests++;
+    conn->keep_alive = keep_alive && conn->req.keep_alive && conn->body_len >= 0
+        && conn->requests < KEEPALIVE_MAX && !server_quit;
+
+    conn->out_len = format_res_head(server, &conn->res, conn->body_len, conn->keep_alive, conn->out, sizeof(conn->out));
+    conn->out_pos = 0;
+    conn->state = CONN_WRITE_HEAD;
+    conn_watch(server, conn, EPOLLOUT);
+}
+
+/**
+ * @brief Answers a request whose body could not be received with
+ * @code{status} instead of the response of the handler. The rest of the
+ * body is not read, so the connection is closed after the answer.
+ *
+ * @param server server
+ * @param conn connection
+ * @param status status of the answer
+ */
+static void conn_refuse(struct server* server, struct conn* conn, unsigned int status)
+{
+    conn_reset(conn);
+    conn->res.status = status;
+    conn->linger = 1;
+    conn_answer(server, conn, 0);
+}
+
+/**
+ * @brief Starts receiving the request body for res_receive. A body which
+ * is known to be too large is refused before the client is asked for it
+ * with 100 Continue.
+ *
+ * @param server server
+ * @param conn connection with a handled request
+ */
+static void conn_receive_start(struct server* server, struct conn* conn)
+{
+    if (!conn->req.chunked && conn->req.content_length > conn->res.receive_max) {
+        conn_refuse(server, conn, 413);
+        return;
+    }
+    if (body_init(&conn->req_body, &conn->parser) < 0
+        || (conn->pipe[0] < 0 && pipe2(conn->pipe, O_NONBLOCK | O_CLOEXEC) < 0)) {
+        conn_refuse(server, conn, 500);
+        return;
+    }
+    // the default pipe of 64 KiB would split a BODY_CHUNK into many
+    // splice calls, a smaller pipe still works if the limit is lower
+    fcntl(conn->pipe[1], F_SETPIPE_SZ, BODY_CHUNK);
+    if (conn->req.expect_continue) {
+        // the previous response is sent completely, so the socket buffer
+        // takes the line. A failed send shows up when reading the body.
+        ssize_t ignored = send(conn->fd, CONTINUE_RESPONSE, sizeof(CONTINUE_RESPONSE) - 1, MSG_NOSIGNAL);
+        (void)ignored;
+    }
+    conn->req_body_pos = conn->head_len;
+    conn->req_body_len = 0;
+    conn->last_active = time(NULL);
+    conn->state = CONN_READ_BODY;
+    // the socket is writable, so the next event receives the body bytes
+    // which are already buffered
+    conn_watch(server, conn, EPOLLOUT);
+}
+
+/**
+ * @brief Frames the request body and formats the response head.
+ *
+ * @param server server
+ * @param conn connection
+ * @param valid 1 if the request was parsed successfully
+ */
+static void conn_respond(struct server* server, struct conn* conn, int valid)
+{
+    // the request body is not used, skip it to find the next request
+    size_t head_len = conn->head_len;
+    conn->req_len = head_len;
+    if (valid && conn->res.received != NULL) {
+        conn_receive_start(server, conn);
+        return;
+    }
+    if (valid && (conn->req.chunked || (conn->req.expect_continue && conn->req.content_length > 0))) {
+        // a chunked body cannot be skipped without parsing it and the
+        // client may never send a body it was not asked for
+        conn->req.keep_alive = 0;
+        conn->linger = 1;
+    } else if (valid && conn->req.content_length > 0) {
+        size_t avail = conn->in_len - head_len;
+        if ((size_t)conn->req.content_length <= avail) {
+            conn->req_len += conn->req.content_length;
+        } else {
+            conn->req_len = conn->in_len;
+            conn->discard = conn->req.content_length - avail;
+        }
+    }
+    conn_answer(server, conn, valid);
+}
+
+/**
+ * @brief Handles a fully received request head and prepares the response.
+ *
+ * @param server server
+ * @param conn connection
+ * @param valid 1 if the request was parsed successfully
+ * @param head_len length of the request head including the empty line
+ */
+static void conn_process(struct server* server, struct conn* conn, int valid, size_t head_len)
+{
+    conn->req_start = now_ns();
+    conn->head_len = head_len;
+    conn->opens = 0;
+    conn->req.opened = NULL;
+    conn->req.waited = NULL;
+    const struct slice* settings = valid && !server_quit ? h2_upgrade_settings(&conn->req) : NULL;
+    if (!valid) {
+        stats_add(&server->stats->parse_failures, 1);
+        // the request line may not have been parsed
+        conn->req.method = NULL;
+        conn->req.path = NULL;
+    } else if (settings != NULL && conn_switch(server, conn, &conn->req, settings, head_len)) {
+        // answered on stream 1 after the 101 response
+        return;
+    } else if (strcmp(conn->req.path, STATS_PATH) == 0 && strcmp(conn->req.method, "GET") == 0) {
+        // answered before the handler, the stats path is reserved
+        serve_stats(&conn->res);
+    } else {
+        if (!conn_handle(server, conn)) {
+            return;
+        }
+    }
+    conn_respond(server, conn, valid);
+}
+
+/**
+ * @brief Continues a request once its file is opened.
+ *
+ * @param server server
+ * @param job completed job of the connection
+ */
+static void conn_opened(struct server* server, struct aio_job* job)
+{
+    struct conn* conn = job->ctx;
+    if (conn_unpark(server, conn) < 0) {
+        aio_job_free(job);
+        return;
+    }
+    conn->req.opened = job;
+    if (conn_handle(server, conn)) {
+        conn_respond(server, conn, 1);
+    }
+    conn_arm(server, conn);
+}
+
+/**
+ * @brief Processes the next request if its head is completely buffered.
+ *
+ * @param server server
+ * @param conn connection
+ */
+static void conn_parse(struct server* server, struct conn* conn)
+{
+    if (conn->discard > 0) {
+        size_t n = conn->discard < conn->in_len ? conn->discard : conn->in_len;
+        conn_consume(conn, n);
+        conn->discard -= n;
+    }
+    if (conn->requests == 0 && conn->discard == 0) {
+        // prior knowledge clients start with the preface right away
+        int preface = h2_preface(conn->in, conn->in_len);
+        if (preface == 0 || (preface > 0 && conn_switch(server, conn, NULL, NULL, 0))) {
+            return;
+        }
+    }
+
+    int res = parse_req(&conn->parser, conn->in, conn->in_len, &conn->req);
+    if (res == PARSE_DONE) {
+        conn_process(server, conn, 1, conn->parser.pos);
+    } else if (res == PARSE_ERROR || conn->in_len == sizeof(conn->in)) {
+        // malformed or too large request head
+        if (res != PARSE_ERROR) {
+            conn->res.status = 431;
+        }
+        conn_process(server, conn, 0, conn->in_len);
+    }
+}
+
+/**
+ * @brief Reads from the client until the request head is complete.
+ *
+ * @param server server
+ * @param conn connection
+ * @return int 0 if the connection is still open, -1 if it was closed
+ */
+static int conn_read(struct server* server, struct conn* conn)
+{
+    while (conn->state == CONN_READ_REQ) {
+        ssize_t n = read(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            conn_close(server, conn);
+            return -1;
+        }
+
+        conn->last_active = time(NULL);
+        if (conn->in_len == 0) {
+            conn->head_start = conn->last_active;
+        }
+        conn->in_len += n;
+        conn_parse(server, conn);
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes request body bytes from the input buffer to the receive
+ * fd.
+ *
+ * @param conn connection in CONN_READ_BODY
+ * @param buf body bytes
+ * @param len number of bytes
+ * @return unsigned int 0 on success, else the status to answer with
+ */
+static unsigned int store_body(struct conn* conn, const char* buf, size_t len)
+{
+    if (conn->req_body_len + (off_t)len > conn->res.receive_max) {
+        return 413;
+    }
+    while (len > 0) {
+        ssize_t n = write(conn->res.receive_fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 500;
+        }
+        buf += n;
+        len -= n;
+        conn->req_body_len += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Moves the body bytes spliced into the connection pipe on to the
+ * receive fd.
+ *
+ * @param conn connection in CONN_READ_BODY
+ * @param len number of bytes in the pipe
+ * @return int 0 on success -1 on failure
+ */
+static int drain_pipe(struct conn* conn, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = splice(conn->pipe[0], NULL, conn->res.receive_fd, NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+        conn->req_body_len += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receives the request body until the socket would block or the
+ * body is complete. Buffered bytes and the chunk framing are parsed in
+ * the input buffer behind the head, which stays in place for the
+ * handler. The body data itself is spliced from the socket through the
+ * connection pipe to the receive fd.
+ *
+ * @param conn connection in CONN_READ_BODY
+ * @param status set to the status to answer a failed body with, 0 if the
+ * connection must be closed without an answer
+ * @return int 1 if the body is complete, 0 if the socket would block and
+ * -1 on failure
+ */
+static int recv_body(struct conn* conn, unsigned int* status)
+{
+    *status = 0;
+    while (1) {
+        int res;
+        do {
+            size_t consumed;
+            struct slice data;
+            res = body_next(&conn->req_body, conn->in + conn->req_body_pos, conn->in_len - conn->req_body_pos,
+                &consumed, &data);
+            conn->req_body_pos += consumed;
+            if (res == PARSE_ERROR) {
+                *status = 400;
+                return -1;
+            }
+            if (data.len > 0 && (*status = store_body(conn, data.ptr, data.len)) != 0) {
+                return -1;
+            }
+            if (consumed == 0) {
+                break;
+            }
+        } while (res == PARSE_AGAIN);
+        if (res == PARSE_DONE) {
+            // bytes behind the body belong to the next request
+            return 1;
+        }
+
+        // only an incomplete chunk line is left, move it behind the head
+        size_t left = conn->in_len - conn->req_body_pos;
+        memmove(conn->in + conn->head_len, conn->in + conn->req_body_pos, left);
+        conn->in_len = conn->head_len + left;
+        conn->req_body_pos = conn->head_len;
+
+        ssize_t n;
+        long long data_left = body_data_left(&conn->req_body);
+        if (data_left > 0) {
+            if (conn->req_body_len + data_left > conn->res.receive_max) {
+                *status = 413;
+                return -1;
+            }
+            n = splice(conn->fd, NULL, conn->pipe[1], NULL, data_left < BODY_CHUNK ? (size_t)data_left : BODY_CHUNK,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                body_skip(&conn->req_body, n);
+                if (drain_pipe(conn, n) < 0) {
+                    *status = 500;
+                    return -1;
+                }
+            }
+        } else if (conn->in_len == sizeof(conn->in)) {
+            // chunk line longer than the free buffer
+            *status = 400;
+            return -1;
+        } else {
+            size_t max = sizeof(conn->in) - conn->in_len;
+            n = read(conn->fd, conn->in + conn->in_len, max < BODY_LINE ? max : BODY_LINE);
+            if (n > 0) {
+                conn->in_len += n;
+            }
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        conn->last_active = time(NULL);
+    }
+}
+
+/**
+ * @brief Continues receiving the request body. Once it is complete the
+ * handler completes the response, a failed body is answered with its
+ * status instead.
+ *
+ * @param server server
+ * @param conn connection in CONN_READ_BODY
+ * @return int 0 if the connection is still open, -1 if it was closed
+ */
+static int conn_receive(struct server* server, struct conn* conn)
+{
+    unsigned int status;
+    int res = recv_body(conn, &status);
+    if (res == 0) {
+        conn_watch(server, conn, EPOLLIN);
+        return 0;
+    }
+    if (res > 0) {
+        conn->req_len = conn->req_body_pos;
+        conn->res.received(&conn->req, &conn->res);
+        conn_answer(server, conn, 1);
+        return 0;
+    }
+    if (status == 0) {
+        conn_close(server, conn);
+        return -1;
+    }
+    conn_refuse(server, conn, status);
+    return 0;
+}
+
+/**
+ * @brief Finishes the current request. Keep alive connections continue
+ * with the next pipelined request, all others are closed.
+ *
+ * @param server server
+ * @param conn connection
+ * @return int 0 if the connection is still open, -1 if it was closed
+ */
+static int conn_finish(struct server* server, struct conn* conn)
+{
+    if (!conn->keep_alive && (conn->linger || conn->discard > 0)) {
+        // closing with unread data would reset the connection, possibly
+        // before the client read the response
+        conn_reset(conn);
+        shutdown(conn->fd, SHUT_WR);
+        conn->state = CONN_LINGER;
+        conn->last_active = time(NULL);
+        conn_watch(server, conn, EPOLLIN);
+        return 0;
+    }
+    if (!conn->keep_alive) {
+        conn_close(server, conn);
+        return -1;
+    }
+
+    conn_reset(conn);
+    conn_consume(conn, conn->req_len);
+    conn->req_len = 0;
+    // a pipelined head was received before, its timeout starts now
+    conn->head_start = conn->last_active;
+    conn->state = CONN_READ_REQ;
+    conn_parse(server, conn);
+    if (conn->state == CONN_READ_REQ) {
+        conn_watch(server, conn, EPOLLIN);
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads and drops the rest of the request until the client
+ * closes the connection.
+ *
+ * @param server server
+ * @param conn connection in CONN_LINGER
+ */
+static void conn_drain(struct server* server, struct conn* conn)
+{
+    while (1) {
+        ssize_t n = read(conn->fd, conn->in, sizeof(conn->in));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn_arm(server, conn);
+            return;
+        }
+        if (n <= 0) {
+            conn_close(server, conn);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Handles an epoll event of a client connection.
+ *
+ * @param server server
+ * @param conn connection
+ */
+static void conn_event(struct server* server, struct conn* conn)
+{
+    if (conn->state == CONN_OPENING || conn->state == CONN_WAITING || conn->stalled) {
+        // reported before the fd was removed from epoll
+        return;
+    }
+    if (conn->state == CONN_READ_REQ && conn_read(server, conn) < 0) {
+        return;
+    }
+    if (conn->state == CONN_READ_BODY && conn_receive(server, conn) < 0) {
+        return;
+    }
+    if (conn->state == CONN_LINGER) {
+        conn_drain(server, conn);
+        return;
+    }
+
+    while (conn->state == CONN_WRITE_HEAD || conn->state == CONN_WRITE_BODY) {
+        int sent = send_response(conn);
+        if (conn->sent > 0) {
+            stats_add(&server->stats->bytes_sent, conn->sent);
+            conn->res_sent += conn->sent;
+            conn->sent = 0;
+            conn->last_active = time(NULL);
+        }
+        if (sent > 0) {
+            unsigned long long ns = now_ns() - conn->req_start;
+            stats_request(server->stats, conn->res.status, ns);
+            if (server->log != NULL
+                && accesslog_write(server->log, conn->req.method, conn->req.path, conn->res.status, conn->res_sent, ns) < 0) {
+                stats_add(&server->stats->log_dropped, 1);
+            }
+        }
+        if (sent == 0 && conn->stalled) {
+            conn_park(server, conn);
+            return;
+        }
+        if (sent == 0) {
+            conn_arm(server, conn);
+            return;
+        }
+        if (sent < 0) {
+            conn_close(server, conn);
+            return;
+        }
+        if (conn_finish(server, conn) < 0) {
+            return;
+        }
+    }
+    if (conn->state == CONN_H2) {
+        conn_h2_event(server, conn);
+        return;
+    }
+    conn_arm(server, conn);
+}
+
+/**
+ * @brief Continues all connections waiting for another thread once the
+ * wake fd is readable. Connections which still have to wait park again.
+ *
+ * @param server server
+ */
+static void conn_wake(struct server* server)
+{
+    uint64_t count;
+    ssize_t ignored = read(server->wake_fd, &count, sizeof(count));
+    (void)ignored;
+
+    struct conn* conn = server->waiting;
+    server->waiting = NULL;
+    while (conn != NULL) {
+        struct conn* next = conn->wnext;
+        if (conn->state == CONN_WAITING) {
+            // watched again only once the handler does not wait anymore
+            if (conn_handle(server, conn) && conn_unpark(server, conn) == 0) {
+                conn_respond(server, conn, 1);
+                conn_arm(server, conn);
+            }
+        } else if (conn_unpark(server, conn) == 0) {
+            conn->stalled = 0;
+            conn_event(server, conn);
+        }
+        conn = next;
+    }
+}
+
+/**
+ * @brief Number of bytes to move from the body fd in one step
+ *
+ * @param conn connection
+ * @param max maximum number of bytes
+ * @return size_t bytes to move
+ */
+static size_t body_chunk(struct conn* conn, size_t max)
+{
+    if (conn->res.avail != NULL && conn->body_avail - conn->body_off < (off_t)max) {
+        // only the part already written by the other thread
+        max = conn->body_avail - conn->body_off;
+    }
+    return conn->part_left >= 0 && conn->part_left < (off_t)max ? (size_t)conn->part_left : max;
+}
+
+/**
+ * @brief Moves body data through the connection pipe to the socket.
+ * Used if the body fd does not support sendfile.
+ *
+ * @param conn connection
+ * @param fd body file descriptor
+ * @return ssize_t bytes sent, 0 on end of body or -1 on failure
+ */
+static ssize_t splice_body(struct conn* conn, int fd)
+{
+    if (conn->pipe[0] < 0 && pipe2(conn->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    if (conn->piped == 0 && conn->part_left != 0) {
+        loff_t* off = conn->part_left >= 0 ? &conn->body_off : NULL;
+        ssize_t n = splice(fd, off, conn->pipe[1], NULL, body_chunk(conn, BODY_CHUNK), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n <= 0) {
+            return n;
+        }
+        conn->piped = n;
+        if (conn->part_left > 0) {
+            conn->part_left -= n;
+        }
+    }
+
+    ssize_t n = splice(conn->pipe[0], NULL, conn->fd, NULL, conn->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        conn->piped -= n;
+    }
+    return n;
+}
+
+/**
+ * @brief Copies body data through the out buffer to the socket.
+ * Last resort if neither sendfile nor splice work on the body fd.
+ *
+ * @param conn connection
+ * @param fd body file descriptor
+ * @return ssize_t bytes sent, 0 on end of body or -1 on failure
+ */
+static ssize_t copy_body(struct conn* conn, int fd)
+{
+    if (conn->out_pos == conn->out_len) {
+        ssize_t n;
+        if (conn->part_left >= 0) {
+            // the fd may be shared, do not move its file position
+            n = pread(fd, conn->out, body_chunk(conn, sizeof(conn->out)), conn->body_off);
+        } else {
+            n = read(fd, conn->out, sizeof(conn->out));
+        }
+        if (n <= 0) {
+            return n;
+        }
+        conn->body_off += n;
+        if (conn->part_left > 0) {
+            conn->part_left -= n;
+        }
+        conn->out_pos = 0;
+        conn->out_len = n;
+    }
+
+    ssize_t n = send(conn->fd, conn->out + conn->out_pos, conn->out_len - conn->out_pos, MSG_NOSIGNAL);
+    if (n > 0) {
+        conn->out_pos += n;
+    }
+    return n;
+}
+
+/**
+ * @brief Sends a range of the body fd without copying it to userspace
+ * if possible. sendfile is tried first, then splice, then a plain copy.
+ *
+ * @param conn connection
+ * @return ssize_t bytes sent, 0 on end of the fd or -1 on failure
+ */
+static ssize_t send_file_part(struct conn* conn)
+{
+    int fd = conn->body_fd;
+    while (1) {
+        if (conn->send_mode == SEND_SENDFILE) {
+            off_t* off = conn->part_left >= 0 ? &conn->body_off : NULL;
+            ssize_t n = sendfile(conn->fd, fd, off, body_chunk(conn, BODY_CHUNK));
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS || errno == ESPIPE)) {
+                conn->send_mode = SEND_SPLICE;
+                continue;
+            }
+            if (n > 0 && conn->part_left > 0) {
+                conn->part_left -= n;
+            }
+            return n;
+        }
+        if (conn->send_mode == SEND_SPLICE) {
+            ssize_t n = splice_body(conn, fd);
+            if (n < 0 && errno == EINVAL && conn->piped == 0) {
+                conn->send_mode = SEND_COPY;
+                conn->out_pos = 0;
+                conn->out_len = 0;
+                continue;
+            }
+            return n;
+        }
+        return copy_body(conn, fd);
+    }
+}
+
+/**
+ * @brief Sends the parts of the response body. File parts are sent from
+ * the body fd, memory parts directly from their buffer.
+ *
+ * @param conn connection
+ * @return int 1 if the body is sent, 0 if the socket would block, -1 on failure
+ */
+static int send_body(struct conn* conn)
+{
+    while (conn->part < conn->nparts) {
+        struct res_part* part = &conn->parts[conn->part];
+        if (!conn->part_started) {
+            conn->part_started = 1;
+            conn->part_left = part->len;
+            conn->body_off = part->buf != NULL ? 0 : part->offset;
+        }
+        if (conn->part_left == 0 && conn->piped == 0 && conn->out_pos == conn->out_len) {
+            conn->part++;
+            conn->part_started = 0;
+            continue;
+        }
+
+        if (part->buf == NULL && conn->res.avail != NULL && conn->body_off >= conn->body_avail
+            && conn->piped == 0 && conn->out_pos == conn->out_len) {
+            conn->body_avail = conn->res.avail(&conn->res, conn->body_off);
+            if (conn->body_avail < 0) {
+                return -1;
+            }
+            if (conn->body_off >= conn->body_avail) {
+                // continued once the writer wakes the event loop
+                conn->stalled = 1;
+                return 0;
+            }
+        }
+
+        ssize_t n;
+        if (part->buf != NULL) {
+            int flags = MSG_NOSIGNAL;
+            if (conn->part + 1 < conn->nparts) {
+                flags |= MSG_MORE;
+            }
+            n = send(conn->fd, part->buf + conn->body_off, conn->part_left, flags);
+            if (n > 0) {
+                conn->body_off += n;
+                conn->part_left -= n;
+            }
+        } else {
+            n = send_file_part(conn);
+        }
+        if (n > 0) {
+            conn->sent += n;
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            // end of a body of unknown length, shorter files are an error
+            if (conn->part_left > 0) {
+                return -1;
+            }
+            conn->part_left = 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Sends the rest of the head together with the first body part
+ * if that part is in memory, so that small responses need one system
+ * call and leave in as few packets as possible.
+ *
+ * @param conn connection
+ * @param flags send flags
+ * @return ssize_t bytes sent or -1 on failure
+ */
+static ssize_t send_head(struct conn* conn, int flags)
+{
+    size_t head_left = conn->out_len - conn->out_pos;
+    struct res_part* part = conn->nparts > 0 ? &conn->parts[0] : NULL;
+    if (part == NULL || part->buf == NULL || part->len <= 0) {
+        return send(conn->fd, conn->out + conn->out_pos, head_left, flags);
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = conn->out + conn->out_pos;
+    iov[0].iov_len = head_left;
+    iov[1].iov_base = (void*)part->buf;
+    iov[1].iov_len = part->len;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (conn->nparts == 1) {
+        flags &= ~MSG_MORE;
+    }
+    ssize_t n = sendmsg(conn->fd, &msg, flags);
+    if (n > 0 && (size_t)n > head_left) {
+        // continue the first part behind the bytes already sent
+        conn->part_started = 1;
+        conn->body_off = n - head_left;
+        conn->part_left = part->len - conn->body_off;
+    }
+    return n;
+}
+
+int send_response(struct conn* conn)
+{
+    while (conn->state == CONN_WRITE_HEAD) {
+        // keep the head corked until the first body bytes follow, unless
+        // they are still being written
+        int flags = MSG_NOSIGNAL;
+        if (conn->nparts > 0 && conn->body_len != 0 && conn->res.avail == NULL) {
+            flags |= MSG_MORE;
+        }
+
+        ssize_t n = send_head(conn, flags);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n < 0) {
+            return -1;
+        }
+
+        conn->sent += n;
+        if ((size_t)n > conn->out_len - conn->out_pos) {
+            n = conn->out_len - conn->out_pos;
+        }
+        conn->out_pos += n;
+        if (conn->out_pos == conn->out_len) {
+            conn->state = CONN_WRITE_BODY;
+            conn->out_pos = 0;
+            conn->out_len = 0;
+            if (conn->nparts > 1) {
+                // boundaries between file parts would leave as small segments
+                conn_cork(conn, 1);
+            }
+        }
+    }
+
+    int res = send_body(conn);
+    if (conn->corked && (res > 0 || conn->stalled)) {
+        conn_cork(conn, 0);
+    }
+    return res;
+}
+
+/**
+ * @brief Closes all connections whose timer expired. Only the wheel slots
+ * of the seconds since the last call are visited.
+ *
+ * @param server server
+ * @param now current time
+ */
+static void expire_timers(struct server* server, time_t now)
+{
+    time_t t = server->wheel_time;
+    if (now - t > TIMER_SLOTS) {
+        t = now - TIMER_SLOTS;
+    }
+    while (t < now) {
+        t++;
+        struct conn* conn = server->wheel[t % TIMER_SLOTS];
+        while (conn != NULL) {
+            struct conn* next = conn->tnext;
+            // later turns of the wheel share the slot
+            if (conn->deadline <= now) {
+                stats_add(&server->stats->timeouts[conn->timer], 1);
+                conn_close(server, conn);
+            }
+            conn = next;
+        }
+    }
+    server->wheel_time = now;
+}
+
+/**
+ * @brief Closes all connections which did not send any data yet and
+ * tells HTTP/2 connections to go away once their streams are answered.
+ * Called once the server is shutting down.
+ *
+ * @param server server
+ */
+static void close_idle_conns(struct server* server)
+{
+    struct conn* conn = server->conns;
+    while (conn != NULL) {
+        struct conn* next = conn->next;
+        if (conn->state == CONN_READ_REQ && conn->in_len == 0) {
+            conn_close(server, conn);
+        } else if (conn->state == CONN_H2) {
+            // the open streams are still answered
+            h2_shutdown(conn->h2);
+            conn_h2_event(server, conn);
+        }
+        conn = next;
+    }
+}
+
+void server_listen(int sockfd, int queue, void (*handle)(struct req*, struct res*), struct settings* settings)
+{
+    set_listener_options(sockfd, settings->defer_accept);
+    if (listen(sockfd, queue) < 0) {
+        log_error("listen failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct server server = {
+        .conns = NULL, .nconns = 0, .handle = handle, .settings = settings, .aio = NULL, .waiting = NULL, .date_sec = -1
+    };
+    server.wheel_time = time(NULL);
+    for (int i = 0; i < TIMER_SLOTS; i++) {
+        server.wheel[i] = NULL;
+    }
+    pthread_once(&heads_once, init_heads);
+    update_date(&server, time(NULL));
+    server.stats = stats_register();
+    server.log = accesslog_register();
+    server.h2env.handle = h2_handle;
+    server.h2env.ctx = &server;
+    server.h2env.stats = server.stats;
+    server.h2env.log = server.log;
+    server.h2env.date = server.date;
+    server.epfd = epoll_create1(0);
+    server.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server.stats == NULL || server.epfd < 0 || server.wake_fd < 0 || set_nonblocking(sockfd) < 0) {
+        log_error("epoll setup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    init_quit_fd();
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(server.epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+        log_error("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+    ev.data.ptr = &quit_tag;
+    if (epoll_ctl(server.epfd, EPOLL_CTL_ADD, quit_fd, &ev) < 0) {
+        log_error("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+    ev.data.ptr = &wake_tag;
+    if (epoll_ctl(server.epfd, EPOLL_CTL_ADD, server.wake_fd, &ev) < 0) {
+        log_error("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+    if (settings->aio != AIO_OFF) {
+        server.aio = aio_create(settings->aio);
+        ev.data.ptr = &aio_tag;
+        if (server.aio == NULL || epoll_ctl(server.epfd, EPOLL_CTL_ADD, aio_fd(server.aio), &ev) < 0) {
+            log_error("aio setup failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int listening = 1;
+    while (listening || server.conns != NULL) {
+        if (server_quit && listening) {
+            // stop accepting, fulfill ongoing connections
+            epoll_ctl(server.epfd, EPOLL_CTL_DEL, sockfd, NULL);
+            epoll_ctl(server.epfd, EPOLL_CTL_DEL, quit_fd, NULL);
+            listening = 0;
+            close_idle_conns(&server);
+            continue;
+        }
+
+        int n = epoll_wait(server.epfd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("epoll_wait failed");
+            break;
+        }
+        time_t now = time(NULL);
+        update_date(&server, now);
+
+        for (int i = 0; i < n; i++) {
+            struct conn* conn = events[i].data.ptr;
+            if (conn == (struct conn*)&quit_tag) {
+                break;
+            }
+            if (conn == NULL) {
+                accept_conns(&server, sockfd);
+                continue;
+            }
+            if (conn == (struct conn*)&aio_tag) {
+                struct aio_job* job = aio_complete(server.aio);
+                while (job != NULL) {
+                    struct aio_job* next = job->next;
+                    conn_opened(&server, job);
+                    job = next;
+                }
+                continue;
+            }
+            if (conn == (struct conn*)&wake_tag) {
+                conn_wake(&server);
+                continue;
+            }
+
+            conn_event(&server, conn);
+        }
+        if (server.aio != NULL) {
+            // all opens of this round in one system call
+            aio_submit(server.aio);
+        }
+
+        if (now != server.wheel_time) {
+            expire_timers(&server, now);
+        }
+    }
+
+    while (server.conns != NULL) {
+        conn_close(&server, server.conns);
+    }
+    if (server.aio != NULL) {
+        // connections only leave the list once their open completed
+        aio_free(server.aio);
+    }
+    close(server.wake_fd);
+    close(server.epfd);
+    close(sockfd);
+}
+
+/**
+ * @brief Entry point of a worker thread.
+ *
+ * @param arg worker
+ * @return void* NULL
+ */
+static void* worker_main(void* arg)
+{
+    struct worker* worker = arg;
+    server_listen(worker->sockfd, worker->queue, worker->handle, worker->settings);
+    return NULL;
+}
+
+void server_listen_workers(char* port, int workers, int queue, void (*handle)(struct req*, struct res*), struct settings* settings)
+{
+    init_quit_fd();
+
+    struct worker* pool = malloc(workers * sizeof(struct worker));
+    if (pool == NULL) {
+        log_error("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // bind all listeners up front so that errors are reported before serving
+    for (int i = 0; i < workers; i++) {
+        pool[i].sockfd = create_server(port, 1);
+        pool[i].started = 0;
+        pool[i].queue = queue;
+        pool[i].handle = handle;
+        pool[i].settings = settings;
+    }
+
+    // signals are handled by the main thread only
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    int started = 0;
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&pool[i].thread, NULL, worker_main, &pool[i]) != 0) {
+            log_error("Starting worker %d failed", i);
+            close(pool[i].sockfd);
+            continue;
+        }
+        pool[i].started = 1;
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (started == 0) {
+        free(pool);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < workers; i++) {
+        if (pool[i].started) {
+            pthread_join(pool[i].thread, NULL);
+        }
+    }
+    free(pool);
+}
+
+int parse_req(struct parser* parser, char* buf, size_t len, struct req* req)
+{
+    int res = parser_parse(parser, buf, len);
+    if (res != PARSE_DONE) {
+        return res;
+    }
+
+    if (!slice_eq(parser->version, "HTTP/1.1")) {
+        return PARSE_ERROR;
+    }
+
+    // the separators behind method and path are not needed anymore
+    req->method = buf + (parser->method.ptr - buf);
+    req->method[parser->method.len] = '\0';
+    req->path = buf + (parser->path.ptr - buf);
+    req->path[parser->path.len] = '\0';
+    req->headers = parser->headers;
+    req->nheaders = parser->nheaders;
+    req->keep_alive = 1;
+    req->content_length = 0;
+
+    const struct slice* value = req_header(req, "Connection");
+    if (value != NULL && slice_eq(*value, "close")) {
+        req->keep_alive = 0;
+    }
+
+    // repeated lengths must agree and codings or hosts must not repeat, a
+    // proxy in front of the server could use another one of them and frame
+    // or route the request differently
+    int lengths = 0;
+    int codings = 0;
+    int hosts = 0;
+    for (size_t i = 0; i < req->nheaders; i++) {
+        const struct header* header = &req->headers[i];
+        if (slice_eq(header->name, "Content-Length")) {
+            long long length;
+            if (slice_to_ll(header->value, &length) < 0 || (lengths++ > 0 && length != req->content_length)) {
+                return PARSE_ERROR;
+            }
+            req->content_length = length;
+        } else if ((slice_eq(header->name, "Transfer-Encoding") && codings++ > 0)
+            || (slice_eq(header->name, "Host") && hosts++ > 0)) {
+            return PARSE_ERROR;
+        }
+    }
+
+    // a Content-Length next to the coding could frame the request
+    // differently for a proxy in front of the server
+    req->chunked = 0;
+    value = req_header(req, "Transfer-Encoding");
+    if (value != NULL) {
+        if (!slice_eq(*value, "chunked") || lengths > 0) {
+            return PARSE_ERROR;
+        }
+        req->chunked = 1;
+    }
+
+    value = req_header(req, "Expect");
+    req->expect_continue = value != NULL && slice_eq(*value, "100-continue");
+    return PARSE_DONE;
+}
+
+void* res_alloc(struct res* res, size_t size)
+{
+    return arena_alloc(res->arena, size);
+}
+
+off_t res_body(struct res* res, struct res_part* single, struct res_part** parts, size_t* nparts, int* fd)
+{
+    single->buf = NULL;
+    single->offset = res->offset;
+    single->len = res->size;
+    *parts = res->parts != NULL ? res->parts : single;
+    *nparts = res->parts != NULL ? res->nparts : 1;
+    *fd = -1;
+
+    if (res->body != NULL) {
+        *fd = fileno(res->body);
+        single->offset = 0;
+        single->len = file_size(res->body);
+        *parts = single;
+        *nparts = 1;
+    } else if (res->fd >= 0) {
+        *fd = res->fd;
+    } else if (res->parts == NULL) {
+        *nparts = 0;
+    }
+
+    off_t len = 0;
+    for (size_t i = 0; i < *nparts; i++) {
+        if ((*parts)[i].len < 0) {
+            return -1;
+        }
+        len += (*parts)[i].len;
+    }
+    return len;
+}
+
+int res_open(struct res* res, const char* path)
+{
+    res->open_path = arena_strdup(res->arena, path);
+    return res->open_path != NULL ? 0 : -1;
+}
+
+void res_wait(struct res* res, void* ctx)
+{
+    res->wait = ctx;
+}
+
+int res_receive(struct req* req, struct res* res, int fd, off_t max, void (*received)(struct req* req, struct res* res))
+{
+    if (!req->receivable) {
+        return -1;
+    }
+    res->receive_fd = fd;
+    res->receive_max = max;
+    res->received = received;
+    return 0;
+}
+
+int res_header(struct res* res, const char* format, ...)
+{
+    va_list args;
+    size_t size = sizeof(res->extra) - res->extra_len;
+    va_start(args, format);
+    int len = vsnprintf(res->extra + res->extra_len, size, format, args);
+    va_end(args);
+    if (len < 0 || (size_t)len >= size) {
+        res->extra[res->extra_len] = '\0';
+        return -1;
+    }
+    res->extra_len += len;
+    return 0;
+}
+
+const struct slice* req_header(const struct req* req, const char* name)
+{
+    for (size_t i = 0; i < req->nheaders; i++) {
+        if (slice_eq(req->headers[i].name, name)) {
+            return &req->headers[i].value;
         }
     }
-    free(line);
-    return req;
+    return NULL;
 }
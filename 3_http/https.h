@@ -12,36 +12,151 @@
 #ifndef HTTPS
 #define HTTPS
 
+#include "aio.h"
+#include "arena.h"
+#include "parser.h"
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
+
+// seconds a keep alive connection may wait for the next request
+#define KEEPALIVE_TIMEOUT (5)
+// seconds from the first byte of a request head until it must be complete
+#define HEADER_TIMEOUT (10)
+// seconds a client may take to accept any more of a response
+#define WRITE_TIMEOUT (30)
+// seconds a client may pause while it sends a request body
+#define BODY_TIMEOUT (30)
+// connections accepted per readiness of the listener
+#define ACCEPT_BATCH (64)
+// requests served on one connection before it is closed
+#define KEEPALIVE_MAX (100)
+// pending TCP Fast Open connections of a listener
+#define FASTOPEN_QUEUE (256)
 
 struct req {
     char* path;
     char* method;
+    // slices into the receive buffer of the connection
+    struct header* headers;
+    size_t nheaders;
+    int keep_alive;
+    long long content_length;
+    // the body is chunked, its length is unknown
+    int chunked;
+    // the client waits for 100 Continue before it sends the body
+    int expect_continue;
     struct settings* settings;
+    // set if the handler runs on the event loop and must not block on
+    // the file system, files are opened with res_open instead
+    int nonblock;
+    // file opened for the last res_open or NULL, set fd to -1 to keep it
+    struct aio_job* opened;
+    // eventfd of the event loop for res_wait, -1 if the handler must not wait
+    int wake_fd;
+    // ctx passed to the last res_wait or NULL, owned by the handler again
+    void* waited;
+    // set if the body may be received with res_receive
+    int receivable;
+};
+
+#define RES_EXTRA_SIZE (512)
+
+/**
+ * @brief Part of a response body. Either memory or a range of the body fd.
+ */
+struct res_part {
+    // memory to send or NULL to send a range of the body fd
+    const char* buf;
+    off_t offset;
+    off_t len;
 };
 
 struct res {
     unsigned int status;
     FILE* body;
+    // body which is not owned by the response, used if body is NULL
+    int fd;
+    // range of fd which is sent
+    off_t offset;
+    off_t size;
+    // body sent in several parts, replaces offset and size if set
+    struct res_part* parts;
+    size_t nparts;
+    // precomputed header lines each terminated by \r\n, may be NULL
+    const char* headers;
+    size_t headers_len;
+    // header lines added with res_header
+    char extra[RES_EXTRA_SIZE];
+    size_t extra_len;
+    // called after the response was sent or the connection closed
+    void (*done)(struct res* res);
+    void* ctx;
+    // file to open before the handler is called again, see res_open
+    char* open_path;
+    // ctx of res_wait, the handler is called again once wake_fd was written
+    void* wait;
+    // set if the body fd is still written by another thread. Gets the
+    // bytes of the fd written so far or -1 if writing failed. If no more
+    // than off bytes are written, the writer must write to wake_fd of the
+    // request once it wrote more.
+    off_t (*avail)(struct res* res, off_t off);
+    // set by res_receive, the request body is written to receive_fd
+    // before the response is sent
+    void (*received)(struct req* req, struct res* res);
+    int receive_fd;
+    off_t receive_max;
+    // memory of the request, reset once the response is done
+    struct arena* arena;
 };
 
+// how often the handler of one request may ask for a file with res_open
+#define RES_OPEN_MAX (4)
+
 struct settings {
     char* docRoot;
     char* index;
+    // opens files off the event loop if not AIO_OFF
+    enum aio_mode aio;
+    // connections one event loop serves at once, 0 for no limit
+    int max_conns;
+    // connections accepted at once before serving the others again
+    int accept_batch;
+    // lists directories without an index file if set
+    int autoindex;
+    // accepts connections only once their request arrived, which clients
+    // may send with the SYN (TCP_DEFER_ACCEPT and TCP Fast Open)
+    int defer_accept;
 };
 
 /**
  * @brief Create a http socket server
  * 
  * @param port port of socket
+ * @param reuseport 1 to share the port with other listeners of the same
+ * user (SO_REUSEPORT), 0 to fail if the port is in use
  * @return int server socket file descriptor
  */
-int create_server(char* port);
+int create_server(char* port, int reuseport);
 
 /**
- * @brief Listens for http requests
+ * @brief Listens for http requests. All connections are served by one
+ * non blocking epoll event loop, so a slow client does not stall others.
+ * Connections are kept alive for up to KEEPALIVE_MAX pipelined requests
+ * and closed after KEEPALIVE_TIMEOUT idle seconds. Request heads which
+ * are not complete after HEADER_TIMEOUT seconds and clients which do not
+ * read the response for WRITE_TIMEOUT seconds are closed as well.
+ * Connections beyond settings->max_conns are answered with 503 right
+ * away. With settings->defer_accept the request is read right after
+ * accepting its connection. GET requests of
+ * STATS_PATH are answered with the server metrics and never reach
+ * @code{handle}. Connections starting with the HTTP/2 preface and
+ * requests asking for an upgrade to h2c are served as cleartext HTTP/2,
+ * see h2.h. Handlers may wait for other threads with res_wait and send
+ * bodies which are still being written, see res.avail. Request bodies
+ * are skipped unless the handler receives them with res_receive, a
+ * client waiting for 100 Continue is answered right away then.
  * 
  * @param sockfd server socket fd
  * @param queue socket queue
@@ -50,6 +165,20 @@ int create_server(char* port);
  */
 void server_listen(int sockfd, int queue, void (*handle)(struct req*, struct res*), struct settings* settings);
 
+/**
+ * @brief Serves http requests with @code{workers} threads. Every worker binds
+ * its own SO_REUSEPORT listener on @code{port} and runs its own event loop,
+ * so the kernel spreads the connections over all workers. Returns after
+ * all workers finished their connections on shutdown.
+ * 
+ * @param port port of socket
+ * @param workers number of worker threads
+ * @param queue socket queue of each listener
+ * @param handle callback to handle an request, called from all workers
+ * @param settings http server settings
+ */
+void server_listen_workers(char* port, int workers, int queue, void (*handle)(struct req*, struct res*), struct settings* settings);
+
 /**
  * @brief Suts the server down. On going connections will be fulfilled.
  * After the last connection closes the servers shuts down.
@@ -58,30 +187,133 @@ void server_listen(int sockfd, int queue, void (*handle)(struct req*, struct res
 void server_shutdown(void);
 
 /**
- * @brief Sends a http response to client socket @code{clientfile}
+ * @brief Per connection state of the event loop. Only used internally
+ * by the server.
+ */
+struct conn;
+
+/**
+ * @brief Writes the pending response of @code{conn} to the client socket
+ * without blocking. The head is written first followed by the body parts.
+ * File parts are sent from the raw body fd with sendfile or splice. The
+ * socket is corked while a body of several parts is sent.
+ * 
+ * @param conn client connection with a formatted response
+ * @return int 1 if the response was sent completly, 0 if the socket would
+ * block and -1 on failure
+ */
+int send_response(struct conn* conn);
+
+/**
+ * @brief Parses the request head received so far. Method and path are 0
+ * terminated in place, so @code{buf} must stay untouched while @code{req}
+ * is used. The Connection, Content-Length and Transfer-Encoding headers
+ * are used to frame keep alive and pipelined requests. Chunked is the
+ * only supported transfer coding and must not be combined with a
+ * Content-Length.
  * 
- * @param clientfile Client socket file
- * @param res resposne struct
+ * @param parser parser of the connection, resumes partial heads
+ * @param buf receive buffer
+ * @param len number of bytes in @code{buf}
+ * @param req request struct to fill
+ * @return int PARSE_DONE if the request is complete and valid, PARSE_AGAIN
+ * if more data is needed else PARSE_ERROR
  */
-void send_response(FILE* clientfile, struct res* res);
+int parse_req(struct parser* parser, char* buf, size_t len, struct req* req);
 
 /**
- * @brief Parses the req line an sets method and path to the @code{req} struct.
- * The req line must be as followed: Method SP Status SP HTTP/1.1\r\n
+ * @brief Adds a header line to the response. Supports all the printf
+ * formats, the line must be terminated with \r\n.
  * 
- * @param line request line
- * @param req response struct
- * @return int 1 if req line is valid and could be parsed else -1
+ * @param res response
+ * @param format format of the header line
+ * @param ... format parameters
+ * @return int 0 on success -1 if the header does not fit
  */
-int parse_req_line(char* line, struct req* req);
+int res_header(struct res* res, const char* format, ...);
 
 /**
- * @brief Gets the client socketfile and parses the requst.
+ * @brief Allocates memory which lives until the response was sent or the
+ * connection closed. Nothing has to be freed. The memory of one request
+ * is limited to ARENA_MAX bytes.
  * 
- * @param client client socket file
- * @return struct req* request struct with parsed valus if the req is invalid NULL is returned
+ * @param res response
+ * @param size number of bytes
+ * @return void* memory or NULL if the limit is reached
+ */
+void* res_alloc(struct res* res, size_t size);
+
+/**
+ * @brief Gets the parts of the response body. A body given by fd, offset
+ * and size or by a FILE is described by @code{single}.
+ * 
+ * @param res response
+ * @param single part used for a body which is not given in parts
+ * @param parts parts of the body
+ * @param nparts number of parts, 0 if there is no body
+ * @param fd fd the file parts are read from or -1
+ * @return off_t length of the body or -1 if it ends with the fd
+ */
+off_t res_body(struct res* res, struct res_part* single, struct res_part** parts, size_t* nparts, int* fd);
+
+/**
+ * @brief Asks the server to open @code{path} without blocking the event
+ * loop. Only allowed if @code{req->nonblock} is set. The handler must
+ * return right away; everything it set on @code{res} is discarded. Once
+ * the file is opened the handler is called again with @code{req->opened}
+ * describing the result. After RES_OPEN_MAX calls the handler is called
+ * with @code{req->nonblock} cleared instead.
+ * 
+ * @param res response
+ * @param path path of the file
+ * @return int 0 on success -1 on failure
+ */
+int res_open(struct res* res, const char* path);
+
+/**
+ * @brief Asks the server to call the handler again once another thread
+ * wrote to @code{req->wake_fd}. Only allowed if @code{req->wake_fd} is
+ * set. The handler must return right away; everything it set on
+ * @code{res} is discarded. The connection waits without a timeout, so
+ * the other thread must write eventually. On the next call
+ * @code{req->waited} is @code{ctx}. The event loop shares wake_fd among
+ * all its waiting requests, so the handler may be called again before the
+ * thread it waits for made any progress.
+ * 
+ * @param res response
+ * @param ctx state of the handler, not NULL
+ */
+void res_wait(struct res* res, void* ctx);
+
+/**
+ * @brief Asks the server to receive the request body into @code{fd}
+ * before the response is sent. Fails unless @code{req->receivable} is
+ * set. Content-Length and chunked bodies are moved from the socket to
+ * @code{fd} with splice, without copying them to userspace. A client
+ * which expects it is sent 100 Continue first. Once the whole body is
+ * written @code{received} is called to complete the response. Bodies
+ * larger than @code{max} are answered with 413, malformed ones with 400
+ * and failed writes with 500; the response set by the handler is
+ * discarded then, but its done callback is called. The connection is
+ * closed if the client stops sending for BODY_TIMEOUT seconds.
+ * 
+ * @param req request
+ * @param res response
+ * @param fd file the body is written to at its current position
+ * @param max maximum length of the body
+ * @param received called with the request and the response once the body
+ * is written
+ * @return int 0 on success -1 if the body cannot be received
+ */
+int res_receive(struct req* req, struct res* res, int fd, off_t max, void (*received)(struct req* req, struct res* res));
+
+/**
+ * @brief Gets the value of a request header
  * 
+ * @param req parsed request
+ * @param name header name, compared case insensitive
+ * @return const struct slice* value or NULL if the header is missing
  */
-struct req* parse_req(FILE* client);
+const struct slice* req_header(const struct req* req, const char* name);
 
 #endif
@@ -0,0 +1,568 @@
+/**
+ * @file loadgen.c
+ * @author Lorenz Hörburger 12024737
+ * @brief HTTP load generator with a latency histogram
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "loadgen.h"
+#include "common.h"
+#include "parser.h"
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROTOCOL "HTTP/1.1"
+#define MAX_EVENTS (64)
+// head of a request that a slow connection never finishes
+#define SLOW_PREFIX "GET / " PROTOCOL "\r\nHost: slow\r\nX-Slow: "
+// nanoseconds between two bytes sent by a slow connection
+#define SLOW_INTERVAL (1000000000ULL)
+
+enum lconn_state {
+    LCONN_CONNECTING,
+    LCONN_SENDING,
+    LCONN_READING
+};
+
+struct lconn {
+    int fd;
+    // distinguishes events of a closed socket from its successor
+    uint32_t gen;
+    enum lconn_state state;
+    int remaining;
+    unsigned long long start;
+    size_t sent;
+    char buf[LOADGEN_BUF_SIZE];
+    size_t len;
+    int head_done;
+    int keep_alive;
+    struct parser parser;
+    struct body body;
+};
+
+/**
+ * @brief Connection which trickles a never ending request head
+ */
+struct slow {
+    int fd;
+    size_t sent;
+};
+
+struct loadgen {
+    int epfd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char req[LOADGEN_REQ_SIZE];
+    size_t req_len;
+    // body bytes sent behind every request head
+    long long upload;
+    // zeros the upload bodies are sent from
+    char* upload_buf;
+    int keep_alive;
+    int active;
+    struct lconn* conns;
+    struct slow* slow;
+    int nslow;
+    unsigned long long next_trickle;
+    struct loadgen_result* result;
+};
+
+static void conn_next(struct loadgen* lg, struct lconn* conn);
+
+void hist_init(struct hist* hist)
+{
+    memset(hist, 0, sizeof(struct hist));
+}
+
+/**
+ * @brief Gets the bucket of a value
+ *
+ * @param value value below 2^HIST_MAX_BITS
+ * @return size_t bucket index
+ */
+static size_t hist_index(unsigned long long value)
+{
+    if (value < 2 * HIST_SUB_HALF) {
+        return value;
+    }
+    // the top HIST_SUB_BITS bits select the bucket within the range
+    int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return shift * HIST_SUB_HALF + (value >> shift);
+}
+
+void hist_record(struct hist* hist, unsigned long long value)
+{
+    if (value >= 1ULL << HIST_MAX_BITS) {
+        value = (1ULL << HIST_MAX_BITS) - 1;
+    }
+    hist->counts[hist_index(value)]++;
+    if (hist->total == 0 || value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+    hist->total++;
+    hist->sum += value;
+}
+
+unsigned long long hist_percentile(const struct hist* hist, double percentile)
+{
+    if (hist->total == 0) {
+        return 0;
+    }
+    unsigned long long target = (unsigned long long)(percentile / 100.0 * hist->total + 0.5);
+    if (target < 1) {
+        target = 1;
+    }
+
+    unsigned long long seen = 0;
+    for (size_t i = 0; i < HIST_SIZE; i++) {
+        seen += hist->counts[i];
+        if (seen < target) {
+            continue;
+        }
+        unsigned long long high = i;
+        if (i >= 2 * HIST_SUB_HALF) {
+            int shift = i / HIST_SUB_HALF - 1;
+            high = ((unsigned long long)(i % HIST_SUB_HALF + HIST_SUB_HALF) << shift) + (1ULL << shift) - 1;
+        }
+        return high < hist->max ? high : hist->max;
+    }
+    return hist->max;
+}
+
+/**
+ * @brief Gets the monotonic time
+ *
+ * @return unsigned long long time in nanoseconds
+ */
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Closes the socket of the connection
+ *
+ * @param lg load generator
+ * @param conn connection
+ */
+static void conn_close(struct loadgen* lg, struct lconn* conn)
+{
+    if (conn->fd >= 0) {
+        epoll_ctl(lg->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+/**
+ * @brief Opens a new non blocking connection. The socket is watched edge
+ * triggered for both directions, so a keep alive connection needs no
+ * epoll_ctl per request.
+ *
+ * @param lg load generator
+ * @param conn connection
+ * @return int 0 on success -1 on failure
+ */
+static int conn_connect(struct loadgen* lg, struct lconn* conn)
+{
+    conn->fd = socket(lg->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        return -1;
+    }
+    conn->gen++;
+    conn->len = 0;
+    lg->result->connects++;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.u64 = ((uint64_t)conn->gen << 32) | (uint64_t)(conn - lg->conns);
+    if (epoll_ctl(lg->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0
+        || (connect(conn->fd, (struct sockaddr*)&lg->addr, lg->addrlen) < 0 && errno != EINPROGRESS)) {
+        conn_close(lg, conn);
+        return -1;
+    }
+    conn->state = LCONN_CONNECTING;
+    return 0;
+}
+
+/**
+ * @brief Finishes the current request of the connection and starts the
+ * next one.
+ *
+ * @param lg load generator
+ * @param conn connection
+ * @param ok 1 if a complete response was received
+ */
+static void conn_done(struct loadgen* lg, struct lconn* conn, int ok)
+{
+    struct loadgen_result* result = lg->result;
+    if (ok) {
+        result->requests++;
+        if (conn->parser.status < 200 || conn->parser.status > 299) {
+            result->non_2xx++;
+        } else {
+            result->uploaded += lg->upload;
+        }
+        hist_record(&result->latency, now_ns() - conn->start);
+    } else {
+        result->errors++;
+    }
+    conn->remaining--;
+
+    if (!ok || !conn->keep_alive) {
+        conn_close(lg, conn);
+    }
+    conn_next(lg, conn);
+}
+
+/**
+ * @brief Sends the request head followed by the upload body, if any.
+ * Once it is sent the connection waits for the response.
+ *
+ * @param lg load generator
+ * @param conn connection
+ */
+static void conn_send(struct loadgen* lg, struct lconn* conn)
+{
+    if (conn->state == LCONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof err;
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            conn_done(lg, conn, 0);
+            return;
+        }
+        conn->state = LCONN_SENDING;
+    }
+
+    unsigned long long total = lg->req_len + lg->upload;
+    while (conn->sent < total) {
+        const char* data = lg->req + conn->sent;
+        size_t len = lg->req_len - conn->sent;
+        if (conn->sent >= lg->req_len) {
+            data = lg->upload_buf;
+            len = total - conn->sent < LOADGEN_UPLOAD_CHUNK ? total - conn->sent : LOADGEN_UPLOAD_CHUNK;
+        }
+        ssize_t n = send(conn->fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)) {
+            // still connecting or the send buffer is full
+            return;
+        }
+        if (n < 0) {
+            conn_done(lg, conn, 0);
+            return;
+        }
+        conn->sent += n;
+    }
+
+    conn->state = LCONN_READING;
+    conn->head_done = 0;
+    parser_init_res(&conn->parser);
+}
+
+/**
+ * @brief Starts the next request of the connection or retires the
+ * connection once all its requests are done.
+ *
+ * @param lg load generator
+ * @param conn connection
+ */
+static void conn_next(struct loadgen* lg, struct lconn* conn)
+{
+    // a refused connect fails synchronously, loop instead of recursing
+    while (conn->remaining > 0) {
+        conn->start = now_ns();
+        conn->sent = 0;
+        if (conn->fd >= 0) {
+            conn->state = LCONN_SENDING;
+            conn_send(lg, conn);
+            return;
+        }
+        if (conn_connect(lg, conn) == 0) {
+            return;
+        }
+        lg->result->errors++;
+        conn->remaining--;
+    }
+    conn_close(lg, conn);
+    lg->active--;
+}
+
+/**
+ * @brief Sends the next byte of every slow connection. Connections the
+ * server closed are counted and opened again, so the pressure stays.
+ *
+ * @param lg load generator
+ */
+static void slow_trickle(struct loadgen* lg)
+{
+    for (int i = 0; i < lg->nslow; i++) {
+        struct slow* slow = &lg->slow[i];
+        if (slow->fd >= 0) {
+            char c;
+            ssize_t n = recv(slow->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)) {
+                // still connecting or waiting, as expected
+                size_t len = slow->sent < sizeof(SLOW_PREFIX) - 1 ? sizeof(SLOW_PREFIX) - 1 - slow->sent : 1;
+                const char* data = slow->sent < sizeof(SLOW_PREFIX) - 1 ? SLOW_PREFIX + slow->sent : "a";
+                n = send(slow->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (n > 0) {
+                    slow->sent += n;
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)) {
+                    continue;
+                }
+            }
+            // closed or answered by the server
+            lg->result->slow_closed++;
+            close(slow->fd);
+        }
+        slow->sent = 0;
+        slow->fd = socket(lg->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (slow->fd >= 0 && connect(slow->fd, (struct sockaddr*)&lg->addr, lg->addrlen) < 0 && errno != EINPROGRESS) {
+            close(slow->fd);
+            slow->fd = -1;
+        }
+    }
+}
+
+/**
+ * @brief Skips the buffered body data.
+ *
+ * @param conn connection
+ * @return int PARSE_DONE if the body is complete, PARSE_AGAIN or PARSE_ERROR
+ */
+static int skip_body(struct lconn* conn)
+{
+    size_t off = 0;
+    int res = PARSE_AGAIN;
+    while (res == PARSE_AGAIN) {
+        size_t consumed;
+        struct slice data;
+        res = body_next(&conn->body, conn->buf + off, conn->len - off, &consumed, &data);
+        off += consumed;
+        if (res == PARSE_ERROR || consumed == 0) {
+            break;
+        }
+    }
+    memmove(conn->buf, conn->buf + off, conn->len - off);
+    conn->len -= off;
+    return res;
+}
+
+/**
+ * @brief Handles a completely parsed response head.
+ *
+ * @param lg load generator
+ * @param conn connection
+ * @return int 0 on success -1 on failure
+ */
+static int on_head(struct loadgen* lg, struct lconn* conn)
+{
+    struct parser* parser = &conn->parser;
+    if (body_init(&conn->body, parser) < 0) {
+        return -1;
+    }
+    const struct slice* connection = parser_header(parser, "Connection");
+    conn->keep_alive = lg->keep_alive && slice_eq(parser->version, PROTOCOL)
+        && conn->body.mode != BODY_UNTIL_CLOSE && (connection == NULL || !slice_eq(*connection, "close"));
+
+    memmove(conn->buf, conn->buf + parser->pos, conn->len - parser->pos);
+    conn->len -= parser->pos;
+    conn->head_done = 1;
+    return 0;
+}
+
+/**
+ * @brief Reads the response until the socket would block or the
+ * response is complete.
+ *
+ * @param lg load generator
+ * @param conn connection
+ */
+static void conn_read(struct loadgen* lg, struct lconn* conn)
+{
+    while (1) {
+        ssize_t n = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            int ok = n == 0 && conn->head_done && conn->body.mode == BODY_UNTIL_CLOSE;
+            conn->keep_alive = 0;
+            conn_done(lg, conn, ok);
+            return;
+        }
+        lg->result->bytes += n;
+        conn->len += n;
+
+        if (!conn->head_done) {
+            int res = parser_parse(&conn->parser, conn->buf, conn->len);
+            if (res == PARSE_AGAIN && conn->len < sizeof(conn->buf)) {
+                continue;
+            }
+            if (res != PARSE_DONE || on_head(lg, conn) < 0) {
+                conn_done(lg, conn, 0);
+                return;
+            }
+        }
+
+        int res = skip_body(conn);
+        if (res != PARSE_AGAIN) {
+            conn_done(lg, conn, res == PARSE_DONE);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Resolves the host of the url and builds the request.
+ *
+ * @param lg load generator
+ * @param url url
+ * @param port port
+ * @return int 0 on success -1 on failure
+ */
+static int loadgen_init(struct loadgen* lg, const char* url, const char* port)
+{
+    char host[strlen(url) + 1];
+    host_from_url(url, host);
+
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &ai) != 0) {
+        log_error("%s: could not resolve host", url);
+        return -1;
+    }
+    memcpy(&lg->addr, ai->ai_addr, ai->ai_addrlen);
+    lg->addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+
+    int len;
+    if (lg->upload > 0) {
+        len = snprintf(lg->req, sizeof(lg->req), "PUT %s %s\r\nHost: %s\r\nContent-Length: %lld\r\n%s\r\n",
+            file_path_from_url(url), PROTOCOL, host, lg->upload, lg->keep_alive ? "" : "Connection: close\r\n");
+    } else {
+        len = snprintf(lg->req, sizeof(lg->req), "GET %s %s\r\nHost: %s\r\n%s\r\n", file_path_from_url(url),
+            PROTOCOL, host, lg->keep_alive ? "" : "Connection: close\r\n");
+    }
+    if (len < 0 || (size_t)len >= sizeof(lg->req)) {
+        log_error("%s: url too long", url);
+        return -1;
+    }
+    lg->req_len = len;
+    return 0;
+}
+
+int loadgen_run(const char* url, const char* port, int connections, int requests, int keep_alive, int slow,
+    long long upload, struct loadgen_result* result)
+{
+    struct loadgen lg;
+    memset(result, 0, sizeof(struct loadgen_result));
+    hist_init(&result->latency);
+    lg.keep_alive = keep_alive;
+    lg.upload = upload;
+    lg.result = result;
+    if (loadgen_init(&lg, url, port) < 0) {
+        return -1;
+    }
+
+    lg.conns = calloc(connections, sizeof(struct lconn));
+    lg.slow = calloc(slow > 0 ? slow : 1, sizeof(struct slow));
+    lg.nslow = slow;
+    lg.upload_buf = upload > 0 ? calloc(1, LOADGEN_UPLOAD_CHUNK) : NULL;
+    lg.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (lg.conns == NULL || lg.slow == NULL || (upload > 0 && lg.upload_buf == NULL) || lg.epfd < 0) {
+        log_error("loadgen setup failed");
+        free(lg.conns);
+        free(lg.slow);
+        free(lg.upload_buf);
+        return -1;
+    }
+
+    // the slow connections are in place before the measured load starts
+    for (int i = 0; i < slow; i++) {
+        lg.slow[i].fd = -1;
+    }
+    slow_trickle(&lg);
+    lg.next_trickle = now_ns();
+
+    unsigned long long start = now_ns();
+    lg.active = connections;
+    for (int i = 0; i < connections; i++) {
+        lg.conns[i].fd = -1;
+        lg.conns[i].remaining = requests;
+        conn_next(&lg, &lg.conns[i]);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (lg.active > 0) {
+        if (lg.nslow > 0 && now_ns() >= lg.next_trickle) {
+            slow_trickle(&lg);
+            lg.next_trickle += SLOW_INTERVAL;
+        }
+        int n = epoll_wait(lg.epfd, events, MAX_EVENTS, lg.nslow > 0 ? 100 : -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            log_error("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct lconn* conn = &lg.conns[events[i].data.u64 & 0xffffffffu];
+            if (conn->fd < 0 || conn->gen != events[i].data.u64 >> 32) {
+                continue;
+            }
+            if (conn->state != LCONN_READING) {
+                conn_send(&lg, conn);
+            }
+            // the response may already be there when the request is sent
+            if (conn->fd >= 0 && conn->state == LCONN_READING && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                conn_read(&lg, conn);
+            }
+        }
+    }
+    result->seconds = (now_ns() - start) / 1e9;
+
+    for (int i = 0; i < connections; i++) {
+        conn_close(&lg, &lg.conns[i]);
+    }
+    for (int i = 0; i < slow; i++) {
+        if (lg.slow[i].fd >= 0) {
+            close(lg.slow[i].fd);
+        }
+    }
+    free(lg.conns);
+    free(lg.slow);
+    free(lg.upload_buf);
+    close(lg.epfd);
+    return 0;
+}
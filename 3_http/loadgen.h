@@ -0,0 +1,108 @@
+/**
+ * @file loadgen.h
+ * @author Lorenz Hörburger 12024737
+ * @brief HTTP load generator with a latency histogram
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef LOADGEN
+#define LOADGEN
+
+#define LOADGEN_BUF_SIZE (16384)
+#define LOADGEN_REQ_SIZE (4096)
+// bytes of an upload body passed to one send
+#define LOADGEN_UPLOAD_CHUNK (256 * 1024)
+
+// values below 2^HIST_SUB_BITS are recorded exactly, larger values with a
+// relative error below 2^-(HIST_SUB_BITS - 1)
+#define HIST_SUB_BITS (7)
+#define HIST_SUB_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_MAX_BITS (40)
+#define HIST_SIZE ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_SUB_HALF)
+
+/**
+ * @brief Log linear histogram in the style of HdrHistogram.
+ * Every power of two range is split into HIST_SUB_HALF buckets.
+ */
+struct hist {
+    unsigned long long counts[HIST_SIZE];
+    unsigned long long total;
+    unsigned long long min;
+    unsigned long long max;
+    long double sum;
+};
+
+struct loadgen_result {
+    // completed requests, including non 2xx responses
+    unsigned long long requests;
+    unsigned long long non_2xx;
+    // connect, send, receive or protocol errors
+    unsigned long long errors;
+    unsigned long long connects;
+    // received bytes including response heads
+    unsigned long long bytes;
+    // body bytes of the completed uploads
+    unsigned long long uploaded;
+    double seconds;
+    // slow connections closed or answered by the server
+    unsigned long long slow_closed;
+    // request latency in nanoseconds
+    struct hist latency;
+};
+
+/**
+ * @brief Resets the histogram
+ *
+ * @param hist histogram
+ */
+void hist_init(struct hist* hist);
+
+/**
+ * @brief Records a value. Values of 2^HIST_MAX_BITS or more are recorded
+ * as the largest value.
+ *
+ * @param hist histogram
+ * @param value value
+ */
+void hist_record(struct hist* hist, unsigned long long value);
+
+/**
+ * @brief Gets the value at the given percentile. The result is the
+ * highest value that is equivalent to the bucket of the percentile.
+ *
+ * @param hist histogram
+ * @param percentile percentile between 0 and 100
+ * @return unsigned long long value or 0 if the histogram is empty
+ */
+unsigned long long hist_percentile(const struct hist* hist, double percentile);
+
+/**
+ * @brief Sends GET requests, or PUT requests with an upload body of
+ * @code{upload} bytes, to @code{url} from @code{connections} parallel
+ * connections. Each connection sends @code{requests} requests one after
+ * another. With keep alive the requests reuse the connection, otherwise
+ * every request opens a new connection and sends Connection: close.
+ * The latency of a request is measured from sending (or connecting) until
+ * the whole response is received. Meanwhile @code{slow} further
+ * connections send a request head one byte per second that never ends,
+ * like a slowloris attack.
+ *
+ * @param url valid url
+ * @param port port of the server
+ * @param connections number of parallel connections
+ * @param requests number of requests per connection
+ * @param keep_alive 1 to reuse the connections
+ * @param slow number of slow connections
+ * @param upload length of the body of a PUT request, 0 to send GET
+ * requests
+ * @param result result
+ * @return int 0 on success -1 if the load could not be started
+ */
+int loadgen_run(const char* url, const char* port, int connections, int requests, int keep_alive, int slow,
+    long long upload, struct loadgen_result* result);
+
+#endif
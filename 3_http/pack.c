@@ -0,0 +1,677 @@
+/**
+ * @file pack.c
+ * @author Lorenz Hörburger 12024737
+ * @brief CLI which packs a docRoot into a static bundle
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "bundle.h"
+#include "common.h"
+#include "gzcache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define COPY_BUF_SIZE (64 * 1024)
+// page size, bodies start on a page unless they fit into the current one
+#define BODY_ALIGN (4096)
+#define HEAD_SIZE (512)
+// directories nested deeper are not packed, this also ends symlink loops
+#define MAX_DEPTH (32)
+// average number of paths sharing a displacement seed
+#define BUCKET_PATHS (4)
+
+struct options {
+    char* index;
+    char* docRoot;
+    char* bundle;
+};
+
+/**
+ * @brief File of the docRoot and where its representations were written.
+ */
+struct pfile {
+    char* path;
+    time_t mtime;
+    off_t size;
+    uint32_t flags;
+    struct bundle_variant plain;
+    struct bundle_variant gz;
+};
+
+/**
+ * @brief URL path served by a file. A directory with an index file has
+ * its own path next to the path of the index file.
+ */
+struct purl {
+    char* url;
+    size_t file;
+    uint64_t path;
+    uint64_t hash;
+};
+
+struct packer {
+    FILE* out;
+    // bytes written so far
+    uint64_t pos;
+    const char* index;
+    struct pfile* files;
+    size_t nfiles;
+    size_t files_cap;
+    struct purl* urls;
+    size_t nurls;
+    size_t urls_cap;
+};
+
+/**
+ * @brief Bucket of the perfect hash while it is built.
+ */
+struct pbucket {
+    uint32_t bucket;
+    // first of the paths in the sorted order and their number
+    uint32_t first;
+    uint32_t size;
+};
+
+/**
+ * @brief Prints the usage of the program.
+ *
+ */
+void usage(void)
+{
+    (void)fprintf(stderr, "Usage: %s [-i INDEX] DOC_ROOT BUNDLE\n", prg_name);
+}
+
+/**
+ * @brief Initializes the options of the program.
+ *
+ * @param argc argument counter
+ * @param argv argument vector
+ * @return struct options options
+ */
+static struct options init_options(int argc, char** argv)
+{
+    struct options opts;
+    opts.index = "index.html";
+    int opt_i = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:")) != -1) {
+        switch (opt) {
+        case 'i':
+            opt_i += 1;
+            opts.index = optarg;
+            break;
+        default:
+            usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (opt_i > 1 || argc - optind != 2) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    opts.docRoot = argv[optind];
+    opts.bundle = argv[optind + 1];
+    return opts;
+}
+
+/**
+ * @brief Gets the media type of a file from its extension.
+ *
+ * @param path file path
+ * @return const char* media type or NULL if it is unknown
+ */
+static const char* content_type(const char* path)
+{
+    static const char* const types[][2] = {
+        { ".html", "text/html; charset=utf-8" }, { ".htm", "text/html; charset=utf-8" },
+        { ".css", "text/css; charset=utf-8" }, { ".js", "text/javascript; charset=utf-8" },
+        { ".json", "application/json" }, { ".txt", "text/plain; charset=utf-8" },
+        { ".md", "text/markdown; charset=utf-8" }, { ".csv", "text/csv; charset=utf-8" },
+        { ".svg", "image/svg+xml" }, { ".xml", "application/xml" }, { ".png", "image/png" },
+        { ".jpg", "image/jpeg" }, { ".jpeg", "image/jpeg" }, { ".gif", "image/gif" }, { ".webp", "image/webp" },
+        { ".ico", "image/x-icon" }, { ".woff2", "font/woff2" }, { ".pdf", "application/pdf" },
+        { ".wasm", "application/wasm" }, { ".gz", "application/gzip" }
+    };
+    const char* ext = strrchr(path, '.');
+    if (ext == NULL || strchr(ext, '/') != NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcasecmp(ext, types[i][0]) == 0) {
+            return types[i][1];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Grows an array by one element if it is full.
+ *
+ * @param array array
+ * @param len used elements
+ * @param cap allocated elements
+ * @param size size of an element
+ */
+static void grow(void** array, size_t len, size_t* cap, size_t size)
+{
+    if (len < *cap) {
+        return;
+    }
+    *cap = *cap > 0 ? *cap * 2 : 64;
+    void* grown = realloc(*array, *cap * size);
+    if (grown == NULL) {
+        log_error("realloc failed");
+        exit(EXIT_FAILURE);
+    }
+    *array = grown;
+}
+
+/**
+ * @brief Adds a URL path served by a file.
+ *
+ * @param packer packer
+ * @param url URL path, owned by the packer
+ * @param file index of the file
+ */
+static void add_url(struct packer* packer, char* url, size_t file)
+{
+    grow((void**)&packer->urls, packer->nurls, &packer->urls_cap, sizeof(struct purl));
+    struct purl* purl = &packer->urls[packer->nurls++];
+    purl->url = url;
+    purl->file = file;
+    purl->hash = bundle_hash(url, strlen(url));
+}
+
+/**
+ * @brief Joins two path components.
+ *
+ * @param a first component
+ * @param b second component
+ * @return char* joined path to free
+ */
+static char* join(const char* a, const char* b)
+{
+    size_t len = strlen(a) + strlen(b) + 2;
+    char* path = malloc(len);
+    if (path == NULL) {
+        log_error("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(path, len, "%s%s%s", a, a[0] != '\0' && a[strlen(a) - 1] == '/' ? "" : "/", b);
+    return path;
+}
+
+/**
+ * @brief Collects the regular files below a directory in sorted order, so
+ * the same docRoot always gives the same bundle.
+ *
+ * @param packer packer
+ * @param dir directory on the file system
+ * @param url URL path of the directory ending with /
+ * @param depth nesting of the directory
+ */
+static void collect(struct packer* packer, const char* dir, const char* url, int depth)
+{
+    struct dirent** names;
+    int n = scandir(dir, &names, NULL, alphasort);
+    if (n < 0) {
+        log_error("Reading the directory %s failed: %s", dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < n; i++) {
+        const char* name = names[i]->d_name;
+        struct stat st;
+        char* path = join(dir, name);
+        char* file_url = join(url, name);
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || stat(path, &st) < 0) {
+            free(path);
+            free(file_url);
+        } else if (S_ISDIR(st.st_mode)) {
+            if (depth < MAX_DEPTH) {
+                char* dir_url = join(file_url, "");
+                collect(packer, path, dir_url, depth + 1);
+                free(dir_url);
+            }
+            free(path);
+            free(file_url);
+        } else if (S_ISREG(st.st_mode)) {
+            grow((void**)&packer->files, packer->nfiles, &packer->files_cap, sizeof(struct pfile));
+            struct pfile* file = &packer->files[packer->nfiles];
+            memset(file, 0, sizeof(*file));
+            file->path = path;
+            file->mtime = st.st_mtime;
+            file->size = st.st_size;
+            if (strcmp(name, packer->index) == 0) {
+                // the directory itself serves its index file
+                char* dir_url = strdup(url);
+                if (dir_url == NULL) {
+                    log_error("strdup failed");
+                    exit(EXIT_FAILURE);
+                }
+                add_url(packer, dir_url, packer->nfiles);
+            }
+            add_url(packer, file_url, packer->nfiles);
+            packer->nfiles++;
+        } else {
+            free(path);
+            free(file_url);
+        }
+        free(names[i]);
+    }
+    free(names);
+}
+
+/**
+ * @brief Writes bytes to the bundle.
+ *
+ * @param packer packer
+ * @param data bytes
+ * @param len number of bytes
+ * @return uint64_t offset the bytes were written to
+ */
+static uint64_t emit(struct packer* packer, const void* data, size_t len)
+{
+    uint64_t offset = packer->pos;
+    if (len > 0 && fwrite(data, 1, len, packer->out) != len) {
+        log_error("Writing the bundle failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    packer->pos += len;
+    return offset;
+}
+
+/**
+ * @brief Pads the bundle with zeros up to the next multiple of
+ * @code{align}.
+ *
+ * @param packer packer
+ * @param align alignment, at most BODY_ALIGN
+ */
+static void pad(struct packer* packer, size_t align)
+{
+    static const char zeros[BODY_ALIGN];
+    emit(packer, zeros, (align - packer->pos % align) % align);
+}
+
+/**
+ * @brief Copies a file into the bundle.
+ *
+ * @param packer packer
+ * @param path file on the file system
+ * @param size expected size of the file
+ * @return uint64_t offset of the copy
+ */
+static uint64_t emit_file(struct packer* packer, const char* path, off_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Opening %s failed: %s", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    static char buf[COPY_BUF_SIZE];
+    uint64_t offset = packer->pos;
+    off_t copied = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        emit(packer, buf, n);
+        copied += n;
+    }
+    close(fd);
+    if (n < 0 || copied != size) {
+        log_error("%s changed while it was packed", path);
+        exit(EXIT_FAILURE);
+    }
+    return offset;
+}
+
+/**
+ * @brief Reads a whole file into memory.
+ *
+ * @param path file on the file system
+ * @param size size of the file
+ * @return char* content to free or NULL on failure
+ */
+static char* read_file(const char* path, off_t size)
+{
+    char* data = malloc(size > 0 ? size : 1);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (data == NULL || fd < 0 || read(fd, data, size) != size) {
+        free(data);
+        data = NULL;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return data;
+}
+
+/**
+ * @brief Writes the header lines of a representation.
+ *
+ * @param packer packer
+ * @param variant representation, the etag must be set
+ * @param file file
+ * @param gz 1 for the gzip representation
+ */
+static void emit_head(struct packer* packer, struct bundle_variant* variant, const struct pfile* file, int gz)
+{
+    char head[HEAD_SIZE];
+    char date[64];
+    format_http_date(file->mtime, date, sizeof(date));
+    const char* type = content_type(file->path);
+    int len = 0;
+    if (type != NULL) {
+        len += snprintf(head, sizeof(head), "Content-Type: %s\r\n", type);
+    }
+    len += snprintf(head + len, sizeof(head) - len, "Last-Modified: %s\r\nETag: %s\r\n", date, variant->etag);
+    if (gz) {
+        len += snprintf(head + len, sizeof(head) - len, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+    } else {
+        len += snprintf(head + len, sizeof(head) - len, "Accept-Ranges: bytes\r\n%s",
+            is_compressible(file->path) ? "Vary: Accept-Encoding\r\n" : "");
+    }
+    variant->head = emit(packer, head, len);
+    variant->head_len = len;
+}
+
+/**
+ * @brief Writes the gzip representation of a file. A precompressed
+ * sibling @code{path}.gz which is not older is taken as is, other
+ * compressible files are compressed like the gzip cache does.
+ *
+ * @param packer packer
+ * @param file file
+ */
+static void emit_gz(struct packer* packer, struct pfile* file)
+{
+    if (!is_compressible(file->path)) {
+        return;
+    }
+    char* sibling = malloc(strlen(file->path) + sizeof(".gz"));
+    if (sibling == NULL) {
+        log_error("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(sibling, "%s.gz", file->path);
+    struct stat st;
+    if (stat(sibling, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime >= file->mtime) {
+        file->gz.body = emit_file(packer, sibling, st.st_size);
+        file->gz.body_len = st.st_size;
+        file->flags |= BUNDLE_GZIP;
+    } else if (file->size >= GZCACHE_MIN_FILE && file->size <= GZCACHE_MAX_PACK_FILE) {
+        char* data = read_file(file->path, file->size);
+        size_t len;
+        char* compressed = data != NULL ? gzcache_compress(data, file->size, &len) : NULL;
+        if (compressed != NULL) {
+            file->gz.body = emit(packer, compressed, len);
+            file->gz.body_len = len;
+            file->flags |= BUNDLE_GZIP;
+        }
+        free(compressed);
+        free(data);
+    }
+    free(sibling);
+
+    if (file->flags & BUNDLE_GZIP) {
+        snprintf(file->gz.etag, sizeof(file->gz.etag), "\"%llx-%llx-gz\"", (long long)file->mtime, (long long)file->size);
+        emit_head(packer, &file->gz, file, 1);
+    }
+}
+
+/**
+ * @brief Orders buckets by decreasing size.
+ *
+ * @param a first bucket
+ * @param b second bucket
+ * @return int comparison result
+ */
+static int bucket_cmp(const void* a, const void* b)
+{
+    const struct pbucket* x = a;
+    const struct pbucket* y = b;
+    if (x->size != y->size) {
+        return x->size < y->size ? 1 : -1;
+    }
+    return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+/**
+ * @brief Builds a minimal perfect hash by hash and displace. The largest
+ * buckets pick their seeds first while most slots are still free.
+ *
+ * @param hashes hashes of the paths
+ * @param count number of paths
+ * @param nbuckets number of buckets
+ * @param seeds seed of every bucket
+ * @param slots slot of every path
+ * @return int 0 on success -1 if some bucket found no seed
+ */
+static int build_index(const uint64_t* hashes, uint32_t count, uint32_t nbuckets, uint32_t* seeds, uint32_t* slots)
+{
+    struct pbucket* buckets = calloc(nbuckets, sizeof(struct pbucket));
+    uint32_t* order = malloc(count * sizeof(uint32_t));
+    char* taken = calloc(count, 1);
+    if (buckets == NULL || order == NULL || taken == NULL) {
+        log_error("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // counting sort of the paths by bucket
+    for (uint32_t i = 0; i < count; i++) {
+        buckets[bundle_bucket(hashes[i], nbuckets)].size++;
+    }
+    uint32_t first = 0;
+    for (uint32_t b = 0; b < nbuckets; b++) {
+        buckets[b].bucket = b;
+        buckets[b].first = first;
+        first += buckets[b].size;
+        buckets[b].size = 0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        struct pbucket* bucket = &buckets[bundle_bucket(hashes[i], nbuckets)];
+        order[bucket->first + bucket->size++] = i;
+    }
+    qsort(buckets, nbuckets, sizeof(struct pbucket), bucket_cmp);
+
+    int res = 0;
+    uint32_t max_seed = count * 64 + 1024;
+    for (uint32_t b = 0; b < nbuckets && res == 0; b++) {
+        struct pbucket* bucket = &buckets[b];
+        seeds[bucket->bucket] = 0;
+        if (bucket->size == 0) {
+            continue;
+        }
+        uint32_t seed;
+        for (seed = 0; seed < max_seed; seed++) {
+            // claim the slots, undo on a collision
+            uint32_t k;
+            for (k = 0; k < bucket->size; k++) {
+                uint32_t i = order[bucket->first + k];
+                slots[i] = bundle_slot(hashes[i], seed, count);
+                if (taken[slots[i]]) {
+                    break;
+                }
+                taken[slots[i]] = 1;
+            }
+            if (k == bucket->size) {
+                break;
+            }
+            while (k-- > 0) {
+                taken[slots[order[bucket->first + k]]] = 0;
+            }
+        }
+        if (seed == max_seed) {
+            res = -1;
+        }
+        seeds[bucket->bucket] = seed;
+    }
+    free(buckets);
+    free(order);
+    free(taken);
+    return res;
+}
+
+/**
+ * @brief Writes the perfect hash and the entries in slot order.
+ *
+ * @param packer packer
+ * @param header header to fill
+ */
+static void emit_index(struct packer* packer, struct bundle_header* header)
+{
+    uint32_t count = packer->nurls;
+    uint32_t nbuckets = count / BUCKET_PATHS + 1;
+    uint64_t* hashes = malloc((count + 1) * sizeof(uint64_t));
+    uint32_t* slots = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t* seeds = NULL;
+    if (hashes == NULL || slots == NULL) {
+        log_error("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        hashes[i] = packer->urls[i].hash;
+    }
+    while (1) {
+        free(seeds);
+        seeds = malloc(nbuckets * sizeof(uint32_t));
+        if (seeds == NULL) {
+            log_error("malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        if (build_index(hashes, count, nbuckets, seeds, slots) == 0) {
+            break;
+        }
+        // more buckets leave fewer paths per seed to place
+        nbuckets *= 2;
+    }
+
+    struct bundle_entry* entries = calloc(count + 1, sizeof(struct bundle_entry));
+    if (entries == NULL) {
+        log_error("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        const struct purl* purl = &packer->urls[i];
+        const struct pfile* file = &packer->files[purl->file];
+        struct bundle_entry* entry = &entries[slots[i]];
+        entry->path = purl->path;
+        entry->path_len = strlen(purl->url);
+        entry->flags = file->flags;
+        entry->mtime = file->mtime;
+        entry->plain = file->plain;
+        entry->gz = file->gz;
+    }
+
+    pad(packer, sizeof(uint64_t));
+    header->seeds = emit(packer, seeds, nbuckets * sizeof(uint32_t));
+    pad(packer, sizeof(uint64_t));
+    header->entries = emit(packer, entries, count * sizeof(struct bundle_entry));
+    header->count = count;
+    header->nbuckets = nbuckets;
+    free(entries);
+    free(seeds);
+    free(slots);
+    free(hashes);
+}
+
+/**
+ * @brief Main method of the pack CLI. The bundle is written to a
+ * temporary file first and renamed, so a server never maps a half
+ * written bundle.
+ *
+ * @param argc argument counter
+ * @param argv argument vector
+ * @return int exit status
+ */
+int main(int argc, char** argv)
+{
+    prg_name = argv[0];
+    struct options opts = init_options(argc, argv);
+
+    struct packer packer;
+    memset(&packer, 0, sizeof(packer));
+    packer.index = opts.index;
+    collect(&packer, opts.docRoot, "/", 0);
+
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", opts.bundle) >= (int)sizeof(tmp)) {
+        log_error("Bundle path too long");
+        exit(EXIT_FAILURE);
+    }
+    packer.out = fopen(tmp, "w");
+    if (packer.out == NULL) {
+        log_error("Creating %s failed: %s", tmp, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct bundle_header header;
+    memset(&header, 0, sizeof(header));
+    emit(&packer, &header, sizeof(header));
+
+    unsigned long long plain_bytes = 0;
+    unsigned long long gz_bytes = 0;
+    size_t ngz = 0;
+    for (size_t i = 0; i < packer.nfiles; i++) {
+        struct pfile* file = &packer.files[i];
+        snprintf(file->plain.etag, sizeof(file->plain.etag), "\"%llx-%llx\"", (long long)file->mtime, (long long)file->size);
+        emit_head(&packer, &file->plain, file, 0);
+        // sendfile sends an unaligned body in more and smaller segments
+        if (packer.pos % BODY_ALIGN + file->size > BODY_ALIGN) {
+            pad(&packer, BODY_ALIGN);
+        }
+        file->plain.body = emit_file(&packer, file->path, file->size);
+        file->plain.body_len = file->size;
+        emit_gz(&packer, file);
+        plain_bytes += file->size;
+        if (file->flags & BUNDLE_GZIP) {
+            gz_bytes += file->gz.body_len;
+            ngz++;
+        }
+    }
+    for (size_t i = 0; i < packer.nurls; i++) {
+        packer.urls[i].path = emit(&packer, packer.urls[i].url, strlen(packer.urls[i].url));
+    }
+    emit_index(&packer, &header);
+
+    memcpy(header.magic, BUNDLE_MAGIC, BUNDLE_MAGIC_SIZE);
+    header.size = packer.pos;
+    if (fseek(packer.out, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, packer.out) != 1
+        || fflush(packer.out) != 0 || fsync(fileno(packer.out)) < 0 || fclose(packer.out) != 0) {
+        log_error("Writing the bundle failed: %s", strerror(errno));
+        unlink(tmp);
+        exit(EXIT_FAILURE);
+    }
+    if (rename(tmp, opts.bundle) < 0) {
+        log_error("Renaming %s failed: %s", tmp, strerror(errno));
+        unlink(tmp);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%zu files, %zu paths, %llu bytes, %zu gzip variants with %llu bytes, %u seeds\n", packer.nfiles,
+        packer.nurls, plain_bytes, ngz, gz_bytes, header.nbuckets);
+    for (size_t i = 0; i < packer.nfiles; i++) {
+        free(packer.files[i].path);
+    }
+    for (size_t i = 0; i < packer.nurls; i++) {
+        free(packer.urls[i].url);
+    }
+    free(packer.files);
+    free(packer.urls);
+    exit(EXIT_SUCCESS);
+    return 0;
+}
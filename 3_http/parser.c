@@ -0,0 +1,354 @@
+/**
+ * @file parser.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Incremental HTTP request/response head parser and body framing
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "parser.h"
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * @brief Checks if @code{c} may be part of a token (RFC 7230 tchar)
+ *
+ * @param c character
+ * @return int 1 if c is a tchar else 0
+ */
+static int is_tchar(char c)
+{
+    return isalnum((unsigned char)c) || (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+/**
+ * @brief Parses the request line: Method SP Path SP Version. The path
+ * must be in origin form (/path) or, for proxies, in absolute form
+ * (http://host/path).
+ *
+ * @param parser parser
+ * @param line line without line ending
+ * @param len length of line
+ * @return int 0 on success -1 if malformed
+ */
+static int parse_start_line(struct parser* parser, const char* line, size_t len)
+{
+    size_t i = 0;
+    while (i < len && is_tchar(line[i])) {
+        i++;
+    }
+    if (i == 0 || i == len || line[i] != ' ') {
+        return -1;
+    }
+    parser->method.ptr = line;
+    parser->method.len = i;
+
+    size_t start = ++i;
+    while (i < len && line[i] != ' ') {
+        if (iscntrl((unsigned char)line[i])) {
+            return -1;
+        }
+        i++;
+    }
+    if (i == start || i == len) {
+        return -1;
+    }
+    if (line[start] != '/' && (i - start < 7 || strncasecmp(line + start, "http://", 7) != 0)) {
+        return -1;
+    }
+    parser->path.ptr = line + start;
+    parser->path.len = i - start;
+
+    start = ++i;
+    if (len - start != 8 || strncmp(line + start, "HTTP/", 5) != 0) {
+        return -1;
+    }
+    parser->version.ptr = line + start;
+    parser->version.len = len - start;
+    return 0;
+}
+
+/**
+ * @brief Parses the status line: Version SP Status SP Reason
+ *
+ * @param parser parser
+ * @param line line without line ending
+ * @param len length of line
+ * @return int 0 on success -1 if malformed
+ */
+static int parse_status_line(struct parser* parser, const char* line, size_t len)
+{
+    if (len < 12 || strncmp(line, "HTTP/", 5) != 0 || line[8] != ' ') {
+        return -1;
+    }
+    parser->version.ptr = line;
+    parser->version.len = 8;
+
+    parser->status = 0;
+    for (int i = 9; i < 12; i++) {
+        if (!isdigit((unsigned char)line[i])) {
+            return -1;
+        }
+        parser->status = parser->status * 10 + line[i] - '0';
+    }
+
+    if (len > 12 && line[12] != ' ') {
+        return -1;
+    }
+    parser->reason.ptr = line + (len > 12 ? 13 : 12);
+    parser->reason.len = len > 12 ? len - 13 : 0;
+    return 0;
+}
+
+/**
+ * @brief Parses a header line: Name ":" OWS Value OWS
+ *
+ * @param parser parser
+ * @param line line without line ending
+ * @param len length of line
+ * @return int 0 on success -1 if malformed
+ */
+static int parse_header_line(struct parser* parser, const char* line, size_t len)
+{
+    if (parser->nheaders == PARSER_MAX_HEADERS) {
+        return -1;
+    }
+
+    size_t i = 0;
+    while (i < len && is_tchar(line[i])) {
+        i++;
+    }
+    if (i == 0 || i == len || line[i] != ':') {
+        return -1;
+    }
+
+    struct header* header = &parser->headers[parser->nheaders++];
+    header->name.ptr = line;
+    header->name.len = i;
+
+    i++;
+    while (i < len && (line[i] == ' ' || line[i] == '\t')) {
+        i++;
+    }
+    while (len > i && (line[len - 1] == ' ' || line[len - 1] == '\t')) {
+        len--;
+    }
+    header->value.ptr = line + i;
+    header->value.len = len - i;
+    return 0;
+}
+
+void parser_init(struct parser* parser)
+{
+    parser->state = PARSER_REQ_LINE;
+    parser->response = 0;
+    parser->pos = 0;
+    parser->scan = 0;
+    parser->nheaders = 0;
+}
+
+void parser_init_res(struct parser* parser)
+{
+    parser_init(parser);
+    parser->response = 1;
+}
+
+int parser_parse(struct parser* parser, const char* buf, size_t len)
+{
+    while (parser->state != PARSER_DONE) {
+        const char* nl = memchr(buf + parser->scan, '\n', len - parser->scan);
+        if (nl == NULL) {
+            parser->scan = len;
+            return PARSE_AGAIN;
+        }
+
+        const char* line = buf + parser->pos;
+        size_t line_len = nl - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') {
+            line_len--;
+        }
+        parser->pos = nl + 1 - buf;
+        parser->scan = parser->pos;
+
+        if (parser->state == PARSER_REQ_LINE) {
+            // ignore empty lines before the request line
+            if (line_len == 0) {
+                continue;
+            }
+            int res = parser->response ? parse_status_line(parser, line, line_len)
+                                       : parse_start_line(parser, line, line_len);
+            if (res < 0) {
+                return PARSE_ERROR;
+            }
+            parser->state = PARSER_HEADERS;
+        } else if (line_len == 0) {
+            parser->state = PARSER_DONE;
+        } else if (parse_header_line(parser, line, line_len) < 0) {
+            return PARSE_ERROR;
+        }
+    }
+    return PARSE_DONE;
+}
+
+int slice_eq(struct slice slice, const char* str)
+{
+    return strlen(str) == slice.len && strncasecmp(slice.ptr, str, slice.len) == 0;
+}
+
+int slice_to_ll(struct slice slice, long long* value)
+{
+    if (slice.len == 0) {
+        return -1;
+    }
+    *value = 0;
+    for (size_t i = 0; i < slice.len; i++) {
+        if (!isdigit((unsigned char)slice.ptr[i]) || *value > (LLONG_MAX - 9) / 10) {
+            return -1;
+        }
+        *value = *value * 10 + slice.ptr[i] - '0';
+    }
+    return 0;
+}
+
+const struct slice* parser_header(const struct parser* parser, const char* name)
+{
+    for (size_t i = 0; i < parser->nheaders; i++) {
+        if (slice_eq(parser->headers[i].name, name)) {
+            return &parser->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+int body_init(struct body* body, const struct parser* parser)
+{
+    body->chunk = CHUNK_SIZE;
+    body->remaining = 0;
+
+    const struct slice* te = parser_header(parser, "Transfer-Encoding");
+    const struct slice* cl = parser_header(parser, "Content-Length");
+    if (te != NULL) {
+        // chunked must be the last and only supported coding
+        body->mode = BODY_CHUNKED;
+        return slice_eq(*te, "chunked") ? 0 : -1;
+    }
+    if (cl != NULL) {
+        body->mode = BODY_LENGTH;
+        return slice_to_ll(*cl, &body->remaining);
+    }
+    if (parser->response && parser->status >= 200 && parser->status != 204 && parser->status != 304) {
+        body->mode = BODY_UNTIL_CLOSE;
+    } else {
+        body->mode = BODY_NONE;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses the next step of the chunked framing
+ *
+ * @param body body framing
+ * @param buf received bytes
+ * @param len number of bytes in @code{buf}
+ * @param consumed number of bytes consumed
+ * @param data body data within @code{buf}
+ * @return int PARSE_DONE, PARSE_AGAIN or PARSE_ERROR
+ */
+static int chunk_next(struct body* body, const char* buf, size_t len, size_t* consumed, struct slice* data)
+{
+    if (body->chunk == CHUNK_DATA) {
+        size_t n = len < (unsigned long long)body->remaining ? len : (size_t)body->remaining;
+        data->len = n;
+        *consumed = n;
+        body->remaining -= n;
+        if (body->remaining == 0) {
+            body->chunk = CHUNK_DATA_END;
+        }
+        return PARSE_AGAIN;
+    }
+
+    // all other states consume whole lines
+    const char* nl = memchr(buf, '\n', len);
+    if (nl == NULL) {
+        return PARSE_AGAIN;
+    }
+    size_t line_len = nl - buf;
+    if (line_len > 0 && buf[line_len - 1] == '\r') {
+        line_len--;
+    }
+    *consumed = nl + 1 - buf;
+
+    if (body->chunk == CHUNK_SIZE) {
+        long long size = 0;
+        size_t i = 0;
+        for (; i < line_len && isxdigit((unsigned char)buf[i]); i++) {
+            if (size > (LLONG_MAX >> 4)) {
+                return PARSE_ERROR;
+            }
+            int c = tolower((unsigned char)buf[i]);
+            size = size * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+        }
+        // chunk extensions are ignored
+        if (i == 0 || (i < line_len && buf[i] != ';' && buf[i] != ' ' && buf[i] != '\t')) {
+            return PARSE_ERROR;
+        }
+        body->remaining = size;
+        body->chunk = size == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+    } else if (body->chunk == CHUNK_DATA_END) {
+        if (line_len != 0) {
+            return PARSE_ERROR;
+        }
+        body->chunk = CHUNK_SIZE;
+    } else if (line_len == 0) {
+        // empty line ends the trailer
+        return PARSE_DONE;
+    }
+    return PARSE_AGAIN;
+}
+
+int body_next(struct body* body, const char* buf, size_t len, size_t* consumed, struct slice* data)
+{
+    data->ptr = buf;
+    data->len = 0;
+    *consumed = 0;
+
+    switch (body->mode) {
+    case BODY_NONE:
+        return PARSE_DONE;
+    case BODY_LENGTH:
+        if (body->remaining == 0) {
+            return PARSE_DONE;
+        }
+        data->len = len < (unsigned long long)body->remaining ? len : (size_t)body->remaining;
+        *consumed = data->len;
+        body->remaining -= data->len;
+        return body->remaining == 0 ? PARSE_DONE : PARSE_AGAIN;
+    case BODY_UNTIL_CLOSE:
+        data->len = len;
+        *consumed = len;
+        return PARSE_AGAIN;
+    default:
+        return chunk_next(body, buf, len, consumed, data);
+    }
+}
+
+long long body_data_left(const struct body* body)
+{
+    if (body->mode == BODY_LENGTH || (body->mode == BODY_CHUNKED && body->chunk == CHUNK_DATA)) {
+        return body->remaining;
+    }
+    return 0;
+}
+
+void body_skip(struct body* body, long long n)
+{
+    body->remaining -= n;
+    if (body->mode == BODY_CHUNKED && body->remaining == 0) {
+        body->chunk = CHUNK_DATA_END;
+    }
+}
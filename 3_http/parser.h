@@ -0,0 +1,190 @@
+/**
+ * @file parser.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Incremental HTTP request/response head parser and body framing
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef PARSER
+#define PARSER
+
+#include <stddef.h>
+
+#define PARSER_MAX_HEADERS (32)
+
+#define PARSE_ERROR (-1)
+#define PARSE_AGAIN (0)
+#define PARSE_DONE (1)
+
+/**
+ * @brief Part of the parsed buffer. Not 0 terminated.
+ */
+struct slice {
+    const char* ptr;
+    size_t len;
+};
+
+struct header {
+    struct slice name;
+    struct slice value;
+};
+
+enum parser_state {
+    PARSER_REQ_LINE,
+    PARSER_HEADERS,
+    PARSER_DONE
+};
+
+/**
+ * @brief State of one request or response head. The parser does not
+ * allocate or copy, all slices point into the buffer given to parser_parse.
+ * It holds no global state and can be used by several threads at once.
+ */
+struct parser {
+    enum parser_state state;
+    int response;
+    // start of the next unparsed line
+    size_t pos;
+    // bytes already searched for the end of the line
+    size_t scan;
+    struct slice method;
+    struct slice path;
+    struct slice version;
+    // only set for responses
+    int status;
+    struct slice reason;
+    struct header headers[PARSER_MAX_HEADERS];
+    size_t nheaders;
+};
+
+enum body_mode {
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    BODY_UNTIL_CLOSE
+};
+
+enum chunk_state {
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER
+};
+
+/**
+ * @brief Framing of a message body (Content-Length, chunked or until the
+ * connection is closed).
+ */
+struct body {
+    enum body_mode mode;
+    enum chunk_state chunk;
+    // bytes left of the body or of the current chunk
+    long long remaining;
+};
+
+/**
+ * @brief Resets the parser for a new request.
+ * 
+ * @param parser parser
+ */
+void parser_init(struct parser* parser);
+
+/**
+ * @brief Resets the parser for a new response.
+ * 
+ * @param parser parser
+ */
+void parser_init_res(struct parser* parser);
+
+/**
+ * @brief Parses the request head in @code{buf}. If the head is incomplete
+ * the call can be repeated with the same buffer once more data has been
+ * appended, parsing resumes where it stopped. The buffer must not move
+ * between calls.
+ * 
+ * @param parser parser
+ * @param buf buffer with the received data
+ * @param len number of bytes in @code{buf}
+ * @return int PARSE_DONE if the head is complete (its length is
+ * @code{parser->pos}), PARSE_AGAIN if more data is needed or PARSE_ERROR
+ * if the head is malformed
+ */
+int parser_parse(struct parser* parser, const char* buf, size_t len);
+
+/**
+ * @brief Gets the value of a parsed header
+ * 
+ * @param parser parser with a complete head
+ * @param name header name, compared case insensitive
+ * @return const struct slice* value or NULL if the header is missing
+ */
+const struct slice* parser_header(const struct parser* parser, const char* name);
+
+/**
+ * @brief Sets up the body framing from the Transfer-Encoding and
+ * Content-Length headers of a parsed head. Requests without these headers
+ * have no body, responses are read until the connection closes.
+ * 
+ * @param body body framing
+ * @param parser parser with a complete head
+ * @return int 0 on success -1 if the headers are invalid
+ */
+int body_init(struct body* body, const struct parser* parser);
+
+/**
+ * @brief Gets the next body data of @code{buf}. Chunk framing is skipped.
+ * Call repeatedly, data may be empty if only framing was consumed.
+ * 
+ * @param body body framing
+ * @param buf received bytes following the head
+ * @param len number of bytes in @code{buf}
+ * @param consumed number of bytes of @code{buf} which were consumed
+ * @param data body data within @code{buf}
+ * @return int PARSE_DONE if the body is complete, PARSE_AGAIN if more data
+ * is needed or PARSE_ERROR if the chunk framing is malformed
+ */
+int body_next(struct body* body, const char* buf, size_t len, size_t* consumed, struct slice* data);
+
+/**
+ * @brief Gets the number of body bytes which directly follow, without
+ * any framing in between. They may be moved past the parser, e.g. with
+ * splice, and skipped with body_skip.
+ * 
+ * @param body body framing
+ * @return long long bytes of the body or of the current chunk, 0 if
+ * framing follows or the length is unknown
+ */
+long long body_data_left(const struct body* body);
+
+/**
+ * @brief Skips @code{n} body bytes which were received without
+ * body_next.
+ * 
+ * @param body body framing
+ * @param n number of bytes, at most body_data_left
+ */
+void body_skip(struct body* body, long long n);
+
+/**
+ * @brief Parses a non negative decimal number
+ * 
+ * @param slice digits
+ * @param value parsed number
+ * @return int 0 on success -1 if invalid
+ */
+int slice_to_ll(struct slice slice, long long* value);
+
+/**
+ * @brief Compares a slice case insensitive with a string
+ * 
+ * @param slice slice
+ * @param str 0 terminated string
+ * @return int 1 if equal else 0
+ */
+int slice_eq(struct slice slice, const char* str);
+
+#endif
@@ -0,0 +1,776 @@
+/**
+ * @file proxy.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Caching forward proxy
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "proxy.h"
+#include "common.h"
+#include "httpc.h"
+#include "parser.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROXY_BUCKETS (4096)
+#define PORT_SIZE (8)
+
+enum pentry_state {
+    PENTRY_FETCHING,
+    PENTRY_DONE,
+    PENTRY_FAILED
+};
+
+/**
+ * @brief Response of one URL. The cache file is written by a fetcher
+ * while requests already send the part written so far.
+ */
+struct pentry {
+    char* url;
+    unsigned int id;
+    enum pentry_state state;
+    // cache file, -1 until the fetcher created it
+    int fd;
+    // upstream status, 0 until the head was received
+    unsigned int status;
+    // forwarded header lines each terminated by \r\n
+    char head[PROXY_HEAD_SIZE];
+    size_t head_len;
+    // length of the body, -1 until known
+    off_t len;
+    // bytes of the body written to fd
+    off_t written;
+    // kept once complete
+    int cacheable;
+    // cached responses are served until then and fetched again afterwards
+    time_t expires;
+    // references of the table, the fetch and the requests
+    unsigned int refs;
+    // set while in the least recently used list
+    int lru;
+    // eventfds of the event loops waiting for progress
+    int* wake;
+    size_t nwake;
+    size_t wake_size;
+    struct pentry* hnext;
+    // least recently used list, only complete entries
+    struct pentry* prev;
+    struct pentry* next;
+    // queue of the fetchers
+    struct pentry* qnext;
+};
+
+/**
+ * @brief Stream of a response whose entry is still being fetched.
+ */
+struct pstream {
+    struct pentry* entry;
+    int wake_fd;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct pentry* buckets[PROXY_BUCKETS];
+// least recently used entries are at the tail
+static struct pentry* lru_head = NULL;
+static struct pentry* lru_tail = NULL;
+static struct pentry* queue_head = NULL;
+static struct pentry* queue_tail = NULL;
+// bytes of the complete cached entries
+static size_t cache_size = 0;
+static size_t cache_max = PROXY_CACHE_MAX;
+static char* cache_dir = NULL;
+static unsigned int next_id = 0;
+static int closing = 0;
+
+/**
+ * @brief FNV-1a hash of a URL
+ *
+ * @param url 0 terminated URL
+ * @return uint32_t hash
+ */
+static uint32_t hash_url(const char* url)
+{
+    uint32_t hash = 2166136261u;
+    for (; *url != '\0'; url++) {
+        hash ^= (unsigned char)*url;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Splits an absolute URL into the URL without port used by httpc
+ * and the port.
+ *
+ * @param url absolute http:// URL
+ * @param out URL without port, the path starts with /
+ * @param size size of @code{out}
+ * @param port port, 80 if the URL has none
+ * @return int 0 on success -1 if the URL is invalid
+ */
+static int split_url(const char* url, char* out, size_t size, char* port)
+{
+    if (strncmp(url, "http://", 7) != 0) {
+        return -1;
+    }
+    const char* host = url + 7;
+    const char* path = host + strcspn(host, "/?#");
+    const char* colon = memchr(host, ':', path - host);
+    const char* host_end = colon != NULL ? colon : path;
+    // httpc takes everything up to the first of these as the host
+    if (host_end == host || strcspn(host, ";?:@=&") < (size_t)(host_end - host)) {
+        return -1;
+    }
+
+    strcpy(port, "80");
+    if (colon != NULL) {
+        size_t len = path - colon - 1;
+        if (len == 0 || len >= PORT_SIZE || strspn(colon + 1, "0123456789") < len) {
+            return -1;
+        }
+        memcpy(port, colon + 1, len);
+        port[len] = '\0';
+        if (!is_port_valid(port)) {
+            return -1;
+        }
+    }
+
+    int len = snprintf(out, size, "http://%.*s%s%s", (int)(host_end - host), host, *path == '/' ? "" : "/", path);
+    return len > 0 && (size_t)len < size ? 0 : -1;
+}
+
+/**
+ * @brief Gets the path of the cache file of an entry.
+ *
+ * @param entry entry
+ * @param buf buffer of PATH_MAX bytes
+ */
+static void entry_path(const struct pentry* entry, char* buf)
+{
+    snprintf(buf, PATH_MAX, "%s/%08x.cache", cache_dir, entry->id);
+}
+
+/**
+ * @brief Drops a reference. The last one frees the entry. Caller must
+ * hold the lock.
+ *
+ * @param entry entry
+ */
+static void entry_put(struct pentry* entry)
+{
+    if (--entry->refs > 0) {
+        return;
+    }
+    if (entry->fd >= 0) {
+        close(entry->fd);
+    }
+    free(entry->wake);
+    free(entry->url);
+    free(entry);
+}
+
+static void lru_unlink(struct pentry* entry)
+{
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        lru_head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        lru_tail = entry->prev;
+    }
+}
+
+static void lru_push(struct pentry* entry)
+{
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+}
+
+/**
+ * @brief Removes the entry from the table and its file from the cache
+ * directory. Requests still sending it keep the open file. Caller must
+ * hold the lock.
+ *
+ * @param entry cached entry
+ */
+static void entry_remove(struct pentry* entry)
+{
+    struct pentry** p = &buckets[hash_url(entry->url) % PROXY_BUCKETS];
+    while (*p != entry) {
+        p = &(*p)->hnext;
+    }
+    *p = entry->hnext;
+    if (entry->lru) {
+        lru_unlink(entry);
+        cache_size -= entry->len;
+    }
+    if (entry->fd >= 0) {
+        char path[PATH_MAX];
+        entry_path(entry, path);
+        unlink(path);
+    }
+    entry_put(entry);
+}
+
+/**
+ * @brief Wakes all event loops waiting for the entry. Caller must hold
+ * the lock.
+ *
+ * @param entry entry which made progress
+ */
+static void entry_notify(struct pentry* entry)
+{
+    uint64_t one = 1;
+    for (size_t i = 0; i < entry->nwake; i++) {
+        ssize_t ignored = write(entry->wake[i], &one, sizeof(one));
+        (void)ignored;
+    }
+    entry->nwake = 0;
+}
+
+/**
+ * @brief Registers an event loop to be woken on the next progress of the
+ * entry. Caller must hold the lock.
+ *
+ * @param entry entry
+ * @param wake_fd eventfd of the event loop
+ * @return int 0 on success -1 on failure
+ */
+static int entry_wait(struct pentry* entry, int wake_fd)
+{
+    for (size_t i = 0; i < entry->nwake; i++) {
+        if (entry->wake[i] == wake_fd) {
+            return 0;
+        }
+    }
+    if (entry->nwake == entry->wake_size) {
+        size_t size = entry->wake_size > 0 ? entry->wake_size * 2 : 4;
+        int* wake = realloc(entry->wake, size * sizeof(int));
+        if (wake == NULL) {
+            return -1;
+        }
+        entry->wake = wake;
+        entry->wake_size = size;
+    }
+    entry->wake[entry->nwake++] = wake_fd;
+    return 0;
+}
+
+/**
+ * @brief Looks up the entry of a URL. A miss creates the entry and queues
+ * its fetch, so concurrent misses of the same URL share one fetch.
+ *
+ * @param url absolute URL
+ * @param hit set to 1 if the entry is cached completely
+ * @return struct pentry* entry with a reference for the caller or NULL
+ */
+static struct pentry* entry_get(const char* url, int* hit)
+{
+    pthread_mutex_lock(&lock);
+    struct pentry** bucket = &buckets[hash_url(url) % PROXY_BUCKETS];
+    struct pentry* entry = *bucket;
+    while (entry != NULL && strcmp(entry->url, url) != 0) {
+        entry = entry->hnext;
+    }
+
+    if (entry != NULL && entry->lru && time(NULL) >= entry->expires) {
+        // stale, requests still sending it keep the old file
+        entry_remove(entry);
+        entry = NULL;
+    }
+
+    *hit = entry != NULL && entry->lru;
+    if (*hit) {
+        lru_unlink(entry);
+        lru_push(entry);
+    } else if (entry == NULL) {
+        entry = malloc(sizeof(struct pentry));
+        char* copy = strdup(url);
+        if (entry == NULL || copy == NULL) {
+            free(entry);
+            free(copy);
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        memset(entry, 0, sizeof(*entry));
+        entry->url = copy;
+        entry->id = next_id++;
+        entry->state = PENTRY_FETCHING;
+        entry->fd = -1;
+        entry->len = -1;
+        // the table and the fetch
+        entry->refs = 2;
+        entry->hnext = *bucket;
+        *bucket = entry;
+
+        if (queue_tail != NULL) {
+            queue_tail->qnext = entry;
+        } else {
+            queue_head = entry;
+        }
+        queue_tail = entry;
+        pthread_cond_signal(&queue_cond);
+    }
+    entry->refs++;
+    pthread_mutex_unlock(&lock);
+    return entry;
+}
+
+/**
+ * @brief Adds the written bytes of the fetch and wakes the streams.
+ *
+ * @param ctx entry
+ * @param n number of bytes written to the cache file
+ */
+static void fetch_progress(void* ctx, size_t n)
+{
+    struct pentry* entry = ctx;
+    pthread_mutex_lock(&lock);
+    entry->written += n;
+    entry_notify(entry);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Completes a fetch. Complete successful responses are cached and
+ * the least recently used entries are evicted until the cache fits again.
+ *
+ * @param entry fetched entry
+ * @param ok 1 if the whole body was received
+ */
+static void fetch_done(struct pentry* entry, int ok)
+{
+    pthread_mutex_lock(&lock);
+    if (ok && entry->len >= 0 && entry->written != entry->len) {
+        ok = 0;
+    }
+    entry->state = ok ? PENTRY_DONE : PENTRY_FAILED;
+    entry->len = entry->written;
+    entry_notify(entry);
+
+    if (ok && entry->cacheable && !closing) {
+        lru_push(entry);
+        entry->lru = 1;
+        cache_size += entry->len;
+        // an entry larger than the whole cache evicts itself
+        while (cache_size > cache_max) {
+            entry_remove(lru_tail);
+        }
+    } else {
+        entry_remove(entry);
+    }
+    entry_put(entry);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Looks for a directive in a Cache-Control value.
+ *
+ * @param list Cache-Control value
+ * @param name directive name
+ * @param value set to the number of seconds of the directive, 0 if the
+ * directive has no valid number. May be NULL.
+ * @return int 1 if the directive is present, 0 otherwise
+ */
+static int cache_directive(struct slice list, const char* name, long long* value)
+{
+    size_t name_len = strlen(name);
+    const char* p = list.ptr;
+    const char* end = list.ptr + list.len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char* start = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+        if ((size_t)(p - start) < name_len || strncasecmp(start, name, name_len) != 0) {
+            continue;
+        }
+        const char* rest = start + name_len;
+        if (rest < p && *rest != '=' && *rest != ' ' && *rest != '\t') {
+            // only a directive with the same prefix
+            continue;
+        }
+        if (value != NULL) {
+            struct slice number = { rest + 1, 0 };
+            while (number.ptr + number.len < p && number.ptr[number.len] != ' ' && number.ptr[number.len] != '\t') {
+                number.len++;
+            }
+            // stale if the number is missing or invalid
+            if (rest == p || *rest != '=' || slice_to_ll(number, value) < 0) {
+                *value = 0;
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses a date header of the upstream response.
+ *
+ * @param parser parsed upstream head
+ * @param name header name
+ * @return time_t date or -1 if missing or invalid
+ */
+static time_t header_date(const struct parser* parser, const char* name)
+{
+    const struct slice* value = parser_header(parser, name);
+    char date[64];
+    if (value == NULL || value->len >= sizeof(date)) {
+        return -1;
+    }
+    memcpy(date, value->ptr, value->len);
+    date[value->len] = '\0';
+    return parse_http_date(date);
+}
+
+/**
+ * @brief Gets how long a response may be served from the cache, from
+ * s-maxage or max-age or else from Expires relative to Date.
+ *
+ * @param parser parsed upstream head
+ * @param now current time
+ * @return long long lifetime in seconds, 0 or less if it must not be
+ * cached
+ */
+static long long fresh_lifetime(const struct parser* parser, time_t now)
+{
+    long long lifetime = -1;
+    const struct slice* cache_control = parser_header(parser, "Cache-Control");
+    if (cache_control != NULL) {
+        if (cache_directive(*cache_control, "no-store", NULL) || cache_directive(*cache_control, "private", NULL)
+            || cache_directive(*cache_control, "no-cache", NULL)) {
+            return 0;
+        }
+        if (!cache_directive(*cache_control, "s-maxage", &lifetime)) {
+            cache_directive(*cache_control, "max-age", &lifetime);
+        }
+    }
+    if (lifetime < 0) {
+        // an invalid Expires means already expired
+        time_t expires = header_date(parser, "Expires");
+        time_t date = header_date(parser, "Date");
+        lifetime = expires < 0 ? 0 : expires - (date >= 0 ? date : now);
+    }
+
+    // time the response already spent in caches further upstream
+    const struct slice* age = parser_header(parser, "Age");
+    long long seconds;
+    if (age != NULL && slice_to_ll(*age, &seconds) == 0) {
+        lifetime -= seconds;
+    }
+    return lifetime;
+}
+
+/**
+ * @brief Copies the header lines which describe the body from the
+ * upstream response.
+ *
+ * @param entry entry
+ * @param parser parsed upstream head
+ */
+static void fetch_head(struct pentry* entry, const struct parser* parser)
+{
+    static const char* forwarded[] = { "Content-Type", "Content-Encoding", "Last-Modified", "ETag", "Cache-Control",
+        "Expires", "Location" };
+    size_t len = 0;
+    for (size_t i = 0; i < sizeof(forwarded) / sizeof(forwarded[0]); i++) {
+        const struct slice* value = parser_header(parser, forwarded[i]);
+        if (value == NULL) {
+            continue;
+        }
+        int n = snprintf(entry->head + len, sizeof(entry->head) - len, "%s: %.*s\r\n", forwarded[i], (int)value->len,
+            value->ptr);
+        if (n < 0 || (size_t)n >= sizeof(entry->head) - len) {
+            // the line is dropped
+            entry->head[len] = '\0';
+            continue;
+        }
+        len += n;
+    }
+    entry->head_len = len;
+
+    // responses without freshness information are not cached
+    time_t now = time(NULL);
+    long long lifetime = parser->status == 200 ? fresh_lifetime(parser, now) : 0;
+    entry->cacheable = lifetime > 0;
+    entry->expires = entry->cacheable ? now + lifetime : now;
+}
+
+/**
+ * @brief Fetches the URL of an entry with blocking system calls. The body
+ * is written to the cache file, every write wakes the streams.
+ *
+ * @param entry entry in PENTRY_FETCHING
+ * @param buf receive buffer of HTTPC_BUF_SIZE bytes
+ */
+static void fetch(struct pentry* entry, char* buf)
+{
+    char url[PROXY_URL_MAX + 8];
+    char port[PORT_SIZE];
+    char path[PATH_MAX];
+    entry_path(entry, path);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int sockfd = fd >= 0 && split_url(entry->url, url, sizeof(url), port) == 0 ? create_socket(url, port) : -1;
+    if (sockfd < 0) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(path);
+        }
+        fetch_done(entry, 0);
+        return;
+    }
+
+    struct timeval timeout = { .tv_sec = PROXY_TIMEOUT, .tv_usec = 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    size_t len;
+    struct parser parser;
+    struct body body;
+    if (send_request(sockfd, "GET", url) < 0 || httpc_head(sockfd, buf, HTTPC_BUF_SIZE, &len, &parser) < 0
+        || body_init(&body, &parser) < 0) {
+        close(sockfd);
+        close(fd);
+        unlink(path);
+        fetch_done(entry, 0);
+        return;
+    }
+    if (parser.status < 200 || parser.status == 204 || parser.status == 304) {
+        body.mode = BODY_NONE;
+    }
+
+    pthread_mutex_lock(&lock);
+    entry->fd = fd;
+    entry->status = parser.status;
+    fetch_head(entry, &parser);
+    if (body.mode == BODY_NONE) {
+        entry->len = 0;
+    } else if (body.mode == BODY_LENGTH) {
+        entry->len = body.remaining;
+    }
+    entry_notify(entry);
+    pthread_mutex_unlock(&lock);
+
+    int ok = 1;
+    if (body.mode != BODY_NONE) {
+        len -= parser.pos;
+        memmove(buf, buf + parser.pos, len);
+        ok = httpc_body(sockfd, &body, buf, len, HTTPC_BUF_SIZE, fd, fetch_progress, entry) > 0;
+    }
+    close(sockfd);
+    fetch_done(entry, ok);
+}
+
+/**
+ * @brief Entry point of a fetcher. Fetches queued entries forever.
+ *
+ * @param arg unused
+ * @return void* NULL
+ */
+static void* fetcher_main(void* arg)
+{
+    (void)arg;
+    char* buf = malloc(HTTPC_BUF_SIZE);
+    if (buf == NULL) {
+        log_error("malloc failed");
+        return NULL;
+    }
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (queue_head == NULL) {
+            pthread_cond_wait(&queue_cond, &lock);
+        }
+        struct pentry* entry = queue_head;
+        queue_head = entry->qnext;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+
+        fetch(entry, buf);
+    }
+    return NULL;
+}
+
+int proxy_open(const char* dir, size_t max_size)
+{
+    struct stat st;
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        log_error("Creating the cache directory %s failed: %s", dir, strerror(errno));
+        return -1;
+    }
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || access(dir, W_OK) < 0) {
+        log_error("%s is no writable directory", dir);
+        return -1;
+    }
+    cache_dir = strdup(dir);
+    if (cache_dir == NULL) {
+        log_error("malloc failed");
+        return -1;
+    }
+    cache_max = max_size;
+
+    // signals are handled by the main thread only
+    sigset_t set, old;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    int started = 0;
+    for (int i = 0; i < PROXY_FETCHERS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, fetcher_main, NULL) == 0) {
+            pthread_detach(thread);
+            started++;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (started == 0) {
+        log_error("Starting the fetchers failed");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Gets how much of the body the fetcher wrote so far. The event
+ * loop is woken on the next progress if no more than @code{off} bytes
+ * are written and the fetch is not done.
+ *
+ * @param res response streamed from the entry
+ * @param off bytes already sent
+ * @return off_t bytes written or -1 if the fetch failed
+ */
+static off_t stream_avail(struct res* res, off_t off)
+{
+    struct pstream* stream = res->ctx;
+    struct pentry* entry = stream->entry;
+    pthread_mutex_lock(&lock);
+    off_t written = entry->written;
+    if (entry->state == PENTRY_FAILED) {
+        written = -1;
+    } else if (entry->state == PENTRY_FETCHING && written <= off && entry_wait(entry, stream->wake_fd) < 0) {
+        written = -1;
+    }
+    pthread_mutex_unlock(&lock);
+    return written;
+}
+
+/**
+ * @brief Releases the entry of a response.
+ *
+ * @param res response
+ */
+static void stream_done(struct res* res)
+{
+    struct pstream* stream = res->ctx;
+    pthread_mutex_lock(&lock);
+    entry_put(stream->entry);
+    pthread_mutex_unlock(&lock);
+}
+
+void proxy_handler(struct req* req, struct res* res)
+{
+    struct pentry* entry = req->waited;
+    int hit = 0;
+    if (entry == NULL) {
+        char url[PROXY_URL_MAX + 8];
+        char port[PORT_SIZE];
+        // HTTP/2 streams cannot wait for the fetch without blocking the loop
+        if (strcmp(req->method, "GET") != 0 || req->wake_fd < 0) {
+            res->status = 501;
+            return;
+        }
+        if (strlen(req->path) > PROXY_URL_MAX || split_url(req->path, url, sizeof(url), port) < 0) {
+            res->status = 400;
+            return;
+        }
+        entry = entry_get(req->path, &hit);
+        if (entry == NULL) {
+            res->status = 500;
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    // the head is needed first, a body of unknown length must be complete
+    int ready = entry->state != PENTRY_FETCHING || (entry->status != 0 && entry->len >= 0);
+    if (!ready) {
+        int waiting = entry_wait(entry, req->wake_fd) == 0;
+        if (!waiting) {
+            entry_put(entry);
+        }
+        pthread_mutex_unlock(&lock);
+        if (waiting) {
+            res_wait(res, entry);
+        } else {
+            res->status = 503;
+        }
+        return;
+    }
+    enum pentry_state state = entry->state;
+    off_t len = entry->len;
+    pthread_mutex_unlock(&lock);
+
+    struct pstream* stream = state != PENTRY_FAILED ? res_alloc(res, sizeof(struct pstream)) : NULL;
+    if (stream == NULL) {
+        pthread_mutex_lock(&lock);
+        entry_put(entry);
+        pthread_mutex_unlock(&lock);
+        res->status = 502;
+        return;
+    }
+    stream->entry = entry;
+    stream->wake_fd = req->wake_fd;
+    res->done = stream_done;
+    res->ctx = stream;
+    res->status = entry->status;
+    res->headers = entry->head;
+    res->headers_len = entry->head_len;
+    res->fd = entry->fd;
+    res->offset = 0;
+    res->size = len;
+    if (state == PENTRY_FETCHING) {
+        res->avail = stream_avail;
+    }
+    res_header(res, "X-Cache: %s\r\n", hit ? "HIT" : "MISS");
+}
+
+void proxy_close(void)
+{
+    pthread_mutex_lock(&lock);
+    closing = 1;
+    while (lru_tail != NULL) {
+        entry_remove(lru_tail);
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,60 @@
+/**
+ * @file proxy.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Caching forward proxy
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef PROXY
+#define PROXY
+
+#include "https.h"
+#include <stddef.h>
+
+// threads fetching misses from the upstream servers
+#define PROXY_FETCHERS (16)
+// seconds an upstream server may stall before its fetch fails
+#define PROXY_TIMEOUT (30)
+// default bytes of responses kept in the cache directory
+#define PROXY_CACHE_MAX (256 * 1024 * 1024)
+#define PROXY_URL_MAX (2048)
+// header lines forwarded from the upstream response
+#define PROXY_HEAD_SIZE (1024)
+
+/**
+ * @brief Opens the cache in @code{dir} and starts the fetchers. The
+ * directory is created if it does not exist.
+ *
+ * @param dir directory the responses are stored in
+ * @param max_size bytes of complete responses kept before the least
+ * recently used ones are evicted
+ * @return int 0 on success -1 on failure
+ */
+int proxy_open(const char* dir, size_t max_size);
+
+/**
+ * @brief HTTP request handler of the proxy mode. Requests must name an
+ * absolute http:// URL. A miss is fetched by one of the fetchers while
+ * the response is streamed from the growing cache file, all requests
+ * for the same URL arriving meanwhile share that fetch. Successful GET
+ * responses with freshness information (s-maxage, max-age or Expires)
+ * stay cached until they expire or are evicted, all others, including
+ * no-cache ones, are only passed to the requests which waited for them. Over HTTP/2 requests
+ * are answered with 501, their streams cannot wait for a fetch.
+ *
+ * @param req request struct
+ * @param res response struct
+ */
+void proxy_handler(struct req* req, struct res* res);
+
+/**
+ * @brief Removes all cached responses from the cache directory.
+ *
+ */
+void proxy_close(void);
+
+#endif
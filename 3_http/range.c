@@ -0,0 +1,157 @@
+/**
+ * @file range.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Range requests and conditional requests
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "range.h"
+#include "common.h"
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+
+/**
+ * @brief Parses a decimal number at @code{*pos}
+ *
+ * @param pos position, moved behind the number
+ * @param end end of the input
+ * @param value parsed number
+ * @return int 1 if a number was parsed, 0 if there is none, -1 on overflow
+ */
+static int parse_num(const char** pos, const char* end, long long* value)
+{
+    const char* p = *pos;
+    *value = 0;
+    while (p < end && isdigit((unsigned char)*p)) {
+        if (*value > (LLONG_MAX - 9) / 10) {
+            return -1;
+        }
+        *value = *value * 10 + *p - '0';
+        p++;
+    }
+    int found = p != *pos;
+    *pos = p;
+    return found;
+}
+
+/**
+ * @brief Skips spaces and tabs
+ *
+ * @param p position
+ * @param end end of the input
+ * @return const char* first other character
+ */
+static const char* skip_ows(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    return p;
+}
+
+int parse_ranges(struct slice value, off_t size, struct range* ranges, int max)
+{
+    const char* p = value.ptr;
+    const char* end = value.ptr + value.len;
+    if (value.len < 6 || strncmp(p, "bytes=", 6) != 0) {
+        return -1;
+    }
+    p += 6;
+
+    int n = 0;
+    int specs = 0;
+    while (p < end) {
+        p = skip_ows(p, end);
+        if (p < end && *p == ',') {
+            p++;
+            continue;
+        }
+
+        long long first, last;
+        int has_first = parse_num(&p, end, &first);
+        if (has_first < 0 || p == end || *p != '-') {
+            return -1;
+        }
+        p++;
+        int has_last = parse_num(&p, end, &last);
+        if (has_last < 0 || (!has_first && !has_last) || (has_first && has_last && last < first)) {
+            return -1;
+        }
+        p = skip_ows(p, end);
+        if (p < end && *p != ',') {
+            return -1;
+        }
+        if (++specs > max) {
+            return -1;
+        }
+
+        struct range range;
+        if (!has_first) {
+            // suffix range: the last bytes of the file, none of an empty one
+            if (last == 0 || size == 0) {
+                continue;
+            }
+            range.start = last < size ? size - last : 0;
+            range.len = size - range.start;
+        } else {
+            if (first >= size) {
+                continue;
+            }
+            range.start = first;
+            range.len = (has_last && last < size ? last + 1 : size) - first;
+        }
+        ranges[n++] = range;
+    }
+    return specs == 0 ? -1 : n;
+}
+
+int etag_matches(struct slice value, const char* etag)
+{
+    const char* p = value.ptr;
+    const char* end = value.ptr + value.len;
+    size_t len = strlen(etag);
+    while (p < end) {
+        p = skip_ows(p, end);
+        if (p < end && *p == '*') {
+            return 1;
+        }
+        if (end - p >= 2 && strncmp(p, "W/", 2) == 0) {
+            p += 2;
+        }
+        const char* tag = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+        const char* tag_end = p;
+        while (tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t')) {
+            tag_end--;
+        }
+        if ((size_t)(tag_end - tag) == len && strncmp(tag, etag, len) == 0) {
+            return 1;
+        }
+        if (p < end) {
+            p++;
+        }
+    }
+    return 0;
+}
+
+int unmodified_since(struct slice value, time_t mtime, int exact)
+{
+    char date[64];
+    if (value.len >= sizeof(date)) {
+        return 0;
+    }
+    memcpy(date, value.ptr, value.len);
+    date[value.len] = '\0';
+    time_t since = parse_http_date(date);
+    if (since < 0) {
+        return 0;
+    }
+    return exact ? mtime == since : mtime <= since;
+}
@@ -0,0 +1,61 @@
+/**
+ * @file range.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Range requests and conditional requests
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef RANGE
+#define RANGE
+
+#include "parser.h"
+#include <sys/types.h>
+#include <time.h>
+
+// more ranges are ignored and the whole file is sent
+#define RANGE_MAX (16)
+
+struct range {
+    off_t start;
+    off_t len;
+};
+
+/**
+ * @brief Parses the value of a Range header, e.g. bytes=0-99,200-,-50
+ * Ranges which start behind the end of the file are skipped.
+ * 
+ * @param value header value
+ * @param size size of the file
+ * @param ranges parsed ranges
+ * @param max maximum number of ranges
+ * @return int number of satisfiable ranges, 0 if none is satisfiable
+ * or -1 if the header is invalid and must be ignored
+ */
+int parse_ranges(struct slice value, off_t size, struct range* ranges, int max);
+
+/**
+ * @brief Checks an If-None-Match header value against an entity tag.
+ * Weak comparison is used, "*" matches every tag.
+ * 
+ * @param value header value, a list of entity tags
+ * @param etag quoted entity tag
+ * @return int 1 if matching else 0
+ */
+int etag_matches(struct slice value, const char* etag);
+
+/**
+ * @brief Checks if a resource modified at @code{mtime} is unchanged
+ * since the date of an If-Modified-Since or If-Range header.
+ * 
+ * @param value header value
+ * @param mtime modification time of the resource
+ * @param exact 1 if the dates must match exactly (If-Range)
+ * @return int 1 if unchanged else 0
+ */
+int unmodified_since(struct slice value, time_t mtime, int exact);
+
+#endif
@@ -0,0 +1,660 @@
+/**
+ * @file segdl.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Parallel segmented downloads with Range requests
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "segdl.h"
+#include "common.h"
+#include "httpc.h"
+#include "parser.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROTOCOL "HTTP/1.1"
+#define MAX_EVENTS (64)
+#define REQ_SIZE (4096)
+#define PROGRESS_MAGIC "httpc-segments 1"
+
+/**
+ * @brief Byte range [start, end) of the file, downloaded up to pos
+ */
+struct seg {
+    long long start;
+    long long end;
+    long long pos;
+};
+
+enum sconn_state {
+    SCONN_CONNECTING,
+    SCONN_SENDING,
+    SCONN_HEAD,
+    SCONN_BODY
+};
+
+struct sconn {
+    int fd;
+    enum sconn_state state;
+    struct seg* seg;
+    char req[REQ_SIZE];
+    size_t req_len;
+    size_t req_sent;
+    char buf[SEGDL_BUF_SIZE];
+    size_t len;
+    struct parser parser;
+};
+
+struct segdl {
+    const char* url;
+    const char* port;
+    const char* path;
+    char* progress;
+    int epfd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int outfd;
+    long long size;
+    // ETag or Last-Modified sent as If-Range, empty if the server has none
+    char validator[SEGDL_VALIDATOR_SIZE];
+    struct seg segs[SEGDL_MAX_JOBS];
+    int nsegs;
+    int active;
+    int failed;
+};
+
+/**
+ * @brief Reads a response head from a blocking socket.
+ *
+ * @param sockfd socket
+ * @param buf buffer
+ * @param size size of the buffer
+ * @param parser parser
+ * @return int 0 on success -1 on failure
+ */
+static int read_head(int sockfd, char* buf, size_t size, struct parser* parser)
+{
+    size_t len = 0;
+    parser_init_res(parser);
+    int res = PARSE_AGAIN;
+    while (res == PARSE_AGAIN && len < size) {
+        ssize_t n = read(sockfd, buf + len, size - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len += n;
+        res = parser_parse(parser, buf, len);
+    }
+    return res == PARSE_DONE ? 0 : -1;
+}
+
+/**
+ * @brief Gets the total size from a Content-Range value like
+ * bytes 0-0/1234.
+ *
+ * @param range Content-Range value
+ * @param start set to the first byte of the range
+ * @return long long total size or -1 if the value is invalid
+ */
+static long long content_range_size(struct slice range, long long* start)
+{
+    const char* dash = memchr(range.ptr, '-', range.len);
+    const char* slash = memchr(range.ptr, '/', range.len);
+    long long size;
+    if (range.len < 6 || strncasecmp(range.ptr, "bytes ", 6) != 0 || dash == NULL || slash == NULL || slash < dash) {
+        return -1;
+    }
+    struct slice first = { range.ptr + 6, dash - range.ptr - 6 };
+    struct slice total = { slash + 1, range.ptr + range.len - slash - 1 };
+    if (slice_to_ll(first, start) < 0 || slice_to_ll(total, &size) < 0) {
+        return -1;
+    }
+    return size;
+}
+
+/**
+ * @brief Asks the server for the first byte to learn the size and the
+ * validator of the file.
+ *
+ * @param dl download
+ * @return int 1 if ranges are supported, 0 if not, -1 on failure
+ */
+static int probe(struct segdl* dl)
+{
+    int sockfd = create_socket(dl->url, dl->port);
+    if (sockfd < 0) {
+        return -1;
+    }
+    char host[strlen(dl->url) + 1];
+    host_from_url(dl->url, host);
+    char req[REQ_SIZE];
+    int len = snprintf(req, sizeof(req), "GET %s %s\r\nHost: %s\r\nRange: bytes=0-0\r\nConnection: close\r\n\r\n",
+        file_path_from_url(dl->url), PROTOCOL, host);
+    char buf[HTTPC_BUF_SIZE];
+    struct parser parser;
+    if (len < 0 || (size_t)len >= sizeof(req) || send(sockfd, req, len, MSG_NOSIGNAL) != len
+        || read_head(sockfd, buf, sizeof(buf), &parser) < 0) {
+        log_error("%s: probing the size failed", dl->url);
+        close(sockfd);
+        return -1;
+    }
+    close(sockfd);
+
+    if (parser.status == 200) {
+        return 0;
+    }
+    const struct slice* range = parser_header(&parser, "Content-Range");
+    long long start;
+    if (parser.status != 206 || range == NULL || (dl->size = content_range_size(*range, &start)) < 0) {
+        log_error("%s: %d %.*s", dl->url, parser.status, (int)parser.reason.len, parser.reason.ptr);
+        return -1;
+    }
+
+    // a weak entity tag is not allowed in If-Range
+    const struct slice* validator = parser_header(&parser, "ETag");
+    if (validator == NULL || (validator->len >= 2 && strncmp(validator->ptr, "W/", 2) == 0)) {
+        validator = parser_header(&parser, "Last-Modified");
+    }
+    dl->validator[0] = '\0';
+    if (validator != NULL && validator->len < sizeof(dl->validator)) {
+        memcpy(dl->validator, validator->ptr, validator->len);
+        dl->validator[validator->len] = '\0';
+    }
+    return 1;
+}
+
+/**
+ * @brief Splits the file into @code{jobs} segments of equal size.
+ *
+ * @param dl download
+ * @param jobs number of parallel connections
+ */
+static void split(struct segdl* dl, int jobs)
+{
+    long long max_jobs = dl->size / SEGDL_MIN_SEGMENT;
+    if (jobs > max_jobs) {
+        jobs = max_jobs > 0 ? max_jobs : 1;
+    }
+    dl->nsegs = jobs;
+    for (int i = 0; i < jobs; i++) {
+        dl->segs[i].start = dl->size * i / jobs;
+        dl->segs[i].end = dl->size * (i + 1) / jobs;
+        dl->segs[i].pos = dl->segs[i].start;
+    }
+}
+
+/**
+ * @brief Reads the progress file of an earlier run of the same download.
+ *
+ * @param dl download with the probed size and validator
+ * @return int 0 if the segments were restored, -1 if the download has to
+ * start over
+ */
+static int load_progress(struct segdl* dl)
+{
+    FILE* in = fopen(dl->progress, "r");
+    if (in == NULL) {
+        return -1;
+    }
+    char* line = NULL;
+    size_t size = 0;
+    int res = 0;
+    const char* expected[4] = { PROGRESS_MAGIC, dl->url, NULL, dl->validator };
+    char size_line[32];
+    snprintf(size_line, sizeof(size_line), "%lld", dl->size);
+    expected[2] = size_line;
+    for (int i = 0; i < 4 && res == 0; i++) {
+        ssize_t len = getline(&line, &size, in);
+        if (len < 1 || line[len - 1] != '\n') {
+            res = -1;
+            break;
+        }
+        line[len - 1] = '\0';
+        res = strcmp(line, expected[i]) == 0 ? 0 : -1;
+    }
+
+    dl->nsegs = 0;
+    struct seg seg;
+    while (res == 0 && fscanf(in, "%lld %lld %lld\n", &seg.start, &seg.end, &seg.pos) == 3) {
+        if (dl->nsegs == SEGDL_MAX_JOBS || seg.start < 0 || seg.start > seg.pos || seg.pos > seg.end || seg.end > dl->size) {
+            res = -1;
+            break;
+        }
+        dl->segs[dl->nsegs++] = seg;
+    }
+    free(line);
+    fclose(in);
+    return res == 0 && dl->nsegs > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Saves the progress. The output is flushed to disk first, so the
+ * progress file never claims bytes that could still be lost. The file is
+ * replaced atomically by renaming a temporary file.
+ *
+ * @param dl download
+ * @return int 0 on success -1 on failure
+ */
+static int save_progress(struct segdl* dl)
+{
+    if (fdatasync(dl->outfd) < 0) {
+        return -1;
+    }
+    char tmp[strlen(dl->progress) + 5];
+    sprintf(tmp, "%s.tmp", dl->progress);
+    FILE* out = fopen(tmp, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    fprintf(out, "%s\n%s\n%lld\n%s\n", PROGRESS_MAGIC, dl->url, dl->size, dl->validator);
+    for (int i = 0; i < dl->nsegs; i++) {
+        fprintf(out, "%lld %lld %lld\n", dl->segs[i].start, dl->segs[i].end, dl->segs[i].pos);
+    }
+    if (fclose(out) != 0 || rename(tmp, dl->progress) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens the output file. A new download preallocates the whole
+ * file so that the segments can be written in place without
+ * fragmenting it.
+ *
+ * @param dl download
+ * @param resume 1 if the segments were restored from the progress file
+ * @return int 0 on success -1 on failure
+ */
+static int open_output(struct segdl* dl, int resume)
+{
+    if (resume) {
+        struct stat st;
+        dl->outfd = open(dl->path, O_WRONLY | O_CLOEXEC);
+        if (dl->outfd >= 0 && fstat(dl->outfd, &st) == 0 && st.st_size == dl->size) {
+            return 0;
+        }
+        if (dl->outfd >= 0) {
+            close(dl->outfd);
+        }
+        return -1;
+    }
+
+    dl->outfd = open(dl->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dl->outfd < 0) {
+        log_error("Error creating output file %s", dl->path);
+        return -1;
+    }
+    // not every file system supports fallocate
+    if (dl->size > 0 && fallocate(dl->outfd, 0, 0, dl->size) < 0 && ftruncate(dl->outfd, dl->size) < 0) {
+        log_error("Error allocating output file %s", dl->path);
+        close(dl->outfd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Closes the connection of a segment.
+ *
+ * @param dl download
+ * @param conn connection
+ * @param ok 1 if the segment is complete
+ */
+static void conn_finish(struct segdl* dl, struct sconn* conn, int ok)
+{
+    if (!ok) {
+        log_error("%s: segment at %lld failed", dl->url, conn->seg->pos);
+        dl->failed++;
+    }
+    epoll_ctl(dl->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    dl->active--;
+}
+
+/**
+ * @brief Opens a non blocking connection which requests the missing part
+ * of its segment. If-Range makes the server send the whole file instead
+ * if it changed, which is detected as a failure.
+ *
+ * @param dl download
+ * @param conn connection
+ * @param seg segment
+ * @return int 0 on success -1 on failure
+ */
+static int conn_start(struct segdl* dl, struct sconn* conn, struct seg* seg)
+{
+    char host[strlen(dl->url) + 1];
+    host_from_url(dl->url, host);
+    int len = snprintf(conn->req, sizeof(conn->req), "GET %s %s\r\nHost: %s\r\nRange: bytes=%lld-%lld\r\n%s%s%s"
+                                                     "Connection: close\r\n\r\n",
+        file_path_from_url(dl->url), PROTOCOL, host, seg->pos, seg->end - 1, dl->validator[0] != '\0' ? "If-Range: " : "",
+        dl->validator, dl->validator[0] != '\0' ? "\r\n" : "");
+    if (len < 0 || (size_t)len >= sizeof(conn->req)) {
+        return -1;
+    }
+    conn->req_len = len;
+    conn->req_sent = 0;
+    conn->len = 0;
+    conn->seg = seg;
+
+    conn->fd = socket(dl->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    if ((connect(conn->fd, (struct sockaddr*)&dl->addr, dl->addrlen) < 0 && errno != EINPROGRESS)
+        || epoll_ctl(dl->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    conn->state = SCONN_CONNECTING;
+    dl->active++;
+    return 0;
+}
+
+/**
+ * @brief Sends the request of the connection.
+ *
+ * @param dl download
+ * @param conn connection
+ */
+static void conn_send(struct segdl* dl, struct sconn* conn)
+{
+    if (conn->state == SCONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof err;
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            conn_finish(dl, conn, 0);
+            return;
+        }
+        conn->state = SCONN_SENDING;
+    }
+
+    while (conn->req_sent < conn->req_len) {
+        ssize_t n = send(conn->fd, conn->req + conn->req_sent, conn->req_len - conn->req_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n < 0) {
+            conn_finish(dl, conn, 0);
+            return;
+        }
+        conn->req_sent += n;
+    }
+
+    conn->state = SCONN_HEAD;
+    parser_init_res(&conn->parser);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    epoll_ctl(dl->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/**
+ * @brief Checks that the response is the requested part of the same file.
+ *
+ * @param conn connection with a complete head
+ * @return int 0 if it is, -1 otherwise
+ */
+static int check_head(struct sconn* conn)
+{
+    struct parser* parser = &conn->parser;
+    struct body body;
+    const struct slice* range = parser_header(parser, "Content-Range");
+    long long start;
+    if (parser->status != 206 || range == NULL || content_range_size(*range, &start) < 0 || start != conn->seg->pos
+        || body_init(&body, parser) < 0 || body.mode != BODY_LENGTH || body.remaining != conn->seg->end - conn->seg->pos) {
+        if (parser->status == 200) {
+            log_error("The file changed on the server");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes received body bytes in place.
+ *
+ * @param dl download
+ * @param conn connection
+ * @param data body bytes
+ * @param len number of bytes
+ * @return int 0 on success -1 on failure
+ */
+static int write_segment(struct segdl* dl, struct sconn* conn, const char* data, size_t len)
+{
+    struct seg* seg = conn->seg;
+    if ((long long)len > seg->end - seg->pos) {
+        return -1;
+    }
+    while (len > 0) {
+        ssize_t n = pwrite(dl->outfd, data, len, seg->pos);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+        seg->pos += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the response of the connection.
+ *
+ * @param dl download
+ * @param conn connection
+ */
+static void conn_read(struct segdl* dl, struct sconn* conn)
+{
+    while (conn->seg->pos < conn->seg->end) {
+        ssize_t n = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            conn_finish(dl, conn, 0);
+            return;
+        }
+        conn->len += n;
+
+        if (conn->state == SCONN_HEAD) {
+            int res = parser_parse(&conn->parser, conn->buf, conn->len);
+            if (res == PARSE_AGAIN && conn->len < sizeof(conn->buf)) {
+                continue;
+            }
+            if (res != PARSE_DONE || check_head(conn) < 0) {
+                conn_finish(dl, conn, 0);
+                return;
+            }
+            conn->state = SCONN_BODY;
+            memmove(conn->buf, conn->buf + conn->parser.pos, conn->len - conn->parser.pos);
+            conn->len -= conn->parser.pos;
+        }
+
+        if (write_segment(dl, conn, conn->buf, conn->len) < 0) {
+            conn_finish(dl, conn, 0);
+            return;
+        }
+        conn->len = 0;
+    }
+    conn_finish(dl, conn, 1);
+}
+
+/**
+ * @brief Resolves the host once for all connections.
+ *
+ * @param dl download
+ * @return int 0 on success -1 on failure
+ */
+static int resolve(struct segdl* dl)
+{
+    char host[strlen(dl->url) + 1];
+    host_from_url(dl->url, host);
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, dl->port, &hints, &ai) != 0) {
+        log_error("%s: could not resolve host", dl->url);
+        return -1;
+    }
+    memcpy(&dl->addr, ai->ai_addr, ai->ai_addrlen);
+    dl->addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return 0;
+}
+
+/**
+ * @brief Downloads all missing parts of the segments in parallel and
+ * saves the progress every second.
+ *
+ * @param dl download with the opened output
+ * @return int 0 if all segments are complete, -1 otherwise
+ */
+static int run(struct segdl* dl)
+{
+    struct sconn* conns = malloc(dl->nsegs * sizeof(struct sconn));
+    dl->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (conns == NULL || dl->epfd < 0 || resolve(dl) < 0) {
+        free(conns);
+        if (dl->epfd >= 0) {
+            close(dl->epfd);
+        }
+        return -1;
+    }
+
+    dl->active = 0;
+    dl->failed = 0;
+    for (int i = 0; i < dl->nsegs; i++) {
+        conns[i].fd = -1;
+        if (dl->segs[i].pos < dl->segs[i].end && conn_start(dl, &conns[i], &dl->segs[i]) < 0) {
+            log_error("%s: connect failed", dl->url);
+            dl->failed++;
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    time_t saved = time(NULL);
+    while (dl->active > 0) {
+        int n = epoll_wait(dl->epfd, events, MAX_EVENTS, 1000);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            log_error("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct sconn* conn = events[i].data.ptr;
+            if (conn->state == SCONN_CONNECTING || conn->state == SCONN_SENDING) {
+                conn_send(dl, conn);
+            } else {
+                conn_read(dl, conn);
+            }
+        }
+
+        time_t now = time(NULL);
+        if (now != saved) {
+            save_progress(dl);
+            saved = now;
+        }
+    }
+
+    for (int i = 0; i < dl->nsegs; i++) {
+        if (conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+    }
+    free(conns);
+    close(dl->epfd);
+
+    for (int i = 0; i < dl->nsegs; i++) {
+        if (dl->segs[i].pos < dl->segs[i].end) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int httpc_segmented(const char* url, const char* port, const char* path, int jobs)
+{
+    struct segdl* dl = malloc(sizeof(struct segdl));
+    if (dl == NULL) {
+        return -1;
+    }
+    dl->url = url;
+    dl->port = port;
+    dl->path = path;
+    dl->epfd = -1;
+    dl->progress = malloc(strlen(path) + sizeof(SEGDL_SUFFIX));
+    if (dl->progress == NULL) {
+        free(dl);
+        return -1;
+    }
+    sprintf(dl->progress, "%s%s", path, SEGDL_SUFFIX);
+
+    int res = probe(dl);
+    if (res <= 0) {
+        free(dl->progress);
+        free(dl);
+        return res;
+    }
+
+    int resume = load_progress(dl) == 0;
+    if (resume && open_output(dl, 1) < 0) {
+        resume = 0;
+    }
+    if (!resume) {
+        split(dl, jobs);
+        if (open_output(dl, 0) < 0) {
+            free(dl->progress);
+            free(dl);
+            return -1;
+        }
+    }
+
+    res = run(dl);
+    if (res == 0) {
+        unlink(dl->progress);
+    } else {
+        save_progress(dl);
+        log_error("Download incomplete, run again to resume");
+    }
+    close(dl->outfd);
+    free(dl->progress);
+    free(dl);
+    return res == 0 ? 1 : -1;
+}
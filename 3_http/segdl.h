@@ -0,0 +1,41 @@
+/**
+ * @file segdl.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Parallel segmented downloads with Range requests
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef SEGDL
+#define SEGDL
+
+#define SEGDL_BUF_SIZE (1 << 18)
+#define SEGDL_MAX_JOBS (64)
+// segments are not made smaller than this
+#define SEGDL_MIN_SEGMENT (1 << 20)
+// appended to the output path for the progress file
+#define SEGDL_SUFFIX ".segments"
+#define SEGDL_VALIDATOR_SIZE (128)
+
+/**
+ * @brief Downloads @code{url} into the file @code{path} with @code{jobs}
+ * parallel Range requests. The size is probed first, then the file is
+ * preallocated and every connection writes its segment in place.
+ * The progress is saved every second in @code{path}SEGDL_SUFFIX. If that
+ * file matches the url, size and validator of the server, only the
+ * missing bytes are downloaded. It is removed once the download is
+ * complete.
+ * 
+ * @param url valid url
+ * @param port port of the server
+ * @param path output file
+ * @param jobs number of parallel connections, at most SEGDL_MAX_JOBS
+ * @return int 1 on success, 0 if the server does not support ranges and
+ * nothing was written, -1 on failure
+ */
+int httpc_segmented(const char* url, const char* port, const char* path, int jobs);
+
+#endif
@@ -9,26 +9,58 @@
  * @copyright Copyright (c) 2023
  *
  */
+#include "accesslog.h"
+#include "bundle.h"
 #include "common.h"
+#include "dircache.h"
+#include "fcache.h"
+#include "gzcache.h"
 #include "https.h"
+#include "proxy.h"
+#include "range.h"
+#include "stats.h"
+#include "upload.h"
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <netdb.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #define PROTOCOL "HTTP/1.1"
+#define MULTIPART_HEAD_SIZE (160)
 
 struct options {
     char* port;
     char* index;
     char* docRoot;
+    int workers;
+    enum aio_mode aio;
+    int max_conns;
+    int accept_batch;
+    int autoindex;
+    int defer_accept;
+    size_t mmap_max;
+    size_t mlock_max;
+    char* log_path;
+    enum accesslog_format log_format;
+    // bundle served instead of the docRoot or NULL
+    char* bundle_path;
+    // cache directory of the proxy mode or NULL
+    char* cache_dir;
+    size_t cache_max;
+    // maximum length of a PUT body, 0 if uploads are disabled
+    off_t upload_max;
 };
 
 struct options* g_opts;
+// mapped bundle if the server runs in bundle mode
+static struct bundle* bundle = NULL;
 
 void clean_exit(int exit_status);
 struct options init_options(int argc, char** argv);
@@ -39,7 +71,9 @@ struct options init_options(int argc, char** argv);
  */
 void usage(void)
 {
-    (void)fprintf(stderr, "Usage: %s [-p PORT] [-i INDEX] DOC_ROOT\n",
+    (void)fprintf(stderr, "Usage: %s [-p PORT] [-i INDEX] [-w WORKERS] [-a uring|threads] [-m MAX_CONNS] [-b ACCEPT_BATCH]\n"
+                          "       [-d] [-l] [-s MMAP_MAX] [-L MLOCK_MB] [-o LOG_FILE] [-f text|json|binary]\n"
+                          "       [-u UPLOAD_MB] DOC_ROOT | -B BUNDLE | -P CACHE_DIR [-C CACHE_MB]\n",
         prg_name);
 }
 
@@ -56,9 +90,39 @@ struct options init_options(int argc, char** argv)
     char opt;
     int opt_p = 0;
     int opt_i = 0;
+    int opt_w = 0;
+    int opt_a = 0;
+    int opt_m = 0;
+    int opt_b = 0;
+    int opt_d = 0;
+    int opt_l = 0;
+    int opt_s = 0;
+    int opt_L = 0;
+    int opt_o = 0;
+    int opt_f = 0;
+    int opt_B = 0;
+    int opt_P = 0;
+    int opt_C = 0;
+    int opt_u = 0;
+    char* endptr;
+    long long value;
     opts.port = "80";
     opts.index = "index.html";
-    while ((opt = getopt(argc, argv, "p:i:")) != -1) {
+    opts.workers = 1;
+    opts.aio = AIO_OFF;
+    opts.max_conns = 0;
+    opts.accept_batch = ACCEPT_BATCH;
+    opts.autoindex = 0;
+    opts.defer_accept = 0;
+    opts.mmap_max = FCACHE_MMAP_MAX;
+    opts.mlock_max = 0;
+    opts.log_path = NULL;
+    opts.log_format = ACCESSLOG_TEXT;
+    opts.bundle_path = NULL;
+    opts.cache_dir = NULL;
+    opts.cache_max = PROXY_CACHE_MAX;
+    opts.upload_max = 0;
+    while ((opt = getopt(argc, argv, "p:i:w:a:m:b:dls:L:o:f:B:P:C:u:")) != -1) {
         switch (opt) {
         case 'p':
             opt_p += 1;
@@ -68,6 +132,110 @@ struct options init_options(int argc, char** argv)
             opt_i += 1;
             opts.index = optarg;
             break;
+        case 'w':
+            opt_w += 1;
+            opts.workers = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || opts.workers < 1) {
+                log_error("Invalid number of workers. Must be at least 1");
+                clean_exit(EXIT_FAILURE);
+            }
+            break;
+        case 'a':
+            opt_a += 1;
+            if (strcmp(optarg, "uring") == 0) {
+                opts.aio = AIO_URING;
+            } else if (strcmp(optarg, "threads") == 0) {
+                opts.aio = AIO_THREADS_ONLY;
+            } else {
+                log_error("Invalid async mode. Must be uring or threads");
+                clean_exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            opt_m += 1;
+            opts.max_conns = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || opts.max_conns < 1) {
+                log_error("Invalid number of connections. Must be at least 1");
+                clean_exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            opt_b += 1;
+            opts.accept_batch = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || opts.accept_batch < 1) {
+                log_error("Invalid accept batch. Must be at least 1");
+                clean_exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd':
+            opt_d += 1;
+            opts.defer_accept = 1;
+            break;
+        case 'l':
+            opt_l += 1;
+            opts.autoindex = 1;
+            break;
+        case 's':
+            opt_s += 1;
+            value = strtoll(optarg, &endptr, 10);
+            if (*endptr != '\0' || value < 0) {
+                log_error("Invalid mmap size. Must be at least 0");
+                clean_exit(EXIT_FAILURE);
+            }
+            opts.mmap_max = value;
+            break;
+        case 'L':
+            opt_L += 1;
+            value = strtoll(optarg, &endptr, 10);
+            if (*endptr != '\0' || value < 0) {
+                log_error("Invalid mlock size. Must be at least 0");
+                clean_exit(EXIT_FAILURE);
+            }
+            opts.mlock_max = (size_t)value * 1024 * 1024;
+            break;
+        case 'o':
+            opt_o += 1;
+            opts.log_path = optarg;
+            break;
+        case 'f':
+            opt_f += 1;
+            if (strcmp(optarg, "text") == 0) {
+                opts.log_format = ACCESSLOG_TEXT;
+            } else if (strcmp(optarg, "json") == 0) {
+                opts.log_format = ACCESSLOG_JSON;
+            } else if (strcmp(optarg, "binary") == 0) {
+                opts.log_format = ACCESSLOG_BINARY;
+            } else {
+                log_error("Invalid log format. Must be text, json or binary");
+                clean_exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            opt_B += 1;
+            opts.bundle_path = optarg;
+            break;
+        case 'P':
+            opt_P += 1;
+            opts.cache_dir = optarg;
+            break;
+        case 'C':
+            opt_C += 1;
+            value = strtoll(optarg, &endptr, 10);
+            if (*endptr != '\0' || value < 0) {
+                log_error("Invalid cache size. Must be at least 0");
+                clean_exit(EXIT_FAILURE);
+            }
+            opts.cache_max = (size_t)value * 1024 * 1024;
+            break;
+        case 'u':
+            opt_u += 1;
+            value = strtoll(optarg, &endptr, 10);
+            if (*endptr != '\0' || value < 1 || value > LLONG_MAX / (1024 * 1024)) {
+                log_error("Invalid upload size. Must be at least 1");
+                clean_exit(EXIT_FAILURE);
+            }
+            opts.upload_max = (off_t)value * 1024 * 1024;
+            break;
         default:
             usage();
             clean_exit(EXIT_FAILURE);
@@ -76,7 +244,9 @@ struct options init_options(int argc, char** argv)
     }
 
     // too many options
-    if (opt_p > 1 || opt_i > 1) {
+    if (opt_p > 1 || opt_i > 1 || opt_w > 1 || opt_a > 1 || opt_m > 1 || opt_b > 1 || opt_d > 1 || opt_l > 1 || opt_s > 1
+        || opt_L > 1 || opt_o > 1 || opt_f > 1 || opt_B > 1 || opt_P > 1 || opt_C > 1
+        || opt_u > 1) {
         log_error("Too many options");
         clean_exit(EXIT_FAILURE);
     }
@@ -86,8 +256,15 @@ struct options init_options(int argc, char** argv)
         clean_exit(EXIT_FAILURE);
     }
 
-    // check doc_root argument
-    if (argc - 1 == optind) {
+    // check doc_root argument, a bundle or the proxy cache replaces it.
+    // Uploads are only stored in a docRoot.
+    if ((opt_C && !opt_P) || (opt_u && (opt_B || opt_P))) {
+        usage();
+        clean_exit(EXIT_FAILURE);
+    }
+    if (opt_B + opt_P == 1 && argc == optind) {
+        opts.docRoot = "";
+    } else if (!opt_B && !opt_P && argc - 1 == optind) {
         opts.docRoot = argv[optind];
     } else {
         usage();
@@ -106,6 +283,352 @@ void clean_exit(int exit_status)
     exit(exit_status);
 }
 
+/**
+ * @brief Releases the cached file of a response.
+ * 
+ * @param res response struct
+ */
+static void release_file(struct res* res)
+{
+    fcache_release(res->ctx);
+}
+
+/**
+ * @brief Builds a multipart/byteranges body with one part per range.
+ * 
+ * @param res response struct
+ * @param etag entity tag of the file
+ * @param size size of the file
+ * @param base offset of the file in the body fd
+ * @param ranges requested ranges
+ * @param n number of ranges
+ * @return int 0 on success -1 on failure
+ */
+static int multipart_body(struct res* res, const char* etag, off_t size, off_t base, struct range* ranges, int n)
+{
+    // a part header, a file range per part and the closing boundary
+    size_t nparts = 2 * n + 1;
+    size_t text_size = (n + 1) * MULTIPART_HEAD_SIZE;
+    struct res_part* parts = res_alloc(res, nparts * sizeof(struct res_part) + text_size);
+    if (parts == NULL) {
+        return -1;
+    }
+    char* text = (char*)(parts + nparts);
+
+    char boundary[FCACHE_ETAG_SIZE + 16];
+    snprintf(boundary, sizeof(boundary), "byteranges%.*s", (int)strlen(etag) - 2, etag + 1);
+
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(text, MULTIPART_HEAD_SIZE, "%s--%s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+            i == 0 ? "" : "\r\n", boundary, (long long)ranges[i].start,
+            (long long)(ranges[i].start + ranges[i].len - 1), (long long)size);
+        parts[2 * i].buf = text;
+        parts[2 * i].offset = 0;
+        parts[2 * i].len = len;
+        parts[2 * i + 1].buf = NULL;
+        parts[2 * i + 1].offset = base + ranges[i].start;
+        parts[2 * i + 1].len = ranges[i].len;
+        text += len;
+    }
+    parts[nparts - 1].buf = text;
+    parts[nparts - 1].offset = 0;
+    parts[nparts - 1].len = snprintf(text, MULTIPART_HEAD_SIZE, "\r\n--%s--\r\n", boundary);
+
+    res->parts = parts;
+    res->nparts = nparts;
+    return res_header(res, "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+}
+
+/**
+ * @brief Answers a Range request with 206 or 416. If-Range is honored,
+ * if it does not match the whole file is sent.
+ * 
+ * @param req request strcut
+ * @param res response struct
+ * @param etag entity tag of the file
+ * @param mtime modification time of the file
+ * @param size size of the file
+ * @param base offset of the file in the body fd
+ */
+static void serve_ranges(struct req* req, struct res* res, const char* etag, time_t mtime, off_t size, off_t base)
+{
+    const struct slice* range = req_header(req, "Range");
+    const struct slice* if_range = req_header(req, "If-Range");
+    if (range == NULL) {
+        return;
+    }
+    // entity tags are compared strongly, i.e. byte by byte
+    if (if_range != NULL
+        && !(if_range->len > 0 && if_range->ptr[0] == '"'
+                ? if_range->len == strlen(etag) && memcmp(if_range->ptr, etag, if_range->len) == 0
+                : unmodified_since(*if_range, mtime, 1))) {
+        return;
+    }
+
+    struct range ranges[RANGE_MAX];
+    int n = parse_ranges(*range, size, ranges, RANGE_MAX);
+    if (n < 0) {
+        return;
+    }
+
+    if (n == 0) {
+        res->status = 416;
+        res->fd = -1;
+        res_header(res, "Content-Range: bytes */%lld\r\n", (long long)size);
+    } else if (n == 1) {
+        res->status = 206;
+        res->offset = base + ranges[0].start;
+        res->size = ranges[0].len;
+        res_header(res, "Content-Range: bytes %lld-%lld/%lld\r\n", (long long)ranges[0].start,
+            (long long)(ranges[0].start + ranges[0].len - 1), (long long)size);
+    } else if (multipart_body(res, etag, size, base, ranges, n) == 0) {
+        res->status = 206;
+    }
+}
+
+/**
+ * @brief Releases the compressed body of a response.
+ * 
+ * @param res response struct
+ */
+static void release_gz(struct res* res)
+{
+    gzcache_release(res->ctx);
+}
+
+/**
+ * @brief Checks if the client accepts a gzip encoded response.
+ * 
+ * @param req request struct
+ * @return int 1 if gzip is accepted, 0 otherwise
+ */
+static int accepts_gzip(struct req* req)
+{
+    const struct slice* value = req_header(req, "Accept-Encoding");
+    if (value == NULL) {
+        return 0;
+    }
+
+    const char* p = value->ptr;
+    const char* end = value->ptr + value->len;
+    while (p < end) {
+        // one coding with optional parameters per list element
+        const char* elem_end = memchr(p, ',', end - p);
+        if (elem_end == NULL) {
+            elem_end = end;
+        }
+        while (p < elem_end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        const char* name = p;
+        while (p < elem_end && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        struct slice coding = { name, p - name };
+        if (slice_eq(coding, "gzip") || slice_eq(coding, "x-gzip") || slice_eq(coding, "*")) {
+            // q=0 means not acceptable
+            const char* q = p;
+            while (q + 1 < elem_end && !((q[0] == 'q' || q[0] == 'Q') && q[1] == '=')) {
+                q++;
+            }
+            if (q + 1 >= elem_end || strtod(q + 2, NULL) > 0) {
+                return 1;
+            }
+        }
+        p = elem_end + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Gets a file from the cache. If the handler must not block, a file
+ * the cache does not know is opened by the server with res_open first.
+ * 
+ * @param req request struct
+ * @param res response struct
+ * @param path path of the file
+ * @param pending set to 1 if the file is being opened
+ * @return struct fentry* file or NULL
+ */
+static struct fentry* get_file(struct req* req, struct res* res, const char* path, int* pending)
+{
+    *pending = 0;
+    if (!req->nonblock) {
+        return fcache_get(path);
+    }
+
+    int cached;
+    struct fentry* file = fcache_peek(path, &cached);
+    if (cached) {
+        return file;
+    }
+    struct aio_job* opened = req->opened;
+    if (opened != NULL && strcmp(opened->path, path) == 0) {
+        // the cache takes over the fd
+        int fd = opened->fd;
+        opened->fd = -1;
+        return fcache_add(path, fd, opened->err, &opened->st);
+    }
+    if (res_open(res, path) < 0) {
+        return fcache_get(path);
+    }
+    *pending = 1;
+    return NULL;
+}
+
+/**
+ * @brief Looks up a precompressed sibling @code{path}.gz that is not older
+ * than the file itself.
+ * 
+ * @param req request struct
+ * @param res response struct
+ * @param path path of the file
+ * @param len length of the path
+ * @param size size of the path buffer
+ * @param file file
+ * @param pending set to 1 if the sibling is being opened
+ * @return struct fentry* sibling or NULL
+ */
+static struct fentry* precompressed(struct req* req, struct res* res, char* path, size_t len, size_t size,
+    struct fentry* file, int* pending)
+{
+    *pending = 0;
+    if (len + sizeof(".gz") > size) {
+        return NULL;
+    }
+    memcpy(path + len, ".gz", sizeof(".gz"));
+    struct fentry* gz = get_file(req, res, path, pending);
+    path[len] = '\0';
+    if (gz != NULL && gz->mtime < file->mtime) {
+        fcache_release(gz);
+        return NULL;
+    }
+    return gz;
+}
+
+/**
+ * @brief Checks If-None-Match and If-Modified-Since. If-None-Match takes
+ * precedence over If-Modified-Since.
+ * 
+ * @param req request struct
+ * @param etag entity tag of the representation
+ * @param mtime modification time of the representation
+ * @return int 1 if the client copy is still valid, 0 otherwise
+ */
+static int not_modified(struct req* req, const char* etag, time_t mtime)
+{
+    const struct slice* inm = req_header(req, "If-None-Match");
+    const struct slice* ims = req_header(req, "If-Modified-Since");
+    return inm != NULL ? etag_matches(*inm, etag) : ims != NULL && unmodified_since(*ims, mtime, 0);
+}
+
+/**
+ * @brief Serves a cached file, honoring conditional and range requests.
+ * 
+ * @param req request struct
+ * @param res response struct
+ * @param file file
+ */
+static void serve_file(struct req* req, struct res* res, struct fentry* file)
+{
+    res->status = 200;
+    res->fd = file->fd;
+    res->size = file->size;
+    res->headers = file->head;
+    res->headers_len = file->head_len;
+    res->done = release_file;
+    res->ctx = file;
+
+    if (not_modified(req, file->etag, file->mtime)) {
+        res->status = 304;
+        res->fd = -1;
+        return;
+    }
+    serve_ranges(req, res, file->etag, file->mtime, file->size, 0);
+
+    // small files are sent from their mapping in one call with the head
+    struct res_part* part = res->status == 200 && file->map != NULL ? res_alloc(res, sizeof(struct res_part)) : NULL;
+    if (part != NULL) {
+        part->buf = file->map;
+        part->offset = 0;
+        part->len = file->size;
+        res->fd = -1;
+        res->parts = part;
+        res->nparts = 1;
+    }
+}
+
+/**
+ * @brief Serves the compressed content of a file from memory.
+ * 
+ * @param req request struct
+ * @param res response struct
+ * @param gz compressed content
+ */
+static void serve_gz(struct req* req, struct res* res, struct gzentry* gz)
+{
+    res->status = 200;
+    res->fd = -1;
+    res->parts = &gz->part;
+    res->nparts = 1;
+    res->headers = gz->head;
+    res->headers_len = gz->head_len;
+    res->done = release_gz;
+    res->ctx = gz;
+
+    if (not_modified(req, gz->etag, gz->mtime)) {
+        res->status = 304;
+        res->parts = NULL;
+        res->nparts = 0;
+    }
+}
+
+/**
+ * @brief Releases the directory listing of a response.
+ * 
+ * @param res response struct
+ */
+static void release_listing(struct res* res)
+{
+    dircache_release(res->ctx);
+}
+
+/**
+ * @brief Serves the listing of the requested directory, 404 if it is no
+ * directory.
+ * 
+ * @param req request struct
+ * @param res response struct
+ * @param path decoded URL path of the directory
+ */
+static void serve_listing(struct req* req, struct res* res, const char* path)
+{
+    char dirpath[PATH_MAX];
+    struct dirlisting* listing = NULL;
+    if (resolve_path_buf(dirpath, sizeof(dirpath), req->settings->docRoot, path, "") >= 0) {
+        listing = dircache_get(dirpath, path);
+    }
+    if (listing == NULL) {
+        res->status = 404;
+        return;
+    }
+
+    res->status = 200;
+    res->fd = -1;
+    res->parts = &listing->part;
+    res->nparts = 1;
+    res->headers = listing->head;
+    res->headers_len = listing->head_len;
+    res->done = release_listing;
+    res->ctx = listing;
+
+    if (not_modified(req, listing->etag, listing->mtime.tv_sec)) {
+        res->status = 304;
+        res->parts = NULL;
+        res->nparts = 0;
+    }
+}
+
 /**
  * @brief HTTP requst handler
  * 
@@ -114,19 +637,139 @@ void clean_exit(int exit_status)
  */
 void handler(struct req* req, struct res* res)
 {
+    // absolute targets are only meant for the proxy
+    char path[PATH_MAX];
+    if (req->path[0] != '/' || url_decode_path(path, sizeof(path), req->path) < 0) {
+        res->status = 400;
+        return;
+    }
+    if (!path_safe(path)) {
+        res->status = 403;
+        return;
+    }
     if (strcmp(req->method, "GET") == 0) {
-        char* reqfilepath = resolve_path(req->settings->docRoot, req->path, req->settings->index);
-        if ((res->body = fopen(reqfilepath, "r")) == NULL) {
+        char reqfilepath[PATH_MAX];
+        struct fentry* file = NULL;
+        int pending = 0;
+        if (resolve_path_buf(reqfilepath, sizeof(reqfilepath), req->settings->docRoot, path, req->settings->index) >= 0) {
+            file = get_file(req, res, reqfilepath, &pending);
+        }
+        if (pending) {
+            return;
+        }
+        if (file == NULL) {
+            struct stat st;
+            if (file_from_url(path) != NULL && stat(reqfilepath, &st) == 0 && S_ISDIR(st.st_mode)) {
+                // relative links of the index or listing need the slash
+                size_t len = strcspn(req->path, "?");
+                res->status = 301;
+                res_header(res, "Location: %.*s/%s\r\n", (int)len, req->path, req->path + len);
+                return;
+            }
+            if (req->settings->autoindex && file_from_url(path) == NULL) {
+                // no index file, list the directory instead
+                serve_listing(req, res, path);
+                return;
+            }
             res->status = 404;
-        } else {
-            res->status = 200;
+            return;
+        }
+
+        if (!is_compressible(reqfilepath)) {
+            serve_file(req, res, file);
+            return;
+        }
+
+        // ranges always refer to the identity encoding
+        if (req_header(req, "Range") == NULL && accepts_gzip(req)) {
+            struct fentry* gz = precompressed(req, res, reqfilepath, strlen(reqfilepath), sizeof(reqfilepath), file, &pending);
+            if (pending) {
+                fcache_release(file);
+                return;
+            }
+            if (gz != NULL) {
+                fcache_release(file);
+                serve_file(req, res, gz);
+                if (res->status == 200 || res->status == 304) {
+                    res_header(res, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+                }
+                return;
+            }
+
+            struct gzentry* entry = gzcache_get(file);
+            if (entry != NULL) {
+                fcache_release(file);
+                serve_gz(req, res, entry);
+                return;
+            }
         }
-        free(reqfilepath);
+
+        serve_file(req, res, file);
+        res_header(res, "Vary: Accept-Encoding\r\n");
+    } else if (strcmp(req->method, "PUT") == 0 && g_opts->upload_max > 0) {
+        upload_put(req, res, path, g_opts->upload_max);
     } else {
         res->status = 501;
     }
 }
 
+/**
+ * @brief HTTP request handler of the bundle mode. One probe of the
+ * perfect hash finds the precomputed response, the file system is never
+ * touched.
+ * 
+ * @param req request strcut
+ * @param res response struct
+ */
+void bundle_handler(struct req* req, struct res* res)
+{
+    if (strcmp(req->method, "GET") != 0) {
+        res->status = 501;
+        return;
+    }
+    // the bundle knows the files by their decoded paths
+    char path[PATH_MAX];
+    if (url_decode_path(path, sizeof(path), req->path) < 0) {
+        res->status = 400;
+        return;
+    }
+    const struct bundle_entry* entry = bundle_find(bundle, path);
+    if (entry == NULL) {
+        res->status = 404;
+        return;
+    }
+
+    // ranges always refer to the identity encoding
+    int gz = (entry->flags & BUNDLE_GZIP) && req_header(req, "Range") == NULL && accepts_gzip(req);
+    const struct bundle_variant* variant = gz ? &entry->gz : &entry->plain;
+    res->status = 200;
+    res->headers = bundle->map + variant->head;
+    res->headers_len = variant->head_len;
+    if (not_modified(req, variant->etag, entry->mtime)) {
+        res->status = 304;
+        return;
+    }
+    res->fd = bundle->fd;
+    res->offset = variant->body;
+    res->size = variant->body_len;
+    if (!gz) {
+        serve_ranges(req, res, variant->etag, entry->mtime, variant->body_len, variant->body);
+    }
+
+    // small bodies go out in one call with the head, others by sendfile
+    struct res_part* part = res->status == 200 && variant->body_len <= g_opts->mmap_max
+        ? res_alloc(res, sizeof(struct res_part))
+        : NULL;
+    if (part != NULL) {
+        part->buf = bundle->map + variant->body;
+        part->offset = 0;
+        part->len = variant->body_len;
+        res->fd = -1;
+        res->parts = part;
+        res->nparts = 1;
+    }
+}
+
 /**
  * @brief Handles SIGTERM and SIGINT. Shuts the http server down.
  * 
@@ -158,15 +801,55 @@ int main(int argc, char** argv)
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
 
+    // a client closing early must not kill the server
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
     struct options opts = init_options(argc, argv);
     g_opts = &opts;
 
     struct settings settings;
     settings.docRoot = opts.docRoot;
     settings.index = opts.index;
+    settings.aio = opts.aio;
+    // the limit is split evenly over the event loops
+    settings.max_conns = (opts.max_conns + opts.workers - 1) / opts.workers;
+    settings.accept_batch = opts.accept_batch;
+    settings.autoindex = opts.autoindex;
+    settings.defer_accept = opts.defer_accept;
+    fcache_configure(opts.mmap_max, opts.mlock_max);
+    stats_file_cache(fcache_stats);
+    void (*handle)(struct req*, struct res*) = handler;
+    if (opts.bundle_path != NULL) {
+        bundle = bundle_open(opts.bundle_path);
+        if (bundle == NULL) {
+            clean_exit(EXIT_FAILURE);
+        }
+        handle = bundle_handler;
+    }
+    if (opts.cache_dir != NULL) {
+        if (proxy_open(opts.cache_dir, opts.cache_max) < 0) {
+            clean_exit(EXIT_FAILURE);
+        }
+        handle = proxy_handler;
+    }
+    if (opts.log_path != NULL && accesslog_open(opts.log_path, opts.log_format) < 0) {
+        clean_exit(EXIT_FAILURE);
+    }
 
-    int sockfd = create_server(opts.port);
-    server_listen(sockfd, 1, handler, &settings);
+    if (opts.workers > 1) {
+        server_listen_workers(opts.port, opts.workers, SOMAXCONN, handle, &settings);
+    } else {
+        int sockfd = create_server(opts.port, 0);
+        server_listen(sockfd, SOMAXCONN, handle, &settings);
+    }
+    accesslog_close();
+    if (bundle != NULL) {
+        bundle_close(bundle);
+    }
+    if (opts.cache_dir != NULL) {
+        proxy_close();
+    }
 
     exit(EXIT_SUCCESS);
     return 0;
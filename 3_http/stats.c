@@ -0,0 +1,266 @@
+/**
+ * @file stats.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Per worker server metrics
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "stats.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RENDER_SIZE (4096)
+
+static const char* const timeout_kinds[STATS_TIMEOUTS] = { "idle", "head", "write", "body" };
+static const unsigned int codes[STATS_CODES - 1] = {
+    200, 201, 204, 206, 301, 304, 400, 403, 404, 409, 413, 416, 431, 500, 501, 502, 503
+};
+// upper bounds of the latency buckets in microseconds
+static const unsigned long long bounds[STATS_BUCKETS - 1] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 5000000
+};
+// upper bounds of the arena peak buckets in bytes
+static const unsigned long long arena_bounds[STATS_ARENA_BUCKETS - 1] = { 0, 256, 1024, 4096, 16384 };
+
+// the lock only guards the list, never the counters
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats* workers = NULL;
+static int nworkers = 0;
+static void (*file_cache)(unsigned long* hits, unsigned long* misses) = NULL;
+
+struct stats* stats_register(void)
+{
+    struct stats* stats;
+    if (posix_memalign((void**)&stats, STATS_CACHE_LINE, sizeof(struct stats)) != 0) {
+        return NULL;
+    }
+    memset(stats, 0, sizeof(struct stats));
+
+    pthread_mutex_lock(&lock);
+    stats->worker = nworkers++;
+    // append so that the workers are rendered in order
+    struct stats** p = &workers;
+    while (*p != NULL) {
+        p = &(*p)->next;
+    }
+    *p = stats;
+    pthread_mutex_unlock(&lock);
+    return stats;
+}
+
+void stats_request(struct stats* stats, unsigned int status, unsigned long long ns)
+{
+    size_t code = 0;
+    while (code < STATS_CODES - 1 && codes[code] != status) {
+        code++;
+    }
+    stats_add(&stats->requests[code], 1);
+
+    size_t bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && ns > bounds[bucket] * 1000) {
+        bucket++;
+    }
+    stats_add(&stats->latency[bucket], 1);
+    stats_add(&stats->latency_sum_ns, ns);
+}
+
+void stats_file_cache(void (*counters)(unsigned long* hits, unsigned long* misses))
+{
+    file_cache = counters;
+}
+
+void stats_arena(struct stats* stats, size_t peak, unsigned long long exhausted)
+{
+    size_t bucket = 0;
+    while (bucket < STATS_ARENA_BUCKETS - 1 && peak > arena_bounds[bucket]) {
+        bucket++;
+    }
+    stats_add(&stats->arena_peak[bucket], 1);
+    stats_add(&stats->arena_peak_sum, peak);
+    if (exhausted > 0) {
+        stats_add(&stats->arena_exhausted, exhausted);
+    }
+}
+
+/**
+ * @brief Loads a counter written by another thread
+ *
+ * @param counter counter
+ * @return unsigned long long value
+ */
+static unsigned long long load(const unsigned long long* counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Growing text buffer
+ */
+struct text {
+    char* buf;
+    size_t len;
+    size_t size;
+};
+
+/**
+ * @brief Appends formatted text, the buffer grows as needed.
+ *
+ * @param text text buffer
+ * @param format printf format
+ * @param ... format parameters
+ * @return int 0 on success -1 on failure
+ */
+static int append(struct text* text, const char* format, ...)
+{
+    while (1) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(text->buf + text->len, text->size - text->len, format, args);
+        va_end(args);
+        if (n < 0) {
+            return -1;
+        }
+        if ((size_t)n < text->size - text->len) {
+            text->len += n;
+            return 0;
+        }
+        char* buf = realloc(text->buf, text->size * 2);
+        if (buf == NULL) {
+            return -1;
+        }
+        text->buf = buf;
+        text->size *= 2;
+    }
+}
+
+char* stats_render(size_t* len)
+{
+    struct text text = { malloc(RENDER_SIZE), 0, RENDER_SIZE };
+    if (text.buf == NULL) {
+        return NULL;
+    }
+
+    int res = 0;
+    pthread_mutex_lock(&lock);
+    res |= append(&text, "# HELP http_accepted_connections_total Accepted client connections.\n"
+                         "# TYPE http_accepted_connections_total counter\n");
+    for (struct stats* s = workers; s != NULL; s = s->next) {
+        res |= append(&text, "http_accepted_connections_total{worker=\"%d\"} %llu\n", s->worker, load(&s->accepted));
+    }
+
+    res |= append(&text, "# HELP http_rejected_connections_total Connections refused with 503 by the connection limit.\n"
+                         "# TYPE http_rejected_connections_total counter\n");
+    for (struct stats* s = workers; s != NULL; s = s->next) {
+        res |= append(&text, "http_rejected_connections_total{worker=\"%d\"} %llu\n", s->worker, load(&s->rejected));
+    }
+
+    res |= append(&text, "# HELP http_timeouts_total Connections closed by a timeout.\n"
+                         "# TYPE http_timeouts_total counter\n");
+    for (struct stats* s = workers; s != NULL; s = s->next) {
+        for (size_t i = 0; i < STATS_TIMEOUTS; i++) {
+            res |= append(&text, "http_timeouts_total{worker=\"%d\",kind=\"%s\"} %llu\n", s->worker, timeout_kinds[i],
+                load(&s->timeouts[i]));
+        }
+    }
+
+    res |= append(&text, "# HELP http_requests_total Answered requests by status code.\n"
+                         "# TYPE http_requests_total counter\n");
+    for (struct stats* s = workers; s != NULL; s = s->next) {
+        for (size_t i = 0; i < STATS_CODES; i++) {
+            if (i < STATS_CODES - 1) {
+                res |= append(&text, "http_requests_total{worker=\"%d\",code=\"%u\"} %llu\n", s->worker, codes[i],
+                    load(&s->requests[i]));
+            } else {
+                res |= append(&text, "http_requests_total{worker=\"%d\",code=\"other\"} %llu\n", s->worker,
+                    load(&s->requests[i]));
+            }
+        }
+    }
+
+    res |= append(&text, "# HELP http_sent_bytes_total Bytes sent to clients, heads included.\n"
+                         "# TYPE http_sent_bytes_total counter\n");
+    for (struct stats* s = workers; s != NULL; s = s->next) {
+        res |= append(&text, "http_sent_bytes_total{worker=\"%d\"} %llu\n", s->worker, load(&s->bytes_sent));
+    }
+
+    res |= append(&text, "# HELP http_parse_failures_total Malformed or too large request heads.\n"
+                         "# TYPE http_parse_failures_total counter\n");
+    for (struct stats* s = workers; s != NULL; s = s->next) {
+        res |= append(&text, "http_parse_failures_total{worker=\"%d\"} %llu\n", s->worker, load(&s->parse_failures));
+    }
+
+    res |= append(&text, "# HELP http_request_duration_seconds Time from the complete request head to the last byte sent.\n"
+                         "# TYPE http_request_duration_seconds histogram\n");
+    for (struct stats* s = workers; s != NULL; s = s->next) {
+        unsigned long long count = 0;
+        for (size_t i = 0; i < STATS_BUCKETS; i++) {
+            count += load(&s->latency[i]);
+            if (i < STATS_BUCKETS - 1) {
+                res |= append(&text, "http_request_duration_seconds_bucket{worker=\"%d\",le=\"%g\"} %llu\n", s->worker,
+                    bounds[i] / 1e6, count);
+            } else {
+                res |= append(&text, "http_request_duration_seconds_bucket{worker=\"%d\",le=\"+Inf\"} %llu\n", s->worker,
+                    count);
+            }
+        }
+        res |= append(&text, "http_request_duration_seconds_sum{worker=\"%d\"} %.9f\n", s->worker,
+            load(&s->latency_sum_ns) / 1e9);
+        res |= append(&text, "http_request_duration_seconds_count{worker=\"%d\"} %llu\n", s->worker, count);
+    }
+
+    res |= append(&text, "# HELP http_connection_arena_peak_bytes Most request memory used at once per closed connection.\n"
+                         "# TYPE http_connection_arena_peak_bytes histogram\n");
+    for (struct stats* s = workers; s != NULL; s = s->next) {
+        unsigned long long count = 0;
+        for (size_t i = 0; i < STATS_ARENA_BUCKETS; i++) {
+            count += load(&s->arena_peak[i]);
+            if (i < STATS_ARENA_BUCKETS - 1) {
+                res |= append(&text, "http_connection_arena_peak_bytes_bucket{worker=\"%d\",le=\"%llu\"} %llu\n", s->worker,
+                    arena_bounds[i], count);
+            } else {
+                res |= append(&text, "http_connection_arena_peak_bytes_bucket{worker=\"%d\",le=\"+Inf\"} %llu\n", s->worker,
+                    count);
+            }
+        }
+        res |= append(&text, "http_connection_arena_peak_bytes_sum{worker=\"%d\"} %llu\n", s->worker,
+            load(&s->arena_peak_sum));
+        res |= append(&text, "http_connection_arena_peak_bytes_count{worker=\"%d\"} %llu\n", s->worker, count);
+    }
+
+    res |= append(&text, "# HELP http_arena_exhausted_total Request allocations refused by the arena limit.\n"
+                         "# TYPE http_arena_exhausted_total counter\n");
+    for (struct stats* s = workers; s != NULL; s = s->next) {
+        res |= append(&text, "http_arena_exhausted_total{worker=\"%d\"} %llu\n", s->worker, load(&s->arena_exhausted));
+    }
+
+    res |= append(&text, "# HELP http_access_log_dropped_total Access log entries dropped because the log fell behind.\n"
+                         "# TYPE http_access_log_dropped_total counter\n");
+    for (struct stats* s = workers; s != NULL; s = s->next) {
+        res |= append(&text, "http_access_log_dropped_total{worker=\"%d\"} %llu\n", s->worker, load(&s->log_dropped));
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (file_cache != NULL) {
+        unsigned long hits, misses;
+        file_cache(&hits, &misses);
+        res |= append(&text, "# HELP http_file_cache_lookups_total Lookups of the open file cache by result.\n"
+                             "# TYPE http_file_cache_lookups_total counter\n"
+                             "http_file_cache_lookups_total{result=\"hit\"} %lu\n"
+                             "http_file_cache_lookups_total{result=\"miss\"} %lu\n",
+            hits, misses);
+    }
+
+    if (res != 0) {
+        free(text.buf);
+        return NULL;
+    }
+    *len = text.len;
+    return text.buf;
+}
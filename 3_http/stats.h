@@ -0,0 +1,110 @@
+/**
+ * @file stats.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Per worker server metrics
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef STATS
+#define STATS
+
+#include <stddef.h>
+
+#define STATS_CACHE_LINE (64)
+// final status codes known to status_str and one slot for all others
+#define STATS_CODES (18)
+// latency buckets and one bucket for all slower requests
+#define STATS_BUCKETS (16)
+// idle, head, write and body timeouts
+#define STATS_TIMEOUTS (4)
+// arena peak buckets and one bucket for larger peaks
+#define STATS_ARENA_BUCKETS (6)
+#define STATS_PATH "/__stats"
+
+/**
+ * @brief Counters of one worker. Only the owning worker writes them, so
+ * no locks or atomic read-modify-write instructions are needed. Readers
+ * see every counter with relaxed atomic loads. The struct is aligned to
+ * a cache line so that workers do not share lines.
+ */
+struct stats {
+    unsigned long long accepted;
+    // connections answered with 503 because of the connection limit
+    unsigned long long rejected;
+    unsigned long long timeouts[STATS_TIMEOUTS];
+    unsigned long long requests[STATS_CODES];
+    unsigned long long bytes_sent;
+    unsigned long long parse_failures;
+    // request latency from the complete head to the last byte sent
+    unsigned long long latency[STATS_BUCKETS];
+    unsigned long long latency_sum_ns;
+    // peak arena usage of closed connections
+    unsigned long long arena_peak[STATS_ARENA_BUCKETS];
+    unsigned long long arena_peak_sum;
+    unsigned long long arena_exhausted;
+    // access log entries dropped because the ring was full
+    unsigned long long log_dropped;
+    int worker;
+    struct stats* next;
+} __attribute__((aligned(STATS_CACHE_LINE)));
+
+/**
+ * @brief Adds @code{n} to a counter. Must only be called by the worker
+ * owning the counter.
+ *
+ * @param counter counter
+ * @param n value to add
+ */
+static inline void stats_add(unsigned long long* counter, unsigned long long n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Allocates the counters of a new worker and registers them for
+ * stats_render. Thread safe.
+ *
+ * @return struct stats* counters or NULL on failure
+ */
+struct stats* stats_register(void);
+
+/**
+ * @brief Counts a finished request.
+ *
+ * @param stats counters of the worker
+ * @param status response status
+ * @param ns latency in nanoseconds
+ */
+void stats_request(struct stats* stats, unsigned int status, unsigned long long ns);
+
+/**
+ * @brief Counts the arena usage of a closed connection.
+ *
+ * @param stats counters of the worker
+ * @param peak most arena bytes used by one request of the connection
+ * @param exhausted allocations refused because of the arena limit
+ */
+void stats_arena(struct stats* stats, size_t peak, unsigned long long exhausted);
+
+/**
+ * @brief Sets the function which reads the hit and miss counters of the
+ * file cache for stats_render. Must be called before the workers start.
+ *
+ * @param counters reads the counters, NULL hides them
+ */
+void stats_file_cache(void (*counters)(unsigned long* hits, unsigned long* misses));
+
+/**
+ * @brief Renders the counters of all workers in the Prometheus text
+ * format. Thread safe. The returned memory must be freed.
+ *
+ * @param len length of the text
+ * @return char* text or NULL on failure
+ */
+char* stats_render(size_t* len);
+
+#endif
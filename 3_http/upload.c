@@ -0,0 +1,128 @@
+/**
+ * @file upload.c
+ * @author Lorenz Hörburger 12024737
+ * @brief Uploads of files into the docRoot with PUT
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#include "upload.h"
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Upload of one request, lives in the memory of the response.
+ */
+struct upload {
+    // temporary file, -1 once it is closed
+    int fd;
+    // set once the temporary file replaced the target
+    int renamed;
+    char* target;
+    char* temp;
+};
+
+/**
+ * @brief Closes the temporary file and removes it unless it replaced
+ * the target.
+ *
+ * @param res response struct
+ */
+static void release_upload(struct res* res)
+{
+    struct upload* up = res->ctx;
+    if (up->fd >= 0) {
+        close(up->fd);
+    }
+    if (!up->renamed) {
+        unlink(up->temp);
+    }
+}
+
+/**
+ * @brief Moves the completely received body into place. The file is not
+ * synced, the rename only guarantees that readers never see a partial
+ * file.
+ *
+ * @param req request struct
+ * @param res response struct
+ */
+static void upload_received(struct req* req, struct res* res)
+{
+    struct upload* up = res->ctx;
+    struct stat st;
+    int existed = stat(up->target, &st) == 0;
+    int failed = close(up->fd) < 0;
+    up->fd = -1;
+    if (failed || rename(up->temp, up->target) < 0) {
+        // the target may have become a directory meanwhile
+        res->status = !failed && (errno == EISDIR || errno == ENOTDIR) ? 409 : 500;
+        return;
+    }
+    up->renamed = 1;
+    if (existed) {
+        res->status = 204;
+        return;
+    }
+    res->status = 201;
+    res_header(res, "Location: %s\r\n", req->path);
+}
+
+void upload_put(struct req* req, struct res* res, const char* path, off_t max)
+{
+    if (!req->receivable) {
+        res->status = 501;
+        return;
+    }
+    if (!path_safe(path)) {
+        res->status = 403;
+        return;
+    }
+
+    char target[PATH_MAX];
+    int len = resolve_path_buf(target, sizeof(target), req->settings->docRoot, path, "");
+    if (len < 0) {
+        res->status = 400;
+        return;
+    }
+    struct stat st;
+    if (file_from_url(path) == NULL || (stat(target, &st) == 0 && !S_ISREG(st.st_mode))) {
+        res->status = 409;
+        return;
+    }
+
+    // the temporary file is in the same directory, so rename is atomic
+    size_t dir_len = strrchr(target, '/') + 1 - target;
+    struct upload* up = res_alloc(res, sizeof(struct upload) + len + 1 + dir_len + sizeof(UPLOAD_TEMP));
+    if (up == NULL) {
+        res->status = 500;
+        return;
+    }
+    up->renamed = 0;
+    up->target = (char*)(up + 1);
+    memcpy(up->target, target, len + 1);
+    up->temp = up->target + len + 1;
+    memcpy(up->temp, target, dir_len);
+    memcpy(up->temp + dir_len, UPLOAD_TEMP, sizeof(UPLOAD_TEMP));
+    up->fd = mkostemp(up->temp, O_CLOEXEC);
+    if (up->fd < 0) {
+        res->status = errno == ENOENT || errno == ENOTDIR ? 409 : errno == EACCES || errno == EROFS ? 403 : 500;
+        return;
+    }
+    // mkostemp creates the file for the owner only
+    fchmod(up->fd, 0644);
+
+    res->status = 500;
+    res->done = release_upload;
+    res->ctx = up;
+    res_receive(req, res, up->fd, max, upload_received);
+}
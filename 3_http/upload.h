@@ -0,0 +1,37 @@
+/**
+ * @file upload.h
+ * @author Lorenz Hörburger 12024737
+ * @brief Uploads of files into the docRoot with PUT
+ *
+ * @version 0.1
+ * @date 15.01.2023
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+#ifndef UPLOAD
+#define UPLOAD
+
+#include "https.h"
+#include <sys/types.h>
+
+// name of the temporary file an upload is written to, next to its target
+#define UPLOAD_TEMP ".upload-XXXXXX"
+
+/**
+ * @brief Handles a PUT request of a file in the docRoot. The body is
+ * received into a temporary file next to the target, which replaces the
+ * target with one rename once the body is complete. Readers therefore
+ * see either the old or the new file, never a partial one. Answers 201
+ * if the file was created and 204 if it was replaced. Paths with . or ..
+ * segments are refused with 403, targets in missing directories or which
+ * are directories with 409. Over HTTP/2 the request is answered with 501.
+ *
+ * @param req request struct
+ * @param res response struct
+ * @param path decoded URL path of the target
+ * @param max maximum length of the body, larger ones are answered with 413
+ */
+void upload_put(struct req* req, struct res* res, const char* path, off_t max);
+
+#endif